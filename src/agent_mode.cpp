@@ -1,4 +1,6 @@
 #include "agent_mode.hpp"
+#include "git_files.hpp"
+#include "trace.hpp"
 #include <regex>
 #include <fstream>
 #include <sstream>
@@ -9,23 +11,47 @@ namespace fs = std::filesystem;
 
 static string lower(string s){ transform(s.begin(), s.end(), s.begin(), ::tolower); return s; }
 
+namespace {
+bool is_agent_doc_name(const fs::path& p) {
+    static const vector<string> names = {"agents.md","agent.md"};
+    string lname = lower(p.filename().string());
+    return find(names.begin(), names.end(), lname) != names.end();
+}
+
+void add_agent_doc(vector<AgentDoc>& docs, const fs::path& p) {
+    ifstream ifs(p, ios::binary);
+    if (!ifs) return;
+    ostringstream oss; oss << ifs.rdbuf();
+    docs.push_back(AgentDoc{p, oss.str()});
+}
+
+// 近いパスを優先：浅い階層順
+void sort_agent_docs(vector<AgentDoc>& docs) {
+    sort(docs.begin(), docs.end(), [](const AgentDoc& a, const AgentDoc& b){ return a.path.string().size() < b.path.string().size(); });
+}
+}
+
 vector<AgentDoc> find_agent_docs(const fs::path& root) {
+    trace::Span span("find_agent_docs", "files");
+    // git 作業ツリーなら index と .gitignore に従い、依存物やビルド出力の中は探さない
+    if (auto git = list_git_files(root)) return find_agent_docs(root, git->files);
     vector<AgentDoc> docs;
-    vector<string> names = {"AGENTS.md","AGENT.md","agents.md","agent.md"};
     for (auto it = fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied);
          it != fs::recursive_directory_iterator(); ++it) {
-        if (!it->is_regular_file()) continue;
-        auto name = it->path().filename().string();
-        string lname = lower(name);
-        bool match = false; for (auto& n : names) if (lname==lower(n)) { match=true; break; }
-        if (!match) continue;
-        ifstream ifs(it->path(), ios::binary);
-        if (!ifs) continue;
-        ostringstream oss; oss << ifs.rdbuf();
-        docs.push_back(AgentDoc{it->path(), oss.str()});
+        if (it->is_regular_file() && is_agent_doc_name(it->path())) add_agent_doc(docs, it->path());
     }
-    // 近いパスを優先：浅い階層順
-    sort(docs.begin(), docs.end(), [](const AgentDoc& a, const AgentDoc& b){ return a.path.string().size() < b.path.string().size(); });
+    sort_agent_docs(docs);
+    return docs;
+}
+
+vector<AgentDoc> find_agent_docs(const fs::path& root, const vector<string>& files) {
+    vector<AgentDoc> docs;
+    for (const auto& rel : files) {
+        fs::path p = root / fs::path(rel);
+        std::error_code ec;
+        if (is_agent_doc_name(p) && fs::is_regular_file(p, ec)) add_agent_doc(docs, p);
+    }
+    sort_agent_docs(docs);
     return docs;
 }
 
@@ -70,6 +96,7 @@ string build_auto_system_prompt(const vector<AgentDoc>& docs) {
 }
 
 ApplyResult apply_file_blocks(const string& output, bool dry_run) {
+    trace::Span span("apply_file_blocks", "files");
     ApplyResult ar; ostringstream log;
     // 検出: ```file: path 〜 ``` または ```agens:file=path 〜 ```
     // 簡易パーサ（貪欲すぎない）
@@ -8,6 +8,8 @@ struct AgentDoc { std::filesystem::path path; std::string content; };
 
 // 設計書(AGENT.md/AGENTS.md)の探索
 std::vector<AgentDoc> find_agent_docs(const std::filesystem::path& root);
+// 列挙済みのファイル（root からの相対）から探す版（ディレクトリを辿らない）
+std::vector<AgentDoc> find_agent_docs(const std::filesystem::path& root, const std::vector<std::string>& files);
 
 // 箇条書きや番号付きリストからタスク抽出
 std::vector<std::string> extract_tasks(const std::string& md);
@@ -0,0 +1,74 @@
+// 割り当てを数える operator new/delete（alloc_stats.hpp）。agens_lib には入れず、
+// unit_tests と AGENS_ALLOC_STATS=ON の agens にだけリンクする
+#include "alloc_stats.hpp"
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace {
+[[maybe_unused]] const bool g_registered = (alloc_stats_enable(), true);
+
+void* raw_alloc(std::size_t n, std::size_t align) {
+    if (n == 0) n = 1;
+    if (align == 0) return std::malloc(n);
+#if defined(_WIN32)
+    return _aligned_malloc(n, align);
+#else
+    void* p = nullptr;
+    return posix_memalign(&p, align, n) == 0 ? p : nullptr;
+#endif
+}
+
+// 境界指定で確保したものの解放（Windows では _aligned_malloc の対）
+void aligned_free(void* p) {
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+// 標準の operator new と同じく、確保できなければ new_handler を呼んで再試行し、無ければ bad_alloc
+void* counted_alloc(std::size_t n, std::size_t align) {
+    alloc_stats_record(n);
+    for (;;) {
+        if (void* p = raw_alloc(n, align)) return p;
+        std::new_handler h = std::get_new_handler();
+        if (!h) throw std::bad_alloc();
+        h();
+    }
+}
+
+void* counted_alloc_nothrow(std::size_t n, std::size_t align) noexcept {
+    try {
+        return counted_alloc(n, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+}
+
+// 確保・解放の組をすべて置き換える（一部だけだと new[] と delete 等の組み合わせが食い違う）
+void* operator new(std::size_t n) { return counted_alloc(n, 0); }
+void* operator new[](std::size_t n) { return counted_alloc(n, 0); }
+void* operator new(std::size_t n, std::align_val_t a) { return counted_alloc(n, static_cast<std::size_t>(a)); }
+void* operator new[](std::size_t n, std::align_val_t a) { return counted_alloc(n, static_cast<std::size_t>(a)); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(n, 0); }
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(n, 0); }
+void* operator new(std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(n, static_cast<std::size_t>(a)); }
+void* operator new[](std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept { return counted_alloc_nothrow(n, static_cast<std::size_t>(a)); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { aligned_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { aligned_free(p); }
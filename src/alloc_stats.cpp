@@ -0,0 +1,25 @@
+#include "alloc_stats.hpp"
+#include <atomic>
+
+namespace {
+// 動的初期化の無い変数なので operator new の中から触っても初期化順の問題は無い
+std::atomic<bool> g_enabled{false};
+thread_local int t_depth = 0;
+thread_local size_t t_count = 0;
+thread_local size_t t_bytes = 0;
+}
+
+AllocCounter::AllocCounter() : start_{t_count, t_bytes} { ++t_depth; }
+AllocCounter::~AllocCounter() { --t_depth; }
+
+AllocCount AllocCounter::get() const {
+    return {t_count - start_.count, t_bytes - start_.bytes};
+}
+
+bool alloc_counting_enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+void alloc_stats_enable() { g_enabled.store(true, std::memory_order_relaxed); }
+
+void alloc_stats_record(size_t bytes) {
+    if (t_depth > 0) { ++t_count; t_bytes += bytes; }
+}
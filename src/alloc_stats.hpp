@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+
+// operator new の回数・バイト数の計測（/bench の1リクエストあたりの割り当て、テスト用）
+//
+// 数えるのは alloc_hook.cpp の置き換えた operator new/delete がリンクされているときだけ
+// （unit_tests と、CMake の AGENS_ALLOC_STATS=ON で作った agens）。それ以外では常に 0 を返す。
+// 数えるのは AllocCounter が生存している間、そのスレッドでの確保だけ（他スレッドの確保は混ざらない）
+
+struct AllocCount {
+    size_t count = 0;
+    size_t bytes = 0;
+};
+
+/// @brief 生存中、このスレッドでの割り当てを数える。入れ子にすると内側の分は外側にも入る
+class AllocCounter {
+public:
+    AllocCounter();
+    ~AllocCounter();
+    AllocCounter(const AllocCounter&) = delete;
+    AllocCounter& operator=(const AllocCounter&) = delete;
+    /// @brief 作ってからの割り当て
+    AllocCount get() const;
+
+private:
+    AllocCount start_;
+};
+
+/// @brief 割り当てを数える operator new がリンクされているか
+bool alloc_counting_enabled();
+
+/// @brief alloc_hook.cpp から呼ぶ。静的初期化で1度だけ
+void alloc_stats_enable();
+/// @brief alloc_hook.cpp の operator new から確保ごとに呼ぶ
+void alloc_stats_record(size_t bytes);
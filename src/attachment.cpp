@@ -0,0 +1,45 @@
+#include "attachment.hpp"
+#include "chat.hpp"
+#include "trace.hpp"
+#include <algorithm>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+shared_ptr<const Attachment> load_attachment(const string& path, string* err) {
+    trace::Span span("attach.load", "attach");
+    span.arg(path);
+    std::error_code ec;
+    auto mtime = fs::last_write_time(path, ec);
+    if (ec) { if (err) *err = "ファイルが見つかりません: " + path; return nullptr; }
+    auto a = make_shared<Attachment>();
+    if (!a->file_.open(path, err)) return nullptr;
+    string_view text = a->text();
+    if (text.substr(0, 8192).find('\0') != string_view::npos) {
+        if (err) *err = "バイナリファイルは添付できません: " + path;
+        return nullptr;
+    }
+    a->path_ = path;
+    a->mtime_ = mtime;
+    a->disk_size_ = a->file_.size();
+    a->header_ = "\n\n[添付ファイル: " + path + "]\n```\n";
+    a->tokens_ = estimate_tokens(text) + estimate_tokens(a->header_) + 2;
+    return a;
+}
+
+shared_ptr<const Attachment> refresh_attachment(const shared_ptr<const Attachment>& a, bool* changed, string* err) {
+    if (changed) *changed = false;
+    if (!a) return a;
+    std::error_code ec;
+    auto mtime = fs::last_write_time(a->path_, ec);
+    auto size = ec ? 0 : fs::file_size(a->path_, ec);
+    if (!ec && mtime == a->mtime_ && size == a->disk_size_) return a;
+    if (changed) *changed = true;
+    return load_attachment(a->path_, err);
+}
+
+long attachment_tokens(const AttachmentList& list) {
+    long total = 0;
+    for (const auto& a : list) if (a) total += a->tokens();
+    return total;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "mapped_file.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// /attach: ローカルファイルを mmap したまま会話に添付する（本文は送信時にリクエストへ直接エスケープして書き出す）
+
+/// @brief 添付ファイル1つ。読み込み後は不変で、変更を検出したら別のオブジェクトとして読み直す
+class Attachment {
+public:
+    const std::string& path() const { return path_; }
+    std::string_view text() const { return file_.view(); }
+    size_t size() const { return file_.size(); }
+    /// @brief 見出し込みのトークン数（読み込み時に1度だけ数える）
+    long tokens() const { return tokens_; }
+    /// @brief 送信時に本文の前後へ付ける見出し
+    const std::string& header() const { return header_; }
+    static constexpr std::string_view footer = "\n```\n";
+
+private:
+    friend std::shared_ptr<const Attachment> load_attachment(const std::string& path, std::string* err);
+    friend std::shared_ptr<const Attachment> refresh_attachment(const std::shared_ptr<const Attachment>& a, bool* changed, std::string* err);
+    std::string path_;
+    std::string header_;
+    MappedFile file_;
+    std::filesystem::file_time_type mtime_{};
+    std::uintmax_t disk_size_ = 0;
+    long tokens_ = 0;
+};
+
+using AttachmentList = std::vector<std::shared_ptr<const Attachment>>;
+
+/// @brief path を mmap して添付にする。バイナリ（先頭 8KB に NUL）やディレクトリは失敗
+std::shared_ptr<const Attachment> load_attachment(const std::string& path, std::string* err = nullptr);
+/// @brief mtime かサイズが変わっていれば読み直したものを返す。変わっていなければ a のまま
+///
+/// 消えた・変わったのに読み直せないファイルは nullptr（changed は真、理由は err）。
+/// 切り詰められたファイルの古いマップを読むと SIGBUS になるため、a は使い続けずに外すこと
+std::shared_ptr<const Attachment> refresh_attachment(const std::shared_ptr<const Attachment>& a, bool* changed = nullptr,
+                                                     std::string* err = nullptr);
+/// @brief 添付の合計トークン数（概算）
+long attachment_tokens(const AttachmentList& list);
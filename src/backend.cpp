@@ -1,15 +1,53 @@
 #include "backend.hpp"
 #include "utils.hpp"
 #include "chat.hpp"
+#include "trace.hpp"
 #include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdlib>
 
 using namespace std;
 
 namespace backend {
 
+// 先読みロードは大きなモデルの読み込み（数十秒〜）を待つ
+static constexpr int kWarmupTimeoutSec = 300;
+
+static double elapsed_ms(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// "<arch>.block_count" のように接頭辞付きで並ぶキーを接尾辞で探し、数値を返す
+static bool find_number_by_suffix(const string& text, size_t from, const string& suffix, double& out) {
+    const string pat = "." + suffix + "\"";
+    size_t pos = text.find(pat, from);
+    if (pos == string::npos) return false;
+    pos += pat.size();
+    while (pos < text.size() && (isspace(static_cast<unsigned char>(text[pos])) || text[pos] == ':')) ++pos;
+    const char* begin = text.c_str() + pos;
+    char* end = nullptr;
+    double v = strtod(begin, &end);
+    if (end == begin) return false;
+    out = v;
+    return true;
+}
+
+// "key": true/false を読む（見つからなければ false）
+static bool find_bool(const string& text, const string& key) {
+    size_t pos = text.find("\"" + key + "\"");
+    if (pos == string::npos) return false;
+    pos = text.find(':', pos);
+    if (pos == string::npos) return false;
+    ++pos;
+    while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+    return text.compare(pos, 4, "true") == 0;
+}
+
 namespace ollama {
 
 bool probe(IHttp& http) {
+    trace::Span span("probe.ollama", "backend");
     auto body = http.get("http://localhost:11434/api/version");
     if (!body.has_value()) return false;
 
@@ -20,6 +58,7 @@ bool probe(IHttp& http) {
 }
 
 vector<string> list_models(IHttp& http) {
+    trace::Span span("list_models.ollama", "backend");
     auto body = http.get("http://localhost:11434/api/tags");
     if (!body) return {};
 
@@ -32,13 +71,91 @@ vector<string> list_models(IHttp& http) {
     return names;
 }
 
-optional<string> chat(IHttp& http, const string& model, const vector<ChatMsg>& msgs, const InferenceTuning& t) {
-    string body = build_ollama_chat_body(model, msgs, t);
-    auto resp = http.post_json("http://localhost:11434/api/chat", body, {});
+optional<ChatResult> chat(IHttp& http, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    trace::Span span("chat.ollama", "backend");
+    // 本文は送信時に一時ファイルへ直接書き出す（添付ファイルを文字列へ複製しない）
+    auto body = [&](ostream& os){ trace::Span s("chat.build_body", "backend"); write_ollama_chat_body(os, model, msgs, t); };
+    HttpTiming timing;
+    timing.timeout_sec = t.request_timeout_sec;
+    auto t0 = chrono::steady_clock::now();
+    trace::Span send_span("chat.send_wait", "backend");
+    auto resp = http.post_json_stream("http://localhost:11434/api/chat", body, {}, timing);
+    send_span.end();
     if (!resp) return nullopt;
-    string content;
-    if (utils::json_find_first_string_value(*resp, "content", content)) return content;
-    return *resp;
+    trace::Span parse_span("chat.parse", "backend");
+    ChatResult r;
+    r.stats = parse_ollama_stats(*resp);
+    r.stats.client_ms = elapsed_ms(t0);
+    r.stats.ttfb_ms = timing.ttfb_ms;
+    if (!utils::json_find_first_string_value(*resp, "content", r.content)) r.content = *resp;
+    return r;
+}
+
+optional<ModelInfo> show_model(IHttp& http, const string& model) {
+    trace::Span span("show_model.ollama", "backend");
+    auto resp = http.post_json("http://localhost:11434/api/show", "{\"model\":\"" + json_escape(model) + "\"}", {});
+    if (!resp || resp->find("error") != string::npos) return nullopt;
+    ModelInfo mi;
+    mi.name = model;
+    utils::json_find_first_string_value(*resp, "quantization_level", mi.quantization);
+    utils::json_find_first_string_value(*resp, "family", mi.family);
+    string psize;
+    if (utils::json_find_first_string_value(*resp, "parameter_size", psize)) mi.parameter_count = parse_parameter_size(psize);
+    // model_info 以降のみを見る（modelfile/template 内の文字列を拾わないように）
+    size_t from = resp->find("\"model_info\"");
+    if (from == string::npos) from = 0;
+    double v = 0;
+    if (find_number_by_suffix(*resp, from, "parameter_count", v)) mi.parameter_count = v;
+    if (find_number_by_suffix(*resp, from, "block_count", v)) mi.n_layers = static_cast<int>(v);
+    if (find_number_by_suffix(*resp, from, "embedding_length", v)) mi.embedding_length = static_cast<int>(v);
+    if (find_number_by_suffix(*resp, from, "context_length", v)) mi.context_length = static_cast<int>(v);
+    if (find_number_by_suffix(*resp, from, "head_count", v)) mi.n_heads = static_cast<int>(v);
+    if (find_number_by_suffix(*resp, from, "head_count_kv", v)) mi.n_kv_heads = static_cast<int>(v);
+    if (find_number_by_suffix(*resp, from, "key_length", v)) mi.head_dim = static_cast<int>(v);
+    if (mi.parameter_count <= 0) mi.parameter_count = parse_parameter_size(model);
+    return mi;
+}
+
+bool unload(IHttp& http, const string& model) {
+    auto resp = http.post_json("http://localhost:11434/api/generate", "{\"model\":\"" + json_escape(model) + "\",\"keep_alive\":0}", {});
+    return resp.has_value() && resp->find("error") == string::npos;
+}
+
+bool warmup(IHttp& http, const string& model, const string& keep_alive) {
+    trace::Span span("warmup.ollama", "backend");
+    string body = "{\"model\":\"" + json_escape(model) + "\",\"messages\":[]";
+    if (!keep_alive.empty()) body += ",\"keep_alive\":" + keep_alive_json(keep_alive);
+    body += "}";
+    HttpTiming timing;
+    timing.timeout_sec = kWarmupTimeoutSec;
+    auto resp = http.post_json_timed("http://localhost:11434/api/chat", body, {}, timing);
+    return resp.has_value() && resp->find("\"error\"") == string::npos;
+}
+
+vector<ModelInfo> list_model_infos(IHttp& http) {
+    trace::Span span("list_model_infos.ollama", "backend");
+    auto body = http.get("http://localhost:11434/api/tags");
+    if (!body || body->find("\"error\"") != string::npos) return {};
+    vector<ModelInfo> out;
+    for (const auto& obj : utils::json_array_objects(*body, "models")) {
+        ModelInfo mi;
+        if (!utils::json_find_first_string_value(obj, "name", mi.name)) continue;
+        double v = 0;
+        if (utils::json_find_last_number_value(obj, "size", v) && v > 0) mi.size_bytes = static_cast<uint64_t>(v);
+        utils::json_find_first_string_value(obj, "quantization_level", mi.quantization);
+        utils::json_find_first_string_value(obj, "family", mi.family);
+        string psize;
+        if (utils::json_find_first_string_value(obj, "parameter_size", psize)) mi.parameter_count = parse_parameter_size(psize);
+        out.push_back(mi);
+    }
+    return out;
+}
+
+optional<vector<ResidentModel>> list_running(IHttp& http) {
+    trace::Span span("list_running.ollama", "backend");
+    auto resp = http.get("http://localhost:11434/api/ps");
+    if (!resp || resp->find("\"models\"") == string::npos) return nullopt;
+    return parse_ollama_ps(*resp);
 }
 
 } // namespace ollama
@@ -46,6 +163,7 @@ optional<string> chat(IHttp& http, const string& model, const vector<ChatMsg>& m
 namespace lmstudio {
 
 bool probe(IHttp& http) {
+    trace::Span span("probe.lmstudio", "backend");
     auto body = http.get("http://localhost:1234/v1/models", {"Authorization: Bearer lm-studio"});
     if (!body.has_value() || body->find("error") != string::npos) {
         body = http.get("http://localhost:1234/v1/models");
@@ -59,6 +177,7 @@ bool probe(IHttp& http) {
 }
 
 vector<string> list_models(IHttp& http) {
+    trace::Span span("list_models.lmstudio", "backend");
     auto body = http.get("http://localhost:1234/v1/models", {"Authorization: Bearer lm-studio"});
     if (!body.has_value() || body->find("error")!=string::npos) body = http.get("http://localhost:1234/v1/models");
     if (!body) return {};
@@ -72,12 +191,21 @@ vector<string> list_models(IHttp& http) {
     return ids;
 }
 
-optional<string> chat(IHttp& http, const string& model, const vector<ChatMsg>& msgs, const InferenceTuning& t) {
-    string body = build_lmstudio_chat_body(model, msgs, t);
-    auto resp = http.post_json("http://localhost:1234/v1/chat/completions", body, {"Authorization: Bearer lm-studio"});
+optional<ChatResult> chat(IHttp& http, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    trace::Span span("chat.lmstudio", "backend");
+    auto body = [&](ostream& os){ trace::Span s("chat.build_body", "backend"); write_lmstudio_chat_body(os, model, msgs, t); };
+    HttpTiming timing;
+    timing.timeout_sec = t.request_timeout_sec;
+    auto t0 = chrono::steady_clock::now();
+    trace::Span send_span("chat.send_wait", "backend");
+    auto resp = http.post_json_stream("http://localhost:1234/v1/chat/completions", body, {"Authorization: Bearer lm-studio"}, timing);
     if (!resp.has_value() || (resp->find("error") != string::npos && resp->find("choices") == string::npos)) {
-        resp = http.post_json("http://localhost:1234/v1/chat/completions", body, {});
+        timing = HttpTiming{};
+        timing.timeout_sec = t.request_timeout_sec;
+        t0 = chrono::steady_clock::now();
+        resp = http.post_json_stream("http://localhost:1234/v1/chat/completions", body, {}, timing);
     }
+    send_span.end();
     if (!resp.has_value()) return nullopt;
     
     // Check for error in response
@@ -85,12 +213,279 @@ optional<string> chat(IHttp& http, const string& model, const vector<ChatMsg>& m
         return nullopt;
     }
     
-    string content;
-    if (utils::json_find_first_string_value(*resp, "content", content)) return content;
-    return *resp;
+    trace::Span parse_span("chat.parse", "backend");
+    ChatResult r;
+    r.stats = parse_openai_stats(*resp);
+    r.stats.client_ms = elapsed_ms(t0);
+    r.stats.ttfb_ms = timing.ttfb_ms;
+    if (!utils::json_find_first_string_value(*resp, "content", r.content)) r.content = *resp;
+    return r;
+}
+
+optional<ModelInfo> show_model(IHttp& http, const string& model) {
+    trace::Span span("show_model.lmstudio", "backend");
+    auto resp = http.get("http://localhost:1234/api/v0/models/" + utils::url_encode(model));
+    if (!resp || (resp->find("error") != string::npos && resp->find("\"id\"") == string::npos)) return nullopt;
+    ModelInfo mi;
+    mi.name = model;
+    utils::json_find_first_string_value(*resp, "quantization", mi.quantization);
+    utils::json_find_first_string_value(*resp, "arch", mi.family);
+    double v = 0;
+    if (utils::json_find_last_number_value(*resp, "max_context_length", v)) mi.context_length = static_cast<int>(v);
+    // 層数・次元は返らないため fill_missing_dims の代表値で補う
+    mi.parameter_count = parse_parameter_size(model);
+    return mi;
+}
+
+bool unload(IHttp& http, const string& model) {
+    (void)http; (void)model;
+    return false;
+}
+
+bool warmup(IHttp& http, const string& model, const string& keep_alive) {
+    (void)keep_alive;
+    trace::Span span("warmup.lmstudio", "backend");
+    string body = "{\"model\":\"" + json_escape(model) + "\",\"max_tokens\":1,\"stream\":false,\"messages\":[{\"role\":\"user\",\"content\":\".\"}]}";
+    HttpTiming timing;
+    timing.timeout_sec = kWarmupTimeoutSec;
+    auto resp = http.post_json_timed("http://localhost:1234/v1/chat/completions", body, {"Authorization: Bearer lm-studio"}, timing);
+    return resp.has_value() && resp->find("choices") != string::npos;
+}
+
+vector<ModelInfo> list_model_infos(IHttp& http) {
+    trace::Span span("list_model_infos.lmstudio", "backend");
+    auto body = http.get("http://localhost:1234/api/v0/models");
+    if (!body) return {};
+    vector<ModelInfo> out;
+    for (const auto& obj : utils::json_array_objects(*body, "data")) {
+        ModelInfo mi;
+        if (!utils::json_find_first_string_value(obj, "id", mi.name)) continue;
+        string type;
+        if (utils::json_find_first_string_value(obj, "type", type) && type == "embeddings") continue;
+        utils::json_find_first_string_value(obj, "quantization", mi.quantization);
+        utils::json_find_first_string_value(obj, "arch", mi.family);
+        double v = 0;
+        if (utils::json_find_last_number_value(obj, "max_context_length", v)) mi.context_length = static_cast<int>(v);
+        mi.parameter_count = parse_parameter_size(mi.name);
+        out.push_back(mi);
+    }
+    return out;
+}
+
+optional<vector<ResidentModel>> list_running(IHttp& http) {
+    trace::Span span("list_running.lmstudio", "backend");
+    auto resp = http.get("http://localhost:1234/api/v0/models");
+    if (!resp || resp->find("\"data\"") == string::npos) return nullopt;
+    return parse_lmstudio_loaded(*resp);
 }
 
 } // namespace lmstudio
 
+namespace llamacpp {
+
+string base_url() {
+    string url = "http://localhost:8080";
+    if (const char* env = getenv("AGENS_LLAMACPP_URL")) if (*env) url = env;
+    while (!url.empty() && url.back() == '/') url.pop_back();
+    return url;
+}
+
+bool probe(IHttp& http) {
+    trace::Span span("probe.llamacpp", "backend");
+    auto body = http.get(base_url() + "/health");
+    if (!body) return false;
+    string status;
+    return utils::json_find_first_string_value(*body, "status", status) && status == "ok";
+}
+
+vector<string> list_models(IHttp& http) {
+    trace::Span span("list_models.llamacpp", "backend");
+    auto body = http.get(base_url() + "/v1/models");
+    if (!body) return {};
+    vector<string> ids;
+    for (const auto& obj : utils::json_array_objects(*body, "data")) {
+        string id;
+        if (utils::json_find_first_string_value(obj, "id", id)) ids.push_back(id);
+    }
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+optional<ChatResult> chat(IHttp& http, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    trace::Span span("chat.llamacpp", "backend");
+    auto body = [&](ostream& os){ trace::Span s("chat.build_body", "backend"); write_llamacpp_chat_body(os, model, msgs, t); };
+    HttpTiming timing;
+    timing.timeout_sec = t.request_timeout_sec;
+    auto t0 = chrono::steady_clock::now();
+    trace::Span send_span("chat.send_wait", "backend");
+    auto resp = http.post_json_stream(base_url() + "/v1/chat/completions", body, {}, timing);
+    send_span.end();
+    if (!resp || resp->find("choices") == string::npos) return nullopt;
+    trace::Span parse_span("chat.parse", "backend");
+    ChatResult r;
+    r.stats = parse_openai_stats(*resp);
+    r.stats.client_ms = elapsed_ms(t0);
+    r.stats.ttfb_ms = timing.ttfb_ms;
+    if (!utils::json_find_first_string_value(*resp, "content", r.content)) r.content = *resp;
+    return r;
+}
+
+optional<Props> props(IHttp& http) {
+    auto resp = http.get(base_url() + "/props");
+    if (!resp || resp->find("\"error\"") != string::npos) return nullopt;
+    Props p;
+    utils::json_find_first_string_value(*resp, "model_path", p.model_path);
+    double v = 0;
+    if (utils::json_find_last_number_value(*resp, "n_ctx", v)) p.n_ctx = static_cast<int>(v);
+    if (utils::json_find_last_number_value(*resp, "total_slots", v)) p.total_slots = static_cast<int>(v);
+    return p;
+}
+
+// /v1/models の応答を解釈する（list_running と同じ応答を使い回す）
+static vector<ModelInfo> parse_model_infos(const string& body) {
+    vector<ModelInfo> out;
+    for (const auto& obj : utils::json_array_objects(body, "data")) {
+        ModelInfo mi;
+        if (!utils::json_find_first_string_value(obj, "id", mi.name)) continue;
+        double v = 0;
+        if (utils::json_find_last_number_value(obj, "n_params", v)) mi.parameter_count = v;
+        if (utils::json_find_last_number_value(obj, "size", v) && v > 0) mi.size_bytes = static_cast<uint64_t>(v);
+        if (utils::json_find_last_number_value(obj, "n_embd", v)) mi.embedding_length = static_cast<int>(v);
+        if (utils::json_find_last_number_value(obj, "n_ctx_train", v)) mi.context_length = static_cast<int>(v);
+        if (mi.parameter_count <= 0) mi.parameter_count = parse_parameter_size(mi.name);
+        out.push_back(mi);
+    }
+    return out;
+}
+
+vector<ModelInfo> list_model_infos(IHttp& http) {
+    trace::Span span("list_model_infos.llamacpp", "backend");
+    auto body = http.get(base_url() + "/v1/models");
+    if (!body) return {};
+    return parse_model_infos(*body);
+}
+
+optional<ModelInfo> show_model(IHttp& http, const string& model) {
+    trace::Span span("show_model.llamacpp", "backend");
+    auto infos = list_model_infos(http);
+    auto it = find_if(infos.begin(), infos.end(), [&](const ModelInfo& m){ return m.name == model; });
+    if (it == infos.end()) return nullopt;
+    ModelInfo mi = *it;
+    // サーバの -c で決まるスロットあたりの長さを超えては使えない
+    if (auto p = props(http); p && p->n_ctx > 0) mi.context_length = p->n_ctx;
+    return mi;
+}
+
+bool unload(IHttp& http, const string& model) {
+    (void)http; (void)model;
+    return false;
+}
+
+bool warmup(IHttp& http, const string& model, const string& keep_alive) {
+    (void)model; (void)keep_alive;
+    return probe(http);
+}
+
+optional<vector<ResidentModel>> list_running(IHttp& http) {
+    trace::Span span("list_running.llamacpp", "backend");
+    auto body = http.get(base_url() + "/v1/models");
+    if (!body || body->find("\"data\"") == string::npos) return nullopt;
+    vector<ResidentModel> out;
+    for (const auto& mi : parse_model_infos(*body)) {
+        ResidentModel r;
+        r.name = mi.name;
+        if (mi.size_bytes > 0) r.size_bytes = static_cast<double>(mi.size_bytes);
+        out.push_back(r);
+    }
+    if (auto p = props(http); p && !out.empty()) out[0].context_length = p->n_ctx;
+    return out;
+}
+
+optional<vector<Slot>> list_slots(IHttp& http) {
+    auto body = http.get(base_url() + "/slots");
+    if (!body || body->find("\"error\"") != string::npos) return nullopt;
+    vector<Slot> out;
+    for (const auto& obj : utils::json_array_objects(*body, "")) {
+        Slot s;
+        double v = 0;
+        if (!utils::json_find_last_number_value(obj, "id", v)) continue;
+        s.id = static_cast<int>(v);
+        if (utils::json_find_last_number_value(obj, "n_ctx", v)) s.n_ctx = static_cast<int>(v);
+        s.is_processing = find_bool(obj, "is_processing");
+        out.push_back(s);
+    }
+    return out;
+}
+
+optional<int> pick_idle_slot(const vector<Slot>& slots) {
+    optional<int> best;
+    for (const auto& s : slots) if (!s.is_processing && (!best || s.id < *best)) best = s.id;
+    return best;
+}
+
+static bool slot_action(IHttp& http, int slot, const string& action, const string& body) {
+    trace::Span span("slot", "backend");
+    span.arg(action);
+    auto resp = http.post_json(base_url() + "/slots/" + to_string(slot) + "?action=" + action, body, {});
+    return resp.has_value() && resp->find("\"error\"") == string::npos && resp->find("id_slot") != string::npos;
+}
+
+bool slot_save(IHttp& http, int slot, const string& filename) {
+    return slot_action(http, slot, "save", "{\"filename\":\"" + json_escape(filename) + "\"}");
+}
+
+bool slot_restore(IHttp& http, int slot, const string& filename) {
+    return slot_action(http, slot, "restore", "{\"filename\":\"" + json_escape(filename) + "\"}");
+}
+
+bool slot_erase(IHttp& http, int slot) {
+    return slot_action(http, slot, "erase", "{}");
+}
+
+} // namespace llamacpp
+
+vector<string> list_models(const string& name, IHttp& http) {
+    if (name=="ollama") return ollama::list_models(http);
+    if (name=="llamacpp") return llamacpp::list_models(http);
+    return lmstudio::list_models(http);
+}
+
+optional<ChatResult> chat(const string& name, IHttp& http, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    if (name=="ollama") return ollama::chat(http, model, msgs, t);
+    if (name=="llamacpp") return llamacpp::chat(http, model, msgs, t);
+    return lmstudio::chat(http, model, msgs, t);
+}
+
+optional<ModelInfo> show_model(const string& name, IHttp& http, const string& model) {
+    if (name=="ollama") return ollama::show_model(http, model);
+    if (name=="llamacpp") return llamacpp::show_model(http, model);
+    return lmstudio::show_model(http, model);
+}
+
+bool unload(const string& name, IHttp& http, const string& model) {
+    if (name=="ollama") return ollama::unload(http, model);
+    if (name=="llamacpp") return llamacpp::unload(http, model);
+    return lmstudio::unload(http, model);
+}
+
+bool warmup(const string& name, IHttp& http, const string& model, const string& keep_alive) {
+    if (name=="ollama") return ollama::warmup(http, model, keep_alive);
+    if (name=="llamacpp") return llamacpp::warmup(http, model, keep_alive);
+    return lmstudio::warmup(http, model, keep_alive);
+}
+
+vector<ModelInfo> list_model_infos(const string& name, IHttp& http) {
+    if (name=="ollama") return ollama::list_model_infos(http);
+    if (name=="llamacpp") return llamacpp::list_model_infos(http);
+    return lmstudio::list_model_infos(http);
+}
+
+optional<vector<ResidentModel>> list_running(const string& name, IHttp& http) {
+    if (name=="ollama") return ollama::list_running(http);
+    if (name=="llamacpp") return llamacpp::list_running(http);
+    return lmstudio::list_running(http);
+}
+
 } // namespace backend
 
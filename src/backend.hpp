@@ -5,6 +5,8 @@
 #include "ports.hpp"
 #include "system_info.hpp"
 #include "chat.hpp"
+#include "model_fit.hpp"
+#include "residency.hpp"
 
 // 各LLMバックエンド（Ollama, LM Studioなど）との通信を担うAPI
 namespace backend {
@@ -15,8 +17,18 @@ namespace ollama {
     bool probe(IHttp& http);
     /// @brief 利用可能なモデル一覧を取得する
     std::vector<std::string> list_models(IHttp& http);
-    /// @brief チャットAPIを呼び出し、アシスタントの応答を取得する
-    std::optional<std::string> chat(IHttp& http, const std::string& model, const std::vector<ChatMsg>& msgs, const InferenceTuning& t);
+    /// @brief チャットAPIを呼び出し、アシスタントの応答と計測値を取得する
+    std::optional<ChatResult> chat(IHttp& http, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+    /// @brief /api/show からパラメータ数・量子化・層数・次元・最大コンテキストを取得する
+    std::optional<ModelInfo> show_model(IHttp& http, const std::string& model);
+    /// @brief keep_alive=0 でモデルをメモリから降ろす
+    bool unload(IHttp& http, const std::string& model);
+    /// @brief 空の messages でチャットAPIを呼び、モデルを読み込ませておく
+    bool warmup(IHttp& http, const std::string& model, const std::string& keep_alive);
+    /// @brief /api/tags から各モデルのサイズ・量子化・パラメータ数を取得する
+    std::vector<ModelInfo> list_model_infos(IHttp& http);
+    /// @brief /api/ps から常駐モデルと VRAM/RAM の内訳を取得する
+    std::optional<std::vector<ResidentModel>> list_running(IHttp& http);
 }
 
 // LM Studioバックエンド用API
@@ -25,8 +37,75 @@ namespace lmstudio {
     bool probe(IHttp& http);
     /// @brief 利用可能なモデル一覧を取得する
     std::vector<std::string> list_models(IHttp& http);
-    /// @brief チャットAPIを呼び出し、アシスタントの応答を取得する
-    std::optional<std::string> chat(IHttp& http, const std::string& model, const std::vector<ChatMsg>& msgs, const InferenceTuning& t);
+    /// @brief チャットAPIを呼び出し、アシスタントの応答と計測値を取得する
+    std::optional<ChatResult> chat(IHttp& http, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+    /// @brief /api/v0/models/{id} から量子化・アーキテクチャ・最大コンテキストを取得する（パラメータ数はIDから推定）
+    std::optional<ModelInfo> show_model(IHttp& http, const std::string& model);
+    /// @brief OpenAI互換APIにはアンロード手段が無いため常に false
+    bool unload(IHttp& http, const std::string& model);
+    /// @brief 1トークンだけ生成させて JIT ロードを起こす（keep_alive は未対応のため無視）
+    bool warmup(IHttp& http, const std::string& model, const std::string& keep_alive);
+    /// @brief /api/v0/models から量子化・最大コンテキストを取得する（サイズは名前から推定）
+    std::vector<ModelInfo> list_model_infos(IHttp& http);
+    /// @brief /api/v0/models の state=loaded を常駐モデルとして返す（VRAM 内訳は不明）
+    std::optional<std::vector<ResidentModel>> list_running(IHttp& http);
 }
 
+// llama.cpp server（llama-server）用API。既定は http://localhost:8080（AGENS_LLAMACPP_URL で変更可）
+namespace llamacpp {
+    /// @brief llama-server のスロット（並列推論の単位。各スロットが KV キャッシュを持つ）
+    struct Slot {
+        int id = -1;
+        int n_ctx = 0;
+        bool is_processing = false;
+    };
+    /// @brief /props の主要項目
+    struct Props {
+        std::string model_path;
+        int n_ctx = 0;       // スロットあたりのコンテキスト長
+        int total_slots = 0;
+    };
+
+    std::string base_url();
+    /// @brief /health が ok を返すか確認する（モデル読み込み中は false）
+    bool probe(IHttp& http);
+    std::vector<std::string> list_models(IHttp& http);
+    /// @brief cache_prompt と id_slot を付けて /v1/chat/completions を呼び、timings を読む
+    std::optional<ChatResult> chat(IHttp& http, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+    std::optional<ModelInfo> show_model(IHttp& http, const std::string& model);
+    /// @brief サーバ起動時にモデルが固定されるためアンロード手段は無い（常に false）
+    bool unload(IHttp& http, const std::string& model);
+    /// @brief モデルは常駐しているので /health の確認のみ
+    bool warmup(IHttp& http, const std::string& model, const std::string& keep_alive);
+    /// @brief /v1/models の meta（n_params, size, n_ctx_train）から取得する
+    std::vector<ModelInfo> list_model_infos(IHttp& http);
+    std::optional<std::vector<ResidentModel>> list_running(IHttp& http);
+
+    std::optional<Props> props(IHttp& http);
+    /// @brief /slots の一覧（--no-slots で無効化されていれば nullopt）
+    std::optional<std::vector<Slot>> list_slots(IHttp& http);
+    /// @brief 処理中でない最小 id のスロット。無ければ nullopt
+    std::optional<int> pick_idle_slot(const std::vector<Slot>& slots);
+    /// @brief スロットの KV キャッシュをファイルへ保存/復元/破棄する（サーバ側に --slot-save-path が必要）
+    bool slot_save(IHttp& http, int slot, const std::string& filename);
+    bool slot_restore(IHttp& http, int slot, const std::string& filename);
+    bool slot_erase(IHttp& http, int slot);
+}
+
+// バックエンド名（"ollama" / "lmstudio" / "llamacpp"）で振り分ける共通API
+/// @brief 利用可能なモデル一覧を取得する
+std::vector<std::string> list_models(const std::string& name, IHttp& http);
+/// @brief チャットAPIを呼び出し、アシスタントの応答と計測値を取得する
+std::optional<ChatResult> chat(const std::string& name, IHttp& http, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+/// @brief モデル情報を取得する
+std::optional<ModelInfo> show_model(const std::string& name, IHttp& http, const std::string& model);
+/// @brief モデルをメモリから降ろす（未対応なら false）
+bool unload(const std::string& name, IHttp& http, const std::string& model);
+/// @brief モデルを事前に読み込ませる
+bool warmup(const std::string& name, IHttp& http, const std::string& model, const std::string& keep_alive);
+/// @brief インストール済みモデルのメタデータ一覧（推奨順位付け用）
+std::vector<ModelInfo> list_model_infos(const std::string& name, IHttp& http);
+/// @brief 常駐モデル一覧（取得できなければ nullopt）
+std::optional<std::vector<ResidentModel>> list_running(const std::string& name, IHttp& http);
+
 } // namespace backend
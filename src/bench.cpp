@@ -0,0 +1,259 @@
+#include "bench.hpp"
+#include "alloc_stats.hpp"
+#include "file_finder.hpp"
+#include "task_pool.hpp"
+#include <chrono>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <tuple>
+
+using namespace std;
+
+double BenchSample::ttft_ms() const {
+    return stats.ttft_ms();
+}
+
+static bool parse_int_list(const string& s, vector<int>& out) {
+    vector<int> v; string cur; istringstream iss(s);
+    while (getline(iss, cur, ',')) {
+        try { int n = stoi(cur); if (n <= 0) return false; v.push_back(n); } catch (...) { return false; }
+    }
+    if (v.empty()) return false;
+    out = v;
+    return true;
+}
+
+bool parse_bench_args(const vector<string>& args, BenchOptions& opt, string* err) {
+    for (const auto& a : args) {
+        auto eq = a.find('=');
+        if (eq == string::npos) { if (err) *err = "key=value 形式で指定してください: " + a; return false; }
+        string k = a.substr(0, eq), v = a.substr(eq+1);
+        bool ok = true;
+        try {
+            if (k=="prompts") ok = parse_int_list(v, opt.prompt_tokens);
+            else if (k=="ctx") ok = parse_int_list(v, opt.contexts);
+            else if (k=="iters") { opt.warm_iterations = stoi(v); ok = opt.warm_iterations >= 0; }
+            else if (k=="cold") { opt.cold_iterations = stoi(v); ok = opt.cold_iterations >= 0; }
+            else if (k=="max") { opt.max_tokens = stoi(v); ok = opt.max_tokens > 0; }
+            else if (k=="out") opt.out_prefix = v;
+            else { if (err) *err = "不明なオプション: " + k; return false; }
+        } catch (...) {
+            ok = false;
+        }
+        if (!ok) { if (err) *err = "値が不正です: " + a; return false; }
+    }
+    return true;
+}
+
+string make_bench_prompt(int n_tokens, int nonce) {
+    // 英単語はおおむね1語1トークン。先頭の nonce で KV キャッシュの再利用を防ぐ
+    static const char* kWords[] = {"system", "latency", "memory", "vector", "kernel", "thread", "cache", "signal",
+                                   "buffer", "socket", "driver", "packet", "stream", "matrix", "tensor", "layer"};
+    ostringstream oss;
+    oss << "[run " << nonce << "] Summarize the following words in one sentence:";
+    for (int i = 0; i < n_tokens; ++i) oss << ' ' << kWords[(i * 7 + nonce) % 16];
+    return oss.str();
+}
+
+double percentile(vector<double> v, double p) {
+    if (v.empty()) return -1;
+    sort(v.begin(), v.end());
+    double rank = (p / 100.0) * static_cast<double>(v.size() - 1);
+    size_t lo = static_cast<size_t>(rank);
+    size_t hi = min(lo + 1, v.size() - 1);
+    double frac = rank - static_cast<double>(lo);
+    return v[lo] + (v[hi] - v[lo]) * frac;
+}
+
+vector<BenchSample> run_bench(const BenchOptions& opt, const InferenceTuning& base,
+                              const function<optional<ChatResult>(const vector<ChatMsg>&, const InferenceTuning&)>& chat,
+                              const function<bool()>& unload,
+                              const function<void(const BenchSample&)>& on_sample) {
+    vector<BenchSample> out;
+    vector<int> contexts = opt.contexts.empty() ? vector<int>{base.context} : opt.contexts;
+    bool can_unload = opt.cold_iterations > 0;
+    int nonce = 0;
+    for (int ctx : contexts) {
+        InferenceTuning t = base;
+        t.context = ctx;
+        t.max_tokens = opt.max_tokens;
+        t.temperature = 0.0;
+        t.request_timeout_sec = 0; // 長いプロンプト・生成の計測を打ち切らない
+        for (int pt : opt.prompt_tokens) {
+            if (pt + opt.max_tokens > ctx) continue; // コンテキストに収まらない組み合わせは飛ばす
+            auto once = [&](bool cold, int iter) {
+                vector<ChatMsg> msgs = {{"user", make_bench_prompt(pt, ++nonce)}};
+                BenchSample s;
+                s.prompt_tokens = pt; s.context = ctx; s.cold = cold; s.iteration = iter;
+                optional<ChatResult> r;
+                {
+                    AllocCounter counter;
+                    r = chat(msgs, t);
+                    auto c = counter.get();
+                    s.alloc_counted = alloc_counting_enabled();
+                    s.allocs = c.count; s.alloc_bytes = c.bytes;
+                }
+                if (r) { s.ok = true; s.stats = r->stats; }
+                out.push_back(s);
+                if (on_sample) on_sample(s);
+            };
+            for (int i = 0; i < opt.cold_iterations && can_unload; ++i) {
+                if (!unload || !unload()) { can_unload = false; break; }
+                once(true, i);
+            }
+            for (int i = 0; i < opt.warm_iterations; ++i) once(false, i);
+        }
+    }
+    return out;
+}
+
+vector<BenchSummary> summarize_bench(const vector<BenchSample>& samples) {
+    // 出現順を保ったまま (context, prompt, cold) ごとに集計
+    vector<BenchSummary> out;
+    map<tuple<int,int,bool>, size_t> index;
+    map<size_t, vector<const BenchSample*>> groups;
+    for (const auto& s : samples) {
+        auto key = make_tuple(s.context, s.prompt_tokens, s.cold);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            it = index.emplace(key, out.size()).first;
+            BenchSummary b; b.prompt_tokens = s.prompt_tokens; b.context = s.context; b.cold = s.cold;
+            out.push_back(b);
+        }
+        groups[it->second].push_back(&s);
+    }
+    for (auto& [i, g] : groups) {
+        auto& b = out[i];
+        vector<double> ttft, e2e, pf, dc, al, ab;
+        for (const auto* s : g) {
+            ++b.runs;
+            if (!s->ok) { ++b.failures; continue; }
+            if (s->ttft_ms() >= 0) ttft.push_back(s->ttft_ms());
+            if (s->stats.client_ms >= 0) e2e.push_back(s->stats.client_ms);
+            if (s->stats.prefill_tps() > 0) pf.push_back(s->stats.prefill_tps());
+            if (s->stats.decode_tps() > 0) dc.push_back(s->stats.decode_tps());
+            if (s->alloc_counted) {
+                al.push_back(static_cast<double>(s->allocs));
+                ab.push_back(static_cast<double>(s->alloc_bytes));
+            }
+        }
+        b.ttft_p50 = percentile(ttft, 50); b.ttft_p90 = percentile(ttft, 90); b.ttft_p99 = percentile(ttft, 99);
+        b.e2e_p50 = percentile(e2e, 50); b.e2e_p90 = percentile(e2e, 90); b.e2e_p99 = percentile(e2e, 99);
+        b.prefill_tps = percentile(pf, 50);
+        b.decode_tps = percentile(dc, 50);
+        b.allocs = percentile(al, 50);
+        b.alloc_bytes = percentile(ab, 50);
+    }
+    return out;
+}
+
+string bench_to_csv(const vector<BenchSample>& samples) {
+    ostringstream o;
+    o << fixed << setprecision(2);
+    o << "context,prompt_target,cold,iteration,ok,prompt_tokens,completion_tokens,load_ms,prompt_ms,completion_ms,ttft_ms,ttfb_ms,e2e_ms,prefill_tps,decode_tps,allocs,alloc_bytes\n";
+    for (const auto& s : samples) {
+        const auto& st = s.stats;
+        o << s.context << ',' << s.prompt_tokens << ',' << (s.cold?1:0) << ',' << s.iteration << ',' << (s.ok?1:0) << ','
+          << st.prompt_tokens << ',' << st.completion_tokens << ',' << st.load_ms << ',' << st.prompt_ms << ',' << st.completion_ms << ','
+          << s.ttft_ms() << ',' << st.ttfb_ms << ',' << st.client_ms << ',' << st.prefill_tps() << ',' << st.decode_tps() << ','
+          << (s.alloc_counted ? to_string(s.allocs) : "") << ',' << (s.alloc_counted ? to_string(s.alloc_bytes) : "") << '\n';
+    }
+    return o.str();
+}
+
+string bench_to_json(const string& backend, const string& model, const string& machine,
+                     const vector<BenchSummary>& summaries, const vector<BenchSample>& samples) {
+    ostringstream o;
+    o << fixed << setprecision(2);
+    o << "{\n";
+    o << "  \"backend\": \"" << json_escape(backend) << "\",\n";
+    o << "  \"model\": \"" << json_escape(model) << "\",\n";
+    o << "  \"machine\": \"" << json_escape(machine) << "\",\n";
+    o << "  \"summary\": [\n";
+    for (size_t i=0;i<summaries.size();++i) {
+        const auto& b = summaries[i];
+        o << "    {\"context\":" << b.context << ",\"prompt_tokens\":" << b.prompt_tokens << ",\"cold\":" << (b.cold?"true":"false")
+          << ",\"runs\":" << b.runs << ",\"failures\":" << b.failures
+          << ",\"ttft_ms\":{\"p50\":" << b.ttft_p50 << ",\"p90\":" << b.ttft_p90 << ",\"p99\":" << b.ttft_p99 << "}"
+          << ",\"e2e_ms\":{\"p50\":" << b.e2e_p50 << ",\"p90\":" << b.e2e_p90 << ",\"p99\":" << b.e2e_p99 << "}"
+          << ",\"prefill_tps\":" << b.prefill_tps << ",\"decode_tps\":" << b.decode_tps
+          << ",\"allocs\":" << b.allocs << ",\"alloc_bytes\":" << b.alloc_bytes << "}"
+          << (i+1<summaries.size() ? "," : "") << "\n";
+    }
+    o << "  ],\n";
+    o << "  \"runs\": " << samples.size() << "\n";
+    o << "}\n";
+    return o.str();
+}
+
+string format_bench_table(const vector<BenchSummary>& summaries) {
+    ostringstream o;
+    o << fixed << setprecision(0);
+    // 割り当ての列は数えられるビルド（AGENS_ALLOC_STATS=ON）のときだけ出す
+    bool allocs = any_of(summaries.begin(), summaries.end(), [](const BenchSummary& b){ return b.allocs >= 0; });
+    o << "  ctx    prompt  mode  runs  TTFT p50/p90/p99 (ms)     E2E p50/p90/p99 (ms)      prefill  decode (tok/s)"
+      << (allocs ? "   allocs   KB/req" : "") << "\n";
+    for (const auto& b : summaries) {
+        o << "  " << setw(6) << left << b.context << " " << setw(7) << b.prompt_tokens << " " << setw(5) << (b.cold ? "cold" : "warm")
+          << " " << right << setw(2) << (b.runs - b.failures) << "/" << left << setw(2) << b.runs << " "
+          << right << setw(7) << b.ttft_p50 << "/" << setw(7) << b.ttft_p90 << "/" << setw(7) << b.ttft_p99 << "   "
+          << setw(7) << b.e2e_p50 << "/" << setw(7) << b.e2e_p90 << "/" << setw(7) << b.e2e_p99 << "   "
+          << setprecision(1) << setw(7) << b.prefill_tps << "  " << setw(6) << b.decode_tps << setprecision(0);
+        if (allocs) {
+            o << "           " << setw(6) << b.allocs << "  " << setw(7) << setprecision(1)
+              << (b.alloc_bytes < 0 ? -1.0 : b.alloc_bytes / 1024.0) << setprecision(0);
+        }
+        o << left << "\n";
+    }
+    return o.str();
+}
+
+vector<int> default_scan_threads() {
+    int n = default_thread_count();
+    vector<int> v;
+    for (int t = 1; t < n; t *= 2) v.push_back(t);
+    v.push_back(n);
+    return v;
+}
+
+vector<ScanBenchRow> run_scan_bench(const string& dir, const string& query, const vector<int>& threads, int iterations) {
+    vector<ScanBenchRow> rows;
+    auto key = [](const vector<FileHit>& hits) {
+        vector<pair<int, string>> k;
+        for (const auto& h : hits) k.emplace_back(h.score, h.path);
+        return k;
+    };
+    auto baseline = key(find_relevant_files(dir, query, 10, 1));
+    double base_ms = -1;
+    for (int t : threads) {
+        ScanBenchRow r;
+        r.threads = t;
+        vector<double> ms;
+        for (int i = 0; i < max(1, iterations); ++i) {
+            auto t0 = chrono::steady_clock::now();
+            auto hits = find_relevant_files(dir, query, 10, t);
+            ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+            if (key(hits) != baseline) r.same_ranking = false;
+        }
+        r.ms_p50 = percentile(ms, 50);
+        r.ms_min = *min_element(ms.begin(), ms.end());
+        if (t == 1) base_ms = r.ms_p50;
+        if (base_ms > 0 && r.ms_p50 > 0) r.speedup = base_ms / r.ms_p50;
+        rows.push_back(r);
+    }
+    return rows;
+}
+
+string format_scan_bench(const vector<ScanBenchRow>& rows) {
+    ostringstream o;
+    o << fixed << setprecision(1);
+    o << "  threads   p50 (ms)   min (ms)   speedup  ranking\n";
+    for (const auto& r : rows) {
+        o << "  " << setw(7) << r.threads << "  " << setw(9) << r.ms_p50 << "  " << setw(9) << r.ms_min << "  ";
+        if (r.speedup > 0) o << setw(7) << setprecision(2) << r.speedup << "x" << setprecision(1); else o << setw(8) << "-";
+        o << "  " << (r.same_ranking ? "same" : "DIFFERENT") << "\n";
+    }
+    return o.str();
+}
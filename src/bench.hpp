@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include "ports.hpp"
+#include "chat.hpp"
+#include "system_info.hpp"
+
+// 現在のバックエンド・モデルに対するスループット計測（/bench, --bench）
+
+struct BenchOptions {
+    std::vector<int> prompt_tokens = {128, 512, 2048}; // 送るプロンプトのおおよそのトークン数
+    std::vector<int> contexts;                         // 空なら現在の context のみ
+    int warm_iterations = 3;
+    int cold_iterations = 1;  // 直前にモデルを降ろしてから計測（アンロード非対応のバックエンドでは省略）
+    int max_tokens = 128;
+    std::string out_prefix;   // <prefix>.csv / <prefix>.json に書き出す。空なら既定の場所
+};
+
+/// @brief 1回分の計測結果
+struct BenchSample {
+    int prompt_tokens = 0;  // 目標値（実測は stats.prompt_tokens）
+    int context = 0;
+    bool cold = false;
+    int iteration = 0;
+    bool ok = false;
+    GenerationStats stats;
+    bool alloc_counted = false; // 割り当てを数えられるビルドか（alloc_stats.hpp）
+    size_t allocs = 0;       // 要求1回（本文組み立て〜応答の解析）で呼び出し元スレッドが行った割り当て
+    size_t alloc_bytes = 0;
+    /// @brief 最初のトークンまでの時間。サーバ報告の load+prefill、無ければ TTFB
+    double ttft_ms() const;
+};
+
+/// @brief 同一条件（prompt, context, cold/warm）の集計
+struct BenchSummary {
+    int prompt_tokens = 0;
+    int context = 0;
+    bool cold = false;
+    int runs = 0;
+    int failures = 0;
+    double ttft_p50 = -1, ttft_p90 = -1, ttft_p99 = -1;
+    double e2e_p50 = -1, e2e_p90 = -1, e2e_p99 = -1;
+    double prefill_tps = -1; // 中央値
+    double decode_tps = -1;  // 中央値
+    double allocs = -1;      // 成功した回の割り当て回数の中央値（数えないビルドでは -1）
+    double alloc_bytes = -1; // 同バイト数の中央値
+};
+
+/// @brief key=value 形式（prompts=128,512 ctx=4096,8192 iters=3 cold=1 max=128 out=path）を解釈する
+bool parse_bench_args(const std::vector<std::string>& args, BenchOptions& opt, std::string* err = nullptr);
+/// @brief 約 n トークンのプロンプトを作る。nonce を先頭に置きプレフィックスキャッシュを効かせない
+std::string make_bench_prompt(int n_tokens, int nonce);
+/// @brief 線形補間のパーセンタイル（p は 0〜100）。空なら -1
+double percentile(std::vector<double> v, double p);
+
+/// @brief ベンチマークを実行する
+/// @param unload 呼ばれるとモデルを降ろす。false を返したらコールド計測を省略する
+/// @param on_sample 各計測の直後に呼ばれる（進捗表示・プロファイル記録用）
+std::vector<BenchSample> run_bench(const BenchOptions& opt, const InferenceTuning& base,
+                                   const std::function<std::optional<ChatResult>(const std::vector<ChatMsg>&, const InferenceTuning&)>& chat,
+                                   const std::function<bool()>& unload,
+                                   const std::function<void(const BenchSample&)>& on_sample = {});
+std::vector<BenchSummary> summarize_bench(const std::vector<BenchSample>& samples);
+std::string bench_to_csv(const std::vector<BenchSample>& samples);
+std::string bench_to_json(const std::string& backend, const std::string& model, const std::string& machine,
+                          const std::vector<BenchSummary>& summaries, const std::vector<BenchSample>& samples);
+/// @brief 集計を表形式の文字列にする
+std::string format_bench_table(const std::vector<BenchSummary>& summaries);
+
+/// @brief /target の走査をスレッド数ごとに計測した結果（--bench-files）
+struct ScanBenchRow {
+    int threads = 1;
+    double ms_p50 = -1;
+    double ms_min = -1;
+    double speedup = -1;      // 1スレッドの p50 との比
+    bool same_ranking = true; // 1スレッドと同じ順位・スコアか
+};
+
+/// @brief 計測するスレッド数の既定（1, 2, 4, ... と論理コア数）
+std::vector<int> default_scan_threads();
+/// @brief dir 以下で query を find_relevant_files し、スレッド数ごとの所要時間を測る（初回はページキャッシュを温めるため捨てる）
+std::vector<ScanBenchRow> run_scan_bench(const std::string& dir, const std::string& query,
+                                         const std::vector<int>& threads, int iterations = 5);
+std::string format_scan_bench(const std::vector<ScanBenchRow>& rows);
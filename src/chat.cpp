@@ -1,67 +1,264 @@
 #include "chat.hpp"
+#include "utils.hpp"
+#include "attachment.hpp"
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cctype>
+#include <regex>
 
 using namespace std;
 
-string json_escape(const string& s) {
-    string out; out.reserve(s.size()+8);
-    for (char c : s) {
-        switch (c) {
-            case '"': out += "\\\""; break;
-            case '\\': out += "\\\\"; break;
-            case '\n': out += "\\n"; break;
-            case '\r': out += "\\r"; break;
-            case '\t': out += "\\t"; break;
-            default: out += c; break;
+const char* role_name(Role r) {
+    switch (r) {
+        case Role::System: return "system";
+        case Role::Assistant: return "assistant";
+        default: return "user";
+    }
+}
+
+optional<Role> parse_role(string_view name) {
+    if (name=="system") return Role::System;
+    if (name=="user") return Role::User;
+    if (name=="assistant") return Role::Assistant;
+    return nullopt;
+}
+
+void append_json_escaped(string& out, string_view s) {
+    size_t run = 0; // エスケープ不要な区間はまとめて追記する
+    for (size_t i=0;i<s.size();++i) {
+        const char* rep = nullptr;
+        switch (s[i]) {
+            case '"': rep = "\\\""; break;
+            case '\\': rep = "\\\\"; break;
+            case '\n': rep = "\\n"; break;
+            case '\r': rep = "\\r"; break;
+            case '\t': rep = "\\t"; break;
+            default: break;
         }
+        if (!rep) continue;
+        out.append(s.data() + run, i - run);
+        out += rep;
+        run = i + 1;
     }
+    out.append(s.data() + run, s.size() - run);
+}
+
+string json_escape(string_view s) {
+    string out; out.reserve(s.size()+8);
+    append_json_escaped(out, s);
     return out;
 }
 
-string build_ollama_chat_body(const string& model, const vector<ChatMsg>& msgs, const InferenceTuning& t) {
-    ostringstream oss;
-    oss << "{";
-    oss << "\"model\":\"" << json_escape(model) << "\",";
-    oss << "\"stream\":false,";
-    // messages
-    oss << "\"messages\":[";
+long estimate_tokens(string_view text) {
+    long ascii = 0, other = 0;
+    for (unsigned char c : text) {
+        if (c < 0x80) ++ascii;
+        else if ((c & 0xC0) != 0x80) ++other; // UTF-8 の先頭バイトだけ数える
+    }
+    return (ascii + 3) / 4 + other;
+}
+
+string keep_alive_json(const string& v) {
+    bool numeric = !v.empty();
+    for (size_t i=0;i<v.size();++i) {
+        char c = v[i];
+        if (!(isdigit(static_cast<unsigned char>(c)) || (c=='-' && i==0))) { numeric = false; break; }
+    }
+    if (v == "-") numeric = false;
+    return numeric ? v : "\"" + json_escape(v) + "\"";
+}
+
+void write_json_escaped(ostream& os, string_view s) {
+    size_t run = 0; // エスケープ不要な区間はまとめて書き出す
+    for (size_t i=0;i<s.size();++i) {
+        const char* rep = nullptr;
+        switch (s[i]) {
+            case '"': rep = "\\\""; break;
+            case '\\': rep = "\\\\"; break;
+            case '\n': rep = "\\n"; break;
+            case '\r': rep = "\\r"; break;
+            case '\t': rep = "\\t"; break;
+            default: break;
+        }
+        if (!rep) continue;
+        os.write(s.data() + run, static_cast<streamsize>(i - run));
+        os << rep;
+        run = i + 1;
+    }
+    os.write(s.data() + run, static_cast<streamsize>(s.size() - run));
+}
+
+// "messages":[...] を書き出す。本文・添付は共有バッファ（mmap）から直接エスケープし、途中のコピーを作らない
+static void write_messages_json(ostream& os, span<const ChatMsg> msgs) {
+    os << "\"messages\":[";
     for (size_t i=0;i<msgs.size();++i) {
         const auto& m = msgs[i];
-        if (i) oss << ",";
-        oss << "{\"role\":\"" << json_escape(m.role) << "\",\"content\":\"" << json_escape(m.content) << "\"}";
+        if (i) os << ',';
+        os << "{\"role\":\"" << role_name(m.role) << "\",\"content\":\"";
+        write_json_escaped(os, m.content());
+        for (const auto& a : m.attachments) {
+            write_json_escaped(os, a->header());
+            write_json_escaped(os, a->text());
+            write_json_escaped(os, Attachment::footer);
+        }
+        os << "\"}";
     }
-    oss << "],";
+    os << ']';
+}
+
+bool is_valid_keep_alive(const string& v) {
+    static const regex seconds(R"(^-?\d+$)");
+    static const regex duration(R"(^(\d+(\.\d+)?(ns|us|ms|s|m|h))+$)");
+    return regex_match(v, seconds) || regex_match(v, duration);
+}
+
+void write_ollama_chat_body(ostream& oss, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    oss << "{";
+    oss << "\"model\":\"" << json_escape(model) << "\",";
+    oss << "\"stream\":false,";
+    if (!t.keep_alive.empty()) oss << "\"keep_alive\":" << keep_alive_json(t.keep_alive) << ",";
+    write_messages_json(oss, msgs);
     // options
-    oss << "\"options\":{";
+    oss << ",\"options\":{";
     oss << "\"temperature\":" << t.temperature << ",";
     oss << "\"top_p\":" << t.top_p << ",";
     oss << "\"num_ctx\":" << t.context << ",";
     oss << "\"num_predict\":" << t.max_tokens;
+    if (t.model_fitted && t.gpu_layers >= 0) oss << ",\"num_gpu\":" << t.gpu_layers;
     oss << "}";
     oss << "}";
-    return oss.str();
 }
 
-string build_lmstudio_chat_body(const string& model, const vector<ChatMsg>& msgs, const InferenceTuning& t) {
+string build_ollama_chat_body(const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
     ostringstream oss;
+    write_ollama_chat_body(oss, model, msgs, t);
+    return oss.str();
+}
+
+void write_lmstudio_chat_body(ostream& oss, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
     oss << "{";
     oss << "\"model\":\"" << json_escape(model) << "\",";
     oss << "\"stream\":false,";
     oss << "\"temperature\":" << t.temperature << ",";
     oss << "\"top_p\":" << t.top_p << ",";
     oss << "\"max_tokens\":" << t.max_tokens << ",";
-    // messages
-    oss << "\"messages\":[";
-    for (size_t i=0;i<msgs.size();++i) {
-        const auto& m = msgs[i];
-        if (i) oss << ",";
-        oss << "{\"role\":\"" << json_escape(m.role) << "\",\"content\":\"" << json_escape(m.content) << "\"}";
-    }
-    oss << "]";
+    if (!t.draft_model.empty()) oss << "\"draft_model\":\"" << json_escape(t.draft_model) << "\",";
+    write_messages_json(oss, msgs);
     if (t.gpu_layers >= 0) {
         oss << ",\"extra\":{\"gpu_layers\":" << t.gpu_layers << "}";
     }
     oss << "}";
+}
+
+string build_lmstudio_chat_body(const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    ostringstream oss;
+    write_lmstudio_chat_body(oss, model, msgs, t);
+    return oss.str();
+}
+
+void write_llamacpp_chat_body(ostream& oss, const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    oss << "{";
+    oss << "\"model\":\"" << json_escape(model) << "\",";
+    oss << "\"stream\":false,";
+    oss << "\"temperature\":" << t.temperature << ",";
+    oss << "\"top_p\":" << t.top_p << ",";
+    oss << "\"max_tokens\":" << t.max_tokens << ",";
+    // 前ターンと共通の接頭辞は KV キャッシュから再利用させる
+    oss << "\"cache_prompt\":true,";
+    if (t.slot_id >= 0) oss << "\"id_slot\":" << t.slot_id << ",";
+    if (t.draft_max > 0) oss << "\"speculative.n_max\":" << t.draft_max << ",";
+    if (t.draft_min > 0) oss << "\"speculative.n_min\":" << t.draft_min << ",";
+    if (t.draft_p_min >= 0) oss << "\"speculative.p_min\":" << t.draft_p_min << ",";
+    write_messages_json(oss, msgs);
+    oss << "}";
+}
+
+string build_llamacpp_chat_body(const string& model, span<const ChatMsg> msgs, const InferenceTuning& t) {
+    ostringstream oss;
+    write_llamacpp_chat_body(oss, model, msgs, t);
     return oss.str();
 }
 
+double GenerationStats::prefill_tps() const {
+    if (prompt_tokens <= 0 || prompt_ms <= 0) return -1;
+    return prompt_tokens * 1000.0 / prompt_ms;
+}
+
+double GenerationStats::decode_tps() const {
+    if (completion_tokens <= 0 || completion_ms <= 0) return -1;
+    return completion_tokens * 1000.0 / completion_ms;
+}
+
+double GenerationStats::ttft_ms() const {
+    if (prompt_ms >= 0) return prompt_ms + (load_ms > 0 ? load_ms : 0);
+    return ttfb_ms;
+}
+
+double GenerationStats::draft_acceptance() const {
+    if (draft_tokens <= 0 || draft_accepted < 0) return -1;
+    return static_cast<double>(draft_accepted) / static_cast<double>(draft_tokens);
+}
+
+double GenerationStats::transport_ms() const {
+    if (client_ms < 0) return -1;
+    double server = total_ms;
+    if (server < 0 && prompt_ms >= 0 && completion_ms >= 0) server = prompt_ms + completion_ms;
+    if (server < 0) return -1;
+    return max(0.0, client_ms - server);
+}
+
+GenerationStats parse_ollama_stats(const string& resp) {
+    GenerationStats s;
+    double v = 0;
+    // Ollama の duration 系はナノ秒
+    if (utils::json_find_last_number_value(resp, "total_duration", v)) s.total_ms = v / 1e6;
+    if (utils::json_find_last_number_value(resp, "load_duration", v)) s.load_ms = v / 1e6;
+    if (utils::json_find_last_number_value(resp, "prompt_eval_count", v)) s.prompt_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "prompt_eval_duration", v)) s.prompt_ms = v / 1e6;
+    if (utils::json_find_last_number_value(resp, "eval_count", v)) s.completion_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "eval_duration", v)) s.completion_ms = v / 1e6;
+    return s;
+}
+
+GenerationStats parse_openai_stats(const string& resp) {
+    GenerationStats s;
+    double v = 0;
+    if (utils::json_find_last_number_value(resp, "prompt_tokens", v)) s.prompt_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "completion_tokens", v)) s.completion_tokens = static_cast<long>(v);
+    // llama.cpp server 系は timings ブロックでミリ秒を返す
+    if (utils::json_find_last_number_value(resp, "prompt_n", v)) s.prompt_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "prompt_ms", v)) s.prompt_ms = v;
+    if (utils::json_find_last_number_value(resp, "predicted_n", v)) s.completion_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "predicted_ms", v)) s.completion_ms = v;
+    if (s.prompt_ms >= 0 && s.completion_ms >= 0) s.total_ms = s.prompt_ms + s.completion_ms;
+    if (utils::json_find_last_number_value(resp, "draft_n", v)) s.draft_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "draft_n_accepted", v)) s.draft_accepted = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "total_draft_tokens_count", v)) s.draft_tokens = static_cast<long>(v);
+    if (utils::json_find_last_number_value(resp, "accepted_draft_tokens_count", v)) s.draft_accepted = static_cast<long>(v);
+    return s;
+}
+
+string format_stats_line(const GenerationStats& s) {
+    ostringstream oss;
+    oss << fixed << setprecision(1);
+    oss << "[計測]";
+    auto tps = [&](const char* label, double r, long n) {
+        oss << " " << label << " ";
+        if (r >= 0) oss << r << " tok/s"; else oss << "-";
+        if (n >= 0) oss << " (" << n << " tok)";
+        oss << ",";
+    };
+    tps("prefill", s.prefill_tps(), s.prompt_tokens);
+    tps("decode", s.decode_tps(), s.completion_tokens);
+    oss << setprecision(0);
+    oss << " load ";
+    if (s.load_ms >= 0) oss << s.load_ms << " ms"; else oss << "-";
+    if (s.ttfb_ms >= 0) oss << ", TTFB " << s.ttfb_ms << " ms";
+    if (s.client_ms >= 0) oss << ", total " << s.client_ms << " ms";
+    double tr = s.transport_ms();
+    if (tr >= 0) oss << ", overhead " << tr << " ms";
+    double acc = s.draft_acceptance();
+    if (acc >= 0) oss << ", draft accept " << acc * 100 << "% (" << s.draft_accepted << "/" << s.draft_tokens << ")";
+    return oss.str();
+}
@@ -1,12 +1,95 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
+#include <memory>
+#include <span>
+#include <ostream>
 #include "system_info.hpp"
 
-struct ChatMsg { std::string role; std::string content; };
+class Attachment;
 
-std::string json_escape(const std::string& s);
-std::string build_ollama_chat_body(const std::string& model, const std::vector<ChatMsg>& msgs, const InferenceTuning& t);
-std::string build_lmstudio_chat_body(const std::string& model, const std::vector<ChatMsg>& msgs, const InferenceTuning& t);
+/// @brief メッセージの役割
+enum class Role { System, User, Assistant };
+/// @brief API に送る役割名（"system" / "user" / "assistant"）
+const char* role_name(Role r);
+/// @brief 役割名を Role へ変換する。未知なら nullopt
+std::optional<Role> parse_role(std::string_view name);
 
+/// @brief 会話の1メッセージ。本文は参照カウント付きの不変バッファで、メッセージをコピーしても本文は複製されない
+struct ChatMsg {
+    Role role = Role::User;
+    std::shared_ptr<const std::string> body;
+    /// @brief 本文の後ろへ続けて送る添付ファイル（mmap のまま参照し、送信時に直接書き出す）
+    std::vector<std::shared_ptr<const Attachment>> attachments;
+
+    ChatMsg() = default;
+    ChatMsg(Role r, std::string text) : role(r), body(std::make_shared<const std::string>(std::move(text))) {}
+    ChatMsg(Role r, std::shared_ptr<const std::string> shared) : role(r), body(std::move(shared)) {}
+    /// @brief 従来の {"system", "..."} 形式。未知の役割名は user として扱う
+    ChatMsg(std::string_view r, std::string text) : ChatMsg(parse_role(r).value_or(Role::User), std::move(text)) {}
+
+    std::string_view content() const { return body ? std::string_view(*body) : std::string_view(); }
+};
+
+/// @brief 1回の生成に関する計測値。値が得られなかった項目は負数のまま
+struct GenerationStats {
+    // サーバ報告値（Ollama はナノ秒をミリ秒へ換算、OpenAI互換は usage/timings から）
+    double total_ms = -1;
+    double load_ms = -1;
+    long prompt_tokens = -1;
+    double prompt_ms = -1;
+    long completion_tokens = -1;
+    double completion_ms = -1;
+    // クライアント計測値
+    double ttfb_ms = -1;   // 応答の最初のバイトまで（curl の time_starttransfer）
+    double client_ms = -1; // リクエスト送信から応答受信完了までの壁時計時間
+    // 投機的デコード（llama.cpp の timings.draft_n*、LM Studio の stats.*_draft_tokens_count）
+    long draft_tokens = -1;
+    long draft_accepted = -1;
+
+    /// @brief プロンプト処理速度（tok/s）。不明なら負数
+    double prefill_tps() const;
+    /// @brief 生成速度（tok/s）。不明なら負数
+    double decode_tps() const;
+    /// @brief 最初のトークンまでの時間。サーバ報告の load+prefill、無ければ TTFB。不明なら負数
+    double ttft_ms() const;
+    /// @brief サーバ処理時間以外に掛かった時間（プロセス起動・通信・JSON処理）。不明なら負数
+    double transport_ms() const;
+    /// @brief ドラフトの提案トークンが採択された割合（0〜1）。不明なら負数
+    double draft_acceptance() const;
+};
+
+/// @brief バックエンドのチャット応答（本文と計測値）
+struct ChatResult {
+    std::string content;
+    GenerationStats stats;
+};
+
+std::string json_escape(std::string_view s);
+/// @brief s を JSON 文字列としてエスケープし out の末尾へ追記する（一時文字列を作らない）
+void append_json_escaped(std::string& out, std::string_view s);
+/// @brief s を JSON 文字列としてエスケープし os へ直接書き出す
+void write_json_escaped(std::ostream& os, std::string_view s);
+/// @brief トークン数の概算（ASCII は4バイト≒1トークン、それ以外は1文字≒1トークン）
+long estimate_tokens(std::string_view text);
+std::string build_ollama_chat_body(const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+/// @brief 本文を文字列に組み立てず os へ直接書き出す（添付は mmap から直接エスケープ）。build_* はこれを文字列に集めるだけ
+void write_ollama_chat_body(std::ostream& os, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+/// @brief keep_alive の JSON 値表現（数値ならそのまま、それ以外は文字列）
+std::string keep_alive_json(const std::string& keep_alive);
+/// @brief 秒数（"-1", "0", "600"）か Go の duration 形式（"30m", "1h30m"）なら true
+bool is_valid_keep_alive(const std::string& keep_alive);
+std::string build_lmstudio_chat_body(const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+void write_lmstudio_chat_body(std::ostream& os, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+/// @brief llama.cpp server 向け（OpenAI互換 + cache_prompt / id_slot）
+std::string build_llamacpp_chat_body(const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+void write_llamacpp_chat_body(std::ostream& os, const std::string& model, std::span<const ChatMsg> msgs, const InferenceTuning& t);
+
+/// @brief Ollama の最終応答オブジェクトから total_duration 等を抽出する
+GenerationStats parse_ollama_stats(const std::string& resp);
+/// @brief OpenAI互換応答の usage（および llama.cpp 系の timings）を抽出する
+GenerationStats parse_openai_stats(const std::string& resp);
+/// @brief 応答後に表示する1行サマリ（prefill/decode tok/s, ロード時間など）
+std::string format_stats_line(const GenerationStats& s);
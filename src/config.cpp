@@ -25,13 +25,35 @@ static string to_json(const AppConfig& c) {
     };
     write_arr("allow_patterns", c.allow_patterns);
     write_arr("deny_patterns",  c.deny_patterns);
+    write_arr("recent_models",  c.recent_models);
     o << "  \"auto_confirm\": " << (c.auto_confirm?"true":"false") << ",\n";
     o << "  \"auto_dry_run\": " << (c.auto_dry_run?"true":"false") << ",\n";
     o << "  \"last_backend\": \"" << json_escape(c.last_backend) << "\",\n";
     o << "  \"last_model\": \""   << json_escape(c.last_model)   << "\",\n";
     o << "  \"last_cwd\": \""     << json_escape(c.last_cwd)     << "\",\n";
+    o << "  \"last_session\": \"" << json_escape(c.last_session) << "\",\n";
     o << "  \"unified_gpu_ratio\": " << (c.unified_gpu_ratio)       << ",\n";
-    o << "  \"language\": \""     << json_escape(c.language)     << "\"\n";
+    o << "  \"language\": \""     << json_escape(c.language)     << "\",\n";
+    o << "  \"show_timing\": " << (c.show_timing?"true":"false") << ",\n";
+    o << "  \"tune_auto\": " << (c.tune_auto?"true":"false") << ",\n";
+    o << "  \"latency_target_ms\": " << c.latency_target_ms << ",\n";
+    o << "  \"stats_on_exit\": " << (c.stats_on_exit?"true":"false") << ",\n";
+    o << "  \"keep_alive\": \"" << json_escape(c.keep_alive) << "\",\n";
+    o << "  \"warmup\": " << (c.warmup?"true":"false") << ",\n";
+    o << "  \"auto_min_params_b\": " << c.auto_min_params_b << ",\n";
+    o << "  \"auto_min_tps\": " << c.auto_min_tps << ",\n";
+    o << "  \"route_enabled\": " << (c.route_enabled?"true":"false") << ",\n";
+    o << "  \"route_small\": \"" << json_escape(c.route_small) << "\",\n";
+    o << "  \"route_large\": \"" << json_escape(c.route_large) << "\",\n";
+    o << "  \"route_max_small_tokens\": " << c.route_max_small_tokens << ",\n";
+    o << "  \"file_index\": " << (c.file_index?"true":"false") << ",\n";
+    o << "  \"file_watch\": " << (c.file_watch?"true":"false") << ",\n";
+    o << "  \"target_budget_ms\": " << c.target_budget_ms << ",\n";
+    o << "  \"ask_ctx_ratio\": " << c.ask_ctx_ratio << ",\n";
+    o << "  \"draft_model\": \"" << json_escape(c.draft_model) << "\",\n";
+    o << "  \"draft_max\": " << c.draft_max << ",\n";
+    o << "  \"draft_min\": " << c.draft_min << ",\n";
+    o << "  \"draft_p_min\": " << c.draft_p_min << "\n";
     o << "}\n";
     return o.str();
 }
@@ -39,9 +61,11 @@ static string to_json(const AppConfig& c) {
 static bool parse_bool(const string& text, const string& key, bool& out) {
     auto pos = text.find("\""+key+"\""); if (pos==string::npos) return false;
     pos = text.find(':', pos); if (pos==string::npos) return false;
-    auto tail = text.substr(pos+1);
-    if (tail.find("true")!=string::npos) { out = true; return true; }
-    if (tail.find("false")!=string::npos){ out = false; return true; }
+    // 直後の値のみを見る（後続キーの true/false を拾わないように）
+    size_t i = pos+1;
+    while (i<text.size() && isspace(static_cast<unsigned char>(text[i]))) ++i;
+    if (text.compare(i, 4, "true")==0)  { out = true; return true; }
+    if (text.compare(i, 5, "false")==0) { out = false; return true; }
     return false;
 }
 
@@ -120,18 +144,49 @@ bool load_config(AppConfig& cfg, string* err) {
     ostringstream oss; oss << ifs.rdbuf(); string body = oss.str();
     cfg.allow_patterns = parse_string_array(body, "allow_patterns");
     cfg.deny_patterns  = parse_string_array(body, "deny_patterns");
+    cfg.recent_models  = parse_string_array(body, "recent_models");
     bool b;
     if (parse_bool(body, "auto_confirm", b)) cfg.auto_confirm = b;
     if (parse_bool(body, "auto_dry_run", b)) cfg.auto_dry_run = b;
+    if (parse_bool(body, "show_timing", b)) cfg.show_timing = b;
+    if (parse_bool(body, "tune_auto", b)) cfg.tune_auto = b;
+    if (parse_bool(body, "stats_on_exit", b)) cfg.stats_on_exit = b;
+    if (parse_bool(body, "warmup", b)) cfg.warmup = b;
+    if (parse_bool(body, "route_enabled", b)) cfg.route_enabled = b;
+    if (parse_bool(body, "file_index", b)) cfg.file_index = b;
+    if (parse_bool(body, "file_watch", b)) cfg.file_watch = b;
     cfg.last_backend = parse_string(body, "last_backend");
     cfg.last_model   = parse_string(body, "last_model");
     cfg.last_cwd     = parse_string(body, "last_cwd");
+    cfg.last_session = parse_string(body, "last_session");
     double d;
     if (parse_number(body, "unified_gpu_ratio", d)) cfg.unified_gpu_ratio = d;
+    if (parse_number(body, "latency_target_ms", d) && d > 0) cfg.latency_target_ms = d;
+    if (parse_number(body, "target_budget_ms", d) && d >= 0) cfg.target_budget_ms = static_cast<int>(d);
+    if (parse_number(body, "ask_ctx_ratio", d) && d > 0 && d <= 1) cfg.ask_ctx_ratio = d;
+    if (parse_number(body, "auto_min_params_b", d) && d >= 0) cfg.auto_min_params_b = d;
+    if (parse_number(body, "auto_min_tps", d) && d >= 0) cfg.auto_min_tps = d;
+    if (parse_number(body, "route_max_small_tokens", d) && d >= 1) cfg.route_max_small_tokens = d;
+    cfg.route_small = parse_string(body, "route_small");
+    cfg.route_large = parse_string(body, "route_large");
+    cfg.draft_model = parse_string(body, "draft_model");
+    if (parse_number(body, "draft_max", d) && d >= 0) cfg.draft_max = static_cast<int>(d);
+    if (parse_number(body, "draft_min", d) && d >= 0) cfg.draft_min = static_cast<int>(d);
+    if (parse_number(body, "draft_p_min", d) && d <= 1) cfg.draft_p_min = d;
     cfg.language = parse_string(body, "language");
+    // 空文字（サーバ既定）も明示設定として尊重するため、キーの有無で判定する
+    if (body.find("\"keep_alive\"") != string::npos) cfg.keep_alive = parse_string(body, "keep_alive");
     return true;
 }
 
+void remember_recent_model(AppConfig& cfg, const string& model, size_t limit) {
+    if (model.empty()) return;
+    auto& v = cfg.recent_models;
+    v.erase(remove(v.begin(), v.end(), model), v.end());
+    v.insert(v.begin(), model);
+    if (v.size() > limit) v.resize(limit);
+}
+
 bool save_config(const AppConfig& cfg, string* err) {
     auto path = default_config_path();
     std::error_code ec; fs::create_directories(path.parent_path(), ec);
@@ -11,12 +11,52 @@ struct AppConfig {
     std::string last_backend; // "ollama" or "lmstudio"
     std::string last_model;
     std::string last_cwd;
+    // 最後に書き込んだセッション（--resume で ID 省略時に再開する）
+    std::string last_session;
     // Apple Silicon等の統合メモリ環境で、GPUが利用可能とみなすRAM比率（0.1〜0.9）
     double unified_gpu_ratio = 0.5;
     // UIメッセージ言語（"ja"|"en"）。空なら既定=ja
     std::string language;
+    // 応答ごとに計測サマリ（prefill/decode tok/s 等）を1行表示するか
+    bool show_timing = false;
+    // /tune auto: 実測プロファイルから毎ターン num_ctx/num_predict を調整する
+    bool tune_auto = false;
+    // /tune auto の目標（初回応答までのミリ秒）
+    double latency_target_ms = 8000;
+    // 終了時にセッションのレイテンシ統計（/stats と同じ表）を表示するか
+    bool stats_on_exit = false;
+    // Ollama の keep_alive（"30m" / "-1"=無期限 / "0"=即解放）。空ならサーバ既定
+    std::string keep_alive = "30m";
+    // モデル選択直後に空リクエストを投げ、ロードを入力待ちの間に済ませるか
+    bool warmup = true;
+    // 最近使ったモデル（先頭が最新、最大5件）。/model 一覧時の先読み候補
+    std::vector<std::string> recent_models;
+    // --model auto の下限: パラメータ数（十億単位）と decode tok/s
+    double auto_min_params_b = 0;
+    double auto_min_tps = 8;
+    // カスケードルーティング（/route）: 短い質問は small、長文・コード・/auto は large（空なら現在のモデル）
+    bool route_enabled = false;
+    std::string route_small;
+    std::string route_large;
+    double route_max_small_tokens = 400;
+    // /target でトライグラム索引（キャッシュディレクトリに保存）を使うか
+    bool file_index = true;
+    // 索引をファイル変更の監視（Linux は inotify）で最新に保つか（無効・監視できないときは30秒ごとに再走査）
+    bool file_watch = true;
+    // /target の探索時間の上限（ミリ秒。0=無制限）。超えたらそれまでの上位を返す
+    int target_budget_ms = 3000;
+    // /ask --ctx の参照コードに使う割合（context から応答・システム・添付・質問を除いた残りのうち。残りは履歴）
+    double ask_ctx_ratio = 0.5;
+    // 投機的デコード: ドラフトモデル（空=無効, "auto"=同系列の小さいモデルを自動選択。LM Studio のみ）と提案数等
+    std::string draft_model;
+    int draft_max = 0;
+    int draft_min = 0;
+    double draft_p_min = -1;
 };
 
+/// @brief recent_models の先頭に model を移動（重複除去し最大 limit 件に丸める）
+void remember_recent_model(AppConfig& cfg, const std::string& model, size_t limit = 5);
+
 std::filesystem::path default_config_path();
 bool load_config(AppConfig& cfg, std::string* err = nullptr);
 bool save_config(const AppConfig& cfg, std::string* err = nullptr);
@@ -0,0 +1,164 @@
+#include "context_pack.hpp"
+#include "chat.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cctype>
+#include <unordered_set>
+
+using namespace std;
+
+namespace {
+const string kPreamble = "以下は作業ディレクトリから検索した関連コードです（見出しはパスと行範囲）。\n\n";
+const string kQuestionHeader = "[質問]\n";
+
+string shown_path(const string& path) {
+    return path.rfind("./", 0) == 0 ? path.substr(2) : path;
+}
+
+string region_header(const ContextRegion& r) {
+    return "[参照: " + shown_path(r.path) + " " + to_string(r.first_line) + "-" + to_string(r.last_line)
+           + (r.truncated ? "（以下略）" : "") + "]\n```\n";
+}
+constexpr string_view kRegionFooter = "\n```\n\n";
+
+// 切り出す前の範囲。end は定義の本来の最終行（切り詰めたかの判定用）
+struct Span {
+    int first = 0, last = 0, end = 0;
+    bool definition = false;
+};
+
+// 1ファイル分の範囲を行番号順にまとめ、本文を切り出す
+vector<ContextRegion> regions_for(const FileHit& hit, int rank, const ContextPackOptions& opt) {
+    vector<Span> spans;
+    int max_lines = max(1, opt.max_region_lines);
+    for (const auto& d : hit.definitions) {
+        if (d.line <= 0) continue;
+        int end = max(d.line, d.end_line);
+        spans.push_back({d.line, min(end, d.line + max_lines - 1), end, true});
+    }
+    for (const auto& sn : hit.snippets) {
+        if (sn.line <= 0) continue;
+        spans.push_back({max(1, sn.line - opt.around_lines), sn.line + opt.around_lines, 0, false});
+    }
+    if (spans.empty()) return {};
+    sort(spans.begin(), spans.end(), [](const Span& a, const Span& b){ return a.first < b.first; });
+    vector<Span> merged;
+    for (const auto& s : spans) {
+        if (!merged.empty() && s.first <= merged.back().last + 1) {
+            Span& m = merged.back();
+            m.last = max(m.last, s.last);
+            m.end = max(m.end, s.end);
+            m.definition = m.definition || s.definition;
+        } else {
+            merged.push_back(s);
+        }
+    }
+
+    // 検索後に書き換えられたファイルでも落ちないよう mmap せずに読む
+    string content;
+    if (!read_whole_file(hit.path, content)) return {};
+    string_view text = content;
+    vector<ContextRegion> out;
+    size_t pos = 0;
+    int line = 1;
+    for (const auto& m : merged) {
+        while (line < m.first && pos < text.size()) {
+            size_t nl = text.find('\n', pos);
+            pos = nl == string_view::npos ? text.size() : nl + 1;
+            ++line;
+        }
+        if (line < m.first || pos >= text.size()) break;
+        size_t begin = pos;
+        while (line <= m.last && pos < text.size()) {
+            size_t nl = text.find('\n', pos);
+            pos = nl == string_view::npos ? text.size() : nl + 1;
+            ++line;
+        }
+        ContextRegion r;
+        r.path = hit.path;
+        r.first_line = m.first;
+        r.last_line = line - 1;
+        r.rank = rank;
+        r.definition = m.definition;
+        r.truncated = m.end > r.last_line;
+        string_view body = text.substr(begin, pos - begin);
+        while (!body.empty() && (body.back() == '\n' || body.back() == '\r')) body.remove_suffix(1);
+        r.text.assign(body);
+        r.tokens = estimate_tokens(region_header(r)) + estimate_tokens(r.text) + estimate_tokens(kRegionFooter);
+        out.push_back(std::move(r));
+    }
+    return out;
+}
+}
+
+ContextPack pack_context(const vector<FileHit>& hits, const ContextPackOptions& opt) {
+    trace::Span span("context.pack", "files");
+    ContextPack pack;
+    vector<ContextRegion> cand;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        auto rs = regions_for(hits[i], static_cast<int>(i), opt);
+        for (auto& r : rs) cand.push_back(std::move(r));
+    }
+    pack.candidates = cand.size();
+    // 順位の高いファイルから。同じファイルでは定義、次に前の方の範囲
+    stable_sort(cand.begin(), cand.end(), [](const ContextRegion& a, const ContextRegion& b){
+        if (a.rank != b.rank) return a.rank < b.rank;
+        if (a.definition != b.definition) return a.definition;
+        return a.first_line < b.first_line;
+    });
+    long room = opt.budget_tokens - estimate_tokens(kPreamble) - estimate_tokens(kQuestionHeader);
+    // 重複は本文そのもので判定する（cand は選び終わるまで動かさないので view のまま持てる）
+    unordered_set<string_view> seen;
+    vector<char> take(cand.size(), 0);
+    for (size_t i = 0; i < cand.size(); ++i) {
+        const ContextRegion& r = cand[i];
+        if (!seen.insert(r.text).second) { ++pack.duplicates; continue; }
+        if (r.tokens > room) { ++pack.dropped; continue; }
+        room -= r.tokens;
+        pack.tokens += r.tokens;
+        take[i] = 1;
+    }
+    for (size_t i = 0; i < cand.size(); ++i) if (take[i]) pack.regions.push_back(std::move(cand[i]));
+    if (!pack.regions.empty()) pack.tokens += estimate_tokens(kPreamble) + estimate_tokens(kQuestionHeader);
+    sort(pack.regions.begin(), pack.regions.end(), [](const ContextRegion& a, const ContextRegion& b){
+        if (a.path != b.path) return a.path < b.path;
+        return a.first_line < b.first_line;
+    });
+    span.arg(to_string(pack.regions.size()) + " regions");
+    return pack;
+}
+
+string format_context_prompt(const ContextPack& pack, const string& question) {
+    if (pack.regions.empty()) return question;
+    string out = kPreamble;
+    for (const auto& r : pack.regions) {
+        out += region_header(r);
+        out += r.text;
+        out += kRegionFooter;
+    }
+    out += kQuestionHeader;
+    out += question;
+    return out;
+}
+
+string context_query(const string& question) {
+    auto word_char = [](unsigned char c){ return isalnum(c) || c == '_' || c == '.' || c == ':' || c == '/' || c == '-'; };
+    vector<string> words;
+    for (size_t i = 0; i < question.size();) {
+        if (!word_char(static_cast<unsigned char>(question[i]))) { ++i; continue; }
+        size_t j = i;
+        while (j < question.size() && word_char(static_cast<unsigned char>(question[j]))) ++j;
+        string w = question.substr(i, j - i);
+        i = j;
+        // 文末の句読点や "foo::" の区切りは語に含めない
+        while (!w.empty() && (w.back() == '.' || w.back() == ':' || w.back() == '/' || w.back() == '-')) w.pop_back();
+        while (!w.empty() && (w.front() == '.' || w.front() == ':' || w.front() == '-')) w.erase(w.begin());
+        if (w.size() < 3 || find(words.begin(), words.end(), w) != words.end()) continue;
+        words.push_back(std::move(w));
+    }
+    if (words.empty()) return question;
+    string q;
+    for (const auto& w : words) q += (q.empty() ? "" : " ") + w;
+    return q;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "file_finder.hpp"
+#include <string>
+#include <vector>
+
+// /ask --ctx: /target の検索結果から関連箇所を切り出し、トークン予算に収まるだけ質問の前に付ける
+//
+// 候補は定義の行範囲と一致行の前後。同じファイル内で重なる・隣り合う範囲は1つにまとめ、
+// 別のファイルにある同じ内容（コピーされたコード等）は1度だけ入れる。
+// 選ぶ順は検索順位（同じファイルでは定義を先）で、入らない範囲は飛ばして後ろの小さい範囲で埋める。
+// 並べる順はパスと行番号の順にして、点数が多少揺れても選ばれた範囲が同じなら同じ文字列になるようにする
+
+struct ContextPackOptions {
+    long budget_tokens = 0;    // 前書き・見出し込みの上限
+    int around_lines = 3;      // 一致行の前後に付ける行数
+    int max_region_lines = 80; // 長い定義（クラス・名前空間等）は先頭からこの行数まで
+};
+
+/// @brief 切り出した1範囲（行は 1 始まりで両端を含む）
+struct ContextRegion {
+    std::string path;
+    int first_line = 0;
+    int last_line = 0;
+    int rank = 0;            // 元のファイルの検索順位（0 始まり）
+    bool definition = false; // 定義の範囲を含む
+    bool truncated = false;  // 定義の途中で切った
+    std::string text;
+    long tokens = 0;         // 見出し込み
+};
+
+struct ContextPack {
+    std::vector<ContextRegion> regions; // パス・行番号の順
+    long tokens = 0;                    // 前書き込み（regions が空なら 0）
+    size_t candidates = 0;              // まとめた後の範囲数
+    size_t duplicates = 0;              // 他のファイルと同じ内容で除いた数
+    size_t dropped = 0;                 // 予算に入らなかった数
+};
+
+/// @brief 検索結果 hits（順位順）から範囲を切り出して予算に詰める。読めないファイルは飛ばす
+ContextPack pack_context(const std::vector<FileHit>& hits, const ContextPackOptions& opt);
+/// @brief 詰めた範囲を質問の前に置いたユーザーメッセージにする（範囲が無ければ質問のまま）
+std::string format_context_prompt(const ContextPack& pack, const std::string& question);
+/// @brief 質問から検索語を取り出す（英数字と _ . : / - からなる3文字以上の語。無ければ質問全体）
+std::string context_query(const std::string& question);
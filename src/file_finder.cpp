@@ -1,76 +1,376 @@
 #include "file_finder.hpp"
+#include "git_files.hpp"
+#include "task_pool.hpp"
+#include "text_match.hpp"
+#include "trace.hpp"
 #include <filesystem>
 #include <fstream>
-#include <sstream>
 #include <algorithm>
 #include <cctype>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 namespace fs = std::filesystem;
 
 static string lower(string s){ transform(s.begin(), s.end(), s.begin(), ::tolower); return s; }
 
-static bool is_binary_prefix(const string& data) {
-    int nontext = 0; int total = 0;
-    for (unsigned char c : data) { ++total; if ((c<9) || (c>13 && c<32)) ++nontext; if (total>1024) break; }
-    return nontext > total/16; // heuristic
+namespace {
+bool ignored_dir(const fs::path& dir) {
+    static const vector<string> ignore_dirs = {".git","build","dist","node_modules",".venv","venv","target","bin","obj",".next",".cache"};
+    string lname = lower(dir.filename().string());
+    return find(ignore_dirs.begin(), ignore_dirs.end(), lname) != ignore_dirs.end();
 }
 
-static vector<string> split_words(const string& q) {
+// 上位 k 件だけを保持する（先頭が最下位のヒープ）。ワーカーごとに持ち、最後にまとめる
+struct TopK {
+    size_t k = 0;
+    vector<FileHit> heap;
+    void push(FileHit&& h) {
+        if (heap.size() < k) {
+            heap.push_back(std::move(h));
+            push_heap(heap.begin(), heap.end(), hit_before);
+        } else if (k > 0 && hit_before(h, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), hit_before);
+            heap.back() = std::move(h);
+            push_heap(heap.begin(), heap.end(), hit_before);
+        }
+    }
+};
+
+// ワーカーごとの上位 k 件に加え、締め切り・中断の判定と途中経過の通知を受け持つ
+class Collector {
+public:
+    Collector(int workers, const SearchOptions& opt) : opt_(opt), t0_(chrono::steady_clock::now()) {
+        for (int w = 0; w < workers; ++w) {
+            slots_.push_back(make_unique<Slot>());
+            slots_.back()->top.k = static_cast<size_t>(max(0, opt.max_results));
+        }
+        next_report_ = t0_ + opt.progress_interval;
+    }
+
+    /// @brief 締め切りを過ぎたか中断されたら true（以後のタスクは何もせず戻る）
+    bool stopped() {
+        if (stop_.load(memory_order_relaxed)) return true;
+        if (opt_.cancel && opt_.cancel->load(memory_order_relaxed)) { cancelled_ = true; stop_ = true; return true; }
+        if (opt_.budget.count() > 0 && chrono::steady_clock::now() - t0_ >= opt_.budget) { timed_out_ = true; stop_ = true; return true; }
+        return false;
+    }
+
+    void add(int worker, optional<FileHit> hit) {
+        scanned_.fetch_add(1, memory_order_relaxed);
+        if (hit) {
+            if (opt_.annotate) opt_.annotate(*hit);
+            Slot& s = *slots_[worker];
+            lock_guard<mutex> lk(s.mu);
+            s.top.push(std::move(*hit));
+        }
+        if (opt_.on_progress) maybe_report();
+    }
+
+    SearchResult finish() {
+        SearchResult r;
+        r.hits = snapshot();
+        r.scanned = scanned_.load();
+        r.timed_out = timed_out_.load();
+        r.cancelled = cancelled_.load();
+        r.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0_).count();
+        return r;
+    }
+
+private:
+    struct Slot {
+        mutex mu;
+        TopK top;
+    };
+
+    vector<FileHit> snapshot() {
+        vector<FileHit> hits;
+        for (auto& s : slots_) {
+            lock_guard<mutex> lk(s->mu);
+            hits.insert(hits.end(), s->top.heap.begin(), s->top.heap.end());
+        }
+        rank_hits(hits, opt_.max_results);
+        return hits;
+    }
+
+    // 一定間隔ごとに1つのワーカーだけが現在の上位をまとめ、前回から変わっていれば通知する
+    void maybe_report() {
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lk(report_mu_);
+            if (reporting_ || now < next_report_) return;
+            reporting_ = true;
+            next_report_ = now + opt_.progress_interval;
+        }
+        auto hits = snapshot();
+        vector<pair<int, string>> key;
+        for (const auto& h : hits) key.emplace_back(h.score, h.path);
+        if (!hits.empty() && key != last_key_) {
+            last_key_ = std::move(key);
+            opt_.on_progress(hits, scanned_.load());
+        }
+        lock_guard<mutex> lk(report_mu_);
+        reporting_ = false;
+    }
+
+    const SearchOptions& opt_;
+    chrono::steady_clock::time_point t0_;
+    vector<unique_ptr<Slot>> slots_;
+    atomic<bool> stop_{false}, timed_out_{false}, cancelled_{false};
+    atomic<size_t> scanned_{0};
+    mutex report_mu_;
+    bool reporting_ = false;
+    chrono::steady_clock::time_point next_report_;
+    vector<pair<int, string>> last_key_;
+};
+}
+
+bool looks_binary(string_view data) {
+    size_t total = min<size_t>(data.size(), 1025);
+    return count_control_bytes(data.substr(0, total)) > total/16; // heuristic
+}
+
+vector<string> split_query(const string& q) {
     vector<string> t; string cur;
     for (char c : q) { if (isspace((unsigned char)c)) { if(!cur.empty()){t.push_back(lower(cur)); cur.clear();} } else cur+=c; }
     if (!cur.empty()) t.push_back(lower(cur));
     return t;
 }
 
-vector<FileHit> find_relevant_files(const string& base_dir, const string& query, int max_results) {
-    vector<FileHit> hits;
-    auto tokens = split_words(query);
-    if (tokens.empty()) return hits;
-
-    vector<string> ignore_dirs = {".git","build","dist","node_modules",".venv","venv","target","bin","obj",".next",".cache"};
-
-    for (auto it = fs::recursive_directory_iterator(base_dir, fs::directory_options::skip_permission_denied);
-         it != fs::recursive_directory_iterator(); ++it) {
+void for_each_source_file(const string& base_dir, const function<void(const fs::directory_entry&)>& fn) {
+    // git 作業ツリーなら index と .gitignore に従う
+    if (auto git = list_git_files(base_dir)) {
+        const fs::path base(base_dir);
+        for (const auto& rel : git->files) {
+            std::error_code ec;
+            fs::directory_entry e(base / fs::path(rel), ec);
+            if (ec || !e.is_regular_file(ec)) continue; // 追跡中だが作業ツリーから消えたファイル
+            fn(e);
+        }
+        return;
+    }
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(base_dir, fs::directory_options::skip_permission_denied, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
         if (it->is_directory()) {
-            string name = it->path().filename().string();
-            string lname = lower(name);
-            if (find_if(ignore_dirs.begin(), ignore_dirs.end(), [&](const string& d){return lname==d;}) != ignore_dirs.end()) {
-                it.disable_recursion_pending();
-            }
+            if (ignored_dir(it->path())) it.disable_recursion_pending();
             continue;
         }
         if (!it->is_regular_file()) continue;
-        string path = it->path().string();
-        string lpath = lower(path);
-        int score = 0;
-        for (auto& tk : tokens) if (lpath.find(tk)!=string::npos) score += 5;
-        // read small prefix to determine binary and collect snippets
-        ifstream ifs(path, ios::binary);
-        if (!ifs) continue;
-        string content_prefix; content_prefix.resize(64*1024);
-        ifs.read(content_prefix.data(), content_prefix.size()); 
-        if (ifs.bad()) {
-            continue; // Skip files with read errors
-        }
-        size_t rd = ifs.gcount(); content_prefix.resize(rd);
-        if (is_binary_prefix(content_prefix)) continue;
-        string all = content_prefix;
-        // if small file, read all
-        if (!ifs.eof()) {
-            // leave as prefix only to limit cost
-        }
-        // simple line scanning
-        istringstream iss(all); string line; int added=0; string snip;
-        for (int ln=1; ln<=300 && std::getline(iss, line); ++ln) {
-            string l = lower(line);
-            bool matched=false; for (auto& tk: tokens) if (l.find(tk)!=string::npos) { matched=true; score += 3; }
-            if (matched && added<3) { snip += line + "\n"; ++added; }
+        fn(*it);
+    }
+}
+
+SourcePathFilter::SourcePathFilter(const string& base_dir) {
+    if (auto g = GitPathFilter::open(base_dir)) git_ = make_unique<GitPathFilter>(std::move(*g));
+}
+
+SourcePathFilter::~SourcePathFilter() = default;
+SourcePathFilter::SourcePathFilter(SourcePathFilter&&) noexcept = default;
+SourcePathFilter& SourcePathFilter::operator=(SourcePathFilter&&) noexcept = default;
+
+bool SourcePathFilter::excluded(const string& rel, bool is_dir) {
+    if (git_) return git_->excluded(rel, is_dir);
+    fs::path p(rel);
+    if (!is_dir) p = p.parent_path();
+    for (const auto& part : p) {
+        if (ignored_dir(part)) return true;
+    }
+    return false;
+}
+
+void SourcePathFilter::reload() {
+    if (git_) git_->reload();
+}
+
+namespace {
+// UTF-8 の文字の途中で切らないよう後退する
+size_t utf8_cut(string_view s, size_t n) {
+    if (n >= s.size()) return s.size();
+    while (n > 0 && (static_cast<unsigned char>(s[n]) & 0xC0) == 0x80) --n;
+    return n;
+}
+
+// 完全な行の並びを順に受け取り、行番号を引き継ぎながら採点する（塊ごとに読む経路と共用）
+class ContentScanner {
+public:
+    explicit ContentScanner(const MultiMatcher& matcher) : matcher_(matcher) {}
+
+    /// @brief バイナリと判定したら false（check_binary は最初の塊だけ）
+    bool feed(string_view block, bool check_binary) {
+        auto r = matcher_.scan(block, line_, check_binary, [&](size_t, int line, size_t pos) {
+            out_.score += 3;
+            bool new_line = out_.snippets.empty() || out_.snippets.back().line != line;
+            if (new_line && out_.snippets.size() < kMaxSnippets) out_.snippets.push_back(Snippet{line, line_text(block, pos)});
+        });
+        line_ = r.end_line;
+        return !r.binary;
+    }
+
+    ContentScore take() { return std::move(out_); }
+
+private:
+    static string line_text(string_view block, size_t p) {
+        size_t b = block.rfind('\n', p);
+        b = (b == string_view::npos) ? 0 : b + 1;
+        size_t e = block.find('\n', p);
+        string_view line = block.substr(b, (e == string_view::npos ? block.size() : e) - b);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        return string(line.substr(0, utf8_cut(line, 200)));
+    }
+
+    static constexpr size_t kMaxSnippets = 3;
+    const MultiMatcher& matcher_;
+    int line_ = 1;
+    ContentScore out_;
+};
+
+constexpr size_t kSmallFile = 64 * 1024;
+
+// 大きいファイルは 1MB の塊で読み、末尾の途中の行は次の塊へ繰り越す（mmap は走査中に切り詰められると SIGBUS になる）
+bool scan_chunked(istream& is, string_view head, ContentScanner& scan) {
+    vector<char> buf(max<size_t>(1 << 20, head.size() * 2));
+    size_t have = head.size();
+    memcpy(buf.data(), head.data(), have);
+    bool first = true;
+    for (;;) {
+        if (have == buf.size()) buf.resize(buf.size() * 2); // 1行が塊より長い
+        is.read(buf.data() + have, static_cast<streamsize>(buf.size() - have));
+        size_t got = static_cast<size_t>(is.gcount());
+        have += got;
+        bool eof = got == 0 || !is;
+        string_view v(buf.data(), have);
+        size_t cut = have;
+        if (!eof) { size_t nl = v.rfind('\n'); cut = (nl == string_view::npos) ? 0 : nl + 1; }
+        if (cut > 0 && !scan.feed(v.substr(0, cut), first)) return false;
+        if (cut > 0) first = false;
+        memmove(buf.data(), buf.data() + cut, have - cut);
+        have -= cut;
+        if (eof) return true;
+    }
+}
+}
+
+ContentScore score_content(string_view text, const vector<string>& tokens) {
+    MultiMatcher matcher(tokens);
+    ContentScanner scan(matcher);
+    scan.feed(text, false);
+    return scan.take();
+}
+
+optional<FileHit> score_file(const string& path, const MultiMatcher& matcher) {
+    string lpath = lower(path);
+    int score = 0;
+    for (auto& tk : matcher.tokens()) if (lpath.find(tk)!=string::npos) score += 5;
+    // 小さいファイルはワーカーごとのバッファへ1回で読む
+    thread_local vector<char> head_buf(kSmallFile);
+    ifstream ifs(path, ios::binary);
+    if (!ifs) return nullopt;
+    ifs.read(head_buf.data(), static_cast<streamsize>(head_buf.size()));
+    if (ifs.bad()) return nullopt;
+    string_view head(head_buf.data(), static_cast<size_t>(ifs.gcount()));
+    // バイナリ判定は照合と同じ走査で先頭 1KB の制御文字を数えて行う
+    ContentScanner scan(matcher);
+    bool text = true;
+    if (head.size() < kSmallFile) {
+        text = scan.feed(head, true);
+    } else {
+        text = scan_chunked(ifs, head, scan);
+    }
+    if (!text) return nullopt;
+    ContentScore cs = scan.take();
+    score += cs.score;
+    if (score<=0) return nullopt;
+    return FileHit{path, score, std::move(cs.snippets), {}};
+}
+
+optional<FileHit> score_file(const string& path, const vector<string>& tokens) {
+    return score_file(path, MultiMatcher(tokens));
+}
+
+bool hit_before(const FileHit& a, const FileHit& b) {
+    if (a.score != b.score) return a.score > b.score;
+    return a.path < b.path;
+}
+
+void rank_hits(vector<FileHit>& hits, int max_results) {
+    size_t k = static_cast<size_t>(max(0, max_results));
+    if (hits.size() > k) {
+        partial_sort(hits.begin(), hits.begin() + k, hits.end(), hit_before);
+        hits.resize(k);
+    } else {
+        sort(hits.begin(), hits.end(), hit_before);
+    }
+}
+
+SearchResult score_files(const vector<string>& paths, const vector<string>& tokens, const SearchOptions& opt) {
+    int threads = opt.threads > 0 ? opt.threads : default_thread_count();
+    TaskPool pool(min<int>(threads, max<int>(1, static_cast<int>(paths.size()))));
+    Collector col(pool.threads(), opt);
+    MultiMatcher matcher(tokens);
+    for (const auto& p : paths) {
+        pool.spawn([&matcher, &col, &p](int w){
+            if (!col.stopped()) col.add(w, score_file(p, matcher));
+        });
+    }
+    pool.run();
+    return col.finish();
+}
+
+SearchResult search_files(const string& base_dir, const string& query, const SearchOptions& opt) {
+    trace::Span span("find_relevant_files", "files");
+    span.arg(query);
+    auto tokens = split_query(query);
+    if (tokens.empty() || opt.max_results <= 0) return {};
+    // git 作業ツリーなら列挙は index と .gitignore に任せ、採点だけを並列にする
+    if (auto git = list_git_files(base_dir)) {
+        vector<string> paths;
+        paths.reserve(git->files.size());
+        const fs::path base(base_dir);
+        for (const auto& rel : git->files) {
+            // 作業ツリーから消えたファイルや、ディレクトリを指すシンボリックリンクは除く（for_each_source_file と同じ）
+            std::error_code ec;
+            fs::directory_entry e(base / fs::path(rel), ec);
+            if (ec || !e.is_regular_file(ec)) continue;
+            paths.push_back(e.path().string());
         }
-        if (score>0) hits.push_back(FileHit{path, score, snip});
+        return score_files(paths, tokens, opt);
     }
-    sort(hits.begin(), hits.end(), [](const FileHit& a, const FileHit& b){ return a.score>b.score; });
-    if ((int)hits.size()>max_results) hits.resize(max_results);
-    return hits;
+    // ディレクトリの展開も1ファイルの採点も同じプールのタスクにする（深いツリーも浅く広いツリーも均等に配れる）
+    TaskPool pool(opt.threads);
+    Collector col(pool.threads(), opt);
+    MultiMatcher matcher(tokens);
+    function<void(const fs::path&)> expand = [&](const fs::path& dir) {
+        if (col.stopped()) return;
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::directory_entry& e = *it;
+            std::error_code sec;
+            if (e.is_directory(sec)) {
+                // シンボリックリンク先のディレクトリは辿らない（for_each_source_file と同じ）
+                if (!e.is_symlink(sec) && !ignored_dir(e.path())) {
+                    pool.spawn([&expand, p = e.path()](int){ expand(p); });
+                }
+                continue;
+            }
+            if (!e.is_regular_file(sec)) continue;
+            pool.spawn([&, p = e.path().string()](int w){
+                if (!col.stopped()) col.add(w, score_file(p, matcher));
+            });
+        }
+    };
+    pool.spawn([&](int){ expand(base_dir); });
+    pool.run();
+    return col.finish();
 }
 
+vector<FileHit> find_relevant_files(const string& base_dir, const string& query, int max_results, int threads) {
+    SearchOptions opt;
+    opt.max_results = max_results;
+    opt.threads = threads;
+    return search_files(base_dir, query, opt).hits;
+}
@@ -1,12 +1,99 @@
 #pragma once
+#include "symbols.hpp"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+class MultiMatcher;
+class GitPathFilter;
+
+/// @brief 一致した行（行番号は 1 始まり、本文は末尾の改行を除き最大 200 バイト）
+struct Snippet {
+    int line = 0;
+    std::string text;
+};
+
 struct FileHit {
     std::string path;
     int score = 0;
-    std::string snippet; // 代表的な一致行（先頭数件を連結）
+    std::vector<Snippet> snippets; // 先頭から最大3行
+    std::vector<Symbol> definitions; // 索引の定義表で分かったトークンの定義（行範囲付き）
+};
+
+/// @brief 本文の採点結果（一致行 +3 をトークンごとに加算）
+struct ContentScore {
+    int score = 0;
+    std::vector<Snippet> snippets;
+};
+
+/// @brief 検索の打ち切り条件と途中経過の通知先
+struct SearchOptions {
+    int max_results = 10;
+    int threads = 0;                                 // 0 以下なら論理コア数
+    std::chrono::milliseconds budget{0};             // 締め切り（0=無制限）。過ぎたらそれまでの上位を返す
+    const std::atomic<bool>* cancel = nullptr;       // true になったら打ち切る（Ctrl-C 用）
+    std::chrono::milliseconds progress_interval{80}; // on_progress を呼ぶ最短間隔
+    /// @brief 途中の上位（順位順）が前回の通知から変わったとき、ワーカーの1つから呼ばれる（同時には呼ばれない）
+    std::function<void(const std::vector<FileHit>& best, size_t scanned)> on_progress;
+    /// @brief 採点直後、上位に入れる前にワーカーから呼ばれる（定義の加点等。同時に呼ばれうる）
+    std::function<void(FileHit& hit)> annotate;
+};
+
+struct SearchResult {
+    std::vector<FileHit> hits;
+    size_t scanned = 0;     // 採点したファイル数
+    bool timed_out = false;
+    bool cancelled = false;
+    double elapsed_ms = 0;
 };
 
-std::vector<FileHit> find_relevant_files(const std::string& base_dir, const std::string& query, int max_results = 10);
+/// @brief base_dir 以下を並列に走査・採点し、上位 max_results 件を返す（列挙は for_each_source_file と同じ規則）
+/// 上位はワーカーごとの大きさ max_results のヒープにだけ保持する。順位はスレッド数によらず同じ（打ち切らなければ）
+SearchResult search_files(const std::string& base_dir, const std::string& query, const SearchOptions& opt = {});
+/// @brief search_files の打ち切り・通知なし版
+/// @param threads ワーカー数（0 以下なら論理コア数）
+std::vector<FileHit> find_relevant_files(const std::string& base_dir, const std::string& query, int max_results = 10, int threads = 0);
+
+/// @brief クエリを空白で区切り、小文字化したトークンにする
+std::vector<std::string> split_query(const std::string& query);
+/// @brief base_dir 以下の通常ファイルを列挙する。git 作業ツリーなら追跡中と .gitignore で除外されないファイル、
+/// それ以外は build, node_modules 等の生成物ディレクトリを除いて辿る
+void for_each_source_file(const std::string& base_dir, const std::function<void(const std::filesystem::directory_entry&)>& fn);
 
+/// @brief for_each_source_file と同じ規則で、base_dir からの相対パス1つが列挙対象外かを判定する（ファイル監視用）
+class SourcePathFilter {
+public:
+    explicit SourcePathFilter(const std::string& base_dir);
+    ~SourcePathFilter();
+    SourcePathFilter(SourcePathFilter&&) noexcept;
+    SourcePathFilter& operator=(SourcePathFilter&&) noexcept;
+
+    /// @param rel base_dir からの相対パス（generic 形式）
+    bool excluded(const std::string& rel, bool is_dir);
+    /// @brief .gitignore が変わったとき
+    void reload();
+
+private:
+    std::unique_ptr<GitPathFilter> git_; // git 管理外なら null（生成物ディレクトリの名前だけで判定）
+};
+/// @brief 本文全体を行単位で採点する（tokens は小文字。ASCII の大文字小文字を区別しない）
+ContentScore score_content(std::string_view text, const std::vector<std::string>& tokens);
+/// @brief 1ファイルを採点する（パス一致 +5 と score_content）。バイナリ・読めない・0点なら nullopt
+/// 64KB 以下のファイルはそのまま読み、それより大きいファイルは 1MB ずつ読んで走査する（行の途中は次の塊へ繰り越す）
+std::optional<FileHit> score_file(const std::string& path, const std::vector<std::string>& tokens);
+/// @brief 照合器を使い回す版（トークンは matcher.tokens()）
+std::optional<FileHit> score_file(const std::string& path, const MultiMatcher& matcher);
+/// @brief 先頭約 1KB の制御文字の割合からバイナリとみなすか判定する
+bool looks_binary(std::string_view data);
+/// @brief 順位の比較（score の降順、同点はパスの昇順）
+bool hit_before(const FileHit& a, const FileHit& b);
+/// @brief 採点結果を hit_before の順に並べ max_results 件に切り詰める
+void rank_hits(std::vector<FileHit>& hits, int max_results);
+/// @brief paths を並列に採点し、上位 opt.max_results 件を返す（打ち切り・通知は search_files と同じ）
+SearchResult score_files(const std::vector<std::string>& paths, const std::vector<std::string>& tokens, const SearchOptions& opt);
@@ -0,0 +1,540 @@
+#include "file_index.hpp"
+#include "file_watch.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+constexpr char kMagic[4] = {'A','G','T','I'};
+constexpr uint32_t kVersion = 2; // 2: 定義表を追加
+constexpr uint64_t kMaxIndexedBytes = 32ull << 20; // これより大きいファイルは内容を索引しない
+constexpr int kDefinitionBonus = 100;               // トークンを定義しているファイルへの加点（トークンごと）
+
+double ms_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+inline unsigned char fold(unsigned char c) { return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c + 32) : c; }
+
+// 行をまたぐトライグラムは検索に使わない（トークンは改行を含まない）ので数えない
+vector<uint32_t> trigrams_of(string_view text) {
+    vector<uint32_t> out;
+    out.reserve(min<size_t>(text.size(), 1 << 16));
+    uint32_t key = 0; int n = 0;
+    for (unsigned char c : text) {
+        if (c == '\n' || c == '\r') { n = 0; key = 0; continue; }
+        key = ((key << 8) | fold(c)) & 0xFFFFFFu;
+        if (++n >= 3) out.push_back(key);
+    }
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+void put_varint(string& out, uint32_t v) {
+    while (v >= 0x80) { out += static_cast<char>((v & 0x7F) | 0x80); v >>= 7; }
+    out += static_cast<char>(v);
+}
+
+uint64_t inode_of(const fs::path& p) {
+#if defined(_WIN32)
+    (void)p;
+    return 0;
+#else
+    struct stat st{};
+    if (::stat(p.c_str(), &st) != 0) return 0;
+    return static_cast<uint64_t>(st.st_ino);
+#endif
+}
+
+string lower(string s) { for (auto& c : s) c = static_cast<char>(fold(static_cast<unsigned char>(c))); return s; }
+
+// 索引ファイルの読み書き（リトルエンディアン固定ではなくホストのバイト順。キャッシュなので移植性は不要）
+template <class T> void put(ostream& os, T v) { os.write(reinterpret_cast<const char*>(&v), sizeof(T)); }
+void put_str(ostream& os, const string& s) { put<uint32_t>(os, static_cast<uint32_t>(s.size())); os.write(s.data(), static_cast<streamsize>(s.size())); }
+
+struct Reader {
+    string_view d;
+    size_t pos = 0;
+    bool ok = true;
+    template <class T> T get() {
+        T v{};
+        if (pos + sizeof(T) > d.size()) { ok = false; return v; }
+        memcpy(&v, d.data() + pos, sizeof(T)); pos += sizeof(T);
+        return v;
+    }
+    string str() {
+        uint32_t n = get<uint32_t>();
+        if (!ok || pos + n > d.size()) { ok = false; return {}; }
+        string s(d.substr(pos, n)); pos += n;
+        return s;
+    }
+};
+}
+
+fs::path default_cache_dir() {
+#if defined(_WIN32)
+    const char* base = getenv("LOCALAPPDATA");
+    return (base ? fs::path(base) : fs::path(".")) / "agens" / "cache";
+#else
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) return fs::path(xdg) / "agens";
+    const char* home = getenv("HOME");
+    return (home ? fs::path(home) / ".cache" : fs::path(".")) / "agens";
+#endif
+}
+
+TrigramIndex::TrigramIndex(string root, const fs::path& cache_dir) : root_(std::move(root)) {
+    // ルートの絶対パスごとに別ファイル（FNV-1a）
+    std::error_code ec;
+    string abs = fs::weakly_canonical(fs::absolute(root_, ec), ec).string();
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : abs) { h ^= c; h *= 1099511628211ull; }
+    ostringstream name; name << hex << setw(16) << setfill('0') << h << ".idx";
+    path_ = cache_dir / name.str();
+}
+
+double TrigramIndex::seconds_since_update() const {
+    if (!updated_) return -1;
+    return chrono::duration<double>(chrono::steady_clock::now() - updated_at_).count();
+}
+
+string TrigramIndex::display_path(const string& rel) const {
+    return (fs::path(root_) / fs::path(rel)).string();
+}
+
+vector<uint32_t> TrigramIndex::decode(const Posting& p) const {
+    vector<uint32_t> ids;
+    ids.reserve(p.count);
+    uint32_t cur = 0, shift = 0, v = 0;
+    bool first = true;
+    for (unsigned char b : p.bytes) {
+        v |= static_cast<uint32_t>(b & 0x7F) << shift;
+        if (b & 0x80) { shift += 7; continue; }
+        cur = first ? v : cur + v;
+        first = false;
+        ids.push_back(cur);
+        v = 0; shift = 0;
+    }
+    return ids;
+}
+
+void TrigramIndex::add_file(const string& rel, int64_t mtime, uint64_t size, uint64_t inode) {
+    const uint32_t id = static_cast<uint32_t>(entries_.size());
+    Entry e;
+    e.rel = rel; e.mtime = mtime; e.size = size; e.inode = inode;
+    e.lpath = lower(display_path(rel));
+    if (size > kMaxIndexedBytes) {
+        e.kind = Large;
+    } else {
+        // mmap は索引中に他のプロセスが切り詰めると SIGBUS になるので、スレッドごとのバッファへ読む
+        thread_local string buf;
+        string_view text;
+        if (read_whole_file(display_path(rel), buf)) text = buf;
+        else e.kind = Binary; // 読めないファイルは採点でも除外される
+        if (e.kind == Binary || looks_binary(text.substr(0, 64 * 1024))) e.kind = Binary;
+        else {
+            for (uint32_t key : trigrams_of(text)) {
+                Posting& p = postings_[key];
+                put_varint(p.bytes, p.count == 0 ? id : id - p.last);
+                p.last = id;
+                ++p.count;
+            }
+            for (auto& sym : extract_symbols(text, lang_for_path(rel))) {
+                symbols_.push_back(SymbolRow{symbol_key(sym.name), id, std::move(sym)});
+            }
+        }
+    }
+    entries_.push_back(std::move(e));
+    by_rel_[rel] = id;
+}
+
+void TrigramIndex::compact() {
+    // 削除・変更で使われなくなった番号を詰め直す
+    vector<uint32_t> remap(entries_.size(), UINT32_MAX);
+    vector<Entry> kept;
+    kept.reserve(entries_.size() - dead_);
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+        if (!entries_[i].live) continue;
+        remap[i] = static_cast<uint32_t>(kept.size());
+        kept.push_back(std::move(entries_[i]));
+    }
+    for (auto it = postings_.begin(); it != postings_.end();) {
+        Posting np;
+        for (uint32_t id : decode(it->second)) {
+            uint32_t n = id < remap.size() ? remap[id] : UINT32_MAX;
+            if (n == UINT32_MAX) continue;
+            put_varint(np.bytes, np.count == 0 ? n : n - np.last);
+            np.last = n; ++np.count;
+        }
+        if (np.count == 0) it = postings_.erase(it);
+        else { it->second = std::move(np); ++it; }
+    }
+    // 番号の詰め直しは順序を変えないので、整列済みの先頭は残った行のまま整列済み
+    vector<SymbolRow> rows;
+    rows.reserve(symbols_.size());
+    size_t sorted = 0;
+    for (size_t i = 0; i < symbols_.size(); ++i) {
+        SymbolRow& row = symbols_[i];
+        uint32_t n = row.file < remap.size() ? remap[row.file] : UINT32_MAX;
+        if (n == UINT32_MAX) continue;
+        row.file = n;
+        rows.push_back(std::move(row));
+        if (i < symbols_sorted_) ++sorted;
+    }
+    symbols_.swap(rows);
+    symbols_sorted_ = sorted;
+    entries_ = std::move(kept);
+    by_rel_.clear();
+    for (uint32_t i = 0; i < entries_.size(); ++i) by_rel_[entries_[i].rel] = i;
+    dead_ = 0;
+}
+
+bool TrigramIndex::load() {
+    trace::Span span("index.load", "files");
+    auto t0 = chrono::steady_clock::now();
+    MappedFile mf;
+    if (!mf.open(path_.string())) return false;
+    Reader r{mf.view()};
+    if (r.d.size() < 8 || memcmp(r.d.data(), kMagic, 4) != 0) return false;
+    r.pos = 4;
+    if (r.get<uint32_t>() != kVersion) return false;
+    vector<Entry> entries;
+    unordered_map<uint32_t, Posting> postings;
+    uint32_t n = r.get<uint32_t>();
+    for (uint32_t i = 0; r.ok && i < n; ++i) {
+        Entry e;
+        e.rel = r.str();
+        e.mtime = r.get<int64_t>();
+        e.size = r.get<uint64_t>();
+        e.inode = r.get<uint64_t>();
+        e.kind = static_cast<Kind>(r.get<uint8_t>());
+        e.lpath = lower(display_path(e.rel));
+        entries.push_back(std::move(e));
+    }
+    uint32_t np = r.ok ? r.get<uint32_t>() : 0;
+    for (uint32_t i = 0; r.ok && i < np; ++i) {
+        uint32_t key = r.get<uint32_t>();
+        Posting p;
+        p.count = r.get<uint32_t>();
+        p.last = r.get<uint32_t>();
+        p.bytes = r.str();
+        if (p.last >= entries.size()) r.ok = false;
+        postings.emplace(key, std::move(p));
+    }
+    vector<SymbolRow> rows;
+    uint32_t ns = r.ok ? r.get<uint32_t>() : 0;
+    for (uint32_t i = 0; r.ok && i < ns; ++i) {
+        SymbolRow row;
+        row.sym.name = r.str();
+        row.file = r.get<uint32_t>();
+        row.sym.line = r.get<int32_t>();
+        row.sym.end_line = r.get<int32_t>();
+        uint8_t kind = r.get<uint8_t>();
+        if (row.file >= entries.size() || kind > static_cast<uint8_t>(SymbolKind::Variable)) r.ok = false;
+        row.sym.kind = static_cast<SymbolKind>(kind);
+        row.key = symbol_key(row.sym.name);
+        rows.push_back(std::move(row));
+    }
+    if (!r.ok) return false;
+    loaded_ = true;
+    entries_ = std::move(entries);
+    postings_ = std::move(postings);
+    symbols_ = std::move(rows);
+    // 保存時にキー順で書いているので、整っていれば並べ直さない
+    symbols_sorted_ = is_sorted(symbols_.begin(), symbols_.end(), row_less) ? symbols_.size() : 0;
+    sort_symbols();
+    by_rel_.clear();
+    for (uint32_t i = 0; i < entries_.size(); ++i) by_rel_[entries_[i].rel] = i;
+    dead_ = 0;
+    stats_.files = entries_.size();
+    stats_.symbols = symbols_.size();
+    stats_.load_ms = ms_since(t0);
+    return true;
+}
+
+TrigramIndex::~TrigramIndex() = default;
+
+bool TrigramIndex::refresh_file(const string& rel, const fs::directory_entry& de, vector<char>* seen) {
+    std::error_code ec;
+    int64_t mtime = static_cast<int64_t>(de.last_write_time(ec).time_since_epoch().count());
+    uint64_t size = de.file_size(ec);
+    if (ec) return false;
+    uint64_t inode = inode_of(de.path());
+    auto it = by_rel_.find(rel);
+    if (it != by_rel_.end()) {
+        Entry& e = entries_[it->second];
+        if (e.mtime == mtime && e.size == size && e.inode == inode) {
+            if (seen) (*seen)[it->second] = 1;
+            return false;
+        }
+        e.live = false; ++dead_; ++stats_.changed;
+    } else {
+        ++stats_.added;
+    }
+    add_file(rel, mtime, size, inode);
+    if (seen) { seen->resize(entries_.size(), 0); seen->back() = 1; }
+    return true;
+}
+
+void TrigramIndex::remove_file(uint32_t id) {
+    entries_[id].live = false; ++dead_; ++stats_.removed;
+    by_rel_.erase(entries_[id].rel);
+}
+
+void TrigramIndex::finish_update(chrono::steady_clock::time_point t0) {
+    if (dead_ > 0 && dead_ * 4 > entries_.size()) compact();
+    stats_.files = entries_.size() - dead_;
+    stats_.symbols = symbols_.size();
+    stats_.update_ms = ms_since(t0);
+    updated_ = true;
+    updated_at_ = chrono::steady_clock::now();
+}
+
+bool TrigramIndex::update(const atomic<bool>* cancel, chrono::steady_clock::time_point deadline) {
+    trace::Span span("index.update", "files");
+    auto t0 = chrono::steady_clock::now();
+    stats_.added = stats_.changed = stats_.removed = 0;
+    vector<char> seen(entries_.size(), 0);
+    const fs::path base(root_);
+    bool stopped = false;
+    for_each_source_file(root_, [&](const fs::directory_entry& de){
+        if (!stopped) {
+            stopped = (cancel && cancel->load(memory_order_relaxed))
+                      || (deadline != chrono::steady_clock::time_point{} && chrono::steady_clock::now() >= deadline);
+        }
+        if (!stopped) refresh_file(de.path().lexically_relative(base).generic_string(), de, &seen);
+    });
+    if (stopped) {
+        // 見ていないファイルが消えたとは限らないので除かない。監視中でも次回は全走査からやり直す
+        span.arg("stopped");
+        updated_ = false;
+        stats_.files = entries_.size() - dead_;
+        stats_.symbols = symbols_.size();
+        stats_.update_ms = ms_since(t0);
+        return stats_.added + stats_.changed > 0;
+    }
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].live && !seen[i]) remove_file(i);
+    }
+    ++stats_.rescans;
+    finish_update(t0);
+    return stats_.added + stats_.changed + stats_.removed > 0;
+}
+
+bool TrigramIndex::apply(const vector<string>& rels) {
+    trace::Span span("index.apply", "files");
+    auto t0 = chrono::steady_clock::now();
+    stats_.added = stats_.changed = stats_.removed = 0;
+    if (!filter_) filter_ = make_unique<SourcePathFilter>(root_);
+    const fs::path base(root_);
+    for (const auto& rel : rels) {
+        std::error_code ec;
+        fs::directory_entry de(base / fs::path(rel), ec);
+        if (!ec && de.is_directory(ec)) continue; // 中のファイルは個別に届く
+        if (!ec && de.is_regular_file(ec) && !filter_->excluded(rel, false)) {
+            refresh_file(rel, de, nullptr);
+            continue;
+        }
+        // 消えた（または対象外になった）パス。索引にあるファイルでなければディレクトリとみなし、配下を範囲で除く
+        if (auto it = by_rel_.find(rel); it != by_rel_.end()) { remove_file(it->second); continue; }
+        string prefix = rel + "/";
+        for (auto it = by_rel_.lower_bound(prefix); it != by_rel_.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+            uint32_t id = (it++)->second; // remove_file が by_rel_ から消す
+            remove_file(id);
+        }
+    }
+    finish_update(t0);
+    return stats_.added + stats_.changed + stats_.removed > 0;
+}
+
+bool TrigramIndex::watch() {
+    if (watcher_ && watcher_->running()) return true;
+    watcher_ = make_unique<FileWatcher>(root_);
+    if (!watcher_->start()) { watcher_.reset(); return false; }
+    return true;
+}
+
+bool TrigramIndex::watching() const {
+    return watcher_ && watcher_->running() && !watcher_->degraded();
+}
+
+bool TrigramIndex::refresh(double max_age_sec, const atomic<bool>* cancel, chrono::steady_clock::time_point deadline) {
+    stats_.watched_dirs = watching() ? watcher_->watched_dirs() : 0;
+    if (watching() && updated_) {
+        auto ch = watcher_->take();
+        if (ch.rescan) {
+            if (filter_) filter_->reload();
+            return update(cancel, deadline);
+        }
+        if (ch.paths.empty()) return false;
+        return apply(ch.paths);
+    }
+    double age = seconds_since_update();
+    if (age >= 0 && age <= max_age_sec) return false;
+    return update(cancel, deadline);
+}
+
+vector<string> TrigramIndex::files() const {
+    vector<string> out;
+    out.reserve(entries_.size() - dead_);
+    for (const auto& e : entries_) if (e.live) out.push_back(e.rel);
+    return out;
+}
+
+bool TrigramIndex::save() {
+    trace::Span span("index.save", "files");
+    if (dead_ > 0) compact();
+    std::error_code ec;
+    fs::create_directories(path_.parent_path(), ec);
+    fs::path tmp = path_; tmp += ".tmp";
+    {
+        ofstream os(tmp, ios::binary | ios::trunc);
+        if (!os) return false;
+        os.write(kMagic, 4);
+        put<uint32_t>(os, kVersion);
+        put<uint32_t>(os, static_cast<uint32_t>(entries_.size()));
+        for (const auto& e : entries_) {
+            put_str(os, e.rel);
+            put<int64_t>(os, e.mtime);
+            put<uint64_t>(os, e.size);
+            put<uint64_t>(os, e.inode);
+            put<uint8_t>(os, e.kind);
+        }
+        put<uint32_t>(os, static_cast<uint32_t>(postings_.size()));
+        for (const auto& [key, p] : postings_) {
+            put<uint32_t>(os, key);
+            put<uint32_t>(os, p.count);
+            put<uint32_t>(os, p.last);
+            put_str(os, p.bytes);
+        }
+        // 定義表はキー順のまま書く（読み込み時に並べ直さずに済む）
+        sort_symbols();
+        put<uint32_t>(os, static_cast<uint32_t>(symbols_.size()));
+        for (const auto& row : symbols_) {
+            put_str(os, row.sym.name);
+            put<uint32_t>(os, row.file);
+            put<int32_t>(os, row.sym.line);
+            put<int32_t>(os, row.sym.end_line);
+            put<uint8_t>(os, static_cast<uint8_t>(row.sym.kind));
+        }
+        if (!os) { os.close(); fs::remove(tmp, ec); return false; }
+    }
+    fs::rename(tmp, path_, ec);
+    if (ec) { fs::remove(tmp, ec); return false; }
+    return true;
+}
+
+void TrigramIndex::clear() {
+    entries_.clear(); by_rel_.clear(); postings_.clear(); symbols_.clear();
+    symbols_sorted_ = 0; dead_ = 0; updated_ = false; loaded_ = false;
+    stats_ = IndexStats{};
+    std::error_code ec; fs::remove(path_, ec);
+}
+
+vector<string> TrigramIndex::candidates(const vector<string>& tokens) {
+    trace::Span span("index.query", "files");
+    vector<char> mark(entries_.size(), 0);
+    for (const auto& tk : tokens) {
+        for (uint32_t i = 0; i < entries_.size(); ++i) {
+            const Entry& e = entries_[i];
+            if (!e.live || e.kind == Binary) continue;
+            if (e.kind == Large || tk.size() < 3 || e.lpath.find(tk) != string::npos) mark[i] = 1;
+        }
+        if (tk.size() < 3) continue;
+        // トークンの全トライグラムを含むファイル（最も短いリストから順に積集合）
+        auto keys = trigrams_of(tk);
+        vector<const Posting*> lists;
+        bool missing = false;
+        for (uint32_t k : keys) {
+            auto it = postings_.find(k);
+            if (it == postings_.end()) { missing = true; break; }
+            lists.push_back(&it->second);
+        }
+        if (missing || lists.empty()) continue;
+        sort(lists.begin(), lists.end(), [](const Posting* a, const Posting* b){ return a->count < b->count; });
+        vector<uint32_t> acc = decode(*lists[0]);
+        for (size_t j = 1; j < lists.size() && !acc.empty(); ++j) {
+            vector<uint32_t> other = decode(*lists[j]), out;
+            set_intersection(acc.begin(), acc.end(), other.begin(), other.end(), back_inserter(out));
+            acc.swap(out);
+        }
+        for (uint32_t id : acc) if (id < entries_.size() && entries_[id].live) mark[id] = 1;
+    }
+    vector<string> out;
+    for (uint32_t i = 0; i < entries_.size(); ++i) if (mark[i]) out.push_back(display_path(entries_[i].rel));
+    stats_.candidates = out.size();
+    return out;
+}
+
+bool TrigramIndex::row_less(const SymbolRow& a, const SymbolRow& b) {
+    if (a.key != b.key) return a.key < b.key;
+    if (a.file != b.file) return a.file < b.file;
+    return a.sym.line < b.sym.line;
+}
+
+void TrigramIndex::sort_symbols() {
+    if (symbols_sorted_ >= symbols_.size()) return;
+    auto mid = symbols_.begin() + static_cast<ptrdiff_t>(symbols_sorted_);
+    sort(mid, symbols_.end(), row_less);
+    inplace_merge(symbols_.begin(), mid, symbols_.end(), row_less);
+    symbols_sorted_ = symbols_.size();
+}
+
+unordered_map<string, vector<Symbol>> TrigramIndex::definitions(const vector<string>& tokens) {
+    trace::Span span("index.symbols", "files");
+    sort_symbols();
+    unordered_map<string, vector<Symbol>> out;
+    for (const auto& tk : tokens) {
+        auto lo = lower_bound(symbols_.begin(), symbols_.end(), tk, [](const SymbolRow& r, const string& k){ return r.key < k; });
+        for (auto it = lo; it != symbols_.end() && it->key == tk; ++it) {
+            if (!entries_[it->file].live) continue;
+            out[display_path(entries_[it->file].rel)].push_back(it->sym);
+        }
+    }
+    return out;
+}
+
+SearchResult search_files(TrigramIndex& index, const string& query, const SearchOptions& opt) {
+    trace::Span span("find_relevant_files.indexed", "files");
+    span.arg(query);
+    auto t0 = chrono::steady_clock::now();
+    auto tokens = split_query(query);
+    if (tokens.empty() || opt.max_results <= 0) return {};
+    // トークンを定義しているファイルは呼び出しているだけのファイルより上にし、定義の行範囲を付ける
+    auto defs = index.definitions(tokens);
+    SearchOptions o = opt;
+    if (!defs.empty()) {
+        o.annotate = [&defs, &opt](FileHit& hit) {
+            if (opt.annotate) opt.annotate(hit);
+            auto it = defs.find(hit.path);
+            if (it == defs.end()) return;
+            vector<string> keys;
+            for (const auto& sym : it->second) keys.push_back(symbol_key(sym.name));
+            sort(keys.begin(), keys.end());
+            hit.score += kDefinitionBonus * static_cast<int>(unique(keys.begin(), keys.end()) - keys.begin());
+            hit.definitions = it->second;
+        };
+    }
+    auto r = score_files(index.candidates(tokens), tokens, o);
+    index.set_query_ms(ms_since(t0));
+    return r;
+}
+
+vector<FileHit> find_relevant_files(TrigramIndex& index, const string& query, int max_results) {
+    SearchOptions opt;
+    opt.max_results = max_results;
+    return search_files(index, query, opt).hits;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include "file_finder.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// /target 用の永続トライグラム索引。キャッシュディレクトリに保存し、mtime/サイズ/inode が変わったファイルだけ読み直す
+//
+// 検索時は「パスにトークンを含む」か「トークンの全トライグラムを内容に含む」ファイルだけを採点に回す。
+// 3バイト未満のトークンは絞り込めないため全ファイルが候補になる
+
+/// @brief 索引の読み込み・更新・検索の所要時間と件数（未計測は負数）
+struct IndexStats {
+    double load_ms = -1;
+    double update_ms = -1;
+    double query_ms = -1;
+    size_t files = 0;      // 索引中のファイル数
+    size_t symbols = 0;    // 定義表の行数（削除済みのファイルの分を含むことがある）
+    size_t added = 0;      // 直近の更新で追加・変更・削除された数
+    size_t changed = 0;
+    size_t removed = 0;
+    size_t candidates = 0; // 直近の検索で採点したファイル数
+    size_t rescans = 0;    // 全走査の回数（監視中は初回とイベント取りこぼし時だけ）
+    size_t watched_dirs = 0; // 変更監視中のディレクトリ数（0=監視なし）
+};
+
+class FileWatcher;
+
+/// @brief キャッシュの置き場所（XDG_CACHE_HOME/agens、Windows は LOCALAPPDATA/agens）
+std::filesystem::path default_cache_dir();
+
+class TrigramIndex {
+public:
+    /// @param root 索引対象（表示パスは root を前置した形。"." なら "./src/a.cpp"）
+    explicit TrigramIndex(std::string root, const std::filesystem::path& cache_dir = default_cache_dir() / "index");
+    ~TrigramIndex();
+
+    const std::string& root() const { return root_; }
+    /// @brief 索引ファイルのパス（root の絶対パスから決まる）
+    const std::filesystem::path& path() const { return path_; }
+    const IndexStats& stats() const { return stats_; }
+    void set_query_ms(double ms) { stats_.query_ms = ms; }
+    /// @brief update() を1度も呼んでいなければ負数
+    double seconds_since_update() const;
+
+    /// @brief 保存済みの索引を読み込む。無い・壊れている場合は false（空のまま）
+    bool load();
+    /// @brief ツリーを stat だけで走査し、変わったファイルだけ読み直す。変化があれば true
+    ///
+    /// cancel が真になるか deadline（既定値なら無し）を過ぎたらそこで止める。読み直した分は残すが、
+    /// 消えたファイルは除かず、次の refresh() で最初から走査し直す
+    bool update(const std::atomic<bool>* cancel = nullptr, std::chrono::steady_clock::time_point deadline = {});
+    /// @brief 指定したパス（root からの相対）だけを stat して反映する。消えたディレクトリは配下ごと除く
+    bool apply(const std::vector<std::string>& rels);
+    /// @brief 変更監視を始める（最初の update() より前に呼ぶ）。使えない環境では false
+    bool watch();
+    /// @brief 監視が動いていて、監視できていないディレクトリが無い
+    bool watching() const;
+    /// @brief 監視中は溜まった変更だけを apply()（取りこぼし時は update()）。監視していなければ
+    /// 最後の更新から max_age_sec 秒を超えたときだけ update() する。変化があれば true
+    bool refresh(double max_age_sec, const std::atomic<bool>* cancel = nullptr,
+                 std::chrono::steady_clock::time_point deadline = {});
+    /// @brief 保存済みの索引を読み込んだか、最後まで走査したことがある（作成途中でなく検索に使える）
+    bool ready() const { return loaded_ || stats_.rescans > 0; }
+    /// @brief 索引中のファイル（root からの相対、generic 形式）
+    std::vector<std::string> files() const;
+    /// @brief 一時ファイルへ書いてから置き換える
+    bool save();
+    /// @brief メモリ上と保存済みの索引を消す
+    void clear();
+    /// @brief tokens（小文字）の候補ファイルの表示パス（索引順）
+    std::vector<std::string> candidates(const std::vector<std::string>& tokens);
+    /// @brief 名前（修飾を除き小文字）が tokens のどれかと一致する定義。表示パスごと、行順
+    std::unordered_map<std::string, std::vector<Symbol>> definitions(const std::vector<std::string>& tokens);
+
+private:
+    enum Kind : uint8_t { Text = 0, Binary = 1, Large = 2 }; // Large は内容を索引せず常に候補にする
+    struct Entry {
+        std::string rel;     // root からの相対パス（generic 形式）
+        int64_t mtime = 0;
+        uint64_t size = 0;
+        uint64_t inode = 0;
+        Kind kind = Text;
+        bool live = true;
+        std::string lpath;   // 表示パスの小文字（メモリ上のみ）
+    };
+    /// @brief 定義表の1行（key の昇順に並べて二分探索する）
+    struct SymbolRow {
+        std::string key;   // symbol_key(sym.name)
+        uint32_t file = 0;
+        Symbol sym;
+    };
+    /// @brief ファイル番号の昇順リスト（差分を LEB128 で詰める）
+    struct Posting {
+        std::string bytes;
+        uint32_t last = 0;
+        uint32_t count = 0;
+    };
+
+    void add_file(const std::string& rel, int64_t mtime, uint64_t size, uint64_t inode);
+    /// @brief stat が索引と違えば読み直す（seen は update() の走査で見たファイルの印）
+    bool refresh_file(const std::string& rel, const std::filesystem::directory_entry& de, std::vector<char>* seen);
+    void remove_file(uint32_t id);
+    void finish_update(std::chrono::steady_clock::time_point t0);
+    void compact();
+    /// @brief 末尾に足された未整列の行だけを並べ、整列済みの先頭と併合する
+    void sort_symbols();
+    static bool row_less(const SymbolRow& a, const SymbolRow& b);
+    std::vector<uint32_t> decode(const Posting& p) const;
+    std::string display_path(const std::string& rel) const;
+
+    std::string root_;
+    std::filesystem::path path_;
+    std::vector<Entry> entries_;
+    std::map<std::string, uint32_t> by_rel_; // 順序付き（ディレクトリ配下を範囲で引く）
+    std::unordered_map<uint32_t, Posting> postings_;
+    std::vector<SymbolRow> symbols_;
+    size_t symbols_sorted_ = 0; // symbols_ の先頭から何行が整列済みか
+    size_t dead_ = 0;
+    IndexStats stats_;
+    std::chrono::steady_clock::time_point updated_at_{};
+    bool updated_ = false;
+    bool loaded_ = false;
+    std::unique_ptr<FileWatcher> watcher_;
+    std::unique_ptr<SourcePathFilter> filter_; // apply() で新しく現れたパスの判定
+};
+
+/// @brief 索引で候補を絞ってから採点する（採点・打ち切りは search_files と同じ）。
+/// トークンを定義しているファイルはトークンごとに +100 し、FileHit::definitions に定義の行範囲を入れる
+SearchResult search_files(TrigramIndex& index, const std::string& query, const SearchOptions& opt = {});
+std::vector<FileHit> find_relevant_files(TrigramIndex& index, const std::string& query, int max_results = 10);
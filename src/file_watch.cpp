@@ -0,0 +1,221 @@
+#include "file_watch.hpp"
+#include "file_finder.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+// これを超えて溜まったら個々のパスは捨てて全走査を求める（git checkout 等の大量変更）
+constexpr size_t kMaxPending = 1 << 16;
+}
+
+struct FileWatcher::Impl {
+    fs::path root;
+    SourcePathFilter filter;
+    mutable mutex mu;          // pending, rescan, last_event
+    set<string> pending;
+    bool rescan = false;
+    chrono::steady_clock::time_point last_event{};
+    atomic<bool> running{false};
+    atomic<bool> degraded{false};
+    atomic<size_t> dirs{0};
+#if defined(__linux__)
+    int fd = -1;
+    int wake[2] = {-1, -1};    // stop() から poll を起こす
+    thread th;
+    // 以下は start() の後は監視スレッドだけが触る
+    unordered_map<int, string> wd_path;
+    unordered_map<string, int> path_wd;
+#endif
+
+    explicit Impl(const string& r) : root(fs::absolute(r)), filter(r) {}
+
+    void note(const string& rel) {
+        lock_guard<mutex> lk(mu);
+        if (rescan) return;
+        pending.insert(rel);
+        last_event = chrono::steady_clock::now();
+        if (pending.size() > kMaxPending) { pending.clear(); rescan = true; }
+    }
+
+    void request_rescan() {
+        lock_guard<mutex> lk(mu);
+        pending.clear();
+        rescan = true;
+        last_event = chrono::steady_clock::now();
+    }
+
+#if defined(__linux__)
+    static constexpr uint32_t kMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+                                    | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+    bool add_watch(const string& rel) {
+        fs::path p = rel.empty() ? root : root / fs::path(rel);
+        int wd = inotify_add_watch(fd, p.c_str(), kMask);
+        if (wd < 0) {
+            // 上限に達したら以降は監視を付けない（定期的な全走査に任せる）
+            if (errno == ENOSPC || errno == ENOMEM) degraded = true;
+            return false;
+        }
+        if (auto it = wd_path.find(wd); it != wd_path.end()) path_wd.erase(it->second);
+        wd_path[wd] = rel;
+        path_wd[rel] = wd;
+        dirs = wd_path.size();
+        return true;
+    }
+
+    // rel 以下の対象ディレクトリに監視を付ける。report なら中のファイルも変更として知らせる（移動してきたディレクトリ）
+    void watch_tree(const string& rel, bool report) {
+        if (degraded || !add_watch(rel)) return;
+        std::error_code ec;
+        fs::path dir = rel.empty() ? root : root / fs::path(rel);
+        for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            string child = rel.empty() ? it->path().filename().generic_string() : rel + "/" + it->path().filename().generic_string();
+            std::error_code sec;
+            if (it->is_directory(sec) && !it->is_symlink(sec)) {
+                if (!filter.excluded(child, true)) watch_tree(child, report);
+            } else if (report && it->is_regular_file(sec)) {
+                note(child);
+            }
+        }
+    }
+
+    void unwatch_tree(const string& rel) {
+        string prefix = rel + "/";
+        for (auto it = path_wd.begin(); it != path_wd.end();) {
+            if (it->first == rel || it->first.compare(0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(fd, it->second);
+                wd_path.erase(it->second);
+                it = path_wd.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        dirs = wd_path.size();
+    }
+
+    void handle(const inotify_event& ev) {
+        if (ev.mask & IN_Q_OVERFLOW) {
+            // 取りこぼしの間に作られたディレクトリにも監視を付け直す
+            request_rescan();
+            watch_tree("", false);
+            return;
+        }
+        if (ev.mask & IN_IGNORED) {
+            if (auto it = wd_path.find(ev.wd); it != wd_path.end()) { path_wd.erase(it->second); wd_path.erase(it); }
+            dirs = wd_path.size();
+            return;
+        }
+        auto it = wd_path.find(ev.wd);
+        if (it == wd_path.end() || ev.len == 0) return;
+        string name = ev.name;
+        string child = it->second.empty() ? name : it->second + "/" + name;
+        if (name == ".gitignore") {
+            // 対象に戻ったディレクトリにも監視を付けてから全走査を求める（走査後の編集を取りこぼさない）。
+            // 付いているディレクトリには add_watch が同じ番号を返す
+            filter.reload();
+            watch_tree("", false);
+            request_rescan();
+            return;
+        }
+        if (ev.mask & IN_ISDIR) {
+            if (ev.mask & (IN_DELETE | IN_MOVED_FROM)) unwatch_tree(child);
+            if ((ev.mask & (IN_CREATE | IN_MOVED_TO)) && !filter.excluded(child, true)) watch_tree(child, true);
+        }
+        note(child);
+    }
+
+    void loop() {
+        alignas(inotify_event) char buf[64 * 1024];
+        pollfd fds[2] = {{fd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        while (running) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents) break;
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) continue;
+            for (ssize_t off = 0; off < n;) {
+                const auto* ev = reinterpret_cast<const inotify_event*>(buf + off);
+                handle(*ev);
+                off += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
+            }
+        }
+    }
+#endif
+};
+
+FileWatcher::FileWatcher(const string& root) : impl_(make_unique<Impl>(root)) {}
+
+FileWatcher::~FileWatcher() { stop(); }
+
+bool FileWatcher::start() {
+#if defined(__linux__)
+    if (impl_->running) return true;
+    trace::Span span("watch.start", "files");
+    Impl& m = *impl_;
+    m.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m.fd < 0) return false;
+    if (pipe(m.wake) != 0) { close(m.fd); m.fd = -1; return false; }
+    m.watch_tree("", false);
+    if (m.wd_path.empty()) { stop(); return false; }
+    m.running = true;
+    m.th = thread([&m]{ m.loop(); });
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FileWatcher::stop() {
+#if defined(__linux__)
+    Impl& m = *impl_;
+    if (m.running.exchange(false)) {
+        char c = 0;
+        ssize_t w = write(m.wake[1], &c, 1);
+        (void)w;
+        m.th.join();
+    }
+    if (m.fd >= 0) { close(m.fd); m.fd = -1; }
+    for (int& f : m.wake) if (f >= 0) { close(f); f = -1; }
+    m.wd_path.clear(); m.path_wd.clear();
+    m.dirs = 0;
+#endif
+}
+
+bool FileWatcher::running() const { return impl_->running; }
+bool FileWatcher::degraded() const { return impl_->degraded; }
+size_t FileWatcher::watched_dirs() const { return impl_->dirs; }
+
+FileWatcher::Changes FileWatcher::take(chrono::milliseconds settle) {
+    Impl& m = *impl_;
+    for (int i = 0; i < 10 && settle.count() > 0; ++i) {
+        {
+            lock_guard<mutex> lk(m.mu);
+            if ((m.pending.empty() && !m.rescan) || chrono::steady_clock::now() - m.last_event >= settle) break;
+        }
+        this_thread::sleep_for(settle);
+    }
+    Changes out;
+    lock_guard<mutex> lk(m.mu);
+    out.paths.assign(m.pending.begin(), m.pending.end());
+    out.rescan = m.rescan;
+    m.pending.clear();
+    m.rescan = false;
+    return out;
+}
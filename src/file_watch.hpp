@@ -0,0 +1,38 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 作業ツリーの変更監視（Linux は inotify。他の環境では start() が false を返し、呼び出し側は定期的な全走査を続ける）
+//
+// 監視スレッドは変わったパスを集合に溜めるだけで、索引への反映は take() を呼ぶ側が行う。
+// 同じパスへの連続した書き込みは1件にまとまる。キューのあふれ・.gitignore の変更は全走査の要求として返す
+
+class FileWatcher {
+public:
+    /// @param root 監視するディレクトリ（対象は for_each_source_file と同じ規則で決める）
+    explicit FileWatcher(const std::string& root);
+    ~FileWatcher();
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    /// @brief root 以下の対象ディレクトリに監視を付けてから監視スレッドを起こす。使えない環境・失敗時は false
+    bool start();
+    void stop();
+    bool running() const;
+    /// @brief 監視数の上限（fs.inotify.max_user_watches）で監視できないディレクトリがある
+    bool degraded() const;
+    size_t watched_dirs() const;
+
+    struct Changes {
+        std::vector<std::string> paths; // root からの相対（ファイルとディレクトリ。昇順・重複なし）
+        bool rescan = false;            // 取りこぼした変更がある → 全走査が必要
+    };
+    /// @brief 溜まった変更を取り出す。直前 settle 以内にイベントがあれば静まるまで少し待つ（最大 10 倍）
+    Changes take(std::chrono::milliseconds settle = std::chrono::milliseconds(20));
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
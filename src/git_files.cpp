@@ -0,0 +1,401 @@
+#include "git_files.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <unordered_set>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+// [...] を text[0] と照合する。p は '[' の次から。一致したかと ']' の次の位置を返す
+bool match_class(string_view p, size_t& pi, char c) {
+    bool negate = pi < p.size() && (p[pi] == '!' || p[pi] == '^');
+    if (negate) ++pi;
+    bool hit = false;
+    size_t start = pi;
+    while (pi < p.size() && (p[pi] != ']' || pi == start)) {
+        char lo = p[pi];
+        if (lo == '\\' && pi + 1 < p.size()) lo = p[++pi];
+        char hi = lo;
+        if (pi + 2 < p.size() && p[pi + 1] == '-' && p[pi + 2] != ']') { hi = p[pi + 2]; pi += 2; }
+        if (c >= lo && c <= hi) hit = true;
+        ++pi;
+    }
+    if (pi < p.size()) ++pi; // ']'
+    return hit != negate;
+}
+
+uint32_t be32(const unsigned char* p) { return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3]; }
+uint16_t be16(const unsigned char* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+
+string read_text(const fs::path& p) {
+    ifstream ifs(p, ios::binary);
+    if (!ifs) return {};
+    ostringstream oss; oss << ifs.rdbuf();
+    return oss.str();
+}
+
+string trim_right(string s) {
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r' || s.back() == ' ')) s.pop_back();
+    return s;
+}
+
+// .git がディレクトリならそれ、"gitdir: <パス>" を書いたファイル（worktree・サブモジュール）なら参照先
+optional<fs::path> git_dir_of(const fs::path& dir) {
+    std::error_code ec;
+    fs::path dot = dir / ".git";
+    if (fs::is_directory(dot, ec)) return dot;
+    if (fs::is_regular_file(dot, ec)) {
+        string s = trim_right(read_text(dot));
+        if (s.rfind("gitdir:", 0) != 0) return nullopt;
+        string g = s.substr(7);
+        g.erase(0, g.find_first_not_of(' '));
+        fs::path gp(g);
+        if (gp.is_relative()) gp = dir / gp;
+        if (fs::is_directory(gp, ec)) return gp;
+    }
+    return nullopt;
+}
+}
+
+bool wildmatch(string_view p, string_view t) {
+    size_t pi = 0, ti = 0;
+    while (pi < p.size()) {
+        char c = p[pi];
+        if (c == '*') {
+            if (pi + 1 < p.size() && p[pi + 1] == '*') {
+                size_t q = pi + 2;
+                bool seg_start = pi == 0 || p[pi - 1] == '/';
+                if (seg_start && q == p.size()) return true; // 末尾の "/**" は残り全部
+                if (seg_start && p[q] == '/') {
+                    // "**/" は 0 個以上のディレクトリ
+                    string_view rest = p.substr(q + 1);
+                    for (size_t k = ti;;) {
+                        if (wildmatch(rest, t.substr(k))) return true;
+                        size_t s = t.find('/', k);
+                        if (s == string_view::npos) return false;
+                        k = s + 1;
+                    }
+                }
+                pi = q - 1; // それ以外の "**" は "*" と同じ
+            }
+            string_view rest = p.substr(pi + 1);
+            for (size_t k = ti;; ++k) {
+                if (wildmatch(rest, t.substr(k))) return true;
+                if (k >= t.size() || t[k] == '/') return false;
+            }
+        }
+        if (ti >= t.size()) return false;
+        if (c == '?') {
+            if (t[ti] == '/') return false;
+        } else if (c == '[') {
+            ++pi;
+            if (t[ti] == '/' || !match_class(p, pi, t[ti])) return false;
+            ++ti;
+            continue;
+        } else {
+            if (c == '\\' && pi + 1 < p.size()) c = p[++pi];
+            if (c != t[ti]) return false;
+        }
+        ++pi; ++ti;
+    }
+    return ti == t.size();
+}
+
+void GitIgnore::add_rules(string_view text, const string& base) {
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t nl = text.find('\n', pos);
+        string line(text.substr(pos, (nl == string_view::npos ? text.size() : nl) - pos));
+        pos = (nl == string_view::npos) ? text.size() + 1 : nl + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        // 末尾の空白は "\ " でなければ無視
+        while (!line.empty() && line.back() == ' ' && !(line.size() >= 2 && line[line.size() - 2] == '\\')) line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        Rule r;
+        r.base = base;
+        if (line[0] == '!') { r.negate = true; line.erase(0, 1); }
+        else if (line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#')) line.erase(0, 1);
+        if (!line.empty() && line.back() == '/') { r.dir_only = true; line.pop_back(); }
+        if (line.empty()) continue;
+        if (line[0] == '/') { r.anchored = true; line.erase(0, 1); }
+        else if (line.find('/') != string::npos) r.anchored = true;
+        r.pattern = std::move(line);
+        rules_.push_back(std::move(r));
+    }
+}
+
+void GitIgnore::add_file(const fs::path& file, const string& base) {
+    std::error_code ec;
+    if (!fs::is_regular_file(file, ec)) return;
+    add_rules(read_text(file), base);
+}
+
+bool GitIgnore::ignored(string_view rel, bool is_dir) const {
+    // 最後に一致した規則が勝つので後ろから見る
+    for (auto it = rules_.rbegin(); it != rules_.rend(); ++it) {
+        const Rule& r = *it;
+        if (r.dir_only && !is_dir) continue;
+        if (rel.size() < r.base.size() || rel.compare(0, r.base.size(), r.base) != 0) continue;
+        string_view sub = rel.substr(r.base.size());
+        bool hit;
+        if (r.anchored) {
+            hit = wildmatch(r.pattern, sub);
+        } else {
+            size_t slash = sub.rfind('/');
+            hit = wildmatch(r.pattern, slash == string_view::npos ? sub : sub.substr(slash + 1));
+        }
+        if (hit) return !r.negate;
+    }
+    return false;
+}
+
+bool read_git_index(const fs::path& index_path, vector<string>& paths, size_t hash_size, string* err) {
+    auto fail = [&](const string& m) { if (err) *err = m; return false; };
+    MappedFile mf;
+    string merr;
+    if (!mf.open(index_path.string(), &merr)) return fail(merr);
+    const auto* d = reinterpret_cast<const unsigned char*>(mf.data());
+    size_t n = mf.size();
+    if (n < 12 || memcmp(d, "DIRC", 4) != 0) return fail("not a git index");
+    uint32_t version = be32(d + 4), count = be32(d + 8);
+    if (version < 2 || version > 4) return fail("unsupported index version " + to_string(version));
+    const size_t fixed = 40 + hash_size + 2; // ctime..size (40) + ハッシュ + flags
+    size_t pos = 12;
+    string prev;
+    paths.clear();
+    paths.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        size_t start = pos;
+        if (pos + fixed > n) return fail("truncated index");
+        uint32_t mode = be32(d + pos + 24);
+        uint16_t flags = be16(d + pos + 40 + hash_size);
+        pos += fixed;
+        bool skip_worktree = false;
+        if (flags & 0x4000) { // 拡張フラグ（v3 以降）
+            if (version < 3 || pos + 2 > n) return fail("bad extended flags");
+            skip_worktree = (be16(d + pos) & 0x4000) != 0;
+            pos += 2;
+        }
+        string name;
+        if (version == 4) {
+            // 直前のパスの末尾から N バイト削り、続く文字列を足す（N は git の可変長整数）
+            size_t strip = 0;
+            if (pos >= n) return fail("truncated index");
+            unsigned char c = d[pos++];
+            strip = c & 0x7F;
+            while (c & 0x80) {
+                if (pos >= n) return fail("truncated index");
+                c = d[pos++];
+                strip = ((strip + 1) << 7) | (c & 0x7F);
+            }
+            if (strip > prev.size()) return fail("bad path prefix");
+            const void* z = memchr(d + pos, 0, n - pos);
+            if (!z) return fail("truncated index");
+            size_t len = static_cast<const unsigned char*>(z) - (d + pos);
+            name = prev.substr(0, prev.size() - strip);
+            name.append(reinterpret_cast<const char*>(d + pos), len);
+            pos += len + 1;
+        } else {
+            const void* z = memchr(d + pos, 0, n - pos);
+            if (!z) return fail("truncated index");
+            size_t len = static_cast<const unsigned char*>(z) - (d + pos);
+            name.assign(reinterpret_cast<const char*>(d + pos), len);
+            pos += len + 1;
+            // エントリ全体が 8 バイト境界になるよう NUL で埋められている
+            size_t entry = pos - start;
+            pos = start + ((entry + 7) & ~size_t(7));
+            if (pos > n) return fail("truncated index");
+        }
+        prev = name;
+        uint32_t type = mode & 0170000;
+        bool file = type == 0100000 || type == 0120000; // 通常ファイルとシンボリックリンク（サブモジュール・sparse ディレクトリは除く）
+        int stage = (flags >> 12) & 3;
+        if (!file || skip_worktree) continue;
+        // 競合中は同じパスが stage 1〜3 で並ぶ
+        if (stage != 0 && !paths.empty() && paths.back() == name) continue;
+        paths.push_back(std::move(name));
+    }
+    // 拡張: split index（"link"）は本体に全エントリが無いので扱えない
+    while (pos + 8 <= n - min(n, hash_size)) {
+        if (memcmp(d + pos, "link", 4) == 0) return fail("split index is not supported");
+        pos += 8 + static_cast<size_t>(be32(d + pos + 4));
+    }
+    return true;
+}
+
+namespace {
+struct Repo {
+    fs::path root;   // 作業ツリーの最上位
+    fs::path git_dir;
+    fs::path common; // worktree では info/exclude と config は共通ディレクトリにある
+    size_t hash_size = 20;
+};
+
+// abs から上へ辿って作業ツリーの最上位を探す
+optional<Repo> locate_repo(const fs::path& abs) {
+    Repo r;
+    r.root = abs;
+    optional<fs::path> git_dir;
+    for (;;) {
+        if ((git_dir = git_dir_of(r.root))) break;
+        if (!r.root.has_parent_path() || r.root.parent_path() == r.root) return nullopt;
+        r.root = r.root.parent_path();
+    }
+    r.git_dir = r.common = *git_dir;
+    if (string c = trim_right(read_text(*git_dir / "commondir")); !c.empty()) {
+        fs::path cp(c);
+        r.common = cp.is_relative() ? *git_dir / cp : cp;
+    }
+    string config = read_text(r.common / "config");
+    transform(config.begin(), config.end(), config.begin(), ::tolower);
+    r.hash_size = config.find("objectformat = sha256") != string::npos ? 32 : 20;
+    return r;
+}
+
+fs::path absolute_dir(const fs::path& base) {
+    std::error_code ec;
+    fs::path abs = fs::weakly_canonical(fs::absolute(base, ec), ec);
+    if (ec || !fs::is_directory(abs, ec)) return {};
+    return abs;
+}
+}
+
+optional<GitFileList> list_git_files(const fs::path& base) {
+    trace::Span span("list_git_files", "files");
+    std::error_code ec;
+    fs::path abs = absolute_dir(base);
+    if (abs.empty()) return nullopt;
+    auto repo = locate_repo(abs);
+    if (!repo) return nullopt;
+    const fs::path& root = repo->root;
+    const fs::path& common = repo->common;
+
+    vector<string> tracked;
+    if (!read_git_index(repo->git_dir / "index", tracked, repo->hash_size)) {
+        // まだ何もコミット・追加していない作業ツリーには index が無い
+        if (fs::exists(repo->git_dir / "index", ec)) return nullopt;
+        tracked.clear();
+    }
+
+    GitFileList out;
+    out.root = root;
+    string prefix = abs == root ? string() : abs.lexically_relative(root).generic_string() + "/";
+    for (auto& p : tracked) {
+        if (p.compare(0, prefix.size(), prefix) != 0) continue;
+        out.files.push_back(p.substr(prefix.size()));
+    }
+    out.tracked = out.files.size();
+    unordered_set<string> known(tracked.begin(), tracked.end());
+
+    // 未追跡: 最上位から base までの .gitignore を積んでから、除外されないディレクトリだけを辿る
+    GitIgnore ignore;
+    ignore.add_file(common / "info" / "exclude");
+    ignore.add_file(root / ".gitignore");
+    {
+        string acc;
+        for (const auto& part : fs::path(prefix).lexically_normal()) {
+            string s = part.generic_string();
+            if (s.empty()) continue;
+            acc += s + "/";
+            if (ignore.ignored(acc.substr(0, acc.size() - 1), true)) return out; // base 自体が除外されている
+            ignore.add_file(root / acc / ".gitignore", acc);
+        }
+    }
+    // (絶対パス, 作業ツリーからの相対 "a/b/")
+    function<void(const fs::path&, const string&)> walk = [&](const fs::path& dir, const string& rel) {
+        size_t mark = ignore.size();
+        if (!rel.empty() && rel != prefix) ignore.add_file(dir / ".gitignore", rel);
+        std::error_code wec;
+        for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, wec), end; !wec && it != end; it.increment(wec)) {
+            const fs::directory_entry& e = *it;
+            string name = e.path().filename().string();
+            string child = rel + name;
+            std::error_code sec;
+            if (e.is_directory(sec)) {
+                if (name == ".git" || e.is_symlink(sec)) continue;
+                // 入れ子の別リポジトリ（サブモジュール等）は辿らない
+                if (fs::exists(e.path() / ".git", sec)) continue;
+                if (ignore.ignored(child, true)) continue;
+                walk(e.path(), child + "/");
+                continue;
+            }
+            if (!e.is_regular_file(sec) || known.count(child)) continue;
+            if (ignore.ignored(child, false)) continue;
+            out.files.push_back(child.substr(prefix.size()));
+        }
+        ignore.truncate(mark);
+    };
+    walk(abs, prefix);
+    return out;
+}
+
+optional<GitPathFilter> GitPathFilter::open(const fs::path& base) {
+    fs::path abs = absolute_dir(base);
+    if (abs.empty()) return nullopt;
+    auto repo = locate_repo(abs);
+    if (!repo) return nullopt;
+    GitPathFilter f;
+    f.root_ = repo->root;
+    f.index_path_ = repo->git_dir / "index";
+    f.exclude_path_ = repo->common / "info" / "exclude";
+    f.hash_size_ = repo->hash_size;
+    f.prefix_ = abs == repo->root ? string() : abs.lexically_relative(repo->root).generic_string() + "/";
+    return f;
+}
+
+void GitPathFilter::reload() {
+    dirs_.clear();
+    index_read_ = false;
+}
+
+void GitPathFilter::refresh_tracked() {
+    std::error_code ec;
+    auto stamp = fs::last_write_time(index_path_, ec);
+    if (ec) stamp = {};
+    if (stamp == index_stamp_ && index_read_) return;
+    index_stamp_ = stamp;
+    index_read_ = true;
+    vector<string> paths;
+    tracked_.clear();
+    if (read_git_index(index_path_, paths, hash_size_)) tracked_.insert(paths.begin(), paths.end());
+}
+
+// dir は作業ツリーからの相対で "" か "a/b/" の形。親から順に規則を積み、除外されたディレクトリ以下は読まない
+const GitPathFilter::Dir& GitPathFilter::dir_state(const string& dir) {
+    if (auto it = dirs_.find(dir); it != dirs_.end()) return it->second;
+    Dir d;
+    if (dir.empty()) {
+        d.rules.add_file(exclude_path_);
+        d.rules.add_file(root_ / ".gitignore");
+    } else {
+        string path = dir.substr(0, dir.size() - 1);
+        size_t slash = path.rfind('/');
+        string parent = slash == string::npos ? string() : path.substr(0, slash + 1);
+        string name = path.substr(parent.size());
+        const Dir& up = dir_state(parent);
+        std::error_code ec;
+        d.excluded = up.excluded || name == ".git" || up.rules.ignored(path, true)
+                  || fs::is_symlink(root_ / path, ec)
+                  || fs::exists(root_ / path / ".git", ec); // 入れ子の別リポジトリ
+        d.rules = up.rules;
+        if (!d.excluded) d.rules.add_file(root_ / path / ".gitignore", dir);
+    }
+    return dirs_.emplace(dir, std::move(d)).first->second;
+}
+
+bool GitPathFilter::excluded(const string& rel, bool is_dir) {
+    string full = prefix_ + rel;
+    if (is_dir) return dir_state(full + "/").excluded;
+    refresh_tracked();
+    if (tracked_.count(full)) return false;
+    size_t slash = full.rfind('/');
+    const Dir& d = dir_state(slash == string::npos ? string() : full.substr(0, slash + 1));
+    return d.excluded || d.rules.ignored(full, false);
+}
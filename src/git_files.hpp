@@ -0,0 +1,88 @@
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// git 作業ツリーのファイル列挙（/target と AGENT(S).md の探索用）
+//
+// 追跡中のファイルは .git/index を直接読んで得る（ディレクトリを辿らない）。未追跡のファイルは
+// .gitignore と .git/info/exclude で除外されないディレクトリだけを辿って探す。git を起動はしない
+
+/// @brief gitignore 形式のパターン照合（'*' '?' '[...]' は '/' に一致しない。'**' はディレクトリをまたぐ）
+bool wildmatch(std::string_view pattern, std::string_view text);
+
+/// @brief .gitignore の規則の集まり。後から追加した規則ほど優先（深いディレクトリの .gitignore を後に積む）
+class GitIgnore {
+public:
+    /// @param base 規則を書いたディレクトリ（作業ツリーからの相対、"" か "src/" の形）
+    void add_rules(std::string_view text, const std::string& base = "");
+    /// @brief ファイルがあれば読み込む
+    void add_file(const std::filesystem::path& file, const std::string& base = "");
+    /// @param rel 作業ツリーからの相対パス（generic 形式）
+    bool ignored(std::string_view rel, bool is_dir) const;
+
+    size_t size() const { return rules_.size(); }
+    /// @brief size() の時点まで規則を戻す（ディレクトリを出るとき用）
+    void truncate(size_t n) { if (n < rules_.size()) rules_.resize(n); }
+
+private:
+    struct Rule {
+        std::string pattern;
+        std::string base;
+        bool negate = false;
+        bool dir_only = false;
+        bool anchored = false; // '/' を含む（ベースからのパス全体と照合する）
+    };
+    std::vector<Rule> rules_;
+};
+
+/// @brief .git/index（バージョン 2〜4）から追跡中のパス（作業ツリーからの相対）を読む。
+/// サブモジュール・sparse checkout で作業ツリーに無いもの・split index は扱わない（split index は false）
+bool read_git_index(const std::filesystem::path& index_path, std::vector<std::string>& paths,
+                    size_t hash_size = 20, std::string* err = nullptr);
+
+struct GitFileList {
+    std::filesystem::path root;     // 作業ツリーの最上位
+    std::vector<std::string> files; // base からの相対パス（generic 形式。追跡中 → 未追跡の順）
+    size_t tracked = 0;             // files のうち index から得た数
+};
+
+/// @brief base を含む git 作業ツリーから、base 以下の追跡中ファイルと除外されない未追跡ファイルを列挙する。
+/// git 管理外、または index が読めなければ nullopt（呼び出し側は通常の走査に戻す）
+std::optional<GitFileList> list_git_files(const std::filesystem::path& base);
+
+/// @brief 作業ツリー内の1つのパスが list_git_files の列挙対象かを判定する（ファイル監視で現れたパス用）。
+/// ディレクトリごとの .gitignore は初めて通るときに1度だけ読み、index は更新時刻が変わったときだけ読み直す
+class GitPathFilter {
+public:
+    /// @brief base が git 管理外なら nullopt
+    static std::optional<GitPathFilter> open(const std::filesystem::path& base);
+
+    const std::filesystem::path& root() const { return root_; }
+    /// @param rel base からの相対パス（generic 形式）
+    bool excluded(const std::string& rel, bool is_dir);
+    /// @brief .gitignore が変わったときに読んだ規則を捨てる
+    void reload();
+
+private:
+    struct Dir {
+        GitIgnore rules;       // 最上位からこのディレクトリまでの規則
+        bool excluded = false; // このディレクトリ自体が列挙されない
+    };
+    const Dir& dir_state(const std::string& dir);
+    void refresh_tracked();
+
+    std::filesystem::path root_;
+    std::filesystem::path index_path_;
+    std::filesystem::path exclude_path_;
+    std::string prefix_; // base の作業ツリーからの相対（"" か "sub/"）
+    size_t hash_size_ = 20;
+    std::unordered_map<std::string, Dir> dirs_;
+    std::unordered_set<std::string> tracked_;
+    std::filesystem::file_time_type index_stamp_{};
+    bool index_read_ = false;
+};
@@ -0,0 +1,125 @@
+#include "latency_stats.hpp"
+#include "chat.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+// 2^7 = 128 個の線形サブバケット（後半 64 個が各2冪区間を分割）→ 相対誤差 1/64 未満
+constexpr int kSubBits = 7;
+constexpr uint64_t kSubCount = 1ull << kSubBits;
+constexpr uint64_t kHalf = kSubCount / 2;
+
+int msb_index(uint64_t v) {
+    int n = -1;
+    while (v) { v >>= 1; ++n; }
+    return n;
+}
+}
+
+size_t LatencyHistogram::bucket_index(uint64_t us) {
+    if (us < kSubCount) return static_cast<size_t>(us);
+    int shift = msb_index(us) - (kSubBits - 1);
+    uint64_t sub = us >> shift; // [64, 128)
+    return static_cast<size_t>(kSubCount + static_cast<uint64_t>(shift - 1) * kHalf + (sub - kHalf));
+}
+
+void LatencyHistogram::bucket_range(size_t idx, uint64_t& lower, uint64_t& width) {
+    if (idx < kSubCount) { lower = idx; width = 1; return; }
+    uint64_t j = idx - kSubCount;
+    int shift = static_cast<int>(j / kHalf) + 1;
+    uint64_t sub = j % kHalf + kHalf;
+    lower = sub << shift;
+    width = 1ull << shift;
+}
+
+void LatencyHistogram::record_ms(double ms) {
+    uint64_t us = ms <= 0 ? 0 : static_cast<uint64_t>(ms * 1000.0);
+    size_t idx = bucket_index(us);
+    if (counts_.size() <= idx) counts_.resize(idx + 1, 0);
+    ++counts_[idx];
+    if (count_ == 0 || us < min_us_) min_us_ = us;
+    if (count_ == 0 || us > max_us_) max_us_ = us;
+    ++count_;
+    sum_us_ += static_cast<double>(us);
+}
+
+double LatencyHistogram::percentile_ms(double p) const {
+    if (count_ == 0) return 0;
+    // 少なくとも ceil(p% × n) 個が含まれる最初のバケット
+    uint64_t target = static_cast<uint64_t>(p / 100.0 * static_cast<double>(count_) + 0.999999);
+    target = std::clamp<uint64_t>(target, 1, count_);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= target) {
+            uint64_t lo, w; bucket_range(i, lo, w);
+            double mid = static_cast<double>(lo) + static_cast<double>(w - 1) / 2.0;
+            mid = std::clamp(mid, static_cast<double>(min_us_), static_cast<double>(max_us_));
+            return mid / 1000.0;
+        }
+    }
+    return max_ms();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& o) {
+    if (o.count_ == 0) return;
+    if (counts_.size() < o.counts_.size()) counts_.resize(o.counts_.size(), 0);
+    for (size_t i = 0; i < o.counts_.size(); ++i) counts_[i] += o.counts_[i];
+    min_us_ = count_ ? std::min(min_us_, o.min_us_) : o.min_us_;
+    max_us_ = count_ ? std::max(max_us_, o.max_us_) : o.max_us_;
+    count_ += o.count_;
+    sum_us_ += o.sum_us_;
+}
+
+void SessionStats::record(const string& op, const string& endpoint, const string& model, double ms) {
+    entries_[Key{op, endpoint, model}].hist.record_ms(ms);
+}
+
+void SessionStats::record_tokens(const string& endpoint, const string& model, long tokens, double ms) {
+    if (tokens <= 0 || ms <= 0) return;
+    auto& e = entries_[Key{"chat_total", endpoint, model}];
+    e.tokens += static_cast<uint64_t>(tokens);
+    e.token_ms += ms;
+}
+
+string SessionStats::format_table() const {
+    ostringstream o;
+    o << fixed << setprecision(1);
+    o << "  " << left << setw(11) << "op" << setw(11) << "endpoint" << setw(24) << "model"
+      << right << setw(6) << "n" << setw(10) << "p50(ms)" << setw(10) << "p90(ms)" << setw(10) << "p99(ms)" << setw(10) << "max(ms)" << setw(12) << "decode t/s" << "\n";
+    for (const auto& [k, e] : entries_) {
+        if (e.hist.count() == 0) continue;
+        string model = k.model.size() > 23 ? k.model.substr(0, 20) + "..." : k.model;
+        o << "  " << left << setw(11) << k.op << setw(11) << k.endpoint << setw(24) << (model.empty() ? "-" : model)
+          << right << setw(6) << e.hist.count()
+          << setw(10) << e.hist.percentile_ms(50) << setw(10) << e.hist.percentile_ms(90)
+          << setw(10) << e.hist.percentile_ms(99) << setw(10) << e.hist.max_ms();
+        if (e.token_ms > 0) o << setw(12) << static_cast<double>(e.tokens) * 1000.0 / e.token_ms;
+        else o << setw(12) << "-";
+        o << "\n";
+    }
+    return o.str();
+}
+
+string SessionStats::to_json() const {
+    ostringstream o;
+    o << fixed << setprecision(3);
+    o << "{\n  \"entries\": [\n";
+    bool first = true;
+    for (const auto& [k, e] : entries_) {
+        if (e.hist.count() == 0) continue;
+        if (!first) o << ",\n";
+        first = false;
+        o << "    {\"op\":\"" << json_escape(k.op) << "\",\"endpoint\":\"" << json_escape(k.endpoint) << "\",\"model\":\"" << json_escape(k.model) << "\""
+          << ",\"count\":" << e.hist.count() << ",\"min_ms\":" << e.hist.min_ms() << ",\"mean_ms\":" << e.hist.mean_ms()
+          << ",\"p50_ms\":" << e.hist.percentile_ms(50) << ",\"p90_ms\":" << e.hist.percentile_ms(90)
+          << ",\"p99_ms\":" << e.hist.percentile_ms(99) << ",\"max_ms\":" << e.hist.max_ms();
+        if (e.token_ms > 0) o << ",\"tokens\":" << e.tokens << ",\"decode_tps\":" << static_cast<double>(e.tokens) * 1000.0 / e.token_ms;
+        o << "}";
+    }
+    o << "\n  ]\n}\n";
+    return o.str();
+}
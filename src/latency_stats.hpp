@@ -0,0 +1,77 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// セッション中のレイテンシ分布（HDR 方式の対数線形ヒストグラム）と /stats 用の集計
+
+/// @brief 対数線形バケットのヒストグラム（マイクロ秒単位、相対誤差 1% 未満）
+class LatencyHistogram {
+public:
+    void record_ms(double ms);
+    uint64_t count() const { return count_; }
+    double min_ms() const { return count_ ? static_cast<double>(min_us_) / 1000.0 : 0; }
+    double max_ms() const { return count_ ? static_cast<double>(max_us_) / 1000.0 : 0; }
+    double mean_ms() const { return count_ ? sum_us_ / 1000.0 / static_cast<double>(count_) : 0; }
+    /// @brief p（0〜100）パーセンタイル（バケット中央値で近似）
+    double percentile_ms(double p) const;
+    void merge(const LatencyHistogram& other);
+
+    static size_t bucket_index(uint64_t us);
+    /// @brief バケットの下限と幅（マイクロ秒）
+    static void bucket_range(size_t idx, uint64_t& lower, uint64_t& width);
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t min_us_ = 0;
+    uint64_t max_us_ = 0;
+    double sum_us_ = 0;
+};
+
+/// @brief 操作×エンドポイント×モデル単位のヒストグラム群
+class SessionStats {
+public:
+    struct Key {
+        std::string op;       // probe, list, chat_ttft, chat_total, shell, target, web など
+        std::string endpoint; // ollama, lmstudio, local, duckduckgo など
+        std::string model;
+        bool operator<(const Key& o) const { return std::tie(op, endpoint, model) < std::tie(o.op, o.endpoint, o.model); }
+    };
+    struct Entry {
+        LatencyHistogram hist;
+        uint64_t tokens = 0;  // 生成トークン数（スループット算出用）
+        double token_ms = 0;  // 上記の生成に掛かった時間
+    };
+
+    void record(const std::string& op, const std::string& endpoint, const std::string& model, double ms);
+    /// @brief 生成トークン数と所要時間を加算する（decode tok/s の集計）
+    void record_tokens(const std::string& endpoint, const std::string& model, long tokens, double ms);
+    bool empty() const { return entries_.empty(); }
+    const std::map<Key, Entry>& entries() const { return entries_; }
+    /// @brief p50/p90/p99 とスループットの表
+    std::string format_table() const;
+    std::string to_json() const;
+
+private:
+    std::map<Key, Entry> entries_;
+};
+
+/// @brief スコープを抜けるときに経過時間を記録する
+class ScopedLatency {
+public:
+    ScopedLatency(SessionStats& s, std::string op, std::string endpoint, std::string model = std::string())
+        : stats_(s), op_(std::move(op)), endpoint_(std::move(endpoint)), model_(std::move(model)), t0_(std::chrono::steady_clock::now()) {}
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+    ~ScopedLatency() {
+        stats_.record(op_, endpoint_, model_, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0_).count());
+    }
+private:
+    SessionStats& stats_;
+    std::string op_, endpoint_, model_;
+    std::chrono::steady_clock::time_point t0_;
+};
@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <filesystem>
 #include <cctype>
+#include <iomanip>
 
 #include "utils.hpp"
 #include "system_info.hpp"
@@ -15,6 +16,26 @@
 #include "file_finder.hpp"
 #include "agent_mode.hpp"
 #include "config.hpp"
+#include "perf_profile.hpp"
+#include "model_fit.hpp"
+#include "bench.hpp"
+#include "trace.hpp"
+#include "latency_stats.hpp"
+#include "warmup.hpp"
+#include "router.hpp"
+#include "mapped_file.hpp"
+#include "summarize.hpp"
+#include "session.hpp"
+#include "attachment.hpp"
+#include "file_index.hpp"
+#include "task_pool.hpp"
+#include "text_match.hpp"
+#include "context_pack.hpp"
+#include <mutex>
+#include <fstream>
+#include <ctime>
+#include <chrono>
+#include <set>
 
 using namespace std;
 
@@ -24,11 +45,11 @@ using namespace std;
 
 struct Messages {
     std::string lang = "ja";
-    std::string usage() const { return lang=="en" ? "Usage: agens [-b backend] [-m model] [-p prompt]" : "使い方: agens [-b backend] [-m model] [-p prompt]"; }
-    std::string backend_hint() const { return lang=="en" ? "  backend: ollama|lmstudio" : "  backend: ollama|lmstudio"; }
+    std::string usage() const { return lang=="en" ? "Usage: agens [-b backend] [-m model|auto[:min]] [-p prompt] [--bench [key=value...]] [--summarize path] [--resume [id]] [--bench-files query]" : "使い方: agens [-b backend] [-m model|auto[:最小]] [-p prompt] [--bench [key=value...]] [--summarize パス] [--resume [ID]] [--bench-files キーワード]"; }
+    std::string backend_hint() const { return lang=="en" ? "  backend: ollama|lmstudio|llamacpp" : "  backend: ollama|lmstudio|llamacpp"; }
     std::string starting() const { return lang=="en" ? "Starting local LLM agent. Replies in Japanese." : "ローカルLLMエージェントを起動します。常に日本語で応答します。"; }
-    std::string api_missing1() const { return lang=="en" ? "No local API found for Ollama(11434) or LM Studio(1234)." : "Ollama(11434)またはLM Studio(1234)のローカルAPIが見つかりません。"; }
-    std::string api_missing2() const { return lang=="en" ? "Please start Ollama or LM Studio server and try again." : "OllamaやLM Studioのサーバーを起動してから再度お試しください。"; }
+    std::string api_missing1() const { return lang=="en" ? "No local API found for Ollama(11434), LM Studio(1234) or llama.cpp server(8080)." : "Ollama(11434)、LM Studio(1234)、llama.cpp server(8080)のローカルAPIが見つかりません。"; }
+    std::string api_missing2() const { return lang=="en" ? "Please start Ollama, LM Studio or llama-server and try again." : "Ollama、LM Studio、llama-serverのいずれかを起動してから再度お試しください。"; }
     std::string label_reco() const { return lang=="en" ? "[Recommended]" : "[推奨パラメータ]"; }
     std::string label_sys()  const { return lang=="en" ? "[System]"      : "[システム検出]"; }
     std::string label_ram_about() const { return lang=="en" ? ", RAM~" : ", RAM約"; }
@@ -56,11 +77,27 @@ int main(int argc, char** argv) {
     string prefer_backend; // "ollama" or "lmstudio"
     string prefer_model;
     string one_prompt;
+    bool bench_mode = false;
+    vector<string> bench_args; // --bench に続く key=value
+    string summarize_path;     // --summarize: 要約して終了
+    bool resume = false;       // --resume [ID]: 保存済みセッションを再開
+    string resume_id;
+    string bench_files_query;  // --bench-files: /target の走査をスレッド数ごとに計測して終了
     for (int i=1;i<argc;++i) {
         string a = argv[i];
         if ((a=="-b"||a=="--backend") && i+1<argc) { prefer_backend = argv[++i]; }
         else if ((a=="-m"||a=="--model") && i+1<argc) { prefer_model = argv[++i]; }
         else if ((a=="-p"||a=="--prompt") && i+1<argc) { one_prompt = argv[++i]; }
+        else if (a=="--summarize" && i+1<argc) { summarize_path = argv[++i]; }
+        else if (a=="--bench-files" && i+1<argc) { bench_files_query = argv[++i]; }
+        else if (a=="--resume") {
+            resume = true;
+            if (i+1<argc && argv[i+1][0]!='-') resume_id = argv[++i];
+        }
+        else if (a=="--bench") {
+            bench_mode = true;
+            while (i+1<argc && argv[i+1][0]!='-' && string(argv[i+1]).find('=')!=string::npos) bench_args.push_back(argv[++i]);
+        }
         else if (a=="-h"||a=="--help") {
             cout << msg.usage() << "\n";
             cout << msg.backend_hint() << "\n";
@@ -68,6 +105,18 @@ int main(int argc, char** argv) {
         }
     }
 
+    // AGENS_TRACE=path で trace-event JSON を終了時に書き出す
+    trace::init_from_env();
+
+    // バックエンド不要なので設定の読み込み前に実行する（対象はカレントディレクトリ）
+    if (!bench_files_query.empty()) {
+        cout << "[ファイル走査ベンチ] \"" << bench_files_query << "\"（論理コア " << default_thread_count()
+             << ", " << simd_level_name(detected_simd_level()) << "）\n";
+        auto rows = run_scan_bench(".", bench_files_query, default_scan_threads());
+        cout << format_scan_bench(rows);
+        return std::all_of(rows.begin(), rows.end(), [](const ScanBenchRow& r){ return r.same_ranking; }) ? 0 : 1;
+    }
+
     // 設定ロード
     AppConfig config;
     load_config(config);
@@ -80,6 +129,20 @@ int main(int argc, char** argv) {
     if (!config.last_cwd.empty()) {
         std::error_code ec; std::filesystem::current_path(config.last_cwd, ec);
     }
+    // --resume: 追記ログを mmap で読み込み、バックエンド・モデル・作業ディレクトリを引き継ぐ
+    SessionState resumed;
+    if (resume) {
+        string id = resume_id.empty() ? config.last_session : resume_id;
+        if (id.empty()) { auto ids = list_sessions(); if (!ids.empty()) id = ids[0]; }
+        string err;
+        if (id.empty() || !load_session(session_path(id), resumed, &err)) {
+            cerr << "[エラー] 再開できるセッションがありません" << (err.empty() ? "" : "（" + err + "）") << "\n";
+            return 1;
+        }
+        if (!resumed.cwd.empty()) { std::error_code ec; std::filesystem::current_path(resumed.cwd, ec); }
+        if (prefer_backend.empty()) prefer_backend = resumed.backend;
+        if (prefer_model.empty()) prefer_model = resumed.model;
+    }
 
     // システム検出
     auto si = detect_system_info();
@@ -87,10 +150,10 @@ int main(int argc, char** argv) {
     cout << msg.label_sys() << ' ';
     if (si.is_macos) cout << "macOS"; else if (si.is_linux) cout << "Linux"; else if (si.is_windows) cout << "Windows"; else cout << "Unknown";
     cout << msg.label_ram_about() << (si.ram_bytes/(1024ull*1024ull*1024ull)) << "GB";
+    double unified_ratio = config.unified_gpu_ratio;
+    if (const char* env = getenv("AGENS_UNIFIED_GPU_RATIO")) { try { unified_ratio = stod(env); } catch (...) {} }
+    if (!(unified_ratio>0.0 && unified_ratio<1.0)) unified_ratio = 0.5;
     {
-        double unified_ratio = config.unified_gpu_ratio;
-        if (const char* env = getenv("AGENS_UNIFIED_GPU_RATIO")) { try { unified_ratio = stod(env); } catch (...) {} }
-        if (!(unified_ratio>0.0 && unified_ratio<1.0)) unified_ratio = 0.5;
         if (si.vram_mb>0) {
             cout << ", VRAM約" << (si.vram_mb/1024) << "GB";
         } else if (si.is_macos && si.is_apple_silicon) {
@@ -108,13 +171,22 @@ int main(int argc, char** argv) {
     print_tuning(tune, msg);
     cout.flush();
 
+    // セッション中のレイテンシ統計（/stats）
+    SessionStats session_stats;
+    auto print_exit_stats = [&](){
+        if (config.stats_on_exit && !session_stats.empty()) cout << "[統計]\n" << session_stats.format_table();
+    };
+
     // バックエンド検出
     default_ports::Http http;
-    bool has_ollama = backend::ollama::probe(http);
-    bool has_lms = backend::lmstudio::probe(http);
+    bool has_ollama = false, has_lms = false, has_llamacpp = false;
+    { ScopedLatency l(session_stats, "probe", "ollama"); has_ollama = backend::ollama::probe(http); }
+    { ScopedLatency l(session_stats, "probe", "lmstudio"); has_lms = backend::lmstudio::probe(http); }
+    { ScopedLatency l(session_stats, "probe", "llamacpp"); has_llamacpp = backend::llamacpp::probe(http); }
     vector<string> backends;
     if (has_ollama) backends.push_back("ollama");
     if (has_lms) backends.push_back("lmstudio");
+    if (has_llamacpp) backends.push_back("llamacpp");
     if (backends.empty()) {
         cout << msg.api_missing1() << "\n";
         cout << msg.api_missing2() << "\n";
@@ -148,17 +220,60 @@ int main(int argc, char** argv) {
 
     // モデル一覧
     vector<string> models;
-    if (backend=="ollama") models = backend::ollama::list_models(http);
-    else models = backend::lmstudio::list_models(http);
+    {
+        ScopedLatency l(session_stats, "list", backend);
+        models = backend::list_models(backend, http);
+    }
+
+    // 実測プロファイル（マシン×モデル）。起動時に古いサンプルを落として書き直す
+    const auto perf_path = default_perf_profile_path();
+    const string machine_id = machine_fingerprint(si);
+    PerfStore perf_store;
+    load_perf_store(perf_store, perf_path);
+    save_perf_store(perf_store, perf_path);
+
+    // インストール済みモデルをこのマシンでの当てはまり（全層GPU/一部CPU/CPUのみ）と速度で順位付けする
+    auto rank_installed = [&](){
+        auto infos = backend::list_model_infos(backend, http);
+        return rank_models(si, infos, unified_ratio, [&](const string& m){
+            const PerfProfile* p = perf_store.find(machine_id, m);
+            return (p && !p->empty()) ? p->decode_tps_at(tune.context) : 0.0;
+        });
+    };
 
     string model;
-    if (!prefer_model.empty()) {
+    if (prefer_model=="auto" || prefer_model.rfind("auto:",0)==0) {
+        // --model auto[:8b] 下限（パラメータ数）を満たす中で最も良いものを選ぶ
+        AutoModelFloor fl;
+        fl.min_params = config.auto_min_params_b * 1e9;
+        fl.min_tps = config.auto_min_tps;
+        if (prefer_model.size() > 5) {
+            double p = parse_parameter_size(prefer_model.substr(5));
+            if (p <= 0) { cerr << "[エラー] --model auto:<最小サイズ>（例: auto:7b）\n"; return 1; }
+            fl.min_params = p;
+        }
+        auto ranks = rank_installed();
+        auto best = pick_auto_model(ranks, fl);
+        if (!best) { cerr << "[エラー] 条件を満たすモデルがありません。\n" << format_model_ranking(ranks, ""); return 1; }
+        model = best->info.name;
+        cout << "[自動選択] " << model << "（" << fit_class_label(best->cls) << ", "
+             << (best->measured ? "実測 " : "推定 ") << static_cast<int>(best->est_decode_tps) << " tok/s）\n";
+    } else if (!prefer_model.empty()) {
         model = prefer_model;
     } else if (!config.last_model.empty()) {
         model = config.last_model;
     } else if (!models.empty()) {
-        cout << "利用可能なモデル:\n";
-        for (size_t i=0;i<models.size();++i) cout << "  ["<<(i+1)<<"] "<<models[i]<<"\n";
+        // 初回は推奨順に並べ、空Enterで最上位（このマシンで快適に動くもの）を選ぶ
+        // 埋め込みモデル等の順位付けできないものは推奨順の後ろに並べる
+        vector<ModelRank> ranked;
+        models = order_models_by_rank(rank_installed(), models, &ranked);
+        if (!ranked.empty()) {
+            cout << "利用可能なモデル（推奨順）:\n" << format_model_ranking(ranked, "");
+            for (size_t i=ranked.size();i<models.size();++i) cout << "  ["<<(i+1)<<"] "<<models[i]<<"\n";
+        } else {
+            cout << "利用可能なモデル:\n";
+            for (size_t i=0;i<models.size();++i) cout << "  ["<<(i+1)<<"] "<<models[i]<<"\n";
+        }
         cout << "> モデル番号を選択（空Enterで1番）: ";
         string s; getline(cin, s); 
         size_t idx = 1;
@@ -180,6 +295,68 @@ int main(int argc, char** argv) {
         cerr << "モデル名が空です。終了します。\n"; return 1;
     }
     cout << "モデル: " << model << "\n";
+    remember_recent_model(config, model); save_config(config);
+    tune.keep_alive = config.keep_alive;
+    // 対話モードではモデルのロードを入力待ちの間に済ませる（ベンチは cold 計測を崩すので除外）
+    BackgroundWarmer warmer;
+    auto warm_model = [&](const string& m){
+        if (!config.warmup || bench_mode || !one_prompt.empty() || !summarize_path.empty()) return false;
+        string b = backend, ka = tune.keep_alive;
+        return warmer.start(m, [&http, b, m, ka]{ return backend::warmup(b, http, m, ka); });
+    };
+    warm_model(model);
+    if (config.route_enabled && !config.route_small.empty()) warm_model(config.route_small);
+
+    // llama.cpp server: セッションを空きスロットに固定し、前ターンの KV キャッシュを再利用させる
+    auto slot_file = [&](){
+        string f = "agens-" + model + ".bin";
+        for (auto& c : f) if (!isalnum(static_cast<unsigned char>(c)) && c!='.' && c!='-') c = '_';
+        return f;
+    };
+    if (backend=="llamacpp") {
+        if (auto slots = backend::llamacpp::list_slots(http)) {
+            if (auto id = backend::llamacpp::pick_idle_slot(*slots)) {
+                tune.slot_id = *id;
+                cout << "[スロット] id_slot=" << *id << " に固定（全 " << slots->size() << " スロット）\n";
+            }
+        }
+    }
+
+    // 常駐モデル（/api/ps）。一部オフロードで decode が数倍遅くなるのを見逃さないよう、切替後の初回応答で確認する
+    string residency_checked;
+    auto check_residency = [&](){
+        residency_checked = model;
+        optional<vector<ResidentModel>> rs;
+        {
+            ScopedLatency l(session_stats, "ps", backend);
+            rs = backend::list_running(backend, http);
+        }
+        if (!rs) return;
+        if (const ResidentModel* r = find_resident(*rs, model)) {
+            auto w = format_offload_warning(*r);
+            if (!w.empty()) cout << w << "\n";
+        }
+    };
+    auto unload_model = [&](const string& m){
+        warmer.forget(m);
+        bool ok = backend::unload(backend, http, m);
+        cout << (ok ? "[解放] " : "[解放失敗] ") << m << "\n";
+        return ok;
+    };
+    // 切替前に、新しいモデル以外の常駐モデルを解放するか確認する（Ollama のみ）
+    auto offer_unload_idle = [&](const string& next){
+        if (backend != "ollama") return;
+        auto rs = backend::list_running(backend, http);
+        if (!rs) return;
+        auto idle = idle_residents(*rs, next);
+        if (idle.empty()) return;
+        cout << "[常駐中]\n" << format_residency_table(*rs, model);
+        cout << "[確認] 切替前に " << idle.size() << " 個の常駐モデルを解放しますか？ [y/N]: ";
+        string yn; if (!getline(cin, yn)) { cin.clear(); return; }
+        auto t = utils::trim(yn); transform(t.begin(), t.end(), t.begin(), ::tolower);
+        if (t!="y" && t!="yes") return;
+        for (const auto& m : idle) unload_model(m);
+    };
     // 設定反映
     bool auto_mode = false;
     bool auto_confirm = config.auto_confirm;
@@ -192,26 +369,383 @@ int main(int argc, char** argv) {
     }
 
     // システムプロンプト（常に日本語で応答）
-    string system_jp = "あなたは有能なローカルAIアシスタントです。常に日本語で、簡潔かつ丁寧に回答してください。";
+    // /auto では AGENT(S).md を含み大きくなるため、共有バッファに1度だけ置いてターンごとに複製しない
+    const string default_system = "あなたは有能なローカルAIアシスタントです。常に日本語で、簡潔かつ丁寧に回答してください。";
+    ChatMsg system_msg(Role::System, default_system);
+    long system_tokens = estimate_tokens(default_system);
+    auto set_system = [&](string text){
+        system_tokens = estimate_tokens(text);
+        system_msg = ChatMsg(Role::System, std::move(text));
+    };
+    // 会話履歴（user/assistant の組）と、その追記ログ
+    vector<ChatMsg> history;
+    SessionLog session_log;
+    // /attach した添付ファイル（mmap のまま、システムメッセージの後ろへ毎ターン送る）
+    AttachmentList attachments;
+    // /target 用のトライグラム索引（作業ディレクトリごと。初回の /target で読み込む）
+    std::unique_ptr<TrigramIndex> file_index;
+    string file_index_cwd;
+    auto print_index_stats = [&](const IndexStats& st) {
+        cout << std::fixed << std::setprecision(1) << "[索引] ファイル " << st.files;
+        if (st.load_ms >= 0) cout << ", 読込 " << st.load_ms << " ms";
+        if (st.update_ms >= 0) cout << ", 更新 " << st.update_ms << " ms（+" << st.added << " ~" << st.changed << " -" << st.removed << "）";
+        if (st.symbols > 0) cout << ", 定義 " << st.symbols;
+        if (st.query_ms >= 0) cout << ", 検索 " << st.query_ms << " ms, 候補 " << st.candidates;
+        cout << ", 全走査 " << st.rescans << " 回";
+        if (st.watched_dirs > 0) cout << ", 監視 " << st.watched_dirs << " ディレクトリ";
+        cout << std::defaultfloat << "\n";
+    };
+    // 作業ディレクトリが変わっていれば作り直す。以後は監視で変わったパスだけ、監視できなければ30秒ごとに stat で差分更新する
+    // cancel・deadline で打ち切った作成途中の索引は保存しない
+    auto ensure_index = [&](const std::atomic<bool>* cancel = nullptr, chrono::steady_clock::time_point deadline = {}) -> TrigramIndex& {
+        std::error_code ec;
+        string cwd = filesystem::current_path(ec).string();
+        if (!file_index || file_index_cwd != cwd) {
+            file_index = std::make_unique<TrigramIndex>(".");
+            file_index_cwd = cwd;
+            file_index->load();
+            if (config.file_watch) file_index->watch();
+        }
+        if (file_index->refresh(30, cancel, deadline) && file_index->ready()) file_index->save();
+        return *file_index;
+    };
+    // /target・/ask --ctx の検索。索引の更新に使うのは予算の半分までで、
+    // 初回の作成が間に合わなければ残りの予算で索引なしに走査する（作成の続きは次の検索で）
+    auto search_tree = [&](const string& q, SearchOptions so) -> SearchResult {
+        if (!config.file_index) return search_files(".", q, so);
+        auto started = chrono::steady_clock::now();
+        chrono::steady_clock::time_point deadline{};
+        if (so.budget.count() > 0) deadline = started + so.budget / 2;
+        TrigramIndex& idx = ensure_index(so.cancel, deadline);
+        if (so.budget.count() > 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(started + so.budget - chrono::steady_clock::now());
+            so.budget = max(left, chrono::milliseconds(1));
+        }
+        return idx.ready() ? search_files(idx, q, so) : search_files(".", q, so);
+    };
+    // AGENT(S).md は索引が有効なら索引中のファイル一覧から探す（ツリーを辿り直さない）
+    auto locate_agent_docs = [&]() {
+        if (config.file_index) return find_agent_docs(".", ensure_index().files());
+        return find_agent_docs(".");
+    };
+
+    // モデル情報（/api/show 等）から KV キャッシュ込みで収まる context/gpu_layers を決める
+    InferenceTuning base_tune = tune; // システム＋モデルから決めた既定値（/tune static で戻す先）
+    optional<int> ctx_override, max_override; // /ctx・/max で明示した値（/tune static でも残す）
+    int model_ctx_cap = 0;            // モデルとメモリ量から見た context の上限（0=不明）
+    auto fit_current_model = [&](){
+        InferenceTuning b = decide_tuning(si);
+        b.temperature = tune.temperature; b.top_p = tune.top_p;
+        model_ctx_cap = 0;
+        optional<ModelInfo> mi = backend::show_model(backend, http, model);
+        if (mi) {
+            ModelInfo full = *mi; fill_missing_dims(full);
+            auto fit = fit_model(si, full, unified_ratio);
+            b = apply_model_fit(b, fit);
+            model_ctx_cap = fit.context;
+            cout << "[モデル情報] " << model << ": ";
+            if (full.parameter_count > 0) cout << fixed << setprecision(1) << full.parameter_count/1e9 << "B" << defaultfloat << setprecision(6);
+            if (!full.quantization.empty()) cout << ", " << full.quantization;
+            cout << ", " << full.n_layers << "層";
+            if (mi->context_length > 0) cout << ", 最大ctx " << mi->context_length;
+            cout << ", 重み約" << fixed << setprecision(1) << fit.weight_bytes/1073741824.0 << "GB" << defaultfloat << setprecision(6)
+                 << ", KV " << fit.kv_per_token/1024 << "KB/token"
+                 << " → context=" << fit.context << ", gpu_layers=" << fit.gpu_layers
+                 << (fit.fully_offloaded ? "（全層GPU）" : fit.gpu_layers>0 ? "（一部CPU）" : "（CPUのみ）") << "\n";
+        }
+        base_tune = b;
+        tune.context = b.context; tune.max_tokens = b.max_tokens; tune.gpu_layers = b.gpu_layers; tune.model_fitted = b.model_fitted;
+        if (mi) print_tuning(tune, msg);
+    };
+    fit_current_model();
+
+    // 投機的デコード: 設定からドラフトモデルと提案パラメータを反映（"auto" は同系列の小さいモデルを探す）
+    auto resolve_draft = [&](bool verbose){
+        tune.draft_model.clear();
+        tune.draft_max = config.draft_max; tune.draft_min = config.draft_min; tune.draft_p_min = config.draft_p_min;
+        if (config.draft_model.empty() || backend != "lmstudio") return;
+        if (config.draft_model != "auto") { tune.draft_model = config.draft_model; return; }
+        auto infos = backend::list_model_infos(backend, http);
+        ModelInfo target; target.name = model;
+        for (const auto& mi : infos) if (mi.name == model) target = mi;
+        auto d = pick_draft_model(target, infos);
+        if (d) tune.draft_model = *d;
+        if (verbose) cout << "[ドラフト] " << (d ? *d : string("同系列の小さいモデルが見つかりません")) << "\n";
+    };
+    resolve_draft(true);
+
+    // /tune auto: 実測値と目標レイテンシから context/max_tokens を選び直す（温度等は維持）
+    auto retune = [&](bool verbose){
+        auto t = decide_tuning(si, perf_store.at(machine_id, model), config.latency_target_ms, model_ctx_cap);
+        if (t.context==tune.context && t.max_tokens==tune.max_tokens) return;
+        tune.context = t.context; tune.max_tokens = t.max_tokens;
+        if (verbose) cout << "[自動調整] context=" << tune.context << ", max_tokens=" << tune.max_tokens << "\n";
+    };
+    if (config.tune_auto) retune(true);
+
+    // ベンチマーク（/bench, --bench）。結果は CSV/JSON に書き出し、実測プロファイルにも記録する
+    auto run_bench_cmd = [&](const vector<string>& args)->bool{
+        BenchOptions bo;
+        string err;
+        if (!parse_bench_args(args, bo, &err)) { cout << "[エラー] " << err << "\n"; return false; }
+        if (bo.out_prefix.empty()) {
+            std::time_t now = std::time(nullptr);
+            ostringstream ts; ts << put_time(std::localtime(&now), "%Y%m%d-%H%M%S");
+            bo.out_prefix = (default_config_path().parent_path() / "bench" / ("bench-" + ts.str())).string();
+        }
+        cout << "[ベンチ] " << backend << " / " << model << "（warm " << bo.warm_iterations << "回, cold " << bo.cold_iterations << "回）\n";
+        auto samples = run_bench(bo, tune,
+            [&](const vector<ChatMsg>& msgs, const InferenceTuning& t){ return backend::chat(backend, http, model, msgs, t); },
+            [&](){ return backend::unload(backend, http, model); },
+            [&](const BenchSample& bs){
+                cout << "  ctx=" << bs.context << " prompt~" << bs.prompt_tokens << (bs.cold?" cold":" warm") << " #" << bs.iteration+1 << ": ";
+                if (!bs.ok) { cout << "失敗\n"; cout.flush(); return; }
+                cout << format_stats_line(bs.stats) << "\n";
+                cout.flush();
+                PerfSample ps;
+                if (make_perf_sample(bs.stats, bs.context, ps)) {
+                    perf_store.at(machine_id, model).add(ps);
+                    append_perf_sample(perf_path, machine_id, model, ps);
+                }
+            });
+        if (samples.empty()) { cout << "[ベンチ] 実行できる組み合わせがありません（prompt+max が ctx を超えています）\n"; return false; }
+        auto summary = summarize_bench(samples);
+        cout << format_bench_table(summary);
+        std::error_code ec; filesystem::create_directories(filesystem::path(bo.out_prefix).parent_path(), ec);
+        ofstream(bo.out_prefix + ".csv", ios::binary) << bench_to_csv(samples);
+        ofstream(bo.out_prefix + ".json", ios::binary) << bench_to_json(backend, model, machine_id, summary, samples);
+        cout << "[ベンチ] 保存: " << bo.out_prefix << ".csv, " << bo.out_prefix << ".json\n";
+        bool any_ok = any_of(samples.begin(), samples.end(), [](const BenchSample& bs){ return bs.ok; });
+        if (any_ok && config.tune_auto) retune(true);
+        return any_ok;
+    };
+    if (bench_mode) return run_bench_cmd(bench_args) ? 0 : 2;
 
     // 単発プロンプト or REPL
-    auto do_chat_once = [&](const string& user)->optional<string>{
-        vector<ChatMsg> msgs = {{"system", system_jp}, {"user", user}};
-        if (backend=="ollama") return backend::ollama::chat(http, model, msgs, tune);
-        return backend::lmstudio::chat(http, model, msgs, tune);
+    auto do_chat_with = [&](const string& m, const string& user)->optional<ChatResult>{
+        InferenceTuning t = tune;
+        // 添付は更新時刻が変わったものだけ読み直す。KV キャッシュの接頭辞が変わらないようシステムメッセージに続けて置く
+        ChatMsg sys = system_msg;
+        long attach_tokens = 0;
+        if (!attachments.empty()) {
+            for (auto it = attachments.begin(); it != attachments.end();) {
+                bool changed = false;
+                string err;
+                auto fresh = refresh_attachment(*it, &changed, &err);
+                if (!fresh) {
+                    // 古いマップは切り詰められている恐れがあるので送らずに外す
+                    cout << "[警告] 添付を外しました: " << err << "\n";
+                    if (session_log.written()) session_log.detach((*it)->path());
+                    it = attachments.erase(it);
+                    continue;
+                }
+                if (changed) cout << "[添付] 再読込: " << fresh->path() << "\n";
+                *it++ = std::move(fresh);
+            }
+        }
+        if (!attachments.empty()) {
+            sys.attachments = attachments;
+            attach_tokens = attachment_tokens(attachments);
+            cout << "[添付] " << attachments.size() << " 件 ~" << attach_tokens << " トークン";
+            if (attach_tokens + system_tokens + t.max_tokens > t.context) cout << "（context=" << t.context << " を超えます。/attach rm で外すか /ctx を増やしてください）";
+            cout << "\n";
+        }
+        // 履歴は応答分を残してコンテキストに収まる直近のみ送る
+        long budget = static_cast<long>(t.context) - t.max_tokens - system_tokens - attach_tokens - estimate_tokens(user);
+        vector<ChatMsg> msgs = fit_history(history, budget);
+        msgs.insert(msgs.begin(), std::move(sys));
+        msgs.emplace_back(Role::User, user);
+        // 現在のモデル向けに算出したオフロード層数・ドラフトは別モデルへ流用しない
+        if (m != model) { t.gpu_layers = -1; t.model_fitted = false; t.draft_model.clear(); }
+        optional<ChatResult> r = backend::chat(backend, http, m, msgs, t);
+        if (r) {
+            if (r->stats.ttft_ms() >= 0) session_stats.record("chat_ttft", backend, m, r->stats.ttft_ms());
+            if (r->stats.client_ms >= 0) session_stats.record("chat_total", backend, m, r->stats.client_ms);
+            session_stats.record_tokens(backend, m, r->stats.completion_tokens, r->stats.completion_ms);
+        }
+        PerfSample ps;
+        // ドラフト使用時の decode 速度はベースライン（高速化率の比較対象）に混ぜない
+        if (r && r->stats.draft_tokens <= 0 && make_perf_sample(r->stats, t.context, ps)) {
+            perf_store.at(machine_id, m).add(ps);
+            append_perf_sample(perf_path, machine_id, m, ps);
+        }
+        return r;
+    };
+
+    // カスケードルーティング: 振り分け結果と、large で答えた場合との差（推定）を記録する
+    auto route_config = [&](){
+        RouteConfig rc;
+        rc.enabled = config.route_enabled;
+        rc.small_model = config.route_small;
+        rc.large_model = config.route_large;
+        rc.max_small_tokens = static_cast<long>(config.route_max_small_tokens);
+        return rc;
+    };
+    const auto route_log_path = default_route_log_path();
+    RouteTally route_tally;
+    // /escalate 用。last_prompt は送った本文（/ask --ctx なら参照コード付き）、last_question は履歴に残した質問
+    string last_prompt, last_question;
+    auto log_route = [&](const RouteDecision& d, const optional<ChatResult>& r){
+        if (!config.route_enabled) return;
+        double actual = r ? r->stats.client_ms : -1;
+        double est = -1;
+        if (d.small && r) {
+            const string large = config.route_large.empty() ? model : config.route_large;
+            long pt = r->stats.prompt_tokens > 0 ? r->stats.prompt_tokens : d.prompt_tokens;
+            est = estimate_chat_ms(perf_store.find(machine_id, large), tune.context, pt, max(0L, r->stats.completion_tokens));
+        }
+        optional<double> saved;
+        if (est >= 0 && actual >= 0) saved = est - actual;
+        route_tally.add(d, saved);
+        append_route_log(route_log_path, d, actual, est);
+        cout << "[ルート] " << d.model << "（" << d.reason;
+        if (saved) cout << "、推定 " << fixed << setprecision(1) << *saved/1000.0 << " 秒短縮" << defaultfloat << setprecision(6);
+        cout << "）\n";
+    };
+    // ドラフト使用時の採択率と、実測ベースラインに対する decode 高速化率
+    auto print_draft_report = [&](const GenerationStats& st){
+        double acc = st.draft_acceptance();
+        if (acc < 0) return;
+        cout << "[投機的デコード] 採択率 " << fixed << setprecision(0) << acc * 100 << "%";
+        const PerfProfile* base = perf_store.find(machine_id, model);
+        double b = base ? base->decode_tps_at(tune.context) : 0;
+        if (b > 0 && st.decode_tps() > 0) cout << ", decode " << st.decode_tps() << " tok/s（通常 " << b << " tok/s の " << setprecision(2) << st.decode_tps() / b << " 倍）";
+        cout << defaultfloat << setprecision(6) << "\n";
+    };
+    // question は履歴に残す質問（省略時は user と同じ）
+    auto do_chat_once = [&](const string& user, const string* question = nullptr)->optional<ChatResult>{
+        last_prompt = user;
+        last_question = question ? *question : user;
+        RouteDecision d = route_prompt(route_config(), user, auto_mode, model);
+        optional<ChatResult> r = do_chat_with(d.model, user);
+        if (!r && d.small) {
+            // small が使えなければ large で答え直す
+            d.model = config.route_large.empty() ? model : config.route_large;
+            d.small = false; d.reason = "fallback";
+            r = do_chat_with(d.model, user);
+        }
+        log_route(d, r);
+        return r;
     };
 
+    // 大きなファイルの map-reduce 要約。チャンクはバックエンドの並列スロット数まで同時に投げる
+    auto summarize_file = [&](const string& path, int par)->bool{
+        // 数分かかる要約の間に切り詰められる（logrotate の copytruncate 等）と mmap では SIGBUS になるので読み込んで持つ
+        string text;
+        string err;
+        if (!read_whole_file(path, text, &err)) { cout << "[エラー] " << err << "\n"; return false; }
+        if (par <= 0) {
+            par = 1;
+            if (backend=="llamacpp") { if (auto p = backend::llamacpp::props(http); p && p->total_slots > 0) par = p->total_slots; }
+            else if (backend=="ollama") { if (const char* e = getenv("OLLAMA_NUM_PARALLEL")) par = max(1, atoi(e)); }
+        }
+        SummarizeOptions so;
+        so.name = filesystem::path(path).filename().string();
+        so.parallel = min(par, 16);
+        // 入力+出力+指示文がコンテキストに収まるよう予算を決める
+        long out_tokens = min<long>(tune.max_tokens > 0 ? tune.max_tokens : 512, max(256L, static_cast<long>(tune.context) / 4));
+        so.chunk_tokens = max(256L, static_cast<long>(tune.context) - out_tokens - 200);
+        so.reduce_tokens = so.chunk_tokens;
+        InferenceTuning t = tune;
+        t.max_tokens = static_cast<int>(out_tokens);
+        t.slot_id = -1; // 並列要求はサーバに空きスロットを選ばせる
+        // 1要求はコンテキストいっぱいの prefill になる。実測の速度から見積もった時間の3倍まで待ち（並列ならその分遅くなる）、
+        // 実測が無ければ打ち切らない
+        double est_ms = estimate_chat_ms(perf_store.find(machine_id, model), t.context, so.chunk_tokens + 200, out_tokens);
+        t.request_timeout_sec = est_ms > 0 ? max(tune.request_timeout_sec, static_cast<int>(est_ms * 3 * so.parallel / 1000) + 60) : 0;
+        const string sys = "あなたは正確で簡潔な要約者です。日本語で答えてください。";
+        auto ask = [&](const string& prompt)->optional<string>{
+            vector<ChatMsg> msgs = {{"system", sys}, {"user", prompt}};
+            auto r = backend::chat(backend, http, model, msgs, t);
+            if (!r || r->content.empty()) return nullopt;
+            return r->content;
+        };
+        cout << "[要約] " << path << "（" << text.size() << " バイト, 並列 " << so.parallel << ", チャンク~" << so.chunk_tokens << " トークン）\n";
+        cout.flush();
+        auto t0 = chrono::steady_clock::now();
+        auto res = summarize_text(text, so, ask, [&](const SummarizeProgress& p){
+            cout << "\r  " << (p.stage=="map" ? "チャンク要約" : "統合 段" + to_string(p.level)) << " " << p.done << "/" << p.total;
+            if (p.failed) cout << "（失敗 " << p.failed << "）";
+            if (p.done == p.total) cout << "\n";
+            cout.flush();
+        });
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        session_stats.record("summarize", backend, model, ms);
+        if (res.summary.empty()) { cout << "[要約失敗] 応答が得られませんでした\n"; return false; }
+        cout << res.summary << "\n";
+        cout << "[要約] " << res.chunks << " チャンク, 統合 " << res.levels << " 段";
+        if (res.failed) cout << ", 失敗 " << res.failed;
+        cout << ", " << fixed << setprecision(1) << ms/1000.0 << " 秒" << defaultfloat << setprecision(6) << "\n";
+        return true;
+    };
+    if (!summarize_path.empty()) {
+        bool ok = summarize_file(summarize_path, 0);
+        print_exit_stats();
+        return ok ? 0 : 2;
+    }
+
     if (!one_prompt.empty()) {
         auto ans = do_chat_once(one_prompt);
         if (!ans) { cerr << "推論に失敗しました。\n"; return 2; }
-        cout << *ans << "\n";
+        cout << ans->content << "\n";
+        if (config.show_timing) cout << format_stats_line(ans->stats) << "\n";
+        print_exit_stats();
         return 0;
     }
 
-    cout << "対話を開始します。/exit または /quit で終了。/auto 設計書に基づく自律実行。/model 変更。/web 検索。/target ファイル。/cd で作業ディレクトリ変更。/allow・/deny で許可/拒否。/sh・/prog 実行。/temp 等。\n";
+    cout << "対話を開始します。/exit または /quit で終了。/auto 設計書に基づく自律実行。/model 変更。/web 検索。/target ファイル。/ask --ctx 関連コード付きで質問。/cd で作業ディレクトリ変更。/allow・/deny で許可/拒否。/sh・/prog 実行。/temp 等。\n";
     // ↑ 既に設定から初期化済み
     vector<AgentDoc> agent_docs;
     vector<string> agent_tasks;
+    // セッション: 再開時は履歴・パラメータ・自動モードを戻し、同じログへ追記を続ける
+    if (!resumed.id.empty()) {
+        history = resumed.history;
+        if (resumed.tune) {
+            const auto& rt = *resumed.tune;
+            if (rt.context > 0) tune.context = model_ctx_cap > 0 ? min(rt.context, model_ctx_cap) : rt.context;
+            if (rt.max_tokens > 0) tune.max_tokens = rt.max_tokens;
+            if (rt.temperature >= 0) tune.temperature = rt.temperature;
+            if (rt.top_p >= 0) tune.top_p = rt.top_p;
+            tune.keep_alive = rt.keep_alive;
+        }
+        if (resumed.auto_mode) {
+            agent_docs = locate_agent_docs();
+            if (!agent_docs.empty()) { set_system(build_auto_system_prompt(agent_docs)); auto_mode = true; }
+        }
+        for (const auto& p : resumed.attachments) {
+            string err;
+            if (auto a = load_attachment(p, &err)) attachments.push_back(a);
+            else cout << "[添付] 読み込めません: " << err << "\n";
+        }
+        cout << "[再開] セッション " << resumed.id << "（" << history.size() << " メッセージ" << (auto_mode ? ", 自動モード" : "");
+        if (!attachments.empty()) cout << ", 添付 " << attachments.size() << " 件";
+        cout << "）\n";
+        // llama.cpp: 保存した KV キャッシュを固定スロットへ戻し、履歴の再 prefill を省く
+        if (backend=="llamacpp" && tune.slot_id >= 0 && !resumed.kv_file.empty() && resumed.kv_model == model) {
+            bool ok = backend::llamacpp::slot_restore(http, tune.slot_id, resumed.kv_file);
+            cout << (ok ? "[スロット] KV キャッシュを復元: " : "[スロット] KV キャッシュを復元できません（履歴を再 prefill します）: ") << resumed.kv_file << "\n";
+        }
+        session_log.start(resumed.id);
+    } else {
+        session_log.start(new_session_id());
+    }
+    // 1ターンごとに追記する。モデル・作業ディレクトリ・自動モード・パラメータは変わったときだけ書く
+    string logged_model, logged_cwd, logged_auto;
+    auto session_begin = [&](){
+        if (session_log.written()) return;
+        session_log.set_value("backend", backend);
+        config.last_session = session_log.id(); save_config(config);
+    };
+    auto log_turn = [&](const ChatMsg& user, const ChatMsg& answer){
+        session_begin();
+        string cwd = filesystem::current_path().string(), am = auto_mode ? "1" : "0";
+        if (logged_model != model) { session_log.set_value("model", model); logged_model = model; }
+        if (logged_cwd != cwd) { session_log.set_value("cwd", cwd); logged_cwd = cwd; }
+        if (logged_auto != am) { session_log.set_value("auto", am); logged_auto = am; }
+        session_log.set_tune(tune);
+        session_log.message(user);
+        session_log.message(answer);
+    };
     while (true) {
         cout << "あなた> ";
         string user; if (!getline(cin, user)) { cin.clear(); continue; }
@@ -219,13 +753,30 @@ int main(int argc, char** argv) {
         user = utils::trim(user);
         if (user.empty()) continue;
         if (user=="/exit" || user=="/quit") break;
+        trace::Span turn_span(user[0]=='/' ? "repl.command" : "repl.chat", "repl");
+        if (user[0]=='/') turn_span.arg(user.substr(0, user.find(' ')));
         if (user.rfind("/model",0)==0) {
             string arg = utils::trim(user.substr(6));
+            if (arg=="rank") {
+                auto ranks = rank_installed();
+                if (ranks.empty()) { cout << "[警告] モデル情報を取得できませんでした。\n"; continue; }
+                cout << "[推奨順] 全層GPU > 一部CPU > CPUのみ、同クラス内は大きいモデル順\n" << format_model_ranking(ranks, model);
+                AutoModelFloor fl; fl.min_params = config.auto_min_params_b * 1e9; fl.min_tps = config.auto_min_tps;
+                if (auto best = pick_auto_model(ranks, fl)) cout << "おすすめ: " << best->info.name << "（/model " << best->info.name << "）\n";
+                continue;
+            }
             if (arg.empty() || arg=="?" || arg=="list") {
-                vector<string> models2 = (backend=="ollama") ? backend::ollama::list_models(http) : backend::lmstudio::list_models(http);
+                vector<string> models2;
+                {
+                    ScopedLatency l(session_stats, "list", backend);
+                    models2 = backend::list_models(backend, http);
+                }
                 if (models2.empty()) { cout << "[警告] モデル一覧を取得できませんでした。/model <名前> で直接指定してください。\n"; continue; }
                 cout << "利用可能なモデル:\n";
                 for (size_t i=0;i<models2.size();++i) cout << "  ["<<(i+1)<<"] "<<models2[i]<<"\n";
+                // 選んでいる間に、最近使ったモデルを先読みしておく
+                for (const auto& m : pick_preload_candidates(models2, config.recent_models, model))
+                    if (warm_model(m)) cout << "[先読み] " << m << "\n";
                 cout << "> 番号またはモデル名: ";
                 string sel; if (!getline(cin, sel)) { cin.clear(); continue; }
                 sel = utils::trim(sel);
@@ -243,9 +794,21 @@ int main(int argc, char** argv) {
                         chosen = sel;
                     }
                 }
-                model = chosen; cout << "モデルを変更しました: "<< model <<"\n"; config.last_model = model; save_config(config);
+                if (chosen != model) offer_unload_idle(chosen);
+                model = chosen; cout << "モデルを変更しました: "<< model <<"\n";
+                remember_recent_model(config, model); config.last_model = model; save_config(config);
+                warm_model(model);
+                fit_current_model();
+                resolve_draft(true);
+                if (config.tune_auto) retune(true);
             } else {
-                model = arg; cout << "モデルを変更しました: "<< model <<"\n"; config.last_model = model; save_config(config);
+                if (arg != model) offer_unload_idle(arg);
+                model = arg; cout << "モデルを変更しました: "<< model <<"\n";
+                remember_recent_model(config, model); config.last_model = model; save_config(config);
+                warm_model(model);
+                fit_current_model();
+                resolve_draft(true);
+                if (config.tune_auto) retune(true);
             }
             continue;
         }
@@ -304,14 +867,14 @@ int main(int argc, char** argv) {
             cout << "使い方: /" << (is_allow?"allow":"deny") << " list|add <pat>|rm <pat>|clear\n"; continue;
         }
         if (user.rfind("/agents",0)==0) {
-            if (agent_docs.empty()) agent_docs = find_agent_docs(".");
+            agent_docs = locate_agent_docs();
             if (agent_docs.empty()) { cout << "AGENT(S).md が見つかりません。プロジェクト直下に配置してください。\n"; continue; }
             cout << "検出した設計書:\n";
             for (size_t i=0;i<agent_docs.size();++i) cout << "  ["<<(i+1)<<"] "<<agent_docs[i].path.string()<<"\n";
             continue;
         }
         if (user.rfind("/plan",0)==0) {
-            if (agent_docs.empty()) agent_docs = find_agent_docs(".");
+            if (agent_docs.empty()) agent_docs = locate_agent_docs();
             agent_tasks.clear();
             for (auto& d : agent_docs) {
                 auto t = extract_tasks(d.content);
@@ -327,7 +890,7 @@ int main(int argc, char** argv) {
             arg = utils::trim(arg);
             if (arg=="off"||arg=="stop") {
                 auto_mode=false; cout<<"自動モード: OFF\n";
-                system_jp = "あなたは有能なローカルAIアシスタントです。常に日本語で、簡潔かつ丁寧に回答してください。";
+                set_system(default_system);
                 continue;
             }
             if (arg.rfind("confirm",0)==0) {
@@ -353,9 +916,9 @@ int main(int argc, char** argv) {
                 continue;
             }
             // /auto または /auto on
-            if (agent_docs.empty()) agent_docs = find_agent_docs(".");
+            if (agent_docs.empty()) agent_docs = locate_agent_docs();
             if (agent_docs.empty()) { cout << "AGENT(S).md を見つけられません。/agents で確認してください。\n"; continue; }
-            system_jp = build_auto_system_prompt(agent_docs);
+            set_system(build_auto_system_prompt(agent_docs));
             auto_mode = true;
             cout << "自動モード: ON（" << (auto_dry_run?"dry":"apply") << ", confirm=" << (auto_confirm?"ON":"OFF") << ")\n";
             continue;
@@ -370,6 +933,7 @@ int main(int argc, char** argv) {
             string out; 
             int rc = -1;
             try {
+                ScopedLatency l(session_stats, "shell", "local");
                 rc = utils::run_shell_with_status(cmd + " 2>&1", out);
             } catch (const std::exception& e) {
                 cout << "[エラー] コマンド実行に失敗: " << e.what() << "\n";
@@ -391,6 +955,7 @@ int main(int argc, char** argv) {
                 string out; 
                 int rc = -1;
                 try {
+                    ScopedLatency l(session_stats, "shell", "local");
                     rc = utils::run_shell_with_status(cmd + " 2>&1", out);
                 } catch (const std::exception& e) {
                     cout << "[エラー] コマンド実行に失敗: " << e.what() << "\n";
@@ -406,7 +971,11 @@ int main(int argc, char** argv) {
         if (user.rfind("/web",0)==0) {
             string q = utils::trim(user.substr(4));
             if (q.empty()) { cout << "使い方: /web <検索語>\n"; continue; }
-            vector<WebResult> r = web_search(http, q, 6);
+            vector<WebResult> r;
+            {
+                ScopedLatency l(session_stats, "web", "duckduckgo");
+                r = web_search(http, q, 6);
+            }
             if (r.empty()) { cout << "検索結果が見つかりませんでした。\n"; continue; }
             cout << "[Web検索結果]" << "\n";
             for (size_t i=0;i<r.size();++i) {
@@ -419,11 +988,404 @@ int main(int argc, char** argv) {
         if (user.rfind("/target",0)==0 || user.rfind("/files",0)==0) {
             string q = utils::trim(user.substr(user[1]=='t'?7:6));
             if (q.empty()) { cout << "使い方: /target <キーワード>\n"; continue; }
-            auto hits = find_relevant_files(".", q, 10);
+            SearchResult res;
+            {
+                ScopedLatency l(session_stats, "target", "local");
+                // 時間切れか Ctrl-C でそれまでの上位を返す。途中経過は上位3件に新しく入ったものだけ出す
+                utils::InterruptGuard interrupt;
+                SearchOptions so;
+                so.budget = chrono::milliseconds(config.target_budget_ms);
+                so.cancel = &interrupt.flag();
+                set<string> shown;
+                so.on_progress = [&](const vector<FileHit>& best, size_t) {
+                    for (size_t i = 0; i < best.size() && i < 3; ++i) {
+                        if (!shown.insert(best[i].path).second) continue;
+                        cout << "  … score=" << best[i].score << " " << best[i].path << "\n" << flush;
+                    }
+                };
+                res = search_tree(q, so);
+            }
+            const vector<FileHit>& hits = res.hits;
+            if (res.timed_out || res.cancelled) {
+                cout << "（" << (res.cancelled ? "中断" : "時間切れ") << ": " << res.scanned
+                     << " ファイルまでの結果, " << static_cast<long>(res.elapsed_ms) << " ms）\n";
+            }
+            if (config.file_index && config.show_timing) print_index_stats(file_index->stats());
             if (hits.empty()) { cout << "該当するファイルが見つかりません。\n"; continue; }
             cout << "[候補ファイル]" << "\n";
             for (size_t i=0;i<hits.size();++i) {
                 cout << "  ["<<(i+1)<<"] score="<<hits[i].score<<" "<<hits[i].path<<"\n";
+                for (const auto& d : hits[i].definitions) {
+                    cout << "       定義 " << d.line << "-" << d.end_line << ": " << symbol_kind_name(d.kind) << " " << d.name << "\n";
+                }
+                for (const auto& sn : hits[i].snippets) cout << "       " << sn.line << ": " << utils::trim(sn.text) << "\n";
+            }
+            continue;
+        }
+        if (user.rfind("/index",0)==0) {
+            string arg = utils::trim(user.substr(6));
+            if (arg=="on" || arg=="off") {
+                config.file_index = (arg=="on"); save_config(config);
+                cout << "/target の索引: " << (config.file_index?"ON":"OFF") << "\n";
+            } else if (arg=="rebuild") {
+                TrigramIndex& idx = ensure_index();
+                idx.clear();
+                idx.update(); idx.save();
+                print_index_stats(idx.stats());
+            } else if (arg.empty() || arg=="status") {
+                cout << "/target の索引: " << (config.file_index?"ON":"OFF") << "\n";
+                if (file_index) {
+                    cout << "  保存先: " << file_index->path().string() << "\n";
+                    print_index_stats(file_index->stats());
+                } else {
+                    cout << "  （まだ読み込んでいません。/target か /index rebuild で作成）\n";
+                }
+            } else {
+                cout << "使い方: /index [status|rebuild|on|off]\n";
+            }
+            continue;
+        }
+        if (user.rfind("/tune",0)==0) {
+            string arg = utils::trim(user.substr(5));
+            if (arg=="auto") {
+                config.tune_auto = true; save_config(config);
+                cout << "/tune auto: ON（目標 " << config.latency_target_ms/1000.0 << " 秒）\n";
+                retune(true);
+            } else if (arg=="static" || arg=="off") {
+                config.tune_auto = false; save_config(config);
+                tune.context = base_tune.context; tune.max_tokens = base_tune.max_tokens; tune.gpu_layers = base_tune.gpu_layers;
+                if (ctx_override) tune.context = *ctx_override;
+                if (max_override) tune.max_tokens = *max_override;
+                cout << "/tune auto: OFF\n";
+                print_tuning(tune, msg);
+            } else if (arg.rfind("target",0)==0) {
+                istringstream iss(arg.substr(6));
+                double sec;
+                if (iss>>sec && sec > 0 && sec <= 600) {
+                    config.latency_target_ms = sec * 1000.0; save_config(config);
+                    cout << "目標レイテンシ: " << sec << " 秒\n";
+                    if (config.tune_auto) retune(true);
+                } else {
+                    cout << "[エラー] 目標は秒数（0-600）で指定してください\n";
+                }
+            } else if (arg.empty() || arg=="status") {
+                const auto& prof = perf_store.at(machine_id, model);
+                cout << "/tune auto: " << (config.tune_auto?"ON":"OFF") << ", 目標 " << config.latency_target_ms/1000.0 << " 秒"
+                     << ", サンプル数 " << prof.samples.size() << "\n";
+                if (!prof.empty()) {
+                    cout << "  実測: prefill " << prof.prefill_tps_at(tune.context) << " tok/s, decode " << prof.decode_tps_at(tune.context) << " tok/s"
+                         << "（context=" << tune.context << " 近傍）\n";
+                }
+                print_tuning(tune, msg);
+            } else {
+                cout << "使い方: /tune [status|auto|static|target <秒>]\n";
+            }
+            continue;
+        }
+        if (user.rfind("/bench",0)==0) {
+            vector<string> args; istringstream iss(user.substr(6)); string a;
+            while (iss>>a) args.push_back(a);
+            run_bench_cmd(args);
+            continue;
+        }
+        if (user.rfind("/stats",0)==0) {
+            vector<string> args; istringstream iss(user.substr(6)); string a;
+            while (iss>>a) args.push_back(a);
+            if (args.empty()) {
+                if (session_stats.empty()) cout << "まだ計測値がありません。\n";
+                else cout << session_stats.format_table();
+            } else if (args[0]=="export") {
+                string path;
+                if (args.size()>=2) path = args[1];
+                else {
+                    std::time_t now = std::time(nullptr);
+                    ostringstream ts; ts << put_time(std::localtime(&now), "%Y%m%d-%H%M%S");
+                    path = (default_config_path().parent_path() / ("stats-" + ts.str() + ".json")).string();
+                }
+                ofstream ofs(path, ios::binary);
+                if (ofs << session_stats.to_json()) cout << "[統計] 保存しました: " << path << "\n";
+                else cout << "[エラー] 書き込めません: " << path << "\n";
+            } else if (args[0]=="exit" && args.size()>=2 && (args[1]=="on"||args[1]=="off")) {
+                config.stats_on_exit = (args[1]=="on"); save_config(config);
+                cout << "終了時の統計表示: " << (config.stats_on_exit?"ON":"OFF") << "\n";
+            } else if (args[0]=="reset") {
+                session_stats = SessionStats{};
+                cout << "[統計] リセットしました\n";
+            } else {
+                cout << "使い方: /stats [export [パス]|exit on|off|reset]\n";
+            }
+            continue;
+        }
+        if (user.rfind("/timing",0)==0) {
+            string arg = utils::trim(user.substr(7));
+            if (arg=="on") config.show_timing = true;
+            else if (arg=="off") config.show_timing = false;
+            else if (!arg.empty()) { cout << "使い方: /timing on|off\n"; continue; }
+            else config.show_timing = !config.show_timing;
+            cout << "計測サマリ表示: " << (config.show_timing?"ON":"OFF") << "\n";
+            save_config(config);
+            continue;
+        }
+        if (user=="/ps" || user.rfind("/ps ",0)==0) {
+            vector<string> args; istringstream iss(user.substr(3)); string a;
+            while (iss>>a) args.push_back(a);
+            if (!args.empty() && args[0]=="unload") {
+                if (args.size()<2) { cout << "使い方: /ps unload <モデル名>|idle\n"; continue; }
+                if (backend != "ollama") { cout << "[情報] " << backend << " は API からのアンロードに未対応です。\n"; continue; }
+                if (args[1]=="idle") {
+                    auto rs = backend::list_running(backend, http);
+                    auto idle = rs ? idle_residents(*rs, model) : vector<string>{};
+                    if (idle.empty()) { cout << "解放できる常駐モデルはありません。\n"; continue; }
+                    for (const auto& m : idle) unload_model(m);
+                } else {
+                    unload_model(args[1]);
+                }
+                continue;
+            }
+            if (!args.empty()) { cout << "使い方: /ps [unload <モデル名>|idle]\n"; continue; }
+            optional<vector<ResidentModel>> rs;
+            {
+                ScopedLatency l(session_stats, "ps", backend);
+                rs = backend::list_running(backend, http);
+            }
+            if (!rs) { cout << "[警告] 常駐モデルを取得できませんでした。\n"; continue; }
+            if (rs->empty()) { cout << "常駐しているモデルはありません。\n"; continue; }
+            cout << format_residency_table(*rs, model);
+            residency_checked = model;
+            if (const ResidentModel* r = find_resident(*rs, model)) {
+                auto w = format_offload_warning(*r);
+                if (!w.empty()) cout << w << "\n";
+            }
+            continue;
+        }
+        if (user=="/escalate") {
+            if (last_prompt.empty()) { cout << "まだ質問がありません。\n"; continue; }
+            RouteDecision d;
+            d.model = config.route_large.empty() ? model : config.route_large;
+            d.reason = "escalate";
+            d.prompt_tokens = estimate_tokens(last_prompt);
+            // 直前の組を履歴から外して聞き直し、成功したら置き換える。送るのは前回と同じ本文、履歴に残すのは質問だけ
+            auto saved_history = history;
+            bool replace = pop_last_turn(history, last_question);
+            auto r = do_chat_with(d.model, last_prompt);
+            log_route(d, r);
+            if (!r) { history = std::move(saved_history); cout << "[エラー] 応答を取得できませんでした。\n"; continue; }
+            if (replace && session_log.written()) session_log.pop(2);
+            history.emplace_back(Role::User, last_question);
+            history.emplace_back(Role::Assistant, r->content);
+            log_turn(history[history.size()-2], history.back());
+            cout << "アシスタント(" << d.model << ")> " << r->content << "\n";
+            if (config.show_timing) cout << format_stats_line(r->stats) << "\n";
+            continue;
+        }
+        if (user=="/clear") {
+            history.clear();
+            if (session_log.written()) session_log.clear();
+            cout << "会話履歴を消去しました。\n";
+            continue;
+        }
+        if (user.rfind("/session",0)==0) {
+            string arg = utils::trim(user.substr(8));
+            if (arg=="list") {
+                auto ids = list_sessions();
+                if (ids.empty()) { cout << "保存済みセッションはありません。\n"; continue; }
+                for (size_t i = 0; i < ids.size() && i < 10; ++i) {
+                    std::error_code ec;
+                    auto bytes = filesystem::file_size(session_path(ids[i]), ec);
+                    cout << "  " << ids[i] << (ids[i]==session_log.id() ? " *" : "") << "（" << (ec ? 0 : bytes/1024) << " KB）\n";
+                }
+                cout << "再開: agens --resume <ID>\n";
+            } else if (arg=="new") {
+                history.clear();
+                session_log.start(new_session_id());
+                logged_model.clear(); logged_cwd.clear(); logged_auto.clear();
+                cout << "新しいセッション: " << session_log.id() << "\n";
+            } else if (arg.empty() || arg=="status") {
+                cout << "セッション: " << session_log.id() << "（" << history.size() << " メッセージ"
+                     << (session_log.written() ? ", " + session_path(session_log.id()).string() : string(", 未保存")) << "）\n";
+            } else {
+                cout << "使い方: /session [status|list|new]\n";
+            }
+            continue;
+        }
+        if (user.rfind("/route",0)==0) {
+            vector<string> args; istringstream iss(user.substr(6)); string a;
+            while (iss>>a) args.push_back(a);
+            if (args.empty() || args[0]=="status") {
+                cout << "/route: " << (config.route_enabled?"ON":"OFF")
+                     << ", small=" << (config.route_small.empty() ? "(未設定)" : config.route_small)
+                     << ", large=" << (config.route_large.empty() ? model + "（現在のモデル）" : config.route_large)
+                     << ", small の上限 " << static_cast<long>(config.route_max_small_tokens) << " トークン\n";
+                cout << "  このセッション: small " << route_tally.small_turns << " 回, large " << route_tally.large_turns << " 回";
+                if (route_tally.estimated_turns > 0) cout << ", 推定短縮 " << fixed << setprecision(1) << route_tally.saved_ms/1000.0 << " 秒" << defaultfloat << setprecision(6);
+                cout << "\n  ログ: " << route_log_path.string() << "\n";
+            } else if (args[0]=="on" || args[0]=="off") {
+                config.route_enabled = (args[0]=="on");
+                if (config.route_enabled && config.route_small.empty()) cout << "[ヒント] /route small <モデル> または /route auto で small を設定してください。\n";
+                save_config(config);
+                cout << "/route: " << (config.route_enabled?"ON":"OFF") << "\n";
+                if (config.route_enabled && !config.route_small.empty()) warm_model(config.route_small);
+            } else if ((args[0]=="small" || args[0]=="large") && args.size()>=2) {
+                (args[0]=="small" ? config.route_small : config.route_large) = (args[1]=="-" ? string() : args[1]);
+                save_config(config);
+                cout << args[0] << "=" << (args[1]=="-" ? "(未設定)" : args[1]) << "\n";
+                if (args[0]=="small" && config.route_enabled && !config.route_small.empty()) warm_model(config.route_small);
+            } else if (args[0]=="max" && args.size()>=2) {
+                long v = 0; try { v = stol(args[1]); } catch (...) {}
+                if (v < 1) { cout << "[エラー] トークン数を指定してください\n"; continue; }
+                config.route_max_small_tokens = static_cast<double>(v); save_config(config);
+                cout << "small の上限: " << v << " トークン\n";
+            } else if (args[0]=="auto") {
+                // 推奨順位から large（--model auto と同じ基準）と small（全層GPUで最速）を選ぶ
+                auto ranks = rank_installed();
+                AutoModelFloor fl; fl.min_params = config.auto_min_params_b * 1e9; fl.min_tps = config.auto_min_tps;
+                auto best = pick_auto_model(ranks, fl);
+                string large = best ? best->info.name : model;
+                auto small = pick_small_model(ranks, large);
+                if (!small) { cout << "[警告] small に使える全層GPUのモデルが見つかりません。\n"; continue; }
+                config.route_small = *small; config.route_large = large; config.route_enabled = true; save_config(config);
+                cout << "/route: ON, small=" << *small << ", large=" << large << "\n";
+                warm_model(*small);
+            } else {
+                cout << "使い方: /route [status|on|off|auto|small <モデル>|large <モデル>|max <トークン>]（- で未設定に戻す）\n";
+            }
+            continue;
+        }
+        if (user.rfind("/slot",0)==0) {
+            if (backend!="llamacpp") { cout << "[情報] /slot は llama.cpp server でのみ使えます。\n"; continue; }
+            vector<string> args; istringstream iss(user.substr(5)); string a;
+            while (iss>>a) args.push_back(a);
+            if (args.empty() || args[0]=="status") {
+                auto slots = backend::llamacpp::list_slots(http);
+                if (!slots) { cout << "[警告] /slots を取得できません（--no-slots で起動されていませんか）\n"; continue; }
+                for (const auto& sl : *slots)
+                    cout << "  " << (sl.id==tune.slot_id ? "*" : " ") << "slot " << sl.id << "  n_ctx=" << sl.n_ctx << (sl.is_processing ? "  処理中" : "") << "\n";
+                continue;
+            }
+            if (args[0]=="pin" && args.size()>=2) {
+                try { tune.slot_id = stoi(args[1]); } catch (...) { cout << "[エラー] スロット番号を指定してください\n"; continue; }
+                cout << "id_slot=" << tune.slot_id << (tune.slot_id < 0 ? "（サーバ任せ）" : "") << "\n";
+                continue;
+            }
+            if (tune.slot_id < 0) { cout << "[情報] スロットが固定されていません。/slot pin <番号> で固定してください。\n"; continue; }
+            string file = args.size()>=2 ? args[1] : slot_file();
+            bool ok = false;
+            if (args[0]=="save") ok = backend::llamacpp::slot_save(http, tune.slot_id, file);
+            else if (args[0]=="restore") ok = backend::llamacpp::slot_restore(http, tune.slot_id, file);
+            else if (args[0]=="erase") ok = backend::llamacpp::slot_erase(http, tune.slot_id);
+            else { cout << "使い方: /slot [status|pin <番号>|save [ファイル名]|restore [ファイル名]|erase]\n"; continue; }
+            cout << (ok ? "[スロット] " : "[スロット失敗] ") << args[0] << " id_slot=" << tune.slot_id;
+            if (args[0]!="erase") cout << " " << file;
+            if (!ok && args[0]!="erase") cout << "（llama-server を --slot-save-path 付きで起動してください）";
+            cout << "\n";
+            continue;
+        }
+        if (user.rfind("/attach",0)==0) {
+            vector<string> args; istringstream iss(user.substr(7)); string a;
+            while (iss>>a) args.push_back(a);
+            auto find_attached = [&](const string& p){
+                string abs = filesystem::absolute(p).lexically_normal().string();
+                return find_if(attachments.begin(), attachments.end(), [&](const auto& x){ return x->path()==abs; });
+            };
+            if (args.empty() || args[0]=="list") {
+                if (attachments.empty()) { cout << "添付はありません。使い方: /attach <パス...> | rm <パス> | clear\n"; continue; }
+                for (const auto& x : attachments) cout << "  " << x->path() << "（" << (x->size()+1023)/1024 << " KB, ~" << x->tokens() << " トークン）\n";
+                cout << "合計 ~" << attachment_tokens(attachments) << " トークン / context=" << tune.context << "\n";
+            } else if (args[0]=="clear") {
+                for (const auto& x : attachments) if (session_log.written()) session_log.detach(x->path());
+                attachments.clear();
+                cout << "添付をすべて外しました。\n";
+            } else if (args[0]=="rm" && args.size()>=2) {
+                for (size_t i = 1; i < args.size(); ++i) {
+                    auto it = find_attached(args[i]);
+                    if (it == attachments.end()) { cout << "[エラー] 添付されていません: " << args[i] << "\n"; continue; }
+                    if (session_log.written()) session_log.detach((*it)->path());
+                    attachments.erase(it);
+                    cout << "[添付] 外しました: " << args[i] << "\n";
+                }
+            } else {
+                for (const auto& p : args) {
+                    string err;
+                    auto x = load_attachment(filesystem::absolute(p).lexically_normal().string(), &err);
+                    if (!x) { cout << "[エラー] " << err << "\n"; continue; }
+                    auto it = find_attached(p);
+                    if (it != attachments.end()) *it = x; else attachments.push_back(x);
+                    session_begin();
+                    session_log.attach(x->path());
+                    cout << "[添付] " << p << "（" << (x->size()+1023)/1024 << " KB, ~" << x->tokens() << " トークン）\n";
+                }
+                long total = attachment_tokens(attachments);
+                long room = static_cast<long>(tune.context) - tune.max_tokens - system_tokens;
+                cout << "添付合計 ~" << total << " トークン（履歴・質問に使える残り ~" << max(0L, room - total) << "）\n";
+                if (total > room) cout << "[警告] context=" << tune.context << " に収まりません。/ctx で増やすか /attach rm で外してください。\n";
+            }
+            continue;
+        }
+        if (user.rfind("/summarize",0)==0) {
+            vector<string> args; istringstream iss(user.substr(10)); string a;
+            while (iss>>a) args.push_back(a);
+            int par = 0;
+            string path;
+            for (auto& x : args) {
+                if (x.rfind("par=",0)==0) { try { par = stoi(x.substr(4)); } catch (...) {} }
+                else path = x;
+            }
+            if (path.empty()) { cout << "使い方: /summarize <パス> [par=N]\n"; continue; }
+            summarize_file(path, par);
+            continue;
+        }
+        if (user.rfind("/draft",0)==0) {
+            vector<string> args; istringstream iss(user.substr(6)); string a;
+            while (iss>>a) args.push_back(a);
+            if (args.empty() || args[0]=="status") {
+                cout << "ドラフト: " << (tune.draft_model.empty() ? "(なし)" : tune.draft_model)
+                     << "（設定 " << (config.draft_model.empty() ? "off" : config.draft_model) << "）"
+                     << ", max=" << config.draft_max << ", min=" << config.draft_min << ", p_min=" << config.draft_p_min << "\n";
+                if (backend=="llamacpp") cout << "  llama.cpp はサーバ起動時の -md でドラフトを指定します（ここでは max/min/p_min のみ送信）\n";
+                if (backend=="ollama") cout << "  Ollama は投機的デコードに未対応です\n";
+                continue;
+            }
+            if ((args[0]=="max" || args[0]=="min" || args[0]=="pmin") && args.size()>=2) {
+                double v = -1; try { v = stod(args[1]); } catch (...) {}
+                if (args[0]=="pmin") { if (v < 0 || v > 1) { cout << "[エラー] p_min は 0-1\n"; continue; } config.draft_p_min = v; }
+                else { if (v < 0 || v > 64) { cout << "[エラー] 0-64 で指定してください\n"; continue; } (args[0]=="max" ? config.draft_max : config.draft_min) = static_cast<int>(v); }
+            } else if (args[0]=="off") {
+                config.draft_model.clear();
+            } else {
+                config.draft_model = args[0]; // "auto" またはモデル名
+            }
+            save_config(config);
+            resolve_draft(true);
+            cout << "ドラフト: " << (tune.draft_model.empty() ? "(なし)" : tune.draft_model) << "\n";
+            continue;
+        }
+        if (user.rfind("/keepalive",0)==0) {
+            string arg = utils::trim(user.substr(10));
+            if (arg.empty()) {
+                cout << "keep_alive: " << (tune.keep_alive.empty() ? "（サーバ既定）" : tune.keep_alive) << "\n";
+                continue;
+            }
+            if (arg=="default") arg.clear();
+            else if (!is_valid_keep_alive(arg)) { cout << "使い方: /keepalive [30m|1h|-1|0|default]\n"; continue; }
+            config.keep_alive = arg; tune.keep_alive = arg; save_config(config);
+            cout << "keep_alive: " << (arg.empty() ? "（サーバ既定）" : arg) << "\n";
+            continue;
+        }
+        if (user.rfind("/warmup",0)==0) {
+            string arg = utils::trim(user.substr(7));
+            if (arg=="on" || arg=="off") {
+                config.warmup = (arg=="on"); save_config(config);
+                cout << "ウォームアップ: " << (config.warmup?"ON":"OFF") << "\n";
+            } else if (arg.empty() || arg=="now") {
+                // 手動指定時は完了まで待って結果を表示する
+                warmer.forget(model);
+                auto t0 = chrono::steady_clock::now();
+                bool ok = backend::warmup(backend, http, model, tune.keep_alive);
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+                if (ok) session_stats.record("warmup", backend, model, ms);
+                cout << (ok ? "[ウォームアップ] 完了: " : "[ウォームアップ] 失敗: ") << model << "（" << static_cast<int>(ms) << " ms）\n";
+            } else {
+                cout << "使い方: /warmup [now|on|off]\n";
             }
             continue;
         }
@@ -453,7 +1415,7 @@ int main(int argc, char** argv) {
             istringstream iss(user.substr(4)); 
             int v; 
             if (iss>>v && v >= 512 && v <= 131072) { 
-                tune.context=v; 
+                tune.context=v; ctx_override=v;
                 cout<<"context="<<tune.context<<"\n"; 
             } else {
                 cout << "[エラー] contextは512-131072の範囲で指定してください\n";
@@ -464,7 +1426,7 @@ int main(int argc, char** argv) {
             istringstream iss(user.substr(4)); 
             int v; 
             if (iss>>v && v >= 1 && v <= 8192) { 
-                tune.max_tokens=v; 
+                tune.max_tokens=v; max_override=v;
                 cout<<"max_tokens="<<tune.max_tokens<<"\n"; 
             } else {
                 cout << "[エラー] max_tokensは1-8192の範囲で指定してください\n";
@@ -472,8 +1434,52 @@ int main(int argc, char** argv) {
             continue;
         }
 
-        auto ans = do_chat_once(user);
-        if (!ans) { cout << "[エラー] 応答を取得できませんでした。\n"; continue; }
+        // /ask [--ctx] 質問: --ctx なら /target と同じ検索で関連箇所を切り出し、質問の前に付けて送る。
+        // 参照コードは最後のユーザーメッセージの先頭に置き、システム・添付・履歴の接頭辞（KV キャッシュ）は変えない。履歴には質問だけを残す
+        string prompt = user;
+        optional<chrono::steady_clock::time_point> ask_started;
+        if (user=="/ask" || user.rfind("/ask ",0)==0) {
+            string q = utils::trim(user.substr(4));
+            bool with_ctx = q.rfind("--ctx",0)==0 && (q.size()==5 || isspace(static_cast<unsigned char>(q[5])));
+            if (with_ctx) q = utils::trim(q.substr(5));
+            if (q.empty()) { cout << "使い方: /ask [--ctx] <質問>\n"; continue; }
+            user = prompt = q;
+            if (with_ctx) {
+                ask_started = chrono::steady_clock::now();
+                long room = static_cast<long>(tune.context) - tune.max_tokens - system_tokens - attachment_tokens(attachments) - estimate_tokens(q);
+                ContextPackOptions po;
+                po.budget_tokens = static_cast<long>(room * config.ask_ctx_ratio);
+                SearchResult sr;
+                ContextPack pack;
+                double search_ms = 0;
+                {
+                    ScopedLatency l(session_stats, "ask_ctx", "local");
+                    utils::InterruptGuard interrupt;
+                    SearchOptions so;
+                    so.budget = chrono::milliseconds(config.target_budget_ms);
+                    so.cancel = &interrupt.flag();
+                    string sq = context_query(q);
+                    sr = search_tree(sq, so);
+                    search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - *ask_started).count();
+                    if (po.budget_tokens > 0) pack = pack_context(sr.hits, po);
+                }
+                double pack_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - *ask_started).count() - search_ms;
+                cout << fixed << setprecision(1) << "[参照] 検索 " << search_ms << " ms（" << sr.hits.size() << " ファイル"
+                     << (sr.timed_out ? ", 時間切れ" : sr.cancelled ? ", 中断" : "") << "）, 抽出 " << pack_ms << " ms, "
+                     << pack.regions.size() << " 箇所 ~" << pack.tokens << "/" << max(0L, po.budget_tokens) << " トークン";
+                if (pack.duplicates || pack.dropped) cout << "（重複 " << pack.duplicates << ", 予算外 " << pack.dropped << "）";
+                cout << defaultfloat << setprecision(6) << "\n";
+                for (const auto& r : pack.regions) {
+                    cout << "  " << r.path << " " << r.first_line << "-" << r.last_line << (r.definition ? "（定義）" : "") << "\n";
+                }
+                if (pack.regions.empty()) cout << "[参照] 付けられる箇所がありません。質問だけを送ります。\n";
+                prompt = format_context_prompt(pack, q);
+            }
+        }
+        auto res = do_chat_once(prompt, &user);
+        if (!res) { cout << "[エラー] 応答を取得できませんでした。\n"; continue; }
+        if (config.tune_auto) retune(true);
+        const string* ans = &res->content;
         if (auto_mode) {
             auto preview = apply_file_blocks(*ans, true);
             if (!preview.written.empty()) {
@@ -495,8 +1501,32 @@ int main(int argc, char** argv) {
                 }
             }
         }
+        history.emplace_back(Role::User, user);
+        history.emplace_back(Role::Assistant, *ans);
+        log_turn(history[history.size()-2], history.back());
         cout << "アシスタント> " << *ans << "\n";
+        if (config.show_timing) { cout << format_stats_line(res->stats) << "\n"; print_draft_report(res->stats); }
+        if (ask_started) {
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - *ask_started).count();
+            cout << fixed << setprecision(1) << "[参照] 検索から応答まで " << ms/1000.0 << " 秒";
+            if (res->stats.prompt_tokens > 0) {
+                cout << "（プロンプト " << res->stats.prompt_tokens << " トークン";
+                if (res->stats.prompt_ms >= 0) cout << ", prefill " << res->stats.prompt_ms << " ms";
+                cout << "）";
+            }
+            cout << defaultfloat << setprecision(6) << "\n";
+        }
+        if (residency_checked != model) check_residency();
+    }
+    // llama.cpp: 長いセッションの KV キャッシュを退避し、--resume で再 prefill を省く
+    if (backend=="llamacpp" && tune.slot_id >= 0 && session_log.written() && !history.empty()) {
+        string f = "agens-session-" + session_log.id() + ".bin";
+        if (backend::llamacpp::slot_save(http, tune.slot_id, f)) {
+            session_log.kv(f, model);
+            cout << "[スロット] KV キャッシュを保存: " << f << "\n";
+        }
     }
+    print_exit_stats();
     cout << "終了します。\n";
     return 0;
 }
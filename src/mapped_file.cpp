@@ -0,0 +1,110 @@
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <fstream>
+#include <utility>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() { close(); }
+
+MappedFile::MappedFile(MappedFile&& o) noexcept { *this = std::move(o); }
+
+MappedFile& MappedFile::operator=(MappedFile&& o) noexcept {
+    if (this != &o) {
+        close();
+        data_ = std::exchange(o.data_, nullptr);
+        size_ = std::exchange(o.size_, 0);
+        open_ = std::exchange(o.open_, false);
+#if defined(_WIN32)
+        file_ = std::exchange(o.file_, nullptr);
+        mapping_ = std::exchange(o.mapping_, nullptr);
+#endif
+    }
+    return *this;
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::open(const std::string& path, std::string* err) {
+    close();
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f == INVALID_HANDLE_VALUE) { if (err) *err = "cannot open " + path; return false; }
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(f, &sz)) { CloseHandle(f); if (err) *err = "cannot stat " + path; return false; }
+    file_ = f;
+    open_ = true;
+    if (sz.QuadPart == 0) return true;
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m) { close(); if (err) *err = "cannot map " + path; return false; }
+    mapping_ = m;
+    data_ = static_cast<const char*>(MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0));
+    if (!data_) { close(); if (err) *err = "cannot map " + path; return false; }
+    size_ = static_cast<size_t>(sz.QuadPart);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(static_cast<HANDLE>(mapping_));
+    if (file_) CloseHandle(static_cast<HANDLE>(file_));
+    data_ = nullptr; mapping_ = nullptr; file_ = nullptr; size_ = 0; open_ = false;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, std::string* err) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { if (err) *err = path + ": " + std::strerror(errno); return false; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        if (err) *err = path + ": not a regular file";
+        return false;
+    }
+    open_ = true;
+    if (st.st_size == 0) { ::close(fd); return true; }
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // マップはファイル記述子を閉じても有効
+    if (p == MAP_FAILED) { open_ = false; if (err) *err = path + ": " + std::strerror(errno); return false; }
+    madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(p);
+    size_ = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+    data_ = nullptr; size_ = 0; open_ = false;
+}
+
+#endif
+
+bool read_whole_file(const std::string& path, std::string& out, std::string* err) {
+    out.clear();
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs) { if (err) *err = "cannot open " + path; return false; }
+    auto end = ifs.tellg();
+    ifs.seekg(0);
+    // 末尾の 1 バイトは EOF を確かめる分（読んでいる間に伸びたらそこから塊を足す）
+    out.resize(end > 0 ? static_cast<size_t>(end) + 1 : 0);
+    constexpr size_t kChunk = 1 << 20;
+    size_t have = 0;
+    while (ifs) {
+        if (have == out.size()) out.resize(have + kChunk);
+        ifs.read(out.data() + have, static_cast<std::streamsize>(std::min(kChunk, out.size() - have)));
+        have += static_cast<size_t>(ifs.gcount());
+    }
+    out.resize(have);
+    if (ifs.bad()) { if (err) *err = "cannot read " + path; return false; }
+    return true;
+}
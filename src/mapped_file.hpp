@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// 読み取り専用のメモリマップドファイル（大きなファイルをコピーせずに参照する）
+
+/// @brief ファイル全体を読み取り専用で mmap する。ムーブのみ可能
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// @brief path を開いてマップする。失敗時は false と err（空ファイルは成功・サイズ0）
+    bool open(const std::string& path, std::string* err = nullptr);
+    void close();
+
+    bool is_open() const { return open_; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    std::string_view view() const { return std::string_view(data_ ? data_ : "", size_); }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool open_ = false;
+#if defined(_WIN32)
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
+
+/// @brief path 全体を out へ 1MB ずつ読む。失敗時は false と err
+///
+/// 他のプロセスが書き換え中かもしれないファイル（検索・索引の対象）用。mmap したファイルが
+/// 切り詰められると読んだ時点で SIGBUS になるが、read ならその時点の内容が短く返るだけで済む
+bool read_whole_file(const std::string& path, std::string& out, std::string* err = nullptr);
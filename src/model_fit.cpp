@@ -0,0 +1,264 @@
+#include "model_fit.hpp"
+#include <regex>
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+static string lower(string s){ transform(s.begin(), s.end(), s.begin(), ::tolower); return s; }
+
+double parse_parameter_size(const string& s) {
+    // 数字 + B/M（直後に英字が続かない）: "8.0B", "70b", "0.5b-instruct", "567M"
+    static const regex re(R"((\d+(?:\.\d+)?)\s*([bBmM])(?![A-Za-z]))");
+    smatch m;
+    if (!regex_search(s, m, re)) return 0;
+    double v = 0;
+    try { v = stod(m[1].str()); } catch (...) { return 0; }
+    char unit = static_cast<char>(tolower(static_cast<unsigned char>(m[2].str()[0])));
+    return unit == 'b' ? v * 1e9 : v * 1e6;
+}
+
+double quant_bits_per_weight(const string& quant) {
+    // llama.cpp の代表的な量子化の実効ビット数（スケール等を含む概算）
+    static const pair<const char*, double> kTable[] = {
+        {"f32", 32}, {"f16", 16}, {"bf16", 16}, {"fp16", 16},
+        {"q8_0", 8.5}, {"8bit", 8.5}, {"q6_k", 6.56},
+        {"q5_k_m", 5.69}, {"q5_k_s", 5.54}, {"q5_1", 6.0}, {"q5_0", 5.5},
+        {"q4_k_m", 4.85}, {"q4_k_s", 4.58}, {"q4_1", 5.0}, {"q4_0", 4.55}, {"iq4", 4.5}, {"4bit", 4.5},
+        {"q3_k_l", 4.27}, {"q3_k_m", 3.91}, {"q3_k_s", 3.5}, {"iq3", 3.5},
+        {"q2_k", 3.35}, {"iq2", 2.5},
+    };
+    string q = lower(quant);
+    for (const auto& [name, bits] : kTable) if (q.find(name) != string::npos) return bits;
+    return 5.0;
+}
+
+void fill_missing_dims(ModelInfo& mi) {
+    if (mi.parameter_count <= 0 && mi.size_bytes > 0) {
+        mi.parameter_count = mi.size_bytes * 8.0 / quant_bits_per_weight(mi.quantization);
+    }
+    const double b = mi.parameter_count / 1e9;
+    if (mi.n_layers <= 0 || mi.embedding_length <= 0) {
+        // 代表的な dense モデルの構成（GQA は不明として安全側に全ヘッド分を見積もる）
+        struct Dim { double max_b; int layers; int embd; };
+        static const Dim kDims[] = {{2, 24, 2048}, {5, 28, 3072}, {10, 32, 4096}, {20, 40, 5120}, {40, 60, 6656}, {1e9, 80, 8192}};
+        for (const auto& d : kDims) {
+            if (b < d.max_b) {
+                if (mi.n_layers <= 0) mi.n_layers = d.layers;
+                if (mi.embedding_length <= 0) mi.embedding_length = d.embd;
+                break;
+            }
+        }
+    }
+    if (mi.n_heads <= 0) mi.n_heads = max(1, mi.embedding_length / 128);
+    if (mi.n_kv_heads <= 0) mi.n_kv_heads = mi.n_heads;
+    if (mi.head_dim <= 0) mi.head_dim = max(1, mi.embedding_length / mi.n_heads);
+}
+
+uint64_t estimate_weight_bytes(const ModelInfo& mi) {
+    if (mi.size_bytes > 0) return mi.size_bytes;
+    return static_cast<uint64_t>(mi.parameter_count * quant_bits_per_weight(mi.quantization) / 8.0);
+}
+
+uint64_t kv_bytes_per_token(const ModelInfo& mi) {
+    // K と V の2つ × 層数 × KVヘッド数 × ヘッド次元 × f16(2バイト)
+    return 2ull * static_cast<uint64_t>(mi.n_layers) * static_cast<uint64_t>(mi.n_kv_heads) * static_cast<uint64_t>(mi.head_dim) * 2ull;
+}
+
+ModelFit fit_model(const SystemInfo& si, const ModelInfo& info, double unified_gpu_ratio) {
+    constexpr uint64_t kMiB = 1024ull * 1024ull;
+    static const int kLadder[] = {2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536, 98304, 131072};
+    ModelInfo mi = info;
+    fill_missing_dims(mi);
+
+    ModelFit f;
+    f.n_layers = max(1, mi.n_layers);
+    f.weight_bytes = estimate_weight_bytes(mi);
+    f.kv_per_token = kv_bytes_per_token(mi);
+    const int native = mi.context_length > 0 ? mi.context_length : 131072;
+
+    // GPU で使える量（計算用バッファ分として 10% + 512MiB を残す）
+    uint64_t gpu_total = si.vram_mb * kMiB;
+    if (gpu_total == 0 && si.is_macos && si.is_apple_silicon) {
+        gpu_total = static_cast<uint64_t>(static_cast<double>(si.ram_bytes) * unified_gpu_ratio);
+    }
+    const uint64_t gpu_budget = gpu_total > 512*kMiB ? static_cast<uint64_t>((gpu_total - 512*kMiB) * 0.9) : 0;
+    // CPU 側へはみ出す分は RAM の 70% まで（OS と他プロセスのため）
+    const uint64_t ram_budget = static_cast<uint64_t>(static_cast<double>(si.ram_bytes) * 0.7);
+
+    const uint64_t per_layer = f.weight_bytes / static_cast<uint64_t>(f.n_layers);
+    const uint64_t kv_per_layer_tok = f.kv_per_token / static_cast<uint64_t>(f.n_layers);
+
+    // 全層オフロードで収まる最大のコンテキスト
+    int full_ctx = 0;
+    for (int c : kLadder) {
+        if (c > native) break;
+        if (f.weight_bytes + f.kv_per_token * static_cast<uint64_t>(c) <= gpu_budget) full_ctx = c;
+    }
+    if (full_ctx > 0) {
+        f.context = full_ctx;
+        f.gpu_layers = f.n_layers + 1; // 出力層を含めて全て
+        f.fully_offloaded = true;
+        return f;
+    }
+
+    // 部分オフロード / CPU のみ: 合計が VRAM+RAM に収まる最大コンテキストを選び、
+    // その KV を含めて VRAM に載る層数を求める
+    int ctx = 0;
+    for (int c : kLadder) {
+        if (c > native) break;
+        if (f.weight_bytes + f.kv_per_token * static_cast<uint64_t>(c) <= gpu_budget + ram_budget) ctx = c;
+    }
+    if (ctx == 0) { ctx = min(2048, native); f.fits_memory = false; } // 収まらない: 最小構成（ロード失敗の可能性あり）
+    f.context = ctx;
+    const uint64_t layer_cost = per_layer + kv_per_layer_tok * static_cast<uint64_t>(ctx);
+    f.gpu_layers = layer_cost > 0 ? static_cast<int>(min<uint64_t>(gpu_budget / layer_cost, static_cast<uint64_t>(f.n_layers))) : 0;
+    f.fully_offloaded = false;
+    return f;
+}
+
+InferenceTuning apply_model_fit(const InferenceTuning& base, const ModelFit& fit) {
+    InferenceTuning t = base;
+    if (fit.context > 0) t.context = fit.context;
+    t.gpu_layers = fit.gpu_layers;
+    t.model_fitted = true;
+    t.max_tokens = min(t.max_tokens, max(128, t.context / 2));
+    return t;
+}
+
+const char* fit_class_label(FitClass c) {
+    switch (c) {
+        case FitClass::Full: return "全層GPU";
+        case FitClass::Partial: return "一部CPU";
+        case FitClass::CpuOnly: return "CPUのみ";
+        case FitClass::TooLarge: return "メモリ不足";
+        default: return "不明";
+    }
+}
+
+double estimate_decode_tps(const SystemInfo& si, const ModelFit& fit) {
+    if (fit.weight_bytes == 0) return 0;
+    // 実効メモリ帯域（GB/s）の控えめな概算
+    double gpu_bw = si.has_nvidia ? 300 : (si.is_macos && si.is_apple_silicon) ? 100 : si.vram_mb > 0 ? 150 : 0;
+    const double cpu_bw = (si.is_macos && si.is_apple_silicon) ? 60 : 30;
+    double frac = fit.fully_offloaded ? 1.0 : min(1.0, static_cast<double>(fit.gpu_layers) / max(1, fit.n_layers));
+    if (gpu_bw <= 0) frac = 0;
+    const double gb = static_cast<double>(fit.weight_bytes) / 1e9;
+    double sec = gb * (1.0 - frac) / cpu_bw;
+    if (frac > 0) sec += gb * frac / gpu_bw;
+    return sec > 0 ? 1.0 / sec : 0;
+}
+
+static int class_order(FitClass c) { return static_cast<int>(c); }
+
+vector<ModelRank> rank_models(const SystemInfo& si, const vector<ModelInfo>& models, double unified_gpu_ratio,
+                              const function<double(const string&)>& measured_tps) {
+    vector<ModelRank> out;
+    for (const auto& mi : models) {
+        // 埋め込み専用モデルは対話に使えないので除外
+        if (lower(mi.name).find("embed") != string::npos) continue;
+        ModelRank r;
+        r.info = mi;
+        if (r.info.parameter_count <= 0) r.info.parameter_count = parse_parameter_size(mi.name);
+        if (r.info.parameter_count <= 0 && r.info.size_bytes == 0) { out.push_back(r); continue; }
+        fill_missing_dims(r.info);
+        r.fit = fit_model(si, r.info, unified_gpu_ratio);
+        if (!r.fit.fits_memory) r.cls = FitClass::TooLarge;
+        else if (r.fit.fully_offloaded) r.cls = FitClass::Full;
+        else if (r.fit.gpu_layers > 0) r.cls = FitClass::Partial;
+        else r.cls = FitClass::CpuOnly;
+        r.est_decode_tps = estimate_decode_tps(si, r.fit);
+        if (measured_tps) {
+            double m = measured_tps(mi.name);
+            if (m > 0) { r.est_decode_tps = m; r.measured = true; }
+        }
+        out.push_back(r);
+    }
+    stable_sort(out.begin(), out.end(), [](const ModelRank& a, const ModelRank& b){
+        if (a.cls != b.cls) return class_order(a.cls) < class_order(b.cls);
+        if (a.info.parameter_count != b.info.parameter_count) return a.info.parameter_count > b.info.parameter_count;
+        if (a.est_decode_tps != b.est_decode_tps) return a.est_decode_tps > b.est_decode_tps;
+        return a.info.name < b.info.name;
+    });
+    return out;
+}
+
+optional<ModelRank> pick_auto_model(const vector<ModelRank>& ranks, const AutoModelFloor& floor) {
+    const ModelRank* fastest = nullptr;
+    for (const auto& r : ranks) {
+        if (r.cls == FitClass::TooLarge || r.cls == FitClass::Unknown) continue;
+        if (r.info.parameter_count < floor.min_params) continue;
+        if (r.est_decode_tps >= floor.min_tps) return r; // ranks は良い順に並んでいる
+        if (!fastest || r.est_decode_tps > fastest->est_decode_tps) fastest = &r;
+    }
+    if (fastest) return *fastest;
+    return nullopt;
+}
+
+string format_model_ranking(const vector<ModelRank>& ranks, const string& current) {
+    ostringstream o;
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        const auto& r = ranks[i];
+        o << "  [" << (i+1) << "] " << (r.info.name == current ? "*" : "") << r.info.name << "  " << fit_class_label(r.cls);
+        if (r.cls != FitClass::Unknown) {
+            o << fixed << setprecision(1);
+            if (r.info.parameter_count > 0) o << ", " << r.info.parameter_count / 1e9 << "B";
+            if (!r.info.quantization.empty()) o << " " << r.info.quantization;
+            o << ", " << r.fit.weight_bytes / 1073741824.0 << "GB";
+            o << ", " << (r.measured ? "実測 " : "推定 ") << setprecision(0) << r.est_decode_tps << " tok/s";
+            o << ", ctx " << r.fit.context;
+            o << defaultfloat << setprecision(6);
+        }
+        o << "\n";
+    }
+    return o.str();
+}
+
+vector<string> order_models_by_rank(const vector<ModelRank>& ranks, const vector<string>& names, vector<ModelRank>* ranked) {
+    vector<string> out;
+    if (ranked) ranked->clear();
+    for (const auto& r : ranks) {
+        if (find(names.begin(), names.end(), r.info.name) == names.end()) continue;
+        if (find(out.begin(), out.end(), r.info.name) != out.end()) continue;
+        out.push_back(r.info.name);
+        if (ranked) ranked->push_back(r);
+    }
+    for (const auto& n : names) if (find(out.begin(), out.end(), n) == out.end()) out.push_back(n);
+    return out;
+}
+
+string model_series(const string& name) {
+    string s = lower(name);
+    if (auto slash = s.find_last_of('/'); slash != string::npos) s = s.substr(slash + 1);
+    if (auto colon = s.find(':'); colon != string::npos) s = s.substr(0, colon);
+    // 区切り（- _ 空白）の最初の語が系列名。サイズ表記（7b, 0.5b）が先頭に来ることはない
+    auto end = s.find_first_of("-_ ");
+    return end == string::npos ? s : s.substr(0, end);
+}
+
+optional<string> pick_draft_model(const ModelInfo& target, const vector<ModelInfo>& candidates) {
+    double tp = target.parameter_count > 0 ? target.parameter_count : parse_parameter_size(target.name);
+    if (tp <= 0) return nullopt;
+    const string series = model_series(target.name);
+    const string family = lower(target.family);
+    const ModelInfo* best = nullptr;
+    double best_p = 0;
+    bool best_family = false;
+    for (const auto& c : candidates) {
+        if (c.name == target.name) continue;
+        // ファミリー（LM Studio の arch）だけの一致は語彙が違うことがある（TinyLlama と Llama 3 は共に llama）ので系列名は必須。
+        // 両方がファミリーを報告していて食い違うものは除き、一致していれば同じ大きさのうちで優先する
+        if (model_series(c.name) != series) continue;
+        const string cf = lower(c.family);
+        if (!family.empty() && !cf.empty() && cf != family) continue;
+        bool same_family = !family.empty() && cf == family;
+        double p = c.parameter_count > 0 ? c.parameter_count : parse_parameter_size(c.name);
+        // 小さすぎず（100M以上）、十分に小さい（1/8以下）もののうち最大＝採択率が高い
+        if (p < 1e8 || p * 8 > tp) continue;
+        if (!best || p > best_p || (p == best_p && same_family && !best_family)) { best = &c; best_p = p; best_family = same_family; }
+    }
+    if (!best) return nullopt;
+    return best->name;
+}
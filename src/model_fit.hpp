@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include "system_info.hpp"
+
+// モデルのメタデータ（パラメータ数・量子化・層数など）と、それに基づくメモリ見積もり
+
+/// @brief バックエンドから取得したモデル情報。不明な項目は0/空
+struct ModelInfo {
+    std::string name;
+    std::string family;        // 例: llama, qwen2
+    std::string quantization;  // 例: Q4_K_M
+    double parameter_count = 0;
+    int n_layers = 0;
+    int embedding_length = 0;
+    int n_heads = 0;
+    int n_kv_heads = 0;
+    int head_dim = 0;          // key_length（不明なら embedding/heads）
+    int context_length = 0;    // ネイティブ最大コンテキスト
+    uint64_t size_bytes = 0;   // 重みファイルのサイズ（分かる場合）
+};
+
+/// @brief "8.0B" / "567M" / "llama3:70b" のような表記からパラメータ数を推定する。不明なら0
+double parse_parameter_size(const std::string& s);
+/// @brief 量子化名から1重みあたりのビット数を推定する（不明なら5）
+double quant_bits_per_weight(const std::string& quant);
+/// @brief 層数・次元が不明な場合にパラメータ数から代表的な構成で補う
+void fill_missing_dims(ModelInfo& mi);
+/// @brief 重みのバイト数（size_bytes が分かればそれを優先）
+uint64_t estimate_weight_bytes(const ModelInfo& mi);
+/// @brief 1トークンあたりの KV キャッシュのバイト数（f16 想定）
+uint64_t kv_bytes_per_token(const ModelInfo& mi);
+
+/// @brief メモリ量に収まる最大コンテキストとオフロード層数の算出結果
+struct ModelFit {
+    int context = 0;
+    int gpu_layers = 0;
+    int n_layers = 0;
+    bool fully_offloaded = false;
+    bool fits_memory = true;   // 最小コンテキストでも VRAM+RAM に収まらなければ false
+    uint64_t weight_bytes = 0;
+    uint64_t kv_per_token = 0;
+};
+
+/// @brief VRAM/RAM（余裕を残す）に収まる最大のコンテキスト長とオフロード層数を選ぶ
+/// @param unified_gpu_ratio 統合メモリ環境で GPU が使えるとみなす RAM 比率
+ModelFit fit_model(const SystemInfo& si, const ModelInfo& mi, double unified_gpu_ratio = 0.5);
+/// @brief fit_model の結果を推論パラメータへ反映する（context/gpu_layers のみ）
+InferenceTuning apply_model_fit(const InferenceTuning& base, const ModelFit& fit);
+
+/// @brief インストール済みモデルの当てはまり具合（良い順）
+enum class FitClass { Full, Partial, CpuOnly, TooLarge, Unknown };
+const char* fit_class_label(FitClass c);
+
+/// @brief 推奨順位付けの1件
+struct ModelRank {
+    ModelInfo info;
+    ModelFit fit;
+    FitClass cls = FitClass::Unknown;
+    double est_decode_tps = 0; // 推定（measured なら実測）の decode 速度
+    bool measured = false;
+};
+
+/// @brief メモリ帯域と GPU/CPU の配分から decode tok/s を概算する（重みを毎トークン1回読む前提）
+double estimate_decode_tps(const SystemInfo& si, const ModelFit& fit);
+
+/// @brief 各モデルを fit_model で当てはめ、FitClass→品質（パラメータ数）→速度の順に並べる
+/// @param measured_tps モデル名から実測 decode tok/s を返す（不明なら 0 以下）。あれば推定値より優先
+std::vector<ModelRank> rank_models(const SystemInfo& si, const std::vector<ModelInfo>& models,
+                                   double unified_gpu_ratio = 0.5,
+                                   const std::function<double(const std::string&)>& measured_tps = {});
+
+/// @brief --model auto の下限条件
+struct AutoModelFloor {
+    double min_params = 0;  // パラメータ数の下限（品質の目安）
+    double min_tps = 8;     // decode tok/s の下限（対話で待てる速さ）
+};
+
+/// @brief 下限を満たす最上位のモデルを選ぶ。速度の下限を満たすものが無ければ最速のものにフォールバック
+std::optional<ModelRank> pick_auto_model(const std::vector<ModelRank>& ranks, const AutoModelFloor& floor);
+
+/// @brief /model rank 用の表
+std::string format_model_ranking(const std::vector<ModelRank>& ranks, const std::string& current);
+/// @brief names にある順位付け済みのモデルを順位順に、残り（埋め込みモデル等）を元の順で後ろに並べる
+/// @param ranked 非nullなら names に含まれていた順位付け済みのもの（並べた先頭部分と同じ順）を返す
+std::vector<std::string> order_models_by_rank(const std::vector<ModelRank>& ranks, const std::vector<std::string>& names,
+                                              std::vector<ModelRank>* ranked = nullptr);
+
+/// @brief モデル名から系列名を取り出す（"Qwen2.5-7B-Instruct-GGUF" → "qwen2.5", "llama3.1:8b" → "llama3.1"）
+std::string model_series(const std::string& name);
+/// @brief 投機的デコード用のドラフトモデルを選ぶ（同じ系列で、パラメータ数が 1/8 以下の最大のもの）。
+/// ファミリーは両方が報告していれば一致を求め、同じ大きさなら一致するものを選ぶ
+std::optional<std::string> pick_draft_model(const ModelInfo& target, const std::vector<ModelInfo>& candidates);
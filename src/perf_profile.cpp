@@ -0,0 +1,191 @@
+#include "perf_profile.hpp"
+#include "config.hpp"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static double median_of(vector<double> v) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    size_t n = v.size();
+    return (n % 2) ? v[n/2] : (v[n/2-1] + v[n/2]) / 2.0;
+}
+
+// context に近い（1/2〜2倍）サンプルの値を集める。該当が無ければ全サンプル
+template <class F>
+static vector<double> values_near(const vector<PerfSample>& samples, int context, F get) {
+    vector<double> near, all;
+    for (const auto& s : samples) {
+        double v = get(s);
+        if (v <= 0) continue;
+        all.push_back(v);
+        if (s.context >= context/2 && s.context <= context*2) near.push_back(v);
+    }
+    return near.empty() ? all : near;
+}
+
+void PerfProfile::add(const PerfSample& s) {
+    samples.push_back(s);
+    if (samples.size() > kMaxSamples) samples.erase(samples.begin(), samples.begin() + (samples.size() - kMaxSamples));
+}
+
+double PerfProfile::prefill_tps_at(int context) const {
+    return median_of(values_near(samples, context, [](const PerfSample& s){ return s.prefill_tps; }));
+}
+
+double PerfProfile::decode_tps_at(int context) const {
+    return median_of(values_near(samples, context, [](const PerfSample& s){ return s.decode_tps; }));
+}
+
+long PerfProfile::typical_prompt_tokens() const {
+    vector<double> v;
+    for (const auto& s : samples) if (s.prompt_tokens > 0) v.push_back(static_cast<double>(s.prompt_tokens));
+    return static_cast<long>(median_of(v));
+}
+
+// TSV区切りを壊さないようタブ・改行を空白へ
+static string sanitize_field(string s) {
+    for (auto& c : s) if (c=='\t' || c=='\n' || c=='\r') c = ' ';
+    return s;
+}
+
+// TSV に書く形と同じにして、保存・読み込みの前後で同じプロファイルを指すようにする
+static string profile_key(const string& machine, const string& model) { return sanitize_field(machine) + "\t" + sanitize_field(model); }
+
+PerfProfile& PerfStore::at(const string& machine, const string& model) {
+    return profiles[profile_key(machine, model)];
+}
+
+const PerfProfile* PerfStore::find(const string& machine, const string& model) const {
+    auto it = profiles.find(profile_key(machine, model));
+    return it == profiles.end() ? nullptr : &it->second;
+}
+
+string machine_fingerprint(const SystemInfo& si) {
+    ostringstream oss;
+    oss << (si.is_macos ? "macos" : si.is_linux ? "linux" : si.is_windows ? "windows" : "unknown");
+    oss << "|" << sanitize_field(si.gpu_name);
+    oss << "|vram=" << si.vram_mb;
+    oss << "|ram=" << (si.ram_bytes / (1024ull*1024ull*1024ull));
+    return oss.str();
+}
+
+bool make_perf_sample(const GenerationStats& st, int context, PerfSample& out) {
+    double pf = st.prefill_tps(), dc = st.decode_tps();
+    if (pf <= 0 || dc <= 0) return false;
+    out = PerfSample{};
+    out.context = context;
+    out.prompt_tokens = st.prompt_tokens;
+    out.prefill_tps = pf;
+    out.decode_tps = dc;
+    out.load_ms = st.load_ms > 0 ? st.load_ms : 0;
+    return true;
+}
+
+fs::path default_perf_profile_path() {
+    return default_config_path().parent_path() / "perf_profile.tsv";
+}
+
+static string format_line(const string& machine, const string& model, const PerfSample& s) {
+    ostringstream oss;
+    oss << sanitize_field(machine) << '\t' << sanitize_field(model) << '\t'
+        << s.context << '\t' << s.prompt_tokens << '\t'
+        << s.prefill_tps << '\t' << s.decode_tps << '\t' << s.load_ms << '\n';
+    return oss.str();
+}
+
+bool load_perf_store(PerfStore& store, const fs::path& path) {
+    ifstream ifs(path, ios::binary);
+    if (!ifs) return true;
+    string line;
+    while (getline(ifs, line)) {
+        vector<string> f; string cur;
+        istringstream iss(line);
+        while (getline(iss, cur, '\t')) f.push_back(cur);
+        if (f.size() < 7) continue; // 壊れた行は読み飛ばす
+        PerfSample s;
+        try {
+            s.context = stoi(f[2]);
+            s.prompt_tokens = stol(f[3]);
+            s.prefill_tps = stod(f[4]);
+            s.decode_tps = stod(f[5]);
+            s.load_ms = stod(f[6]);
+        } catch (...) {
+            continue;
+        }
+        store.at(f[0], f[1]).add(s);
+    }
+    return true;
+}
+
+bool append_perf_sample(const fs::path& path, const string& machine, const string& model, const PerfSample& s) {
+    std::error_code ec; fs::create_directories(path.parent_path(), ec);
+    ofstream ofs(path, ios::binary | ios::app);
+    if (!ofs) return false;
+    ofs << format_line(machine, model, s);
+    return static_cast<bool>(ofs);
+}
+
+bool save_perf_store(const PerfStore& store, const fs::path& path) {
+    std::error_code ec; fs::create_directories(path.parent_path(), ec);
+    ofstream ofs(path, ios::binary | ios::trunc);
+    if (!ofs) return false;
+    for (const auto& [key, prof] : store.profiles) {
+        auto tab = key.find('\t');
+        string machine = key.substr(0, tab), model = key.substr(tab+1);
+        for (const auto& s : prof.samples) ofs << format_line(machine, model, s);
+    }
+    return static_cast<bool>(ofs);
+}
+
+// メモリ量から見たコンテキスト長の上限（モデル非依存の安全側の目安）
+static int memory_context_cap(const SystemInfo& si) {
+    const uint64_t ram_gb = si.ram_bytes / (1024ull*1024ull*1024ull);
+    int cap;
+    if (si.vram_mb >= 20000) cap = 32768;
+    else if (si.vram_mb >= 12000) cap = 16384;
+    else if (si.vram_mb >= 8000) cap = 8192;
+    else if (si.vram_mb >= 4000) cap = 4096;
+    else if (si.is_macos && si.is_apple_silicon) cap = ram_gb >= 32 ? 16384 : ram_gb >= 16 ? 8192 : 4096;
+    else cap = ram_gb >= 32 ? 8192 : 4096;
+    if (ram_gb <= 8) cap = std::min(cap, 2048);
+    return cap;
+}
+
+InferenceTuning decide_tuning(const SystemInfo& si, const PerfProfile& profile, double latency_target_ms, int context_cap) {
+    InferenceTuning t = decide_tuning(si);
+    if (profile.empty() || latency_target_ms <= 0) return t;
+    const double target_s = latency_target_ms / 1000.0;
+    const int cap = context_cap > 0 ? context_cap : memory_context_cap(si);
+    const long prompt = std::max(256L, profile.typical_prompt_tokens());
+    static const int kLadder[] = {2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536, 98304, 131072};
+
+    bool found = false;
+    for (int c : kLadder) {
+        if (c > cap) break;
+        double pf = profile.prefill_tps_at(c), dc = profile.decode_tps_at(c);
+        if (pf <= 0 || dc <= 0) continue;
+        if (prompt + 128 > c) continue; // 典型的なプロンプトが入らない
+        // 典型プロンプトの処理後に残る時間を生成へ充てる
+        double remain = target_s - prompt / pf;
+        if (remain <= 0) continue;
+        int max_tok = static_cast<int>(remain * dc) / 64 * 64;
+        max_tok = std::clamp(max_tok, 128, 4096);
+        max_tok = std::min<int>(max_tok, c - static_cast<int>(prompt));
+        // コンテキストの半分までプロンプトが伸びても prefill が目標時間内に収まること
+        if ((c / 2.0) / pf > target_s) continue;
+        t.context = c;
+        t.max_tokens = max_tok;
+        found = true;
+    }
+    if (!found) {
+        // 目標を満たす構成が無い: 最小構成で生成量を絞る
+        double dc = profile.decode_tps_at(2048);
+        t.context = std::min(t.context, 2048);
+        if (dc > 0) t.max_tokens = std::max(128, std::min(t.max_tokens, static_cast<int>(dc * target_s * 0.5) / 64 * 64));
+    }
+    return t;
+}
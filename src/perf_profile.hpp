@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include "system_info.hpp"
+#include "chat.hpp"
+
+// 実測スループットの記録（マシン×モデル単位）と、それに基づく推論パラメータ調整
+
+/// @brief 1回の生成で得られた実測値
+struct PerfSample {
+    int context = 0;         // 送信時の num_ctx
+    long prompt_tokens = 0;  // 実際のプロンプト長
+    double prefill_tps = 0;  // tok/s
+    double decode_tps = 0;   // tok/s
+    double load_ms = 0;      // モデルロード時間（不明なら0）
+};
+
+/// @brief マシン×モデルの実測プロファイル（直近サンプルのみ保持）
+struct PerfProfile {
+    static constexpr size_t kMaxSamples = 32;
+    std::vector<PerfSample> samples; // 古い順
+
+    void add(const PerfSample& s);
+    bool empty() const { return samples.empty(); }
+    /// @brief 指定コンテキスト長に近いサンプルから推定した prefill/decode 速度（中央値）。不明なら0
+    double prefill_tps_at(int context) const;
+    double decode_tps_at(int context) const;
+    /// @brief 直近のプロンプト長の中央値
+    long typical_prompt_tokens() const;
+};
+
+/// @brief 全プロファイル。キーは machine_fingerprint と モデル名
+struct PerfStore {
+    std::map<std::string, PerfProfile> profiles;
+    PerfProfile& at(const std::string& machine, const std::string& model);
+    const PerfProfile* find(const std::string& machine, const std::string& model) const;
+};
+
+/// @brief GPU名・VRAM・RAMからマシンを識別する文字列
+std::string machine_fingerprint(const SystemInfo& si);
+/// @brief 生成統計からサンプルを作る。prefill/decode 速度が得られない場合は false
+bool make_perf_sample(const GenerationStats& st, int context, PerfSample& out);
+
+std::filesystem::path default_perf_profile_path();
+/// @brief TSV（1行1サンプル）から読み込む。ファイルが無ければ空のまま true
+bool load_perf_store(PerfStore& store, const std::filesystem::path& path);
+/// @brief 1サンプルを追記する（毎ターン呼んでも安価）
+bool append_perf_sample(const std::filesystem::path& path, const std::string& machine, const std::string& model, const PerfSample& s);
+/// @brief 保持上限を超えた古いサンプルを落として書き直す
+bool save_perf_store(const PerfStore& store, const std::filesystem::path& path);
+
+/// @brief 実測プロファイルとレイテンシ目標（初回応答までのミリ秒）から context/max_tokens を決める
+/// @param context_cap メモリ上のコンテキスト上限（fit_model の結果など）。0 ならメモリ量からの目安を使う
+/// @note プロファイルが空なら decide_tuning(si) と同じ値を返す
+InferenceTuning decide_tuning(const SystemInfo& si, const PerfProfile& profile, double latency_target_ms, int context_cap = 0);
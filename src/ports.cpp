@@ -15,4 +15,12 @@ namespace default_ports {
         return utils::http_post_json(url, json, headers);
     }
 
+    std::optional<std::string> Http::post_json_timed(const std::string& url, const std::string& json, const std::vector<std::string>& headers, HttpTiming& timing) {
+        return utils::http_post_json(url, json, headers, &timing);
+    }
+
+    std::optional<std::string> Http::post_json_stream(const std::string& url, const std::function<void(std::ostream&)>& write_body, const std::vector<std::string>& headers, HttpTiming& timing) {
+        return utils::http_post_json_stream(url, write_body, headers, &timing);
+    }
+
 }
@@ -3,6 +3,8 @@
 #include <vector>
 #include <functional>
 #include <optional>
+#include <ostream>
+#include <sstream>
 
 // 依存関係逆転の原則（DIP）に基づき、外部環境（シェル、HTTP通信）への依存を抽象化するインターフェース群。
 // これにより、ビジネスロジックと具体的な実装を分離し、テスト容易性を向上させる。
@@ -12,11 +14,30 @@ struct IShell {
     virtual std::string run(const std::string& cmd) = 0;
 };
 
+/// @brief HTTPリクエストの上限時間（呼び出し側が設定）と、クライアント側計測値（ミリ秒、不明なら負数）
+struct HttpTiming {
+    int timeout_sec = 10; // 転送全体の上限（curl の --max-time。0=無制限）。生成やモデルのロードを待つ要求は長くする
+    double ttfb_ms = -1;  // 応答の最初のバイトまで
+    double total_ms = -1; // 転送完了まで
+};
+
 /// @brief HTTP通信の抽象インターフェース
 struct IHttp {
     virtual ~IHttp() = default;
     virtual std::optional<std::string> get(const std::string& url, const std::vector<std::string>& headers = {}) = 0;
     virtual std::optional<std::string> post_json(const std::string& url, const std::string& json, const std::vector<std::string>& headers = {}) = 0;
+    /// @brief 計測付きPOST。計測できない実装では post_json に委譲し timing は未設定のまま
+    virtual std::optional<std::string> post_json_timed(const std::string& url, const std::string& json, const std::vector<std::string>& headers, HttpTiming& timing) {
+        (void)timing;
+        return post_json(url, json, headers);
+    }
+    /// @brief 本文を write_body で直接書き出して POST する（大きな本文を文字列に組み立てない）
+    /// @note ストリーム送信できない実装では文字列に書き出して post_json_timed に委譲する
+    virtual std::optional<std::string> post_json_stream(const std::string& url, const std::function<void(std::ostream&)>& write_body, const std::vector<std::string>& headers, HttpTiming& timing) {
+        std::ostringstream os;
+        write_body(os);
+        return post_json_timed(url, os.str(), headers, timing);
+    }
 };
 
 // `utils`内の関数を利用する、インターフェースの標準実装。
@@ -29,6 +50,8 @@ namespace default_ports {
     struct Http : IHttp {
         std::optional<std::string> get(const std::string& url, const std::vector<std::string>& headers = {}) override;
         std::optional<std::string> post_json(const std::string& url, const std::string& json, const std::vector<std::string>& headers = {}) override;
+        std::optional<std::string> post_json_timed(const std::string& url, const std::string& json, const std::vector<std::string>& headers, HttpTiming& timing) override;
+        std::optional<std::string> post_json_stream(const std::string& url, const std::function<void(std::ostream&)>& write_body, const std::vector<std::string>& headers, HttpTiming& timing) override;
     };
 }
 
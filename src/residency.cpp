@@ -0,0 +1,86 @@
+#include "residency.hpp"
+#include "utils.hpp"
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+bool same_model(const string& a, const string& b) {
+    if (a == b) return true;
+    const string tag = ":latest";
+    return a + tag == b || b + tag == a;
+}
+
+string gb(double bytes) {
+    if (bytes < 0) return "-";
+    ostringstream o; o << fixed << setprecision(1) << bytes / 1073741824.0 << "GB";
+    return o.str();
+}
+}
+
+vector<ResidentModel> parse_ollama_ps(const string& body) {
+    vector<ResidentModel> out;
+    for (const auto& obj : utils::json_array_objects(body, "models")) {
+        ResidentModel r;
+        if (!utils::json_find_first_string_value(obj, "name", r.name) &&
+            !utils::json_find_first_string_value(obj, "model", r.name)) continue;
+        double v = 0;
+        if (utils::json_find_last_number_value(obj, "size", v)) r.size_bytes = v;
+        if (utils::json_find_last_number_value(obj, "size_vram", v)) r.vram_bytes = v;
+        if (utils::json_find_last_number_value(obj, "context_length", v)) r.context_length = static_cast<int>(v);
+        utils::json_find_first_string_value(obj, "expires_at", r.expires_at);
+        out.push_back(r);
+    }
+    return out;
+}
+
+vector<ResidentModel> parse_lmstudio_loaded(const string& body) {
+    vector<ResidentModel> out;
+    for (const auto& obj : utils::json_array_objects(body, "data")) {
+        string state;
+        if (!utils::json_find_first_string_value(obj, "state", state) || state != "loaded") continue;
+        ResidentModel r;
+        if (!utils::json_find_first_string_value(obj, "id", r.name)) continue;
+        double v = 0;
+        if (utils::json_find_last_number_value(obj, "loaded_context_length", v)) r.context_length = static_cast<int>(v);
+        out.push_back(r);
+    }
+    return out;
+}
+
+const ResidentModel* find_resident(const vector<ResidentModel>& rs, const string& model) {
+    for (const auto& r : rs) if (same_model(r.name, model)) return &r;
+    return nullptr;
+}
+
+vector<string> idle_residents(const vector<ResidentModel>& rs, const string& keep) {
+    vector<string> out;
+    for (const auto& r : rs) if (!same_model(r.name, keep)) out.push_back(r.name);
+    return out;
+}
+
+string format_residency_table(const vector<ResidentModel>& rs, const string& current) {
+    ostringstream o;
+    o << "  " << left << setw(32) << "model" << right << setw(9) << "total" << setw(9) << "VRAM" << setw(9) << "RAM"
+      << setw(6) << "GPU" << setw(8) << "ctx" << "  expires\n";
+    for (const auto& r : rs) {
+        string name = (same_model(r.name, current) ? "*" : " ") + r.name;
+        o << "  " << left << setw(32) << name << right << setw(9) << gb(r.size_bytes) << setw(9) << gb(r.vram_bytes)
+          << setw(9) << gb(r.ram_bytes());
+        double f = r.gpu_fraction();
+        if (f >= 0) o << setw(5) << static_cast<int>(f * 100 + 0.5) << "%"; else o << setw(6) << "-";
+        if (r.context_length > 0) o << setw(8) << r.context_length; else o << setw(8) << "-";
+        o << "  " << (r.expires_at.empty() ? "-" : r.expires_at) << "\n";
+    }
+    return o.str();
+}
+
+string format_offload_warning(const ResidentModel& r) {
+    if (!r.partially_offloaded()) return string();
+    ostringstream o;
+    o << "[警告] " << r.name << " は一部のみ GPU に載っています（VRAM " << gb(r.vram_bytes) << " / RAM " << gb(r.ram_bytes())
+      << "、GPU " << static_cast<int>(r.gpu_fraction() * 100 + 0.5) << "%）。デコード速度が数倍落ちます。"
+      << "/ps unload idle で他モデルを解放するか、/ctx で context を縮めてください。";
+    return o.str();
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// サーバ上に常駐しているモデル（Ollama /api/ps, LM Studio /api/v0/models の loaded）の把握
+
+/// @brief 常駐中のモデル1件。サイズは bytes、不明な値は負
+struct ResidentModel {
+    std::string name;
+    double size_bytes = -1;  // 重み＋KVキャッシュ等の総量
+    double vram_bytes = -1;  // うち GPU に載っている量
+    int context_length = 0;
+    std::string expires_at;  // keep_alive による解放予定時刻（Ollama）
+
+    double ram_bytes() const { return (size_bytes >= 0 && vram_bytes >= 0) ? size_bytes - vram_bytes : -1; }
+    /// @brief GPU に載っている割合（0〜1、不明なら -1）
+    double gpu_fraction() const { return (size_bytes > 0 && vram_bytes >= 0) ? vram_bytes / size_bytes : -1; }
+    /// @brief 一部の層が CPU/RAM に溢れている（デコードが数倍遅くなる状態）
+    bool partially_offloaded() const { double f = gpu_fraction(); return f > 0 && f < 0.995; }
+};
+
+/// @brief Ollama /api/ps の応答を解析する
+std::vector<ResidentModel> parse_ollama_ps(const std::string& body);
+/// @brief LM Studio /api/v0/models の応答から state=loaded のものだけを取り出す
+std::vector<ResidentModel> parse_lmstudio_loaded(const std::string& body);
+
+/// @brief 名前で探す（"llama3" と "llama3:latest" は同一視）
+const ResidentModel* find_resident(const std::vector<ResidentModel>& rs, const std::string& model);
+/// @brief keep 以外の常駐モデル名（切替前に解放を提案する候補）
+std::vector<std::string> idle_residents(const std::vector<ResidentModel>& rs, const std::string& keep);
+
+/// @brief /ps 用の表（名前, 合計, VRAM, RAM, GPU%, ctx, 解放予定）
+std::string format_residency_table(const std::vector<ResidentModel>& rs, const std::string& current);
+/// @brief 一部オフロード時の警告文（問題なければ空）
+std::string format_offload_warning(const ResidentModel& r);
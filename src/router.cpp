@@ -0,0 +1,83 @@
+#include "router.hpp"
+#include "chat.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+bool looks_like_code(const string& p) {
+    if (p.find("```") != string::npos) return true;
+    static const char* kMarkers[] = {
+        "#include", "def ", "function ", "class ", "return ", "=>", "::", "();", "{\n", "import ", "SELECT ",
+        "コード", "実装", "関数", "リファクタ", "バグ", "コンパイル", "デバッグ", "スクリプト",
+    };
+    for (const char* m : kMarkers) if (p.find(m) != string::npos) return true;
+    // 記号が多い入力（スタックトレースや式など）
+    size_t sym = count_if(p.begin(), p.end(), [](char c){ return c=='{' || c=='}' || c==';' || c=='(' || c==')' || c=='<' || c=='>'; });
+    return p.size() >= 40 && sym * 12 >= p.size();
+}
+
+RouteDecision route_prompt(const RouteConfig& rc, const string& prompt, bool agent_mode, const string& current_model) {
+    RouteDecision d;
+    d.prompt_tokens = estimate_tokens(prompt);
+    const string large = rc.large_model.empty() ? current_model : rc.large_model;
+    d.model = large;
+    if (!rc.enabled || rc.small_model.empty()) { d.reason = "off"; d.model = current_model; return d; }
+    if (agent_mode) { d.reason = "agent"; return d; }
+    if (d.prompt_tokens > rc.max_small_tokens) { d.reason = "long"; return d; }
+    if (looks_like_code(prompt)) { d.reason = "code"; return d; }
+    if (count(prompt.begin(), prompt.end(), '\n') >= 5) { d.reason = "multiline"; return d; }
+    d.model = rc.small_model;
+    d.small = true;
+    d.reason = "short";
+    return d;
+}
+
+optional<string> pick_small_model(const vector<ModelRank>& ranks, const string& large) {
+    const ModelRank* best = nullptr;
+    for (int pass = 0; pass < 2 && !best; ++pass) {
+        for (const auto& r : ranks) {
+            if (r.cls != FitClass::Full || r.info.name == large) continue;
+            if (pass == 0 && r.info.parameter_count < 1e9) continue; // 小さすぎるモデルは最後の手段
+            if (!best || r.est_decode_tps > best->est_decode_tps) best = &r;
+        }
+    }
+    if (!best) return nullopt;
+    return best->info.name;
+}
+
+double estimate_chat_ms(const PerfProfile* profile, int context, long prompt_tokens, long completion_tokens) {
+    if (!profile || profile->empty()) return -1;
+    double pf = profile->prefill_tps_at(context), dc = profile->decode_tps_at(context);
+    if (pf <= 0 || dc <= 0) return -1;
+    return max(0L, prompt_tokens) * 1000.0 / pf + max(0L, completion_tokens) * 1000.0 / dc;
+}
+
+void RouteTally::add(const RouteDecision& d, optional<double> saved) {
+    if (d.small) ++small_turns; else ++large_turns;
+    if (d.small && saved) {
+        saved_ms += *saved;
+        ++estimated_turns;
+    }
+}
+
+fs::path default_route_log_path() {
+    return default_config_path().parent_path() / "route_log.tsv";
+}
+
+bool append_route_log(const fs::path& path, const RouteDecision& d, double actual_ms, double large_est_ms) {
+    std::error_code ec; fs::create_directories(path.parent_path(), ec);
+    ofstream ofs(path, ios::binary | ios::app);
+    if (!ofs) return false;
+    time_t now = time(nullptr);
+    ofs << put_time(localtime(&now), "%Y-%m-%dT%H:%M:%S") << '\t' << d.reason << '\t' << d.model << '\t'
+        << d.prompt_tokens << '\t' << static_cast<long>(actual_ms) << '\t';
+    if (large_est_ms >= 0 && actual_ms >= 0) ofs << static_cast<long>(large_est_ms) << '\t' << static_cast<long>(large_est_ms - actual_ms);
+    else ofs << "-\t-";
+    ofs << '\n';
+    return static_cast<bool>(ofs);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+#include "model_fit.hpp"
+#include "perf_profile.hpp"
+
+// 小さく速いモデルで答え、長文・コード・/auto は大きいモデルへ回すカスケードルーティング
+
+/// @brief ルーティング設定。large が空なら現在のモデルを使う
+struct RouteConfig {
+    bool enabled = false;
+    std::string small_model;
+    std::string large_model;
+    long max_small_tokens = 400; // これを超えるプロンプトは large へ
+};
+
+/// @brief 1ターン分の振り分け結果
+struct RouteDecision {
+    std::string model;
+    bool small = false;
+    std::string reason;       // short / long / code / multiline / agent / escalate / off
+    long prompt_tokens = 0;   // 概算
+};
+
+/// @brief コードらしさ（フェンス、記号の密度、コード関連の語）を判定する
+bool looks_like_code(const std::string& prompt);
+
+/// @brief プロンプトと状態から振り分け先を決める
+/// @param current_model ルーティング無効時、または large 未設定時に使うモデル
+RouteDecision route_prompt(const RouteConfig& rc, const std::string& prompt, bool agent_mode, const std::string& current_model);
+
+/// @brief 順位付け結果から small 候補を選ぶ（全層GPUで最速、1B 以上を優先。large と同じものは除く）
+std::optional<std::string> pick_small_model(const std::vector<ModelRank>& ranks, const std::string& large);
+
+/// @brief large で同じ質問に答えた場合の推定時間（ミリ秒）。プロファイルが空なら負数
+double estimate_chat_ms(const PerfProfile* profile, int context, long prompt_tokens, long completion_tokens);
+
+/// @brief セッション中の振り分け集計
+struct RouteTally {
+    int small_turns = 0;
+    int large_turns = 0;
+    double saved_ms = 0;      // 推定できたターンの合計
+    int estimated_turns = 0;
+    /// @param saved_ms large で答えた場合との差（推定できなければ nullopt）
+    void add(const RouteDecision& d, std::optional<double> saved_ms);
+};
+
+std::filesystem::path default_route_log_path();
+/// @brief 1ターン分を TSV に追記する（時刻, 理由, モデル, トークン概算, 実測ms, large推定ms, 短縮ms）
+bool append_route_log(const std::filesystem::path& path, const RouteDecision& d, double actual_ms, double large_est_ms);
@@ -0,0 +1,232 @@
+#include "session.hpp"
+#include "config.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+const char* kMagic = "agens-session 1";
+
+string escape_field(const string& s) {
+    string out; out.reserve(s.size() + 8);
+    for (char c : s) {
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '\t': out += "\\t"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            default: out += c;
+        }
+    }
+    return out;
+}
+
+string unescape_field(string_view s) {
+    string out; out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 >= s.size()) { out += s[i]; continue; }
+        char n = s[++i];
+        out += (n=='t') ? '\t' : (n=='n') ? '\n' : (n=='r') ? '\r' : n;
+    }
+    return out;
+}
+
+vector<string_view> split_tabs(string_view line) {
+    vector<string_view> f;
+    size_t b = 0;
+    for (size_t i = 0; i <= line.size(); ++i) {
+        if (i == line.size() || line[i] == '\t') { f.push_back(line.substr(b, i - b)); b = i + 1; }
+    }
+    return f;
+}
+
+long to_long(string_view s) { try { return stol(string(s)); } catch (...) { return 0; } }
+double to_double(string_view s) { try { return stod(string(s)); } catch (...) { return -1; } }
+}
+
+fs::path default_session_dir() {
+    return default_config_path().parent_path() / "sessions";
+}
+
+fs::path session_path(const string& id) {
+    return default_session_dir() / (id + ".log");
+}
+
+string new_session_id() {
+    time_t now = time(nullptr);
+    ostringstream o; o << put_time(localtime(&now), "%Y%m%d-%H%M%S");
+    // 同じ秒に起動した別セッションと混ざらないようにする
+    string id = o.str();
+    std::error_code ec;
+    for (int n = 2; fs::exists(session_path(id), ec); ++n) id = o.str() + "-" + to_string(n);
+    return id;
+}
+
+vector<string> list_sessions(const fs::path& dir) {
+    vector<string> ids;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() == ".log") ids.push_back(it->path().stem().string());
+    }
+    // ID は時刻なので文字列の降順が新しい順
+    sort(ids.begin(), ids.end(), greater<string>());
+    return ids;
+}
+
+SessionState parse_session_log(string_view text) {
+    SessionState st;
+    size_t pos = 0;
+    bool first = true;
+    while (pos < text.size()) {
+        size_t nl = text.find('\n', pos);
+        if (nl == string_view::npos) break; // 書き込み途中の末尾行
+        string_view line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        if (first) { first = false; continue; }
+        auto f = split_tabs(line);
+        const string_view kind = f[0];
+        ++st.records;
+        if (kind == "msg" && f.size() >= 3) {
+            auto role = parse_role(f[1]);
+            if (role) st.history.emplace_back(*role, unescape_field(f[2]));
+            else --st.records;
+        }
+        else if (kind == "pop" && f.size() >= 2) {
+            size_t n = min<size_t>(st.history.size(), static_cast<size_t>(max(0L, to_long(f[1]))));
+            st.history.resize(st.history.size() - n);
+        }
+        else if (kind == "clear") st.history.clear();
+        else if (kind == "backend" && f.size() >= 2) st.backend = unescape_field(f[1]);
+        else if (kind == "model" && f.size() >= 2) st.model = unescape_field(f[1]);
+        else if (kind == "cwd" && f.size() >= 2) st.cwd = unescape_field(f[1]);
+        else if (kind == "auto" && f.size() >= 2) st.auto_mode = (f[1] == "1");
+        else if (kind == "attach" && f.size() >= 2) {
+            string p = unescape_field(f[1]);
+            if (find(st.attachments.begin(), st.attachments.end(), p) == st.attachments.end()) st.attachments.push_back(p);
+        }
+        else if (kind == "detach" && f.size() >= 2) {
+            string p = unescape_field(f[1]);
+            st.attachments.erase(remove(st.attachments.begin(), st.attachments.end(), p), st.attachments.end());
+        }
+        else if (kind == "kv" && f.size() >= 3) { st.kv_file = unescape_field(f[1]); st.kv_model = unescape_field(f[2]); }
+        else if (kind == "tune" && f.size() >= 6) {
+            InferenceTuning t;
+            t.context = static_cast<int>(to_long(f[1]));
+            t.max_tokens = static_cast<int>(to_long(f[2]));
+            t.temperature = to_double(f[3]);
+            t.top_p = to_double(f[4]);
+            t.keep_alive = unescape_field(f[5]);
+            st.tune = t;
+        }
+        else --st.records;
+    }
+    return st;
+}
+
+bool load_session(const fs::path& path, SessionState& out, string* err) {
+    trace::Span span("session.load", "session");
+    MappedFile mf;
+    if (!mf.open(path.string(), err)) return false;
+    string_view text = mf.view();
+    if (text.substr(0, text.find('\n')) != kMagic) {
+        if (err) *err = "セッションログではありません: " + path.string();
+        return false;
+    }
+    out = parse_session_log(text);
+    out.id = path.stem().string();
+    return true;
+}
+
+vector<ChatMsg> fit_history(const vector<ChatMsg>& history, long budget_tokens) {
+    size_t start = history.size();
+    long used = 0;
+    while (start > 0) {
+        long t = estimate_tokens(history[start-1].content()) + 4; // role 等の区切り分
+        if (used + t > budget_tokens) break;
+        used += t;
+        --start;
+    }
+    // 途中の assistant から始めない
+    while (start < history.size() && history[start].role != Role::User) ++start;
+    // 本文は共有されるのでコピーは参照の複製のみ
+    return vector<ChatMsg>(history.begin() + static_cast<long>(start), history.end());
+}
+
+bool pop_last_turn(vector<ChatMsg>& history, string_view question) {
+    size_t n = history.size();
+    if (n < 2 || history[n-2].role != Role::User || history[n-1].role != Role::Assistant) return false;
+    if (history[n-2].content() != question) return false;
+    history.resize(n - 2);
+    return true;
+}
+
+void SessionLog::start(const string& id, const fs::path& dir) {
+    if (ofs_.is_open()) ofs_.close();
+    id_ = id;
+    path_ = dir / (id + ".log");
+    last_tune_.clear();
+    // 再開したログはすぐ開く（/clear・/attach rm 等を書き込みの有無によらず追記できるように）。
+    // 書き込み途中で終わった末尾行は、続きを追記すると1行につながるため切り捨てる
+    std::error_code ec;
+    auto size = fs::file_size(path_, ec);
+    if (ec || size == 0) return;
+    {
+        // 末尾から 4KB ずつ遡って最後の改行を探す（通常は最後の1バイトで済む）
+        ifstream ifs(path_, ios::binary);
+        uintmax_t keep = 0;
+        char buf[4096];
+        for (uintmax_t end = size; end > 0 && keep == 0;) {
+            uintmax_t begin = end > sizeof(buf) ? end - sizeof(buf) : 0;
+            ifs.seekg(static_cast<streamoff>(begin));
+            if (!ifs.read(buf, static_cast<streamsize>(end - begin))) return;
+            for (uintmax_t i = end - begin; i > 0; --i) if (buf[i-1] == '\n') { keep = begin + i; break; }
+            end = begin;
+        }
+        ifs.close();
+        if (keep < size) fs::resize_file(path_, keep, ec);
+        if (keep == 0) return; // 先頭行も無い: 初回の書き込みで作り直す
+    }
+    ofs_.open(path_, ios::binary | ios::app);
+}
+
+void SessionLog::write(const vector<string>& fields) {
+    if (id_.empty()) return;
+    if (!ofs_.is_open()) {
+        std::error_code ec; fs::create_directories(path_.parent_path(), ec);
+        bool fresh = !fs::exists(path_, ec) || fs::file_size(path_, ec) == 0;
+        ofs_.open(path_, ios::binary | ios::app);
+        if (!ofs_) return;
+        if (fresh) ofs_ << kMagic << '\n';
+    }
+    string line;
+    for (size_t i = 0; i < fields.size(); ++i) { if (i) line += '\t'; line += escape_field(fields[i]); }
+    line += '\n';
+    ofs_ << line;
+    ofs_.flush();
+}
+
+void SessionLog::set_value(const char* kind, const string& value) { write({kind, value}); }
+
+void SessionLog::set_tune(const InferenceTuning& t) {
+    ostringstream temp, top_p;
+    temp << t.temperature; top_p << t.top_p;
+    vector<string> f = {"tune", to_string(t.context), to_string(t.max_tokens), temp.str(), top_p.str(), t.keep_alive};
+    string key;
+    for (const auto& x : f) key += x + '\t';
+    if (key == last_tune_) return; // 変化が無ければ書かない
+    last_tune_ = key;
+    write(f);
+}
+
+void SessionLog::message(const ChatMsg& m) { write({"msg", role_name(m.role), string(m.content())}); }
+void SessionLog::pop(size_t n) { write({"pop", to_string(n)}); }
+void SessionLog::clear() { write({"clear"}); }
+void SessionLog::kv(const string& file, const string& model) { write({"kv", file, model}); }
+void SessionLog::attach(const string& path) { write({"attach", path}); }
+void SessionLog::detach(const string& path) { write({"detach", path}); }
@@ -0,0 +1,83 @@
+#pragma once
+#include "chat.hpp"
+#include "system_info.hpp"
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 永続セッション: 会話履歴・パラメータ・自動モード等を追記専用ログに1ターンごとに書き、--resume で復元する
+//
+// 形式（1行1レコード、タブ区切り。フィールド中の \ タブ 改行 CR はエスケープ）:
+//   agens-session 1            先頭行
+//   backend <名前> / model <名前> / cwd <パス>
+//   tune <context> <max_tokens> <temperature> <top_p> <keep_alive>
+//   auto <0|1>
+//   msg <role> <本文>          履歴へ追加
+//   pop <件数>                 末尾から取り除く（/escalate の聞き直し）
+//   clear                      履歴を空にする
+//   kv <ファイル名> <モデル>   llama.cpp のスロット保存先（KV キャッシュ）
+//   attach <パス> / detach <パス>  /attach した添付ファイル（再開時に読み直す）
+// 後のレコードが前を上書きする。未知のレコードと改行で終わらない末尾行（書き込み途中）は無視する
+
+/// @brief セッションログを読み込んだ結果
+struct SessionState {
+    std::string id;
+    std::string backend;
+    std::string model;
+    std::string cwd;
+    std::optional<InferenceTuning> tune; // context/max_tokens/temperature/top_p/keep_alive のみ有効
+    bool auto_mode = false;
+    std::vector<ChatMsg> history;
+    std::string kv_file;  // 空なら KV の保存なし
+    std::string kv_model; // kv_file を保存したときのモデル
+    std::vector<std::string> attachments; // 添付ファイルのパス（添付順）
+    size_t records = 0;
+};
+
+std::filesystem::path default_session_dir();
+std::filesystem::path session_path(const std::string& id);
+/// @brief 現在時刻から "YYYYMMDD-HHMMSS" 形式の ID を作る（既存と重なれば "-2" 等を付ける）
+std::string new_session_id();
+/// @brief 保存済みセッション ID（新しい順）
+std::vector<std::string> list_sessions(const std::filesystem::path& dir = default_session_dir());
+
+/// @brief ログ本文を解釈する（ファイル読み込みと分離してテスト可能にする）
+SessionState parse_session_log(std::string_view text);
+/// @brief path を mmap して読み込む。先頭行が一致しなければ失敗
+bool load_session(const std::filesystem::path& path, SessionState& out, std::string* err = nullptr);
+
+/// @brief 履歴の末尾から budget_tokens に収まる範囲を返す（user から始まるよう揃える）
+std::vector<ChatMsg> fit_history(const std::vector<ChatMsg>& history, long budget_tokens);
+/// @brief 末尾が question への問答（user, assistant）ならその2件を外して true（/escalate で聞き直す前）。
+/// question は履歴に残した質問（/ask --ctx で送った参照コード付きのプロンプトではない）
+bool pop_last_turn(std::vector<ChatMsg>& history, std::string_view question);
+
+/// @brief 追記専用のセッションログ。初回書き込み時にファイルを作り、以後レコードごとに flush する
+class SessionLog {
+public:
+    /// @brief 書き込み先を決める（ファイルはまだ作らない）。既存ファイルなら開いて続きに追記する
+    void start(const std::string& id, const std::filesystem::path& dir = default_session_dir());
+    const std::string& id() const { return id_; }
+    bool active() const { return !id_.empty(); }
+    /// @brief 1度でも書き込んだか（ファイルが存在するか）
+    bool written() const { return ofs_.is_open(); }
+
+    void set_value(const char* kind, const std::string& value);
+    void set_tune(const InferenceTuning& t);
+    void message(const ChatMsg& m);
+    void pop(size_t n);
+    void clear();
+    void kv(const std::string& file, const std::string& model);
+    void attach(const std::string& path);
+    void detach(const std::string& path);
+
+private:
+    void write(const std::vector<std::string>& fields);
+    std::string id_;
+    std::filesystem::path path_;
+    std::string last_tune_;
+    std::ofstream ofs_;
+};
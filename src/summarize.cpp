@@ -0,0 +1,158 @@
+#include "summarize.hpp"
+#include "chat.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace {
+// 空行の直後、またはトップレベルの '}' の直後（関数・段落の切れ目）なら良い切れ目
+bool good_boundary(string_view prev_line) {
+    if (prev_line.find_first_not_of(" \t\r\n") == string_view::npos) return true;
+    return prev_line[0] == '}';
+}
+
+// UTF-8 の継続バイトで切らないよう後退する
+size_t utf8_floor(string_view s, size_t pos) {
+    while (pos > 0 && pos < s.size() && (static_cast<unsigned char>(s[pos]) & 0xC0) == 0x80) --pos;
+    return pos;
+}
+
+// items を parallel 本のワーカーで処理する（index をアトミックに配る）
+void parallel_for(size_t n, int parallel, const function<void(size_t)>& fn) {
+    int workers = max(1, min<int>(parallel, static_cast<int>(n)));
+    if (workers == 1) { for (size_t i = 0; i < n; ++i) fn(i); return; }
+    atomic<size_t> next{0};
+    vector<thread> ts;
+    for (int w = 0; w < workers; ++w) {
+        ts.emplace_back([&]{
+            for (size_t i; (i = next.fetch_add(1)) < n;) fn(i);
+        });
+    }
+    for (auto& t : ts) t.join();
+}
+}
+
+vector<TextChunk> split_chunks(string_view text, long max_tokens) {
+    vector<TextChunk> out;
+    max_tokens = max(16L, max_tokens);
+    // 行の開始位置
+    vector<size_t> starts;
+    for (size_t p = 0; p < text.size();) {
+        starts.push_back(p);
+        size_t nl = text.find('\n', p);
+        p = (nl == string_view::npos) ? text.size() : nl + 1;
+    }
+    auto line_at = [&](size_t i){
+        size_t b = starts[i], e = (i + 1 < starts.size()) ? starts[i+1] : text.size();
+        return text.substr(b, e - b);
+    };
+
+    size_t i = 0;
+    while (i < starts.size()) {
+        size_t begin = i;
+        long tokens = 0;
+        size_t best_cut = 0; // begin より後の良い切れ目（その行の手前で切る）
+        while (i < starts.size()) {
+            long lt = estimate_tokens(line_at(i));
+            if (tokens + lt > max_tokens && i > begin) break;
+            if (i > begin && good_boundary(line_at(i-1))) best_cut = i;
+            tokens += lt;
+            ++i;
+            if (tokens > max_tokens) break; // 1行だけで予算超過
+        }
+        // 後半に良い切れ目があればそこで切る（前半で切ると細切れになる）
+        if (i < starts.size() && best_cut > begin + (i - begin) / 2) i = best_cut;
+        size_t b = starts[begin], e = (i < starts.size()) ? starts[i] : text.size();
+        string_view piece = text.substr(b, e - b);
+        if (i == begin + 1 && estimate_tokens(piece) > max_tokens) {
+            // 巨大な1行: 予算に収まるバイト数ずつ切る（ASCII 4バイト≒1トークンの保守側で近似）
+            size_t step = static_cast<size_t>(max_tokens);
+            for (size_t off = 0; off < piece.size();) {
+                size_t len = min(step, piece.size() - off);
+                size_t end = (off + len < piece.size()) ? utf8_floor(piece, off + len) : piece.size();
+                if (end <= off) end = min(piece.size(), off + len);
+                out.push_back(TextChunk{piece.substr(off, end - off), begin + 1, begin + 1});
+                off = end;
+            }
+            continue;
+        }
+        out.push_back(TextChunk{piece, begin + 1, i});
+    }
+    return out;
+}
+
+vector<vector<size_t>> group_for_reduce(const vector<string>& parts, long budget_tokens) {
+    vector<vector<size_t>> groups;
+    long cur = 0;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        long t = estimate_tokens(parts[i]);
+        if (groups.empty() || (cur + t > budget_tokens && !groups.back().empty())) { groups.emplace_back(); cur = 0; }
+        groups.back().push_back(i);
+        cur += t;
+    }
+    // 1要素だけのグループは隣と合わせると予算を超える（そこで区切ったため）。統合せず次の段へそのまま渡す
+    return groups;
+}
+
+SummaryResult summarize_text(string_view text, const SummarizeOptions& opts, const AskFn& ask, const ProgressFn& progress) {
+    trace::Span span("summarize", "summarize");
+    SummaryResult res;
+    auto chunks = split_chunks(text, opts.chunk_tokens);
+    res.chunks = chunks.size();
+    if (chunks.empty()) return res;
+
+    mutex mu;
+    SummarizeProgress prog;
+    auto report = [&](bool ok){
+        lock_guard<mutex> lk(mu);
+        ++prog.done;
+        if (!ok) { ++prog.failed; ++res.failed; }
+        if (progress) progress(prog);
+    };
+
+    // map: 各チャンクを独立に要約
+    vector<optional<string>> parts(chunks.size());
+    prog = SummarizeProgress{"map", 0, 0, chunks.size(), 0};
+    parallel_for(chunks.size(), opts.parallel, [&](size_t i){
+        trace::Span s("summarize.map", "summarize");
+        string prompt = "次は " + opts.name + " の一部（" + to_string(chunks[i].first_line) + "〜" + to_string(chunks[i].last_line) +
+                        " 行目）です。重要な内容・構造・エラーや数値を落とさず、日本語の箇条書きで簡潔に要約してください。\n```\n" +
+                        string(chunks[i].text) + "\n```";
+        parts[i] = ask(prompt);
+        report(parts[i].has_value());
+    });
+    vector<string> level;
+    for (auto& p : parts) if (p) level.push_back(std::move(*p));
+    if (level.empty()) return res;
+
+    // reduce: 予算に収まるグループごとに統合し、1つになるまで繰り返す
+    while (level.size() > 1) {
+        ++res.levels;
+        auto groups = group_for_reduce(level, opts.reduce_tokens);
+        size_t requests = static_cast<size_t>(count_if(groups.begin(), groups.end(), [](const vector<size_t>& g){ return g.size() > 1; }));
+        if (requests == 0) break; // どの2つも予算に収まらない: 連結して返す
+        vector<optional<string>> merged(groups.size());
+        prog = SummarizeProgress{"reduce", res.levels, 0, requests, 0};
+        parallel_for(groups.size(), opts.parallel, [&](size_t g){
+            if (groups[g].size() == 1) { merged[g] = level[groups[g][0]]; return; }
+            trace::Span s("summarize.reduce", "summarize");
+            string prompt = "以下は " + opts.name + " を分割して要約した部分要約です（ファイル内の順）。重複をまとめ、全体像が分かる1つの日本語の要約に統合してください。\n";
+            for (size_t k = 0; k < groups[g].size(); ++k) prompt += "\n--- 部分 " + to_string(k + 1) + " ---\n" + level[groups[g][k]] + "\n";
+            merged[g] = ask(prompt);
+            report(merged[g].has_value());
+        });
+        vector<string> next;
+        for (size_t g = 0; g < groups.size(); ++g) {
+            if (merged[g]) next.push_back(std::move(*merged[g]));
+            else for (size_t idx : groups[g]) next.push_back(level[idx]); // 失敗したグループは次段で再挑戦
+        }
+        if (next.size() >= level.size()) { level = std::move(next); break; } // 進まない: 連結して返す
+        level = std::move(next);
+    }
+    for (size_t i = 0; i < level.size(); ++i) { if (i) res.summary += "\n\n"; res.summary += level[i]; }
+    return res;
+}
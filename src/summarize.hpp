@@ -0,0 +1,54 @@
+#pragma once
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 大きなファイルの map-reduce 要約（トークン予算で分割→並列に部分要約→階層的に統合）
+
+/// @brief 入力の一部（元テキストへの参照と行範囲。行は1始まり）
+struct TextChunk {
+    std::string_view text;
+    size_t first_line = 0;
+    size_t last_line = 0;
+};
+
+/// @brief 約 max_tokens ごとに行境界で分割する。空行や字下げの無い行（関数・段落の始まり）で切ることを優先する
+/// @note 1行が予算を超える場合はその行の途中（UTF-8 の文字境界）で切る
+std::vector<TextChunk> split_chunks(std::string_view text, long max_tokens);
+
+struct SummarizeOptions {
+    std::string name;          // プロンプトに含めるファイル名
+    long chunk_tokens = 2048;  // 1チャンクあたりの入力トークン予算
+    long reduce_tokens = 2048; // 統合時に1回へ詰め込む部分要約の予算
+    int parallel = 1;          // 同時に投げるリクエスト数（バックエンドのスロット数まで）
+};
+
+/// @brief 進捗。stage は "map" / "reduce"、level は統合の段（map は 0）
+struct SummarizeProgress {
+    std::string stage;
+    int level = 0;
+    size_t done = 0;
+    size_t total = 0;
+    size_t failed = 0;
+};
+
+struct SummaryResult {
+    std::string summary;
+    size_t chunks = 0;
+    int levels = 0;    // 統合の段数
+    size_t failed = 0; // 応答が得られなかった要求の数
+};
+
+/// @brief プロンプトを1つ送って応答本文を返す関数（複数スレッドから同時に呼ばれる）
+using AskFn = std::function<std::optional<std::string>(const std::string& prompt)>;
+using ProgressFn = std::function<void(const SummarizeProgress&)>;
+
+/// @brief 並列度 opts.parallel で map（チャンク要約）と reduce（統合）を実行する
+/// @note progress は内部で直列化して呼ぶ。全チャンク失敗時は summary が空
+SummaryResult summarize_text(std::string_view text, const SummarizeOptions& opts, const AskFn& ask, const ProgressFn& progress = {});
+
+/// @brief 部分要約群を順に予算以内のグループに分ける（2つ以上のグループが1回の統合要求になる）
+/// @note 予算を超えるのは、それ1つで予算を超える部分要約だけのグループのみ
+std::vector<std::vector<size_t>> group_for_reduce(const std::vector<std::string>& parts, long budget_tokens);
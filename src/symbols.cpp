@@ -0,0 +1,771 @@
+#include "symbols.hpp"
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+namespace {
+bool ident_start(unsigned char c) { return isalpha(c) || c == '_' || c == '$' || c >= 0x80; }
+bool ident_char(unsigned char c) { return isalnum(c) || c == '_' || c == '$' || c >= 0x80; }
+
+string lower_ascii(string_view s) {
+    string out(s);
+    for (auto& c : out) if (c >= 'A' && c <= 'Z') c = static_cast<char>(c + 32);
+    return out;
+}
+
+bool is_c_family(SourceLang l) { return l == SourceLang::C || l == SourceLang::Cpp; }
+bool is_js_family(SourceLang l) { return l == SourceLang::JavaScript || l == SourceLang::TypeScript; }
+
+// ---- 見出しの字句 ----
+
+struct Tok {
+    string text;
+    bool ident = false;
+    int depth = 0; // () と [] の深さ（この字句の位置で）
+    int line = 0;  // 見出しの先頭行からの行数
+};
+
+bool is(const vector<Tok>& t, size_t i, string_view s) { return i < t.size() && t[i].text == s; }
+bool is_ident(const vector<Tok>& t, size_t i) { return i < t.size() && t[i].ident; }
+
+vector<Tok> tokenize(string_view h) {
+    vector<Tok> out;
+    int depth = 0, line = 0;
+    for (size_t i = 0; i < h.size();) {
+        unsigned char c = static_cast<unsigned char>(h[i]);
+        if (c == '\n') ++line;
+        if (isspace(c)) { ++i; continue; }
+        Tok t;
+        t.line = line;
+        if (ident_start(c)) {
+            size_t j = i;
+            while (j < h.size() && ident_char(static_cast<unsigned char>(h[j]))) ++j;
+            t.text = string(h.substr(i, j - i));
+            t.ident = true;
+            i = j;
+        } else if (i + 1 < h.size() && ((c == ':' && h[i+1] == ':') || (c == '-' && h[i+1] == '>') || (c == '=' && h[i+1] == '>'))) {
+            t.text = string(h.substr(i, 2));
+            i += 2;
+        } else {
+            t.text = string(1, static_cast<char>(c));
+            ++i;
+        }
+        if (t.text == ")" || t.text == "]") depth = max(0, depth - 1);
+        t.depth = depth;
+        if (t.text == "(" || t.text == "[") ++depth;
+        out.push_back(std::move(t));
+    }
+    return out;
+}
+
+// i の '(' に対応する ')' の位置（無ければ t.size()）
+size_t close_paren(const vector<Tok>& t, size_t i) {
+    for (size_t j = i + 1; j < t.size(); ++j) {
+        if (t[j].text == ")" && t[j].depth == t[i].depth) return j;
+    }
+    return t.size();
+}
+
+// "template <...>" を取り除く（C++）
+void strip_templates(vector<Tok>& t) {
+    vector<Tok> out;
+    for (size_t i = 0; i < t.size(); ++i) {
+        if (t[i].text == "template" && is(t, i + 1, "<")) {
+            int angle = 0;
+            size_t j = i + 1;
+            for (; j < t.size(); ++j) {
+                if (t[j].text == "<") ++angle;
+                else if (t[j].text == ">" && --angle == 0) break;
+            }
+            i = j;
+            continue;
+        }
+        out.push_back(std::move(t[i]));
+    }
+    t.swap(out);
+}
+
+// アクセス指定（"public:" 等）を取り除く（C++ のクラス本体では見出しの前に残る）
+void strip_access_labels(vector<Tok>& t) {
+    vector<Tok> out;
+    for (size_t i = 0; i < t.size(); ++i) {
+        if ((t[i].text == "public" || t[i].text == "private" || t[i].text == "protected") && is(t, i + 1, ":")) { ++i; continue; }
+        out.push_back(std::move(t[i]));
+    }
+    t.swap(out);
+}
+
+bool c_keyword(string_view s) {
+    static const char* const kw[] = {"if","for","while","switch","catch","return","sizeof","else","do","new","delete",
+        "throw","decltype","static_assert","alignof","alignas","typeid","co_return","co_await","requires","case","goto",
+        "defined","__attribute__","__declspec","noexcept","try"};
+    return any_of(begin(kw), end(kw), [&](const char* k){ return s == k; });
+}
+
+bool js_keyword(string_view s) {
+    static const char* const kw[] = {"if","for","while","switch","catch","return","function","with","else","do","new",
+        "typeof","await","yield","super","import"};
+    return any_of(begin(kw), end(kw), [&](const char* k){ return s == k; });
+}
+
+// ---- 括弧の言語 ----
+
+enum class Frame { Scope, Type, Body }; // Scope: ファイル・名前空間, Type: クラス本体（中の関数はメソッド）, Body: 関数本体・その他
+
+struct Block {
+    Frame frame = Frame::Body;
+    int symbol = -1;        // この括弧で閉じる定義
+    bool inline_brace = false; // 式の中の括弧（既定引数・初期化子・ラムダ）。閉じたら外側の見出しに戻る
+    bool typedef_tail = false; // typedef struct {...} Name; の Name を続けて読む
+    string saved;
+    int saved_line = 0;
+    int saved_paren = 0;
+};
+
+struct Classified {
+    Frame frame = Frame::Body;
+    bool has_symbol = false;
+    Symbol sym;
+    bool typedef_tail = false;
+    int line = 0; // 定義の開始行（見出しの先頭行からの行数）
+};
+
+Classified make(Frame f, string name, SymbolKind k) {
+    Classified c;
+    c.frame = f;
+    if (!name.empty()) { c.has_symbol = true; c.sym.name = std::move(name); c.sym.kind = k; }
+    return c;
+}
+
+// 識別子と "::" の連なり（位置 i から）
+string qualified_from(const vector<Tok>& t, size_t& i) {
+    string name;
+    while (i < t.size()) {
+        if (t[i].ident) { name += t[i].text; ++i; }
+        else break;
+        if (is(t, i, "::") && is_ident(t, i + 1)) { name += "::"; ++i; } else break;
+    }
+    return name;
+}
+
+// C/C++ の "class|struct|union|enum 名前"（なければ空）
+Classified classify_c_type(const vector<Tok>& t, Frame parent) {
+    // "struct X x = {...}" は変数の初期化
+    if (any_of(t.begin(), t.end(), [](const Tok& k){ return k.depth == 0 && k.text == "="; })) return {};
+    for (size_t i = 0; i < t.size(); ++i) {
+        if (t[i].depth != 0) continue;
+        if (t[i].text == "(") break;
+        const string& k = t[i].text;
+        if (k != "class" && k != "struct" && k != "union" && k != "enum") continue;
+        if (parent == Frame::Body) return {};
+        bool td = i > 0 && t[0].text == "typedef";
+        SymbolKind kind = k == "class" ? SymbolKind::Class : k == "enum" ? SymbolKind::Enum : SymbolKind::Struct;
+        size_t j = i + 1;
+        if (k == "enum" && (is(t, j, "class") || is(t, j, "struct"))) ++j;
+        // "class API Foo final : Base" → 名前は ':' か末尾の手前の最後の識別子（final を除く）
+        string name;
+        while (j < t.size()) {
+            if (t[j].text == "[" || t[j].text == "(") { // 属性・alignas(...)
+                int d = t[j].depth;
+                ++j;
+                while (j < t.size() && !(t[j].depth == d && (t[j].text == "]" || t[j].text == ")"))) ++j;
+                ++j;
+                continue;
+            }
+            if (!t[j].ident || t[j].text == "final") break;
+            name = qualified_from(t, j);
+        }
+        Classified c = make(Frame::Type, name, kind);
+        c.typedef_tail = td;
+        return c;
+    }
+    return {};
+}
+
+// C/C++ の関数定義の名前（修飾付き）。候補の '(' を順に試し、マクロ呼び出し風の前置きは読み飛ばす
+string c_function_name(const vector<Tok>& t, Frame parent) {
+    for (size_t p = 0; p < t.size(); ++p) {
+        if (t[p].text != "(" || t[p].depth != 0) continue;
+        size_t j = p;
+        string name;
+        // operator の類（operator() は最初の "()" まで名前）
+        for (size_t k = 0; k < p; ++k) {
+            if (t[k].text != "operator" || t[k].depth != 0) continue;
+            name = "operator";
+            size_t m = k + 1;
+            if (m == p && is(t, p + 1, ")")) { name += "()"; p += 2; m = p; if (!is(t, p, "(")) return {}; }
+            for (; m < p; ++m) name += (t[m].ident ? " " : "") + t[m].text; // operator bool, operator new
+            j = k;
+            break;
+        }
+        if (name.empty()) {
+            if (p == 0 || !t[p-1].ident) {
+                // "f<int>(" 等は扱わない。次の候補へ
+                size_t q = close_paren(t, p);
+                if (q >= t.size()) return {};
+                p = q;
+                continue;
+            }
+            j = p - 1;
+            name = t[j].text;
+            if (c_keyword(name)) return {};
+            if (j > 0 && t[j-1].text == "~") { name = "~" + name; --j; }
+        }
+        while (j >= 2 && t[j-1].text == "::" && t[j-2].ident) { name = t[j-2].text + "::" + name; j -= 2; }
+        bool qualified = name.find("::") != string::npos;
+        bool ok = true;
+        for (size_t k = 0; k < j; ++k) {
+            if (t[k].depth != 0) continue;
+            const string& s = t[k].text;
+            if (s == "=" || s == "," || s == ";" || (t[k].ident && c_keyword(s) && s != "noexcept")) { ok = false; break; }
+        }
+        if (ok && j > 0 && (t[j-1].text == "." || t[j-1].text == "->" || t[j-1].text == "!")) ok = false;
+        if (ok && (j > 0 || qualified || parent == Frame::Type)) return name;
+        if (!ok) return {};
+        // 前置きのマクロ（"EXPORT(x) int f() {" の EXPORT）は飛ばして次の '(' を試す
+        size_t q = close_paren(t, p);
+        if (q >= t.size()) return {};
+        p = q;
+    }
+    return {};
+}
+
+// コンストラクタの初期化子の波括弧（"A::A() : x{1}" の '{'）か
+bool c_init_brace(const vector<Tok>& t) {
+    if (t.empty() || !t.back().ident) return false;
+    static const char* const tail_kw[] = {"const", "override", "final", "noexcept", "volatile", "mutable", "try"};
+    if (any_of(begin(tail_kw), end(tail_kw), [&](const char* k){ return t.back().text == k; })) return false;
+    for (size_t i = 0; i < t.size(); ++i) {
+        if (t[i].text != "(" || t[i].depth != 0) continue;
+        for (size_t j = close_paren(t, i) + 1; j < t.size(); ++j) {
+            if (t[j].text == ":" && t[j].depth == 0) return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+Classified classify_c(vector<Tok> t, Frame parent, SourceLang lang) {
+    if (lang == SourceLang::Cpp || lang == SourceLang::C) { strip_templates(t); strip_access_labels(t); }
+    if (t.empty()) return {};
+    if (t[0].text == "namespace") {
+        size_t i = 1;
+        return make(Frame::Scope, qualified_from(t, i), SymbolKind::Namespace);
+    }
+    if (t[0].text == "extern" && is(t, 1, "\"")) return make(Frame::Scope, "", SymbolKind::Namespace);
+    Classified ty = classify_c_type(t, parent);
+    if (ty.frame == Frame::Type) return ty;
+    if (parent == Frame::Body) return {};
+    string name = c_function_name(t, parent);
+    if (name.empty()) return {};
+    return make(Frame::Body, name, parent == Frame::Type ? SymbolKind::Method : SymbolKind::Function);
+}
+
+Classified classify_go(const vector<Tok>& t, Frame parent) {
+    for (size_t i = 0; i < t.size(); ++i) {
+        if (t[i].depth != 0) continue;
+        if (t[i].text == "func") {
+            size_t j = i + 1;
+            bool method = false;
+            if (is(t, j, "(")) { j = close_paren(t, j) + 1; method = true; }
+            if (is_ident(t, j) && (is(t, j + 1, "(") || is(t, j + 1, "["))) {
+                return make(Frame::Body, t[j].text, method ? SymbolKind::Method : SymbolKind::Function);
+            }
+            return {};
+        }
+        if (t[i].text == "type" && is_ident(t, i + 1) && parent != Frame::Body) {
+            size_t j = i + 2;
+            if (is(t, j, "[")) { while (j < t.size() && !(t[j].text == "]" && t[j].depth == 0)) ++j; ++j; }
+            SymbolKind k = is(t, j, "struct") ? SymbolKind::Struct : is(t, j, "interface") ? SymbolKind::Interface : SymbolKind::Type;
+            return make(Frame::Body, t[i+1].text, k);
+        }
+    }
+    return {};
+}
+
+Classified classify_rust(const vector<Tok>& t, Frame parent) {
+    for (size_t i = 0; i < t.size(); ++i) {
+        if (t[i].depth != 0 || !t[i].ident) continue;
+        const string& k = t[i].text;
+        if (k == "fn") {
+            if (!is_ident(t, i + 1)) return {};
+            return make(Frame::Body, t[i+1].text, parent == Frame::Type ? SymbolKind::Method : SymbolKind::Function);
+        }
+        if (k == "impl") return make(Frame::Type, "", SymbolKind::Class);
+        if (k == "macro_rules" && is(t, i + 1, "!") && is_ident(t, i + 2)) return make(Frame::Body, t[i+2].text, SymbolKind::Macro);
+        if (k == "struct" || k == "enum" || k == "union" || k == "trait" || k == "mod") {
+            if (!is_ident(t, i + 1)) return {};
+            SymbolKind kind = k == "enum" ? SymbolKind::Enum : k == "trait" ? SymbolKind::Interface
+                            : k == "mod" ? SymbolKind::Namespace : SymbolKind::Struct;
+            Frame f = k == "mod" ? Frame::Scope : k == "trait" ? Frame::Type : Frame::Body;
+            return make(f, t[i+1].text, kind);
+        }
+        if (k == "let" || k == "match" || k == "if" || k == "while" || k == "for" || k == "loop") return {};
+    }
+    return {};
+}
+
+Classified at_line(Classified c, const Tok& t) { c.line = t.line; return c; }
+
+Classified classify_js(const vector<Tok>& t, Frame parent) {
+    // 文末の ';' が無い書き方では前の文が見出しに残るので、キーワードは後ろから探す（開始行もキーワードの行）
+    for (size_t r = t.size(); r-- > 0;) {
+        if (t[r].depth != 0 || !t[r].ident) continue;
+        const string& k = t[r].text;
+        if (r > 0 && t[r-1].text == ".") continue;
+        if (k == "class") {
+            if (is_ident(t, r + 1) && t[r+1].text != "extends" && t[r+1].text != "implements") return at_line(make(Frame::Type, t[r+1].text, SymbolKind::Class), t[r]);
+            return make(Frame::Type, "", SymbolKind::Class);
+        }
+        if (k == "interface" && is_ident(t, r + 1)) return at_line(make(Frame::Body, t[r+1].text, SymbolKind::Interface), t[r]);
+        if (k == "enum" && is_ident(t, r + 1)) return at_line(make(Frame::Body, t[r+1].text, SymbolKind::Enum), t[r]);
+        if ((k == "namespace" || k == "module") && is_ident(t, r + 1) && (r == 0 || t[r-1].ident)) return at_line(make(Frame::Scope, t[r+1].text, SymbolKind::Namespace), t[r]);
+        if (k == "type" && is_ident(t, r + 1) && (is(t, r + 2, "=") || is(t, r + 2, "<"))) return at_line(make(Frame::Body, t[r+1].text, SymbolKind::Type), t[r]);
+        if (k == "function") {
+            size_t j = r + 1;
+            if (is(t, j, "*")) ++j;
+            if (is_ident(t, j)) return at_line(make(Frame::Body, t[j].text, SymbolKind::Function), t[r]);
+            // 無名関数の代入 "name = function () {" / "name: function () {"
+            if (r >= 2 && (t[r-1].text == "=" || t[r-1].text == ":") && t[r-2].ident) return at_line(make(Frame::Body, t[r-2].text, SymbolKind::Function), t[r-2]);
+            return {};
+        }
+    }
+    // アロー関数の代入 "const name = (a) => {"
+    for (size_t i = 0; i + 2 < t.size(); ++i) {
+        if (t[i].depth != 0 || !t[i].ident) continue;
+        if (!(t[i].text == "const" || t[i].text == "let" || t[i].text == "var")) continue;
+        if (!is_ident(t, i + 1)) continue;
+        bool arrow = false;
+        for (size_t j = i + 2; j < t.size(); ++j) if (t[j].text == "=>" && t[j].depth == 0) arrow = true;
+        if (arrow && (is(t, i + 2, "=") || is(t, i + 2, ":"))) return at_line(make(Frame::Body, t[i+1].text, SymbolKind::Function), t[i]);
+    }
+    // クラス本体のメソッド "static async name(args): T {" と、アロー関数のフィールド "name = () => {"
+    if (parent == Frame::Type) {
+        for (size_t e = 1; e + 1 < t.size(); ++e) {
+            if (t[e].text != "=" || t[e].depth != 0 || !t[e-1].ident) continue;
+            for (size_t j = e + 1; j < t.size(); ++j) {
+                if (t[j].text == "=>" && t[j].depth == 0) return at_line(make(Frame::Body, t[e-1].text, SymbolKind::Method), t[e-1]);
+            }
+            return {};
+        }
+        for (size_t i = 0; i < t.size(); ++i) {
+            if (t[i].text != "(" || t[i].depth != 0) continue;
+            size_t n = i;
+            if (n > 0 && t[n-1].text == ">") { // ジェネリクス name<T>(
+                int angle = 0;
+                while (n > 0) { --n; if (t[n].text == ">") ++angle; else if (t[n].text == "<" && --angle == 0) break; }
+            }
+            if (n == 0 || !t[n-1].ident || js_keyword(t[n-1].text)) return {};
+            string name = t[n-1].text;
+            if (n >= 2 && t[n-2].text == "#") name = "#" + name;
+            return at_line(make(Frame::Body, name, SymbolKind::Method), t[n-1]);
+        }
+    }
+    return {};
+}
+
+// ';'（Go は改行）で終わる文の定義: 型の別名・typedef・定数など
+Classified classify_statement(vector<Tok> t, Frame parent, SourceLang lang) {
+    if (t.empty() || parent == Frame::Body) return {};
+    if (is_c_family(lang)) {
+        strip_templates(t); strip_access_labels(t);
+        if (t.empty()) return {};
+        if (t[0].text == "using" && is_ident(t, 1) && is(t, 2, "=")) return make(Frame::Body, t[1].text, SymbolKind::Type);
+        if (t[0].text == "typedef") {
+            // typedef void (*name)(int); は "(*name)" の name
+            for (size_t i = 0; i + 2 < t.size(); ++i) {
+                if (t[i].text == "(" && t[i+1].text == "*" && t[i+2].ident) return make(Frame::Body, t[i+2].text, SymbolKind::Type);
+            }
+            for (size_t i = t.size(); i-- > 1;) {
+                if (t[i].ident && t[i].depth == 0) return make(Frame::Body, t[i].text, SymbolKind::Type);
+            }
+        }
+        return {};
+    }
+    if (lang == SourceLang::Go) {
+        if (t[0].text == "type" && is_ident(t, 1) && t[1].text != "(") return make(Frame::Body, t[1].text, SymbolKind::Type);
+        if ((t[0].text == "const" || t[0].text == "var") && is_ident(t, 1)) return make(Frame::Body, t[1].text, SymbolKind::Variable);
+        return {};
+    }
+    if (lang == SourceLang::Rust) {
+        size_t i = 0;
+        if (is(t, i, "pub")) { ++i; if (is(t, i, "(")) i = close_paren(t, i) + 1; }
+        if (is(t, i, "struct") && is_ident(t, i + 1)) return make(Frame::Body, t[i+1].text, SymbolKind::Struct);
+        if (is(t, i, "type") && is_ident(t, i + 1)) return make(Frame::Body, t[i+1].text, SymbolKind::Type);
+        if ((is(t, i, "const") || is(t, i, "static")) && is_ident(t, i + 1) && t[i+1].text != "fn") {
+            size_t j = i + 1;
+            if (is(t, j, "mut")) ++j;
+            if (is_ident(t, j)) return make(Frame::Body, t[j].text, SymbolKind::Variable);
+        }
+        return {};
+    }
+    if (is_js_family(lang)) {
+        size_t i = 0;
+        while (is(t, i, "export") || is(t, i, "default") || is(t, i, "declare")) ++i;
+        if (is(t, i, "type") && is_ident(t, i + 1)) return make(Frame::Body, t[i+1].text, SymbolKind::Type);
+        if ((is(t, i, "const") || is(t, i, "let") || is(t, i, "var")) && is_ident(t, i + 1) && is(t, i + 2, "=")) {
+            for (size_t j = i + 3; j < t.size(); ++j) {
+                if (t[j].text == "=>" && t[j].depth == 0) return make(Frame::Body, t[i+1].text, SymbolKind::Function);
+            }
+        }
+        return {};
+    }
+    return {};
+}
+
+Classified classify_block(const vector<Tok>& t, Frame parent, SourceLang lang) {
+    switch (lang) {
+    case SourceLang::C: case SourceLang::Cpp: return classify_c(t, parent, lang);
+    case SourceLang::Go: return classify_go(t, parent);
+    case SourceLang::Rust: return classify_rust(t, parent);
+    case SourceLang::JavaScript: case SourceLang::TypeScript: return classify_js(t, parent);
+    default: return {};
+    }
+}
+
+// Go の自動セミコロン: 行末がこれらなら文が終わる
+bool go_statement_end(const string& h) {
+    size_t e = h.find_last_not_of(" \t\r\n");
+    if (e == string::npos) return false;
+    unsigned char c = static_cast<unsigned char>(h[e]);
+    return ident_char(c) || c == ')' || c == ']' || c == '}' || c == '"' || c == '`' || c == '\'';
+}
+
+class BraceExtractor {
+public:
+    BraceExtractor(string_view text, SourceLang lang) : s_(text), lang_(lang) {}
+
+    vector<Symbol> run() {
+        Block root;
+        root.frame = Frame::Scope;
+        blocks_.push_back(std::move(root));
+        bool line_start = true;
+        for (i_ = 0; i_ < s_.size();) {
+            char c = s_[i_];
+            if (c == '\n') {
+                if (lang_ == SourceLang::Go && paren_ == 0 && go_statement_end(header_)) end_statement();
+                else append('\n');
+                ++line_; ++i_;
+                line_start = true;
+                continue;
+            }
+            if (line_start && c == '#' && is_c_family(lang_)) { directive(); continue; }
+            if (c != ' ' && c != '\t' && c != '\r') line_start = false;
+            if (c == '/' && peek(1) == '/') { while (i_ < s_.size() && s_[i_] != '\n') ++i_; continue; }
+            if (c == '/' && peek(1) == '*') { block_comment(); continue; }
+            if (lang_ == SourceLang::Rust && c == '#' && (peek(1) == '[' || (peek(1) == '!' && peek(2) == '['))) { skip_attribute(); continue; }
+            if (c == '"' || c == '`' || (c == '\'' && !rust_lifetime())) { literal(); continue; }
+            if (lang_ == SourceLang::Rust && c == 'r' && (peek(1) == '"' || (peek(1) == '#' && (peek(2) == '"' || peek(2) == '#'))) && !prev_ident()) { rust_raw(); continue; }
+            switch (c) {
+            case '(': ++paren_; append(c); break;
+            case ')': paren_ = max(0, paren_ - 1); append(c); break;
+            case '{': open(); break;
+            case '}': close(); break;
+            case ';':
+                if (paren_ > 0) append(c);
+                else end_statement();
+                break;
+            case ':':
+                // C++ のアクセス指定は次の定義の開始行に含めない
+                if (lang_ == SourceLang::Cpp && paren_ == 0 && peek(1) != ':' && access_label()) { header_.clear(); header_line_ = 0; break; }
+                append(c);
+                break;
+            default: append(c);
+            }
+            ++i_;
+        }
+        // 閉じていない定義は最終行まで
+        for (auto& b : blocks_) if (b.symbol >= 0 && out_[b.symbol].end_line == 0) out_[b.symbol].end_line = line_;
+        return std::move(out_);
+    }
+
+private:
+    char peek(size_t k) const { return i_ + k < s_.size() ? s_[i_ + k] : '\0'; }
+    bool access_label() const {
+        size_t b = header_.find_first_not_of(" \t\r\n"), e = header_.find_last_not_of(" \t\r\n");
+        if (b == string::npos) return false;
+        string_view w = string_view(header_).substr(b, e - b + 1);
+        return w == "public" || w == "private" || w == "protected";
+    }
+    bool prev_ident() const { return i_ > 0 && ident_char(static_cast<unsigned char>(s_[i_-1])); }
+
+    void append(char c) {
+        if (header_.find_first_not_of(" \t\r\n") == string::npos) {
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') { header_.clear(); return; }
+            header_line_ = line_;
+        }
+        header_ += c;
+        if (header_.size() > 4096) { // データだけの巨大な式。先頭行は数え直す
+            size_t cut = header_.size() - 2048;
+            header_line_ += static_cast<int>(count(header_.begin(), header_.begin() + static_cast<ptrdiff_t>(cut), '\n'));
+            header_.erase(0, cut);
+        }
+    }
+
+    void block_comment() {
+        i_ += 2;
+        while (i_ < s_.size() && !(s_[i_] == '*' && peek(1) == '/')) { if (s_[i_] == '\n') ++line_; ++i_; }
+        i_ = min(s_.size(), i_ + 2);
+        append(' ');
+    }
+
+    // 文字列・文字リテラル・テンプレート文字列。見出しには空の "" として残す
+    void literal() {
+        char q = s_[i_];
+        // C++ の生文字列 R"delim( ... )delim"
+        if (q == '"' && lang_ == SourceLang::Cpp && i_ > 0 && s_[i_-1] == 'R') {
+            size_t open_p = s_.find('(', i_);
+            if (open_p != string_view::npos && open_p - i_ <= 17) {
+                string close = ")" + string(s_.substr(i_ + 1, open_p - i_ - 1)) + "\"";
+                size_t end = s_.find(close, open_p);
+                end = end == string_view::npos ? s_.size() : end + close.size();
+                for (size_t k = i_; k < end; ++k) if (s_[k] == '\n') ++line_;
+                i_ = end;
+                header_ += "\"\"";
+                return;
+            }
+        }
+        bool multiline = q == '`' || lang_ == SourceLang::Rust;
+        ++i_;
+        bool escapes = !(q == '`' && lang_ == SourceLang::Go); // Go の `...` は生文字列
+        while (i_ < s_.size() && s_[i_] != q) {
+            if (s_[i_] == '\\' && escapes) { if (peek(1) == '\n') ++line_; i_ += 2; continue; }
+            if (s_[i_] == '\n') { if (!multiline) break; ++line_; }
+            ++i_;
+        }
+        if (i_ < s_.size() && s_[i_] == q) ++i_;
+        append('"'); header_ += '"';
+    }
+
+    // Rust のライフタイム 'a（文字リテラル 'a' ではない）
+    bool rust_lifetime() const {
+        if (lang_ != SourceLang::Rust || s_[i_] != '\'') return false;
+        if (peek(1) == '\\') return false;
+        return peek(2) != '\'';
+    }
+
+    void rust_raw() {
+        size_t k = i_ + 1, hashes = 0;
+        while (k < s_.size() && s_[k] == '#') { ++hashes; ++k; }
+        if (k >= s_.size() || s_[k] != '"') { append(s_[i_]); ++i_; return; }
+        string close = "\"" + string(hashes, '#');
+        size_t end = s_.find(close, k + 1);
+        end = end == string_view::npos ? s_.size() : end + close.size();
+        for (size_t m = i_; m < end; ++m) if (s_[m] == '\n') ++line_;
+        i_ = end;
+        append('"'); header_ += '"';
+    }
+
+    void skip_attribute() {
+        size_t k = s_.find('[', i_);
+        int depth = 0;
+        for (i_ = k; i_ < s_.size(); ++i_) {
+            if (s_[i_] == '\n') ++line_;
+            if (s_[i_] == '[') ++depth;
+            else if (s_[i_] == ']' && --depth == 0) { ++i_; break; }
+        }
+    }
+
+    // プリプロセッサ行（継続行を含む）。#define だけを記録する
+    void directive() {
+        int first = line_;
+        size_t start = i_;
+        while (i_ < s_.size() && s_[i_] != '\n') {
+            if (s_[i_] == '\\' && peek(1) == '\n') { ++line_; i_ += 2; continue; }
+            if (s_[i_] == '\\' && peek(1) == '\r' && peek(2) == '\n') { ++line_; i_ += 3; continue; }
+            ++i_;
+        }
+        string_view d = s_.substr(start + 1, i_ - start - 1);
+        size_t p = d.find_first_not_of(" \t");
+        if (p == string_view::npos || d.compare(p, 6, "define") != 0) return;
+        p = d.find_first_not_of(" \t", p + 6);
+        if (p == string_view::npos || !ident_start(static_cast<unsigned char>(d[p]))) return;
+        size_t e = p;
+        while (e < d.size() && ident_char(static_cast<unsigned char>(d[e]))) ++e;
+        out_.push_back(Symbol{string(d.substr(p, e - p)), SymbolKind::Macro, first, line_});
+    }
+
+    void open() {
+        Block b;
+        auto toks = tokenize(header_);
+        if (paren_ > 0 || (is_c_family(lang_) && c_init_brace(toks))) {
+            b.inline_brace = true;
+            b.saved = header_; b.saved_line = header_line_; b.saved_paren = paren_;
+        } else {
+            Classified c = classify_block(toks, blocks_.back().frame, lang_);
+            b.frame = c.frame;
+            b.typedef_tail = c.typedef_tail;
+            if (c.has_symbol) {
+                c.sym.line = header_line_ > 0 ? header_line_ + c.line : line_;
+                b.symbol = static_cast<int>(out_.size());
+                out_.push_back(std::move(c.sym));
+            }
+        }
+        blocks_.push_back(std::move(b));
+        header_.clear(); header_line_ = 0; paren_ = 0;
+    }
+
+    void close() {
+        if (blocks_.size() <= 1) { header_.clear(); return; } // 対応の取れない '}'（#if の分岐等）
+        Block b = std::move(blocks_.back());
+        blocks_.pop_back();
+        if (b.symbol >= 0) out_[b.symbol].end_line = line_;
+        if (b.inline_brace) {
+            header_ = b.saved + "{}"; header_line_ = b.saved_line; paren_ = b.saved_paren;
+        } else if (b.typedef_tail) {
+            header_ = "typedef {} "; header_line_ = line_;
+        } else {
+            header_.clear(); header_line_ = 0;
+            // JS/Go/Rust の式の中の '}'（"x = {...}" の後）は文が続くことがあるが、見出しには使わない
+        }
+    }
+
+    void end_statement() {
+        if (!header_.empty()) {
+            Classified c = classify_statement(tokenize(header_), blocks_.back().frame, lang_);
+            if (c.has_symbol) {
+                c.sym.line = header_line_ > 0 ? header_line_ : line_;
+                c.sym.end_line = line_;
+                out_.push_back(std::move(c.sym));
+            }
+        }
+        header_.clear(); header_line_ = 0;
+    }
+
+    string_view s_;
+    SourceLang lang_;
+    size_t i_ = 0;
+    int line_ = 1;
+    int paren_ = 0;
+    string header_;
+    int header_line_ = 0;
+    vector<Block> blocks_;
+    vector<Symbol> out_;
+};
+
+// ---- Python ----
+
+int indent_of(string_view line) {
+    int n = 0;
+    for (char c : line) {
+        if (c == ' ') ++n;
+        else if (c == '\t') n = (n / 8 + 1) * 8;
+        else break;
+    }
+    return n;
+}
+
+vector<Symbol> extract_python(string_view text) {
+    struct Open { int indent; size_t symbol; bool is_class; };
+    vector<Symbol> out;
+    vector<Open> open;
+    string_view triple; // 閉じていない三重引用符
+    int paren = 0;
+    int line_no = 0, last_code = 0;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t nl = text.find('\n', pos);
+        string_view line = text.substr(pos, (nl == string_view::npos ? text.size() : nl) - pos);
+        pos = nl == string_view::npos ? text.size() + 1 : nl + 1;
+        ++line_no;
+        size_t k = 0;
+        if (!triple.empty()) {
+            size_t e = line.find(triple);
+            if (e == string_view::npos) continue;
+            k = e + 3;
+            triple = {};
+            last_code = line_no;
+            if (line.find_first_not_of(" \t\r", k) == string_view::npos) continue;
+        }
+        bool continuation = paren > 0 || k > 0;
+        int ind = indent_of(line);
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string_view::npos || line[first] == '#') continue;
+        if (!continuation) {
+            while (!open.empty() && ind <= open.back().indent) { out[open.back().symbol].end_line = last_code; open.pop_back(); }
+            string_view rest = line.substr(first);
+            if (rest.compare(0, 6, "async ") == 0) {
+                size_t s = rest.find_first_not_of(' ', 6);
+                rest = s == string_view::npos ? string_view() : rest.substr(s);
+            }
+            bool is_def = rest.compare(0, 4, "def ") == 0, is_class = rest.compare(0, 6, "class ") == 0;
+            if (is_def || is_class) {
+                size_t s = rest.find_first_not_of(' ', is_def ? 4 : 6);
+                size_t e = s;
+                while (e < rest.size() && ident_char(static_cast<unsigned char>(rest[e]))) ++e;
+                if (s != string_view::npos && e > s) {
+                    bool in_class = !open.empty() && open.back().is_class;
+                    SymbolKind kind = is_class ? SymbolKind::Class : in_class ? SymbolKind::Method : SymbolKind::Function;
+                    open.push_back(Open{ind, out.size(), is_class});
+                    out.push_back(Symbol{string(rest.substr(s, e - s)), kind, line_no, line_no});
+                }
+            }
+        }
+        last_code = line_no;
+        // 括弧の深さと、この行で閉じない三重引用符（文字列・コメントの中は数えない）
+        for (size_t i = k; i < line.size(); ++i) {
+            char c = line[i];
+            if (c == '#') break;
+            if (c == '"' || c == '\'') {
+                if (i + 2 < line.size() && line[i+1] == c && line[i+2] == c) {
+                    string_view q = line.substr(i, 3);
+                    size_t e = line.find(q, i + 3);
+                    if (e == string_view::npos) { triple = c == '"' ? "\"\"\"" : "'''"; break; }
+                    i = e + 2;
+                    continue;
+                }
+                for (++i; i < line.size() && line[i] != c; ++i) if (line[i] == '\\') ++i;
+                continue;
+            }
+            if (c == '(' || c == '[' || c == '{') ++paren;
+            else if ((c == ')' || c == ']' || c == '}') && paren > 0) --paren;
+        }
+    }
+    for (auto& o : open) out[o.symbol].end_line = last_code;
+    return out;
+}
+}
+
+SourceLang lang_for_path(string_view path) {
+    size_t dot = path.rfind('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == string_view::npos || (slash != string_view::npos && dot < slash)) return SourceLang::Unknown;
+    string ext = lower_ascii(path.substr(dot + 1));
+    if (ext == "c" || ext == "h") return SourceLang::C;
+    if (ext == "cc" || ext == "cpp" || ext == "cxx" || ext == "c++" || ext == "hpp" || ext == "hh" || ext == "hxx" || ext == "ipp" || ext == "inl") return SourceLang::Cpp;
+    if (ext == "py" || ext == "pyi") return SourceLang::Python;
+    if (ext == "js" || ext == "jsx" || ext == "mjs" || ext == "cjs") return SourceLang::JavaScript;
+    if (ext == "ts" || ext == "tsx" || ext == "mts" || ext == "cts") return SourceLang::TypeScript;
+    if (ext == "go") return SourceLang::Go;
+    if (ext == "rs") return SourceLang::Rust;
+    return SourceLang::Unknown;
+}
+
+const char* symbol_kind_name(SymbolKind kind) {
+    switch (kind) {
+    case SymbolKind::Function: return "function";
+    case SymbolKind::Method: return "method";
+    case SymbolKind::Class: return "class";
+    case SymbolKind::Struct: return "struct";
+    case SymbolKind::Enum: return "enum";
+    case SymbolKind::Interface: return "interface";
+    case SymbolKind::Type: return "type";
+    case SymbolKind::Namespace: return "namespace";
+    case SymbolKind::Macro: return "macro";
+    case SymbolKind::Variable: return "variable";
+    }
+    return "?";
+}
+
+string symbol_key(string_view name) {
+    size_t p = name.rfind("::");
+    if (p != string_view::npos) name = name.substr(p + 2);
+    return lower_ascii(name);
+}
+
+vector<Symbol> extract_symbols(string_view text, SourceLang lang) {
+    if (lang == SourceLang::Unknown) return {};
+    if (lang == SourceLang::Python) return extract_python(text);
+    return BraceExtractor(text, lang).run();
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ソースファイルの定義の抽出（/target で「使っている」ファイルより「定義している」ファイルを上位にする）
+//
+// コンパイラは使わず、コメント・文字列を読み飛ばす字句解析と括弧の対応だけで見出しを分類する。
+// Python はインデントでブロックの終わりを決める。宣言だけ（本体の無い関数等）は記録しない
+
+enum class SourceLang { Unknown, C, Cpp, Python, JavaScript, TypeScript, Go, Rust };
+
+enum class SymbolKind : unsigned char {
+    Function, Method, Class, Struct, Enum, Interface, Type, Namespace, Macro, Variable,
+};
+
+struct Symbol {
+    std::string name;  // 書かれたとおり（C++ の "A::f" のような修飾も含む）
+    SymbolKind kind = SymbolKind::Function;
+    int line = 0;      // 定義の開始行（1 始まり。テンプレート行・修飾子を含む）
+    int end_line = 0;  // 定義の最終行（閉じ括弧・ブロック末尾）
+};
+
+/// @brief 拡張子から言語を決める（対応しない拡張子は Unknown）
+SourceLang lang_for_path(std::string_view path);
+const char* symbol_kind_name(SymbolKind kind);
+/// @brief 照合用のキー（修飾を除いた最後の名前を小文字にしたもの）
+std::string symbol_key(std::string_view name);
+/// @brief text 中の定義を出現順に返す
+std::vector<Symbol> extract_symbols(std::string_view text, SourceLang lang);
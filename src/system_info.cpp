@@ -7,6 +7,7 @@
 #include <fstream>
 #include <cctype>
 #include "ports.hpp"
+#include "trace.hpp"
 
 using namespace std;
 
@@ -23,6 +24,7 @@ static uint64_t parse_first_uint_in_text_mb(const std::string& text) {
 }
 
 SystemInfo detect_system_info() {
+    trace::Span span("detect_system_info");
     SystemInfo si;
 #if defined(__APPLE__)
     si.is_macos = true;
@@ -34,6 +36,7 @@ SystemInfo detect_system_info() {
 
     // RAM
     if (si.is_macos) {
+        trace::Span step_ram("sysinfo.ram");
         string out = utils::run_shell("sysctl -n hw.memsize 2>/dev/null");
         if (!out.empty()) {
             // bytes
@@ -62,11 +65,15 @@ SystemInfo detect_system_info() {
                 }
             }
         }
+        step_ram.end();
+        trace::Span step_cpu("sysinfo.cpu");
         string arch = utils::run_shell("uname -m");
         string brand = utils::run_shell("sysctl -n machdep.cpu.brand_string 2>/dev/null");
         std::string brand_l = brand; transform(brand_l.begin(), brand_l.end(), brand_l.begin(), ::tolower);
         si.is_apple_silicon = (arch.find("arm64")!=string::npos) || (brand_l.find("apple")!=string::npos);
+        step_cpu.end();
         // GPU/VRAM (Apple/AMD/NVIDIA)
+        trace::Span step_gpu("sysinfo.gpu");
         string sp = utils::run_shell("system_profiler SPDisplaysDataType 2>/dev/null");
         // ざっくりVRAM行を拾う
         // 例: "VRAM (合計): 15360 MB" / "VRAM (Total): 24 GB"
@@ -91,7 +98,9 @@ SystemInfo detect_system_info() {
             }
             if (si.gpu_name.empty()) si.gpu_name = candidate; // 何もなければ空のまま
         }
+        step_gpu.end();
         // NVIDIA存在確認（外付けeGPUなど）
+        trace::Span step_nv("sysinfo.nvidia");
         string nv = utils::run_shell("which nvidia-smi >/dev/null 2>&1 && nvidia-smi -L 2>/dev/null");
         si.has_nvidia = !nv.empty();
         if (si.vram_mb == 0 && si.has_nvidia) {
@@ -103,6 +112,7 @@ SystemInfo detect_system_info() {
     } else if (si.is_linux) {
         // RAM: /proc/meminfo を直接パース
         {
+            trace::Span step_ram("sysinfo.ram");
             std::ifstream ifs("/proc/meminfo");
             std::string line;
             uint64_t kb = 0;
@@ -115,6 +125,7 @@ SystemInfo detect_system_info() {
             si.ram_bytes = kb * 1024ULL;
         }
         // NVIDIA
+        trace::Span step_nv("sysinfo.nvidia");
         string nv = utils::run_shell("which nvidia-smi >/dev/null 2>&1 && nvidia-smi -L 2>/dev/null");
         si.has_nvidia = !nv.empty();
         if (si.has_nvidia) {
@@ -127,6 +138,7 @@ SystemInfo detect_system_info() {
         // iGPU等はVRAM不明のことが多いので0のまま
     } else if (si.is_windows) {
         // RAM（wmic が無ければ PowerShell CIM を使用）
+        trace::Span step_ram("sysinfo.ram");
         string out = utils::run_shell("wmic computersystem get TotalPhysicalMemory /value 2>NUL");
         if (out.find("TotalPhysicalMemory=") == string::npos) {
             out = utils::run_shell("powershell -NoProfile -Command \"(Get-CimInstance -ClassName Win32_ComputerSystem).TotalPhysicalMemory\" 2>NUL");
@@ -143,7 +155,9 @@ SystemInfo detect_system_info() {
                 }
             }
         }
+        step_ram.end();
         // NVIDIA
+        trace::Span step_gpu("sysinfo.gpu");
         string nv = utils::run_shell("nvidia-smi -L 2>NUL");
         si.has_nvidia = !nv.empty();
         if (si.has_nvidia) {
@@ -27,6 +27,15 @@ struct InferenceTuning {
     double temperature = 0.7;
     double top_p = 0.9;
     int gpu_layers = -1; // LM Studio用。-1=自動/全オフロード
+    bool model_fitted = false; // gpu_layers がモデル情報から算出済みなら Ollama にも num_gpu として送る
+    std::string keep_alive;    // Ollama の keep_alive（"30m", "-1", "0" など）。空ならサーバ既定
+    int slot_id = -1;          // llama.cpp の id_slot（セッションを固定して KV キャッシュを再利用）。-1=サーバ任せ
+    // 投機的デコード。draft_model は LM Studio のみ（llama.cpp はサーバ起動時の -md で指定）
+    std::string draft_model;
+    int draft_max = 0;         // 1回に提案させる最大トークン数（0=サーバ既定）
+    int draft_min = 0;
+    double draft_p_min = -1;   // 提案を続ける最小確率（負=サーバ既定）
+    int request_timeout_sec = 600; // チャット1回の上限（秒、0=無制限）。長いプロンプトの prefill や生成を途中で切らない
 };
 
 InferenceTuning decide_tuning(const SystemInfo& si);
@@ -0,0 +1,80 @@
+#include "task_pool.hpp"
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+namespace {
+// run() 中のワーカー番号（プール外のスレッドでは -1）
+thread_local const TaskPool* t_pool = nullptr;
+thread_local int t_worker = -1;
+}
+
+int default_thread_count() {
+    unsigned n = thread::hardware_concurrency();
+    return n == 0 ? 1 : static_cast<int>(n);
+}
+
+TaskPool::TaskPool(int threads) {
+    if (threads <= 0) threads = default_thread_count();
+    for (int i = 0; i < threads; ++i) queues_.push_back(make_unique<Queue>());
+}
+
+void TaskPool::spawn(Task task) {
+    int w = (t_pool == this && t_worker >= 0) ? t_worker : 0;
+    pending_.fetch_add(1, memory_order_relaxed);
+    Queue& q = *queues_[w];
+    lock_guard<mutex> lk(q.mu);
+    q.tasks.push_back(std::move(task));
+}
+
+bool TaskPool::pop_local(int worker, Task& out) {
+    Queue& q = *queues_[worker];
+    lock_guard<mutex> lk(q.mu);
+    if (q.tasks.empty()) return false;
+    out = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+bool TaskPool::steal(int thief, Task& out) {
+    int n = threads();
+    for (int i = 1; i < n; ++i) {
+        Queue& q = *queues_[(thief + i) % n];
+        unique_lock<mutex> lk(q.mu, try_to_lock);
+        if (!lk.owns_lock() || q.tasks.empty()) continue;
+        out = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::work(int worker) {
+    const TaskPool* prev_pool = t_pool;
+    int prev_worker = t_worker;
+    t_pool = this; t_worker = worker;
+    Task task;
+    int idle = 0;
+    while (pending_.load(memory_order_acquire) > 0) {
+        if (pop_local(worker, task) || steal(worker, task)) {
+            idle = 0;
+            task(worker);
+            task = nullptr;
+            pending_.fetch_sub(1, memory_order_acq_rel);
+        } else if (++idle < 64) {
+            this_thread::yield();
+        } else {
+            // 他ワーカーの長いタスク待ち。空回りで CPU を奪わない
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+    t_pool = prev_pool; t_worker = prev_worker;
+}
+
+void TaskPool::run() {
+    vector<thread> ts;
+    for (int w = 1; w < threads(); ++w) ts.emplace_back([this, w]{ work(w); });
+    work(0);
+    for (auto& t : ts) t.join();
+}
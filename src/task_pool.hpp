@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// ワークスティーリング型のタスクプール（/target のディレクトリ走査・ファイル採点用）
+//
+// 各ワーカーが自分の両端キューを持ち、自分のタスクは末尾から（深さ優先）、他ワーカーのタスクは先頭から盗む。
+// タスクの中から spawn した子タスクは実行中のワーカーのキューへ積まれる
+
+/// @brief 検出した論理コア数（不明なら 1）
+int default_thread_count();
+
+class TaskPool {
+public:
+    /// @brief タスク本体。worker は 0 以上 threads() 未満で、ワーカーごとの集計に使う
+    using Task = std::function<void(int worker)>;
+
+    /// @param threads 0 以下なら default_thread_count()
+    explicit TaskPool(int threads = 0);
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    int threads() const { return static_cast<int>(queues_.size()); }
+    /// @brief タスクを積む。run() 中にタスクから呼べば同じワーカーのキュー、それ以外はワーカー 0 のキューへ
+    void spawn(Task task);
+    /// @brief 呼び出し元スレッドもワーカー 0 として参加し、積まれたタスク（実行中に増えた分も含む）が尽きるまで待つ
+    void run();
+
+private:
+    struct Queue {
+        std::mutex mu;
+        std::deque<Task> tasks;
+    };
+    bool pop_local(int worker, Task& out);
+    bool steal(int thief, Task& out);
+    void work(int worker);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::atomic<size_t> pending_{0}; // 積まれてまだ終わっていないタスク数
+};
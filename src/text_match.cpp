@@ -0,0 +1,309 @@
+#include "text_match.hpp"
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <queue>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AGENS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AGENS_TARGET(x) __attribute__((target(x)))
+#else
+#define AGENS_TARGET(x)
+#endif
+
+using namespace std;
+
+namespace {
+inline uint8_t fold(uint8_t c) { return (c >= 'A' && c <= 'Z') ? static_cast<uint8_t>(c + 32) : c; }
+inline bool is_control(uint8_t c) { return c < 9 || (c > 13 && c < 32); }
+
+// looks_binary と同じ窓（1025 バイト目まで数える）
+constexpr size_t kBinaryWindow = 1025;
+
+// [i, end) で先頭バイト候補の位置を返す（無ければ end）。飛ばした範囲の改行を lines に、ctrl があれば制御文字を加える
+using SkipFn = size_t (*)(const uint8_t* s, size_t i, size_t end, const MultiMatcher::Prefilter& pf, int& lines, size_t* ctrl);
+
+size_t skip_scalar(const uint8_t* s, size_t i, size_t end, const MultiMatcher::Prefilter& pf, int& lines, size_t* ctrl) {
+    for (; i < end; ++i) {
+        uint8_t c = s[i];
+        if (pf.first[c]) {
+            if (i + 1 >= end) return i;
+            uint8_t f0 = fold(c), f1 = fold(s[i + 1]);
+            if (pf.lo0[f0 & 0x0F] & pf.hi0[f0 >> 4] & pf.lo1[f1 & 0x0F] & pf.hi1[f1 >> 4]) return i;
+        }
+        if (c == '\n') ++lines;
+        if (ctrl && is_control(c)) ++*ctrl;
+    }
+    return end;
+}
+
+#if defined(AGENS_X86)
+// 16 バイトずつ: 'A'〜'Z' を畳んでからニブル表を pshufb で引き、i と i+1 の両方でバケットのビットが残れば候補
+AGENS_TARGET("sse4.2") inline __m128i fold16(__m128i x) {
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80 - 'A')), upper_lim = _mm_set1_epi8(static_cast<char>(-128 + 26));
+    __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(x, bias), upper_lim);
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+AGENS_TARGET("sse4.2") inline __m128i lookup16(__m128i f, __m128i lo_t, __m128i hi_t) {
+    const __m128i nib = _mm_set1_epi8(0x0F);
+    return _mm_and_si128(_mm_shuffle_epi8(lo_t, _mm_and_si128(f, nib)),
+                         _mm_shuffle_epi8(hi_t, _mm_and_si128(_mm_srli_epi16(f, 4), nib)));
+}
+
+AGENS_TARGET("sse4.2") size_t skip_sse42(const uint8_t* s, size_t i, size_t end, const MultiMatcher::Prefilter& pf, int& lines, size_t* ctrl) {
+    const __m128i lo0 = _mm_load_si128(reinterpret_cast<const __m128i*>(pf.lo0));
+    const __m128i hi0 = _mm_load_si128(reinterpret_cast<const __m128i*>(pf.hi0));
+    const __m128i lo1 = _mm_load_si128(reinterpret_cast<const __m128i*>(pf.lo1));
+    const __m128i hi1 = _mm_load_si128(reinterpret_cast<const __m128i*>(pf.hi1));
+    const __m128i zero = _mm_setzero_si128(), nl = _mm_set1_epi8('\n');
+    const __m128i c31 = _mm_set1_epi8(31), c9 = _mm_set1_epi8(9), c4 = _mm_set1_epi8(4);
+    for (; i + 17 <= end; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+        __m128i hit = _mm_and_si128(lookup16(fold16(x), lo0, hi0), lookup16(fold16(x1), lo1, hi1));
+        uint32_t cand = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(hit, zero))) ^ 0xFFFFu;
+        uint32_t nls = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, nl)));
+        uint32_t ctl = 0;
+        if (ctrl) {
+            __m128i lt32 = _mm_cmpeq_epi8(_mm_min_epu8(x, c31), x);
+            __m128i d = _mm_sub_epi8(x, c9);
+            __m128i ws = _mm_cmpeq_epi8(_mm_min_epu8(d, c4), d);
+            ctl = static_cast<uint32_t>(_mm_movemask_epi8(_mm_andnot_si128(ws, lt32)));
+        }
+        uint32_t below = cand ? (1u << countr_zero(cand)) - 1 : 0xFFFFu;
+        lines += popcount(nls & below);
+        if (ctrl) *ctrl += static_cast<size_t>(popcount(ctl & below));
+        if (cand) return i + static_cast<size_t>(countr_zero(cand));
+    }
+    return skip_scalar(s, i, end, pf, lines, ctrl);
+}
+
+// 32 バイトずつ（ニブル表は両レーンへ複製）
+AGENS_TARGET("avx2") inline __m256i fold32(__m256i x) {
+    const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80 - 'A')), upper_lim = _mm256_set1_epi8(static_cast<char>(-128 + 26));
+    __m256i upper = _mm256_cmpgt_epi8(upper_lim, _mm256_add_epi8(x, bias));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+AGENS_TARGET("avx2") inline __m256i lookup32(__m256i f, __m256i lo_t, __m256i hi_t) {
+    const __m256i nib = _mm256_set1_epi8(0x0F);
+    return _mm256_and_si256(_mm256_shuffle_epi8(lo_t, _mm256_and_si256(f, nib)),
+                            _mm256_shuffle_epi8(hi_t, _mm256_and_si256(_mm256_srli_epi16(f, 4), nib)));
+}
+
+AGENS_TARGET("avx2") inline __m256i table32(const uint8_t* t) {
+    return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(t)));
+}
+
+AGENS_TARGET("avx2") size_t skip_avx2(const uint8_t* s, size_t i, size_t end, const MultiMatcher::Prefilter& pf, int& lines, size_t* ctrl) {
+    const __m256i lo0 = table32(pf.lo0), hi0 = table32(pf.hi0), lo1 = table32(pf.lo1), hi1 = table32(pf.hi1);
+    const __m256i zero = _mm256_setzero_si256(), nl = _mm256_set1_epi8('\n');
+    const __m256i c31 = _mm256_set1_epi8(31), c9 = _mm256_set1_epi8(9), c4 = _mm256_set1_epi8(4);
+    for (; i + 33 <= end; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 1));
+        __m256i hit = _mm256_and_si256(lookup32(fold32(x), lo0, hi0), lookup32(fold32(x1), lo1, hi1));
+        uint32_t cand = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero)));
+        uint32_t nls = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, nl)));
+        uint32_t ctl = 0;
+        if (ctrl) {
+            __m256i lt32 = _mm256_cmpeq_epi8(_mm256_min_epu8(x, c31), x);
+            __m256i d = _mm256_sub_epi8(x, c9);
+            __m256i ws = _mm256_cmpeq_epi8(_mm256_min_epu8(d, c4), d);
+            ctl = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(ws, lt32)));
+        }
+        uint32_t below = cand ? static_cast<uint32_t>((1ull << countr_zero(cand)) - 1) : 0xFFFFFFFFu;
+        lines += popcount(nls & below);
+        if (ctrl) *ctrl += static_cast<size_t>(popcount(ctl & below));
+        if (cand) return i + static_cast<size_t>(countr_zero(cand));
+    }
+    return skip_sse42(s, i, end, pf, lines, ctrl);
+}
+#endif
+
+SkipFn skip_for(SimdLevel level) {
+#if defined(AGENS_X86)
+    if (level == SimdLevel::AVX2) return skip_avx2;
+    if (level == SimdLevel::SSE42) return skip_sse42;
+#endif
+    (void)level;
+    return skip_scalar;
+}
+
+SimdLevel detect() {
+#if defined(AGENS_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return SimdLevel::SSE42;
+#elif defined(AGENS_X86) && defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    int max_leaf = r[0];
+    __cpuid(r, 1);
+    bool sse42 = (r[2] & (1 << 20)) != 0;
+    bool osxsave = (r[2] & (1 << 27)) != 0, avx = (r[2] & (1 << 28)) != 0;
+    bool avx2 = false;
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(r, 7, 0);
+        avx2 = (r[1] & (1 << 5)) != 0;
+    }
+    if (avx2) return SimdLevel::AVX2;
+    if (sse42) return SimdLevel::SSE42;
+#endif
+    return SimdLevel::Scalar;
+}
+}
+
+SimdLevel detected_simd_level() {
+    static const SimdLevel level = detect();
+    return level;
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE42: return "sse4.2";
+        default: return "scalar";
+    }
+}
+
+size_t count_control_bytes(string_view data, SimdLevel level) {
+    // 候補の無い前置フィルタで最後まで飛ばすと、制御文字だけが数えられる
+    static const MultiMatcher::Prefilter none;
+    level = min(level, detected_simd_level());
+    size_t ctrl = 0;
+    int lines = 0;
+    skip_for(level)(reinterpret_cast<const uint8_t*>(data.data()), 0, data.size(), none, lines, &ctrl);
+    return ctrl;
+}
+
+MultiMatcher::MultiMatcher(vector<string> tokens) : tokens_(std::move(tokens)), level_(detected_simd_level()) {
+    // トライ（遷移は畳んだバイトのみ）。同じ文字列のトークンは同じ状態に複数の出力を持つ
+    vector<map<uint8_t, uint32_t>> trie(1);
+    vector<vector<uint32_t>> outs(1);
+    size_t buckets = 0;
+    for (size_t k = 0; k < tokens_.size(); ++k) {
+        const string& tk = tokens_[k];
+        if (tk.empty()) continue;
+        uint32_t s = 0;
+        for (char ch : tk) {
+            uint8_t c = fold(static_cast<uint8_t>(ch));
+            auto it = trie[s].find(c);
+            if (it == trie[s].end()) {
+                trie.emplace_back();
+                outs.emplace_back();
+                it = trie[s].emplace(c, static_cast<uint32_t>(trie.size() - 1)).first;
+            }
+            s = it->second;
+        }
+        outs[s].push_back(static_cast<uint32_t>(k));
+        // 前置フィルタ: トークンごとにバケット（8個、超えた分は共有して偽陽性を許す）を割り当てる
+        uint8_t bit = static_cast<uint8_t>(1u << (buckets++ % 8));
+        uint8_t c0 = fold(static_cast<uint8_t>(tk[0]));
+        pre_.lo0[c0 & 0x0F] |= bit;
+        pre_.hi0[c0 >> 4] |= bit;
+        if (tk.size() > 1) {
+            uint8_t c1 = fold(static_cast<uint8_t>(tk[1]));
+            pre_.lo1[c1 & 0x0F] |= bit;
+            pre_.hi1[c1 >> 4] |= bit;
+        } else {
+            for (int j = 0; j < 16; ++j) { pre_.lo1[j] |= bit; pre_.hi1[j] |= bit; }
+        }
+        pre_.first[c0] = true;
+        if (c0 >= 'a' && c0 <= 'z') pre_.first[c0 - 32] = true;
+    }
+
+    // 幅優先で失敗遷移を埋め、完全な DFA にする
+    size_t n = trie.size();
+    delta_.assign(n * 256, 0);
+    vector<uint32_t> fail(n, 0);
+    queue<uint32_t> q;
+    for (auto [c, t] : trie[0]) { delta_[c] = t; q.push(t); }
+    while (!q.empty()) {
+        uint32_t s = q.front(); q.pop();
+        for (int c = 0; c < 256; ++c) {
+            auto it = trie[s].find(static_cast<uint8_t>(c));
+            if (it == trie[s].end()) {
+                delta_[s * 256 + c] = delta_[fail[s] * 256 + c];
+            } else {
+                uint32_t t = it->second;
+                fail[t] = delta_[fail[s] * 256 + c];
+                for (uint32_t o : outs[fail[t]]) outs[t].push_back(o);
+                delta_[s * 256 + c] = t;
+                q.push(t);
+            }
+        }
+    }
+    // 大文字の遷移は小文字と同じにする
+    for (size_t s = 0; s < n; ++s) {
+        for (int c = 'A'; c <= 'Z'; ++c) delta_[s * 256 + c] = delta_[s * 256 + c + 32];
+    }
+    out_begin_.resize(n + 1);
+    for (size_t s = 0; s < n; ++s) {
+        out_begin_[s] = static_cast<uint32_t>(out_.size());
+        sort(outs[s].begin(), outs[s].end());
+        out_.insert(out_.end(), outs[s].begin(), outs[s].end());
+    }
+    out_begin_[n] = static_cast<uint32_t>(out_.size());
+}
+
+void MultiMatcher::set_level(SimdLevel level) { level_ = min(level, detected_simd_level()); }
+
+MultiMatcher::ScanResult MultiMatcher::scan(string_view text, int first_line, bool check_binary,
+                                            const function<void(size_t, int, size_t)>& on_match) const {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(text.data());
+    const size_t n = text.size();
+    const SkipFn skip = skip_for(level_);
+    ScanResult r;
+    int line = first_line;
+    uint32_t state = 0;
+    // 同じ行の2回目以降の一致は報告しない（トークン64個までビット、それ以上は行番号の表）
+    uint64_t seen = 0;
+    int seen_line = first_line - 1;
+    vector<int> seen_big(tokens_.size() > 64 ? tokens_.size() : 0, first_line - 1);
+
+    auto run = [&](size_t i, size_t end, size_t* ctrl) {
+        while (i < end) {
+            if (state == 0) {
+                i = skip(s, i, end, pre_, line, ctrl);
+                if (i >= end) break;
+            }
+            uint8_t c = s[i];
+            if (c == '\n') ++line;
+            if (ctrl && is_control(c)) ++*ctrl;
+            state = delta_[state * 256 + c];
+            for (uint32_t o = out_begin_[state]; o < out_begin_[state + 1]; ++o) {
+                uint32_t k = out_[o];
+                if (k < 64) {
+                    if (seen_line != line) { seen = 0; seen_line = line; }
+                    if (seen & (1ull << k)) continue;
+                    seen |= 1ull << k;
+                } else {
+                    if (seen_big[k] == line) continue;
+                    seen_big[k] = line;
+                }
+                on_match(k, line, i + 1 - tokens_[k].size());
+            }
+            ++i;
+        }
+    };
+
+    size_t start = 0;
+    if (check_binary) {
+        size_t window = min(n, kBinaryWindow), ctrl = 0;
+        run(0, window, &ctrl);
+        if (ctrl > window / 16) { r.binary = true; r.end_line = line; return r; }
+        start = window;
+    }
+    run(start, n, nullptr);
+    r.end_line = line;
+    return r;
+}
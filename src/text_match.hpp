@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 複数トークンの大文字小文字を無視した同時照合（/target の本文採点用）
+//
+// Aho-Corasick の DFA（ASCII を小文字に畳んだ遷移表）と、トークン先頭2バイトの SIMD 前置フィルタの組み合わせ。
+// DFA が根にいる間は前置フィルタで候補位置まで飛ばし、飛ばした範囲の改行と制御文字もその場で数える
+
+/// @brief 前置フィルタの命令セット（実行時に CPU から選ぶ）
+enum class SimdLevel { Scalar = 0, SSE42 = 1, AVX2 = 2 };
+
+/// @brief この CPU で使える最上位の命令セット
+SimdLevel detected_simd_level();
+const char* simd_level_name(SimdLevel level);
+/// @brief 制御文字（タブ・改行類を除く 0x00〜0x1F）の数
+size_t count_control_bytes(std::string_view data, SimdLevel level = detected_simd_level());
+
+class MultiMatcher {
+public:
+    /// @param tokens 小文字化済みのトークン（重複可。空は無視）
+    explicit MultiMatcher(std::vector<std::string> tokens);
+
+    const std::vector<std::string>& tokens() const { return tokens_; }
+    SimdLevel level() const { return level_; }
+    /// @brief 前置フィルタを切り替える（テスト・計測用。CPU が対応しない命令セットは detected_simd_level() に丸める）
+    void set_level(SimdLevel level);
+
+    struct ScanResult {
+        bool binary = false; // check_binary のとき先頭 1025 バイトの 1/16 超が制御文字
+        int end_line = 1;    // 走査後の行番号（first_line + 改行数）
+    };
+    /// @brief text を1回走査し、トークンが現れた行ごとに1回 on_match(トークン番号, 行番号, 一致の開始位置) を呼ぶ
+    /// バイナリと判定した時点で打ち切る（それまでの on_match は呼ばれている）
+    ScanResult scan(std::string_view text, int first_line, bool check_binary,
+                    const std::function<void(size_t token, int line, size_t pos)>& on_match) const;
+
+    /// @brief 前置フィルタの表。先頭2バイトそれぞれの下位・上位ニブル → バケットのビット（Teddy 方式）
+    /// 4つの表のビットがすべて立つ位置だけが候補。1バイトのトークンは2バイト目の表を全て立てる
+    struct Prefilter {
+        alignas(16) uint8_t lo0[16] = {};
+        alignas(16) uint8_t hi0[16] = {};
+        alignas(16) uint8_t lo1[16] = {};
+        alignas(16) uint8_t hi1[16] = {};
+        bool first[256] = {}; // スカラー版の一次判定（1バイト目。大文字も立てる）
+    };
+
+private:
+    std::vector<std::string> tokens_;
+    std::vector<uint32_t> delta_;     // 状態 × 256 の遷移表
+    std::vector<uint32_t> out_begin_; // 状態ごとの出力（トークン番号）の範囲
+    std::vector<uint32_t> out_;
+    Prefilter pre_;
+    SimdLevel level_;
+};
@@ -0,0 +1,187 @@
+#include "trace.hpp"
+#include "chat.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace trace {
+
+namespace detail {
+std::atomic<bool> g_enabled{false};
+}
+
+namespace {
+
+struct Event {
+    const char* name;
+    const char* cat;
+    char ph;          // 'X'=完了スパン, 'C'=カウンタ
+    uint64_t ts_us;
+    uint64_t dur_us;
+    double value;     // カウンタ値
+    string arg;
+};
+
+// 追加は持ち主のスレッドだけが行うが、flush は他のスレッドから読むためバッファごとにロックする
+// （競合するのは flush 中だけなので、普段は競合の無いロック1回）
+struct ThreadBuffer {
+    int tid = 0;
+    mutex mu;
+    vector<Event> events;
+
+    void push(Event e) {
+        lock_guard<mutex> lk(mu);
+        events.push_back(std::move(e));
+    }
+};
+
+// スレッドバッファの登録簿。登録と flush 時のみロックし、イベントの追加は各スレッドが自分のバッファへ行う
+struct Registry {
+    mutex mu;
+    vector<unique_ptr<ThreadBuffer>> buffers;
+    string path;
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+};
+
+// 終了時（atexit）より後まで動くスレッドが破棄済みの登録簿に触れないよう、意図的に解放しない
+Registry& registry() {
+    static Registry* r = new Registry;
+    return *r;
+}
+
+ThreadBuffer& local_buffer() {
+    thread_local ThreadBuffer* buf = nullptr;
+    if (!buf) {
+        auto& r = registry();
+        lock_guard<mutex> lk(r.mu);
+        r.buffers.push_back(make_unique<ThreadBuffer>());
+        buf = r.buffers.back().get();
+        buf->tid = static_cast<int>(r.buffers.size());
+        buf->events.reserve(256); // 登録簿のロック中なので flush とは競合しない
+    }
+    return *buf;
+}
+
+thread_local int t_depth = 0;
+
+uint64_t now_us() {
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - registry().epoch).count());
+}
+
+// main の戻り後に呼ばれる（監視スレッド・先読み・ワーカーは main 内のオブジェクトの破棄で join 済み）。
+// 残っているスレッドがあっても以降は記録させない
+void flush_at_exit() {
+    flush();
+    detail::g_enabled.store(false, memory_order_relaxed);
+}
+
+} // namespace
+
+void start(const string& path) {
+    auto& r = registry();
+    {
+        lock_guard<mutex> lk(r.mu);
+        r.path = path;
+    }
+    static bool registered = false;
+    if (!registered) { registered = true; std::atexit(flush_at_exit); }
+    detail::g_enabled.store(true, memory_order_relaxed);
+}
+
+void init_from_env() {
+    const char* p = std::getenv("AGENS_TRACE");
+    if (p && *p) start(p);
+}
+
+uint64_t peak_rss_bytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc{};
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return static_cast<uint64_t>(pmc.PeakWorkingSetSize);
+    return 0;
+#else
+    struct rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(ru.ru_maxrss);          // バイト
+#else
+    return static_cast<uint64_t>(ru.ru_maxrss) * 1024ull; // KiB
+#endif
+#endif
+}
+
+void sample_rss() {
+    if (!enabled()) return;
+    local_buffer().push(Event{"peak_rss_mb", "memory", 'C', now_us(), 0, static_cast<double>(peak_rss_bytes()) / (1024.0 * 1024.0), string()});
+}
+
+Span::Span(const char* name, const char* cat) : name_(name), cat_(cat) {
+    if (!enabled()) return;
+    active_ = true;
+    ++t_depth;
+    start_us_ = now_us();
+}
+
+void Span::arg(const string& detail) {
+    if (!active_) return;
+    arg_ = detail.size() > 200 ? detail.substr(0, 200) + "..." : detail;
+}
+
+Span::~Span() { end(); }
+
+void Span::end() {
+    if (!active_) return;
+    active_ = false;
+    uint64_t end = now_us();
+    local_buffer().push(Event{name_, cat_, 'X', start_us_, end - start_us_, 0, std::move(arg_)});
+    // 最上位スパンの終わりでピークRSSを記録
+    if (--t_depth == 0) sample_rss();
+}
+
+bool flush() {
+    if (!enabled()) return false;
+    sample_rss();
+    auto& r = registry();
+    lock_guard<mutex> lk(r.mu);
+    ofstream ofs(r.path, ios::binary | ios::trunc);
+    if (!ofs) return false;
+#if defined(_WIN32)
+    const unsigned long pid = GetCurrentProcessId();
+#else
+    const long pid = static_cast<long>(getpid());
+#endif
+    ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto& b : r.buffers) {
+        lock_guard<mutex> blk(b->mu);
+        for (const auto& e : b->events) {
+            if (!first) ofs << ",\n";
+            first = false;
+            ofs << "{\"name\":\"" << json_escape(e.name) << "\",\"cat\":\"" << e.cat << "\",\"ph\":\"" << e.ph
+                << "\",\"ts\":" << e.ts_us << ",\"pid\":" << pid << ",\"tid\":" << b->tid;
+            if (e.ph == 'X') {
+                ofs << ",\"dur\":" << e.dur_us;
+                if (!e.arg.empty()) ofs << ",\"args\":{\"detail\":\"" << json_escape(e.arg) << "\"}";
+            } else {
+                ofs << ",\"args\":{\"value\":" << e.value << "}";
+            }
+            ofs << "}";
+        }
+    }
+    ofs << "\n]}\n";
+    return static_cast<bool>(ofs);
+}
+
+} // namespace trace
@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Chrome/Perfetto の trace-event JSON 出力（AGENS_TRACE=path で有効化）。
+// スパンはスレッドごとのバッファ（flush とだけ競合するロック付き）へ積み、終了時にまとめて書き出す。
+// 無効時のコストは atomic<bool> の読み出し1回のみ。
+namespace trace {
+
+namespace detail {
+extern std::atomic<bool> g_enabled;
+}
+
+/// @brief 環境変数 AGENS_TRACE を見て有効化し、終了時の書き出しを登録する
+void init_from_env();
+/// @brief 指定パスへの出力で有効化する（テスト・明示指定用）
+void start(const std::string& path);
+inline bool enabled() { return detail::g_enabled.load(std::memory_order_relaxed); }
+/// @brief 溜まったイベントをファイルへ書き出す（複数回呼んでも最後の内容で上書き）
+bool flush();
+/// @brief 現在のピークRSSをカウンタイベントとして記録する
+void sample_rss();
+/// @brief プロセスのピークRSS（バイト）。取得できなければ0
+uint64_t peak_rss_bytes();
+
+/// @brief RAIIスパン。name はリテラルなど寿命の長い文字列を渡す
+class Span {
+public:
+    explicit Span(const char* name, const char* cat = "agens");
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+    ~Span();
+    /// @brief 付加情報（コマンド文字列など）。無効時は何もしない
+    void arg(const std::string& detail);
+    /// @brief デストラクタを待たずにスパンを閉じる（連続する処理段階の区切り用）
+    void end();
+private:
+    const char* name_;
+    const char* cat_;
+    uint64_t start_us_ = 0;
+    std::string arg_;
+    bool active_ = false;
+};
+
+} // namespace trace
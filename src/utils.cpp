@@ -1,4 +1,6 @@
 #include "utils.hpp"
+#include "ports.hpp"
+#include "trace.hpp"
 #include <filesystem>
 #include <stdexcept>
 #include <array>
@@ -7,6 +9,9 @@
 #include <chrono>
 #include <algorithm>
 #include <cctype> // for isspace
+#include <cstdio>
+#include <atomic>
+#include <csignal>
 
 #if defined(_WIN32)
 #include <windows.h>
@@ -32,6 +37,8 @@ std::string shell_escape_single_quotes(const std::string& s) {
 }
 
 int run_shell_with_status(const std::string& cmd, std::string& result) {
+    trace::Span span("shell", "process");
+    span.arg(cmd);
     result.clear();
     std::array<char, 4096> buffer{};
 #if defined(_WIN32)
@@ -92,6 +99,8 @@ std::string escape_double_quotes(const std::string& s) {
 
 
 std::optional<std::string> http_get(const std::string& url, const std::vector<std::string>& headers) {
+    trace::Span span("http.get", "http");
+    span.arg(url);
     const std::string kMarker = "__STATUS_CODE__:";
     std::string cmd = "curl -sS --connect-timeout 2 --max-time 10 --fail-with-body -w \"" + kMarker + "%{http_code}\" -H \"Content-Type: application/json\"";
     for (const auto& h : headers) {
@@ -127,15 +136,27 @@ std::optional<std::string> http_get(const std::string& url, const std::vector<st
     return std::nullopt;
 }
 
-std::optional<std::string> http_post_json(const std::string& url, const std::string& json_body, const std::vector<std::string>& headers) {
+std::optional<std::string> http_post_json(const std::string& url, const std::string& json_body, const std::vector<std::string>& headers, HttpTiming* timing) {
+    return http_post_json_stream(url, [&](std::ostream& os){ os << json_body; }, headers, timing);
+}
+
+std::optional<std::string> http_post_json_stream(const std::string& url, const std::function<void(std::ostream&)>& write_body, const std::vector<std::string>& headers, HttpTiming* timing) {
+    trace::Span span("http.post", "http");
+    span.arg(url);
     auto path_str = temp_json_path();
     {
+        trace::Span write_span("http.write_body", "http");
         std::ofstream ofs(path_str, std::ios::binary);
         if (!ofs) return std::nullopt;
-        ofs << json_body;
+        write_body(ofs);
+        if (!ofs) { ofs.close(); std::error_code ec; std::filesystem::remove(path_str, ec); return std::nullopt; }
     }
     const std::string kMarker = "__STATUS_CODE__:";
-    std::string cmd = "curl -sS --connect-timeout 2 --max-time 10 --fail-with-body -w \"" + kMarker + "%{http_code}\" -X POST";
+    const std::string kTimingMarker = "__TIMING__:";
+    // 計測値（秒）はステータスの直前に付与する
+    const int max_time = timing ? timing->timeout_sec : 10;
+    std::string cmd = "curl -sS --connect-timeout 2" + (max_time > 0 ? " --max-time " + std::to_string(max_time) : std::string())
+                    + " --fail-with-body -w \"" + kTimingMarker + "%{time_starttransfer} %{time_total}" + kMarker + "%{http_code}\" -X POST";
     cmd += " -H \"Content-Type: application/json\"";
     for (const auto& h : headers) {
         cmd += " -H \"" + escape_double_quotes(h) + "\"";
@@ -157,8 +178,21 @@ std::optional<std::string> http_post_json(const std::string& url, const std::str
     if (pos == std::string::npos) {
         return std::nullopt;
     }
-    std::string body = result.substr(0, pos);
     std::string status = result.substr(pos + kMarker.size());
+    size_t tpos = result.rfind(kTimingMarker, pos);
+    if (tpos != std::string::npos) {
+        std::string t = result.substr(tpos + kTimingMarker.size(), pos - tpos - kTimingMarker.size());
+        if (timing) {
+            // curl は秒で出力する（ロケールにより小数点が ',' になる場合は無視）
+            double ttfb = -1, total = -1;
+            if (std::sscanf(t.c_str(), "%lf %lf", &ttfb, &total) == 2) {
+                timing->ttfb_ms = ttfb * 1000.0;
+                timing->total_ms = total * 1000.0;
+            }
+        }
+        pos = tpos;
+    }
+    std::string body = result.substr(0, pos);
     int code = 0;
     try {
         code = std::stoi(status);
@@ -171,6 +205,16 @@ std::optional<std::string> http_post_json(const std::string& url, const std::str
     return std::nullopt;
 }
 
+std::string url_encode(const std::string& s) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string o; o.reserve(s.size()*3);
+    for (unsigned char c : s) {
+        if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~') o += static_cast<char>(c);
+        else { o += '%'; o += hex[c>>4]; o += hex[c&15]; }
+    }
+    return o;
+}
+
 std::string trim(const std::string& s) {
     auto notspace = [](int ch){ return !std::isspace(static_cast<unsigned char>(ch)); };
     auto it = std::find_if(s.begin(), s.end(), notspace);
@@ -228,6 +272,60 @@ std::vector<std::string> json_collect_string_values(const std::string& text, con
     return out;
 }
 
+bool json_find_last_number_value(const std::string& text, const std::string& key, double& out_value) {
+    const std::string pat = "\"" + key + "\"";
+    size_t pos = text.rfind(pat);
+    if (pos == std::string::npos) return false;
+    pos += pat.size();
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+    if (pos >= text.size() || text[pos] != ':') return false;
+    ++pos;
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+    size_t end = pos;
+    while (end < text.size()) {
+        char c = text[end];
+        if ((c>='0' && c<='9') || c=='-' || c=='+' || c=='.' || c=='e' || c=='E') { ++end; continue; }
+        break;
+    }
+    if (end == pos) return false;
+    try {
+        out_value = std::stod(text.substr(pos, end - pos));
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> json_array_objects(const std::string& text, const std::string& key) {
+    std::vector<std::string> out;
+    size_t pos = key.empty() ? 0 : text.find("\"" + key + "\"");
+    if (pos == std::string::npos) return out;
+    pos = text.find('[', pos);
+    if (pos == std::string::npos) return out;
+    int depth = 0;
+    bool in_str = false, escape = false;
+    size_t start = 0;
+    for (size_t i = pos + 1; i < text.size(); ++i) {
+        char c = text[i];
+        if (in_str) {
+            if (escape) escape = false;
+            else if (c == '\\') escape = true;
+            else if (c == '"') in_str = false;
+            continue;
+        }
+        if (c == '"') { in_str = true; continue; }
+        if (c == '{' || c == '[') {
+            if (depth == 0 && c == '{') start = i;
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) break; // 配列の終わり
+            --depth;
+            if (depth == 0 && c == '}') out.push_back(text.substr(start, i - start + 1));
+        }
+    }
+    return out;
+}
+
 std::string json_escape(const std::string& s) {
     std::string out;
     out.reserve(s.size() + 16);
@@ -247,11 +345,29 @@ std::string json_escape(const std::string& s) {
 std::string temp_json_path() {
     auto tp = std::chrono::high_resolution_clock::now().time_since_epoch();
     uint64_t d = std::chrono::duration_cast<std::chrono::microseconds>(tp).count();
-    std::mt19937_64 rng(d);
+    // 複数スレッドから同時に呼ばれても衝突しないよう連番を混ぜる
+    static std::atomic<uint64_t> seq{0};
+    std::mt19937_64 rng(d ^ (seq.fetch_add(1) * 0x9E3779B97F4A7C15ull));
     std::uniform_int_distribution<uint64_t> dist;
     std::filesystem::path path = std::filesystem::temp_directory_path();
     path /= "agens-" + std::to_string(dist(rng)) + ".json";
     return path.string();
 }
 
+namespace {
+std::atomic<bool> g_interrupted{false};
+extern "C" void on_sigint(int) { g_interrupted.store(true); }
+}
+
+InterruptGuard::InterruptGuard() {
+    g_interrupted.store(false);
+    prev_ = std::signal(SIGINT, on_sigint);
+}
+
+InterruptGuard::~InterruptGuard() {
+    std::signal(SIGINT, prev_ == SIG_ERR ? SIG_DFL : prev_);
+}
+
+const std::atomic<bool>& InterruptGuard::flag() const { return g_interrupted; }
+
 } // namespace utils
@@ -1,7 +1,12 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <atomic>
 #include <optional>
+#include <functional>
+#include <ostream>
+
+struct HttpTiming;
 
 /// @brief 汎用的なヘルパー関数群
 namespace utils {
@@ -11,7 +16,12 @@ int run_shell_with_status(const std::string& cmd, std::string& result);
 std::string run_shell(const std::string& cmd);
 std::string escape_double_quotes(const std::string& s);
 std::optional<std::string> http_get(const std::string& url, const std::vector<std::string>& headers = {});
-std::optional<std::string> http_post_json(const std::string& url, const std::string& json_body, const std::vector<std::string>& headers = {});
+/// @param timing 非nullなら timing->timeout_sec を上限にし、curl が計測した TTFB/全体時間を格納する（null なら上限 10 秒）
+std::optional<std::string> http_post_json(const std::string& url, const std::string& json_body, const std::vector<std::string>& headers = {}, HttpTiming* timing = nullptr);
+/// @brief 本文を write_body で一時ファイルへ直接書き出して POST する（本文全体を文字列に持たない）
+std::optional<std::string> http_post_json_stream(const std::string& url, const std::function<void(std::ostream&)>& write_body, const std::vector<std::string>& headers = {}, HttpTiming* timing = nullptr);
+/// @brief URL のクエリ値・パスの1区間として使えるよう英数字と -_.~ 以外を %XX にする（"/" も符号化する）
+std::string url_encode(const std::string& s);
 /// @brief 文字列の先頭と末尾の空白文字を削除する
 std::string trim(const std::string& s);
 /// @brief JSON風のテキストから、指定されたキーに一致する最初の文字列値を抽出する
@@ -21,8 +31,27 @@ bool json_find_first_string_value(const std::string& text, const std::string& ke
 /// @brief JSON風のテキストから、指定されたキーに一致するすべての文字列値を収集する
 /// @note 簡易的なパーサーであり、複雑なJSON構造には対応していない
 std::vector<std::string> json_collect_string_values(const std::string& text, const std::string& key);
+/// @brief JSON風のテキストから、指定されたキーに一致する最後の数値を抽出する
+/// @note 応答末尾に付く統計値（Ollama の eval_count など）を本文中の同名文字列と取り違えないよう末尾側から探索する
+/// @return 値が見つかった場合はtrue
+bool json_find_last_number_value(const std::string& text, const std::string& key, double& out_value);
+/// @brief 指定キーの配列に並ぶオブジェクトを、それぞれ "{...}" の部分文字列として切り出す
+/// @note 文字列内の括弧は無視する。キーが無ければ空。key が空なら最初の配列（トップレベル配列用）
+std::vector<std::string> json_array_objects(const std::string& text, const std::string& key);
 std::string json_escape(const std::string& s);
 
 std::string temp_json_path();
 
+/// @brief 生存中だけ Ctrl-C（SIGINT）を終了ではなく flag() への通知に変える。入れ子にはしない
+class InterruptGuard {
+public:
+    InterruptGuard();
+    ~InterruptGuard();
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+    const std::atomic<bool>& flag() const;
+private:
+    void (*prev_)(int) = nullptr;
+};
+
 } // namespace utils
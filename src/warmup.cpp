@@ -0,0 +1,76 @@
+#include "warmup.hpp"
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+namespace {
+bool is_ready(const shared_future<bool>& f) {
+    return f.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+}
+
+BackgroundWarmer::~BackgroundWarmer() {
+    lock_guard<mutex> lk(mu_);
+    for (auto& kv : jobs_) if (kv.second.valid()) kv.second.wait();
+}
+
+bool BackgroundWarmer::start(const string& model, function<bool()> job) {
+    if (model.empty()) return false;
+    lock_guard<mutex> lk(mu_);
+    auto it = jobs_.find(model);
+    if (it != jobs_.end()) {
+        // 失敗して終わったものだけは再試行を許す
+        if (!is_ready(it->second) || it->second.get()) return false;
+    }
+    jobs_[model] = std::async(std::launch::async, std::move(job)).share();
+    return true;
+}
+
+bool BackgroundWarmer::wait(const string& model) {
+    shared_future<bool> f;
+    {
+        lock_guard<mutex> lk(mu_);
+        auto it = jobs_.find(model);
+        if (it == jobs_.end()) return false;
+        f = it->second;
+    }
+    return f.get();
+}
+
+bool BackgroundWarmer::pending(const string& model) {
+    lock_guard<mutex> lk(mu_);
+    auto it = jobs_.find(model);
+    return it != jobs_.end() && !is_ready(it->second);
+}
+
+bool BackgroundWarmer::warm(const string& model) {
+    lock_guard<mutex> lk(mu_);
+    auto it = jobs_.find(model);
+    return it != jobs_.end() && is_ready(it->second) && it->second.get();
+}
+
+void BackgroundWarmer::forget(const string& model) {
+    shared_future<bool> f;
+    {
+        lock_guard<mutex> lk(mu_);
+        auto it = jobs_.find(model);
+        if (it == jobs_.end()) return;
+        f = it->second;
+        jobs_.erase(it);
+    }
+    if (f.valid()) f.wait();
+}
+
+vector<string> pick_preload_candidates(const vector<string>& listed, const vector<string>& recent,
+                                       const string& current, size_t max_count) {
+    vector<string> out;
+    for (const auto& m : recent) {
+        if (out.size() >= max_count) break;
+        if (m == current) continue;
+        if (find(listed.begin(), listed.end(), m) == listed.end()) continue;
+        if (find(out.begin(), out.end(), m) != out.end()) continue;
+        out.push_back(m);
+    }
+    return out;
+}
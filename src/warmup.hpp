@@ -0,0 +1,38 @@
+#pragma once
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// モデルのウォームアップ（空リクエストによる事前ロード）をバックグラウンドで行う
+
+/// @brief モデル単位で事前ロードを非同期実行する。同じモデルの多重起動はしない
+class BackgroundWarmer {
+public:
+    BackgroundWarmer() = default;
+    /// @brief 実行中のウォームアップを待ってから破棄する
+    ~BackgroundWarmer();
+    BackgroundWarmer(const BackgroundWarmer&) = delete;
+    BackgroundWarmer& operator=(const BackgroundWarmer&) = delete;
+
+    /// @brief job を別スレッドで開始する。同じモデルが実行中または成功済みなら何もせず false
+    bool start(const std::string& model, std::function<bool()> job);
+    /// @brief 実行中のウォームアップが終わるまで待ち、成功したかを返す（未開始なら false）
+    bool wait(const std::string& model);
+    bool pending(const std::string& model);
+    bool warm(const std::string& model);
+    /// @brief アンロード後などに完了済みの記録を消す
+    void forget(const std::string& model);
+
+private:
+    std::mutex mu_;
+    std::map<std::string, std::shared_future<bool>> jobs_;
+};
+
+/// @brief /model 一覧から先読み候補を選ぶ（最近使った順、現在のモデルと一覧に無いものは除外）
+std::vector<std::string> pick_preload_candidates(const std::vector<std::string>& listed,
+                                                 const std::vector<std::string>& recent,
+                                                 const std::string& current,
+                                                 size_t max_count = 1);
@@ -5,19 +5,9 @@
 
 using namespace std;
 
-static string url_encode(const string& s) {
-    static const char hex[] = "0123456789ABCDEF";
-    string o; o.reserve(s.size()*3);
-    for (unsigned char c : s) {
-        if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~') o += c;
-        else { o += '%'; o += hex[c>>4]; o += hex[c&15]; }
-    }
-    return o;
-}
-
 vector<WebResult> web_search(IHttp& http, const string& query, int max_results) {
     vector<WebResult> out;
-    string url = string("https://api.duckduckgo.com/?q=") + url_encode(query) + "&format=json&no_html=1&skip_disambig=1&t=agens&kl=jp-jp";
+    string url = string("https://api.duckduckgo.com/?q=") + utils::url_encode(query) + "&format=json&no_html=1&skip_disambig=1&t=agens&kl=jp-jp";
     auto body_opt = http.get(url);
     if (!body_opt) return out;
     const string& body = *body_opt;
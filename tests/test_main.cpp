@@ -4,6 +4,10 @@
 #include <cstdlib>
 #include <fstream>
 #include <filesystem>
+#include <sstream>
+#include <thread>
+#include <cmath>
+#include <map>
 
 #include "system_info.hpp"
 #include "chat.hpp"
@@ -12,6 +16,30 @@
 #include "backend.hpp"
 #include "web_search.hpp"
 #include "file_finder.hpp"
+#include "perf_profile.hpp"
+#include "model_fit.hpp"
+#include "bench.hpp"
+#include "trace.hpp"
+#include "latency_stats.hpp"
+#include "warmup.hpp"
+#include "residency.hpp"
+#include "router.hpp"
+#include "mapped_file.hpp"
+#include "summarize.hpp"
+#include "session.hpp"
+#include "attachment.hpp"
+#include "file_index.hpp"
+#include "task_pool.hpp"
+#include "text_match.hpp"
+#include "context_pack.hpp"
+#include "git_files.hpp"
+#include "agent_mode.hpp"
+#include "alloc_stats.hpp"
+#include <atomic>
+#include <tuple>
+#include <chrono>
+#include <new>
+#include <cstdint>
 
 // 簡易テストランナー
 static int failures = 0;
@@ -35,14 +63,21 @@ int main() {
         std::vector<std::pair<std::string,std::string>> map_post;
         std::optional<std::string> get(const std::string& url, const std::vector<std::string>& headers = {}) override {
             (void)headers;
+            ++gets[url];
             for (auto& kv : map_get) if (kv.first==url) return kv.second; return std::nullopt;
         }
         std::optional<std::string> post_json(const std::string& url, const std::string& json, const std::vector<std::string>& headers = {}) override {
             (void)json; (void)headers;
             for (auto& kv : map_post) if (kv.first==url) return kv.second; return std::nullopt;
         }
+        std::optional<std::string> post_json_timed(const std::string& url, const std::string& json, const std::vector<std::string>& headers, HttpTiming& timing) override {
+            last_timeout_sec = timing.timeout_sec;
+            return post_json(url, json, headers);
+        }
         void on_get(const std::string& url, const std::string& resp) { map_get.emplace_back(url, resp); }
         void on_post(const std::string& url, const std::string& resp) { map_post.emplace_back(url, resp); }
+        int last_timeout_sec = -1;
+        std::map<std::string, int> gets; // URL ごとの GET 回数
     };
 
     // モデル一覧（Ollama）
@@ -63,7 +98,13 @@ int main() {
         InferenceTuning t; std::vector<ChatMsg> msgs = {{"system","日本語で"},{"user","テスト"}};
         auto out = backend::ollama::chat(http, "m", msgs, t);
         REQUIRE(out.has_value());
-        REQUIRE(out->find("こんにちは")!=std::string::npos);
+        REQUIRE(out->content.find("こんにちは")!=std::string::npos);
+        REQUIRE(out->stats.client_ms >= 0);
+        // チャットの上限時間は推論パラメータから（既定の 10 秒では長い生成が切れる）
+        REQUIRE_EQ(http.last_timeout_sec, 600);
+        t.request_timeout_sec = 0;
+        backend::ollama::chat(http, "m", msgs, t);
+        REQUIRE_EQ(http.last_timeout_sec, 0);
     }
     // チャット（LM Studio）
     {
@@ -71,7 +112,36 @@ int main() {
         InferenceTuning t; std::vector<ChatMsg> msgs = {{"system","日本語で"},{"user","テスト"}};
         auto out = backend::lmstudio::chat(http, "m", msgs, t);
         REQUIRE(out.has_value());
-        REQUIRE(out->find("了解")!=std::string::npos);
+        REQUIRE(out->content.find("了解")!=std::string::npos);
+    }
+
+    // 生成統計（Ollama: ナノ秒、本文中の同名キーに惑わされない）
+    {
+        std::string resp = "{\"message\":{\"role\":\"assistant\",\"content\":\"\\\"eval_count\\\": 1\"},\"done\":true,"
+                           "\"total_duration\":5000000000,\"load_duration\":3000000000,\"prompt_eval_count\":100,"
+                           "\"prompt_eval_duration\":500000000,\"eval_count\":200,\"eval_duration\":1000000000}";
+        auto s = parse_ollama_stats(resp);
+        REQUIRE_EQ(s.prompt_tokens, 100);
+        REQUIRE_EQ(s.completion_tokens, 200);
+        REQUIRE_EQ(s.load_ms, 3000.0);
+        REQUIRE_EQ(s.prefill_tps(), 200.0);
+        REQUIRE_EQ(s.decode_tps(), 200.0);
+        s.client_ms = 5040;
+        REQUIRE_EQ(s.transport_ms(), 40.0);
+        auto line = format_stats_line(s);
+        REQUIRE(line.find("decode 200.0 tok/s")!=std::string::npos);
+        REQUIRE(line.find("load 3000 ms")!=std::string::npos);
+    }
+
+    // 生成統計（OpenAI互換 usage と llama.cpp timings）
+    {
+        auto s = parse_openai_stats("{\"choices\":[],\"usage\":{\"prompt_tokens\":12,\"completion_tokens\":34,\"total_tokens\":46}}");
+        REQUIRE_EQ(s.prompt_tokens, 12);
+        REQUIRE_EQ(s.completion_tokens, 34);
+        REQUIRE(s.decode_tps() < 0);
+        auto s2 = parse_openai_stats("{\"timings\":{\"prompt_n\":10,\"prompt_ms\":20.0,\"predicted_n\":50,\"predicted_ms\":1000.0}}");
+        REQUIRE_EQ(s2.prefill_tps(), 500.0);
+        REQUIRE_EQ(s2.decode_tps(), 50.0);
     }
 
     // detect_system_info_with をモックで検証
@@ -295,6 +365,201 @@ int main() {
         REQUIRE_EQ(t.max_tokens, 512);
     }
 
+    // 実測プロファイルによる調整: 24GB カードで高速なら静的段階より大きく、低速なら絞る
+    {
+        SystemInfo s; s.vram_mb=24000; s.ram_bytes=64ull<<30;
+        PerfProfile empty;
+        REQUIRE_EQ(decide_tuning(s, empty, 8000).context, decide_tuning(s).context);
+
+        PerfProfile fast;
+        for (int i=0;i<5;++i) fast.add(PerfSample{8192, 1500, 4000.0, 90.0, 0});
+        auto t = decide_tuning(s, fast, 8000);
+        REQUIRE(t.context > 8192);
+        REQUIRE(1500/4000.0 + t.max_tokens/90.0 <= 8.0); // 目標時間内に収まる生成量
+
+        PerfProfile slow;
+        for (int i=0;i<5;++i) slow.add(PerfSample{4096, 1000, 150.0, 4.0, 0});
+        SystemInfo small; small.vram_mb=6000; small.ram_bytes=16ull<<30;
+        auto t2 = decide_tuning(small, slow, 8000);
+        REQUIRE(t2.context <= decide_tuning(small).context);
+        REQUIRE(t2.max_tokens < decide_tuning(small).max_tokens);
+    }
+
+    // 実測プロファイルの追記と読み込み・上限での切り詰め
+    {
+        namespace fs = std::filesystem;
+        auto path = fs::temp_directory_path() / "agens_test_perf.tsv";
+        std::error_code ec; fs::remove(path, ec);
+        for (size_t i=0;i<PerfProfile::kMaxSamples+5;++i) {
+            REQUIRE(append_perf_sample(path, "linux|gpu", "m\tx", PerfSample{4096, 100, 200.0 + (double)i, 20.0, 0}));
+        }
+        PerfStore st; REQUIRE(load_perf_store(st, path));
+        // TSV に書けない文字を含むモデル名でも、記録したときと同じ名前で引ける
+        const auto* p = st.find("linux|gpu", "m\tx");
+        REQUIRE(p != nullptr);
+        REQUIRE(p == st.find("linux|gpu", "m x"));
+        if (p) {
+            REQUIRE_EQ(p->samples.size(), PerfProfile::kMaxSamples);
+            REQUIRE_EQ(p->decode_tps_at(4096), 20.0);
+        }
+        st.at("linux|gpu", "m\tx").add(PerfSample{8192, 100, 100.0, 10.0, 0});
+        REQUIRE(save_perf_store(st, path));
+        PerfStore st2; REQUIRE(load_perf_store(st2, path));
+        REQUIRE_EQ(st2.profiles.size(), (size_t)1);
+        if (const auto* p2 = st2.find("linux|gpu", "m\tx")) REQUIRE_EQ(p2->samples.size(), PerfProfile::kMaxSamples);
+        else REQUIRE(false);
+        fs::remove(path, ec);
+    }
+
+    // モデル情報（Ollama /api/show, LM Studio /api/v0/models）
+    {
+        MockHttp http;
+        http.on_post("http://localhost:11434/api/show",
+            "{\"template\":\"{{ .block_count\\\": 1 }}\",\"details\":{\"family\":\"llama\",\"parameter_size\":\"8.0B\",\"quantization_level\":\"Q4_K_M\"},"
+            "\"model_info\":{\"general.architecture\":\"llama\",\"general.parameter_count\":8030261248,\"llama.attention.head_count\":32,"
+            "\"llama.attention.head_count_kv\":8,\"llama.block_count\":32,\"llama.context_length\":131072,\"llama.embedding_length\":4096}}");
+        auto mi = backend::ollama::show_model(http, "llama3.1:8b");
+        REQUIRE(mi.has_value());
+        if (mi) {
+            REQUIRE_EQ(mi->n_layers, 32);
+            REQUIRE_EQ(mi->n_kv_heads, 8);
+            REQUIRE_EQ(mi->n_heads, 32);
+            REQUIRE_EQ(mi->context_length, 131072);
+            REQUIRE_EQ(mi->quantization, std::string("Q4_K_M"));
+            auto full = *mi; fill_missing_dims(full);
+            REQUIRE_EQ(kv_bytes_per_token(full), 131072u); // 2*32*8*128*2
+        }
+        MockHttp lms;
+        lms.on_get("http://localhost:1234/api/v0/models/qwen2.5-7b-instruct",
+            "{\"id\":\"qwen2.5-7b-instruct\",\"arch\":\"qwen2\",\"quantization\":\"Q4_K_M\",\"state\":\"loaded\",\"max_context_length\":32768}");
+        auto li = backend::lmstudio::show_model(lms, "qwen2.5-7b-instruct");
+        REQUIRE(li.has_value());
+        if (li) {
+            REQUIRE_EQ(li->context_length, 32768);
+            REQUIRE_EQ(li->parameter_count, 7e9);
+        }
+        // publisher/model 形式の ID はパスの1区間として符号化する
+        lms.on_get("http://localhost:1234/api/v0/models/lmstudio-community%2Fqwen2.5-7b-instruct",
+            "{\"id\":\"lmstudio-community/qwen2.5-7b-instruct\",\"arch\":\"qwen2\",\"max_context_length\":16384}");
+        auto lp = backend::lmstudio::show_model(lms, "lmstudio-community/qwen2.5-7b-instruct");
+        REQUIRE(lp.has_value());
+        if (lp) REQUIRE_EQ(lp->context_length, 16384);
+    }
+
+    // パラメータ数表記の解釈
+    {
+        REQUIRE_EQ(parse_parameter_size("8.0B"), 8e9);
+        REQUIRE_EQ(parse_parameter_size("llama3:70b-instruct"), 70e9);
+        REQUIRE_EQ(parse_parameter_size("567M"), 567e6);
+        REQUIRE_EQ(parse_parameter_size("llama3"), 0.0);
+    }
+
+    // モデル依存のフィット: 3B と 70B で context/オフロードが変わり、ネイティブ上限で頭打ち
+    {
+        SystemInfo s; s.vram_mb=24576; s.ram_bytes=64ull<<30;
+        ModelInfo small; small.parameter_count=3e9; small.quantization="Q4_K_M"; small.n_layers=28; small.embedding_length=3072;
+        small.n_heads=24; small.n_kv_heads=8; small.context_length=131072;
+        ModelInfo big; big.parameter_count=70e9; big.quantization="Q4_K_M"; big.n_layers=80; big.embedding_length=8192;
+        big.n_heads=64; big.n_kv_heads=8; big.context_length=131072;
+        auto fs = fit_model(s, small);
+        auto fb = fit_model(s, big);
+        REQUIRE(fs.fully_offloaded);
+        REQUIRE(fs.context > 32768);
+        REQUIRE(!fb.fully_offloaded);
+        REQUIRE(fb.gpu_layers > 0 && fb.gpu_layers < 80);
+        // 3B は KV キャッシュ込みで VRAM に収まりネイティブ上限まで、70B は VRAM+RAM の予算で決まる
+        REQUIRE_EQ(fs.context, 131072);
+        REQUIRE_EQ(fb.context, 65536);
+        small.context_length = 8192;
+        REQUIRE_EQ(fit_model(s, small).context, 8192);
+        // CPU のみ
+        SystemInfo cpu; cpu.is_linux=true; cpu.ram_bytes=16ull<<30;
+        auto fc = fit_model(cpu, small);
+        REQUIRE_EQ(fc.gpu_layers, 0);
+        auto t = apply_model_fit(InferenceTuning{}, fs);
+        REQUIRE(t.model_fitted);
+        std::vector<ChatMsg> msgs = {{"user","x"}};
+        REQUIRE(build_ollama_chat_body("m", msgs, t).find("\"num_gpu\":")!=std::string::npos);
+        REQUIRE(build_ollama_chat_body("m", msgs, InferenceTuning{}).find("num_gpu")==std::string::npos);
+    }
+
+    // ベンチマーク: 組み合わせの掃引・コールド計測・集計
+    {
+        REQUIRE_EQ(percentile({1,2,3,4,5}, 50), 3.0);
+        REQUIRE_EQ(percentile({10}, 99), 10.0);
+        REQUIRE_EQ(percentile({}, 50), -1.0);
+
+        BenchOptions bo;
+        REQUIRE(parse_bench_args({"prompts=100,5000", "ctx=2048,4096", "iters=2", "cold=1", "max=64"}, bo));
+        REQUIRE(!parse_bench_args({"bogus=1"}, bo));
+        int unloads = 0, calls = 0;
+        InferenceTuning base;
+        auto samples = run_bench(bo, base,
+            [&](const std::vector<ChatMsg>& msgs, const InferenceTuning& t)->std::optional<ChatResult>{
+                ++calls;
+                REQUIRE_EQ(t.max_tokens, 64);
+                REQUIRE_EQ(t.request_timeout_sec, 0);
+                REQUIRE(msgs.size()==1);
+                ChatResult r; r.stats.prompt_tokens=100; r.stats.prompt_ms=100; r.stats.completion_tokens=64; r.stats.completion_ms=640;
+                r.stats.load_ms = 0; r.stats.client_ms = 800;
+                r.content.assign(100000, 'x'); // 要求中の割り当てとして数えられる
+                return r;
+            },
+            [&](){ ++unloads; return true; });
+        // 5000 トークンは 2048/4096 のどちらにも収まらない → prompt=100 × ctx 2種 × (cold1+warm2)
+        REQUIRE_EQ(samples.size(), 6u);
+        REQUIRE_EQ(unloads, 2);
+        auto sum = summarize_bench(samples);
+        REQUIRE_EQ(sum.size(), 4u);
+        REQUIRE_EQ(sum[0].decode_tps, 100.0);
+        REQUIRE_EQ(sum[0].ttft_p50, 100.0);
+        REQUIRE(samples[0].allocs >= 1);
+        REQUIRE(samples[0].alloc_bytes >= 100000);
+        REQUIRE(sum[0].alloc_bytes >= 100000.0);
+        REQUIRE(bench_to_csv(samples).find("context,prompt_target")==0);
+        REQUIRE(bench_to_csv(samples).find(",allocs,alloc_bytes\n")!=std::string::npos);
+        // 割り当ての列は数えた回があるときだけ表に出す
+        REQUIRE(samples[0].alloc_counted && format_bench_table(sum).find("allocs")!=std::string::npos);
+        for (auto& s : samples) s.alloc_counted = false;
+        auto uncounted = summarize_bench(samples);
+        REQUIRE_EQ(uncounted[0].allocs, -1.0);
+        REQUIRE(format_bench_table(uncounted).find("allocs")==std::string::npos);
+        REQUIRE(bench_to_json("ollama", "m", "x", sum, samples).find("\"decode_tps\":100.00")!=std::string::npos);
+        // アンロード非対応ならコールド計測を省略
+        auto warm_only = run_bench(bo, base, [](const std::vector<ChatMsg>&, const InferenceTuning&)->std::optional<ChatResult>{ return std::nullopt; },
+                                   [](){ return false; });
+        REQUIRE_EQ(warm_only.size(), 4u);
+        REQUIRE(!warm_only[0].ok);
+    }
+
+    // レイテンシヒストグラム: バケットの往復と 1% 以内の分位点
+    {
+        for (uint64_t us : {0ull, 1ull, 127ull, 128ull, 255ull, 256ull, 1000ull, 123456789ull}) {
+            uint64_t lo, w; LatencyHistogram::bucket_range(LatencyHistogram::bucket_index(us), lo, w);
+            REQUIRE(lo <= us && us < lo + w);
+        }
+        LatencyHistogram h;
+        for (int i=1;i<=1000;++i) h.record_ms(i);
+        REQUIRE_EQ(h.count(), 1000u);
+        REQUIRE(std::abs(h.percentile_ms(50) - 500) < 5);
+        REQUIRE(std::abs(h.percentile_ms(99) - 990) < 10);
+        REQUIRE_EQ(h.max_ms(), 1000.0);
+        LatencyHistogram h2; h2.record_ms(5000); h.merge(h2);
+        REQUIRE_EQ(h.count(), 1001u);
+        REQUIRE_EQ(h.max_ms(), 5000.0);
+
+        SessionStats ss;
+        ss.record("chat_total", "ollama", "m", 1200);
+        ss.record("chat_total", "ollama", "m", 800);
+        ss.record("shell", "local", "", 3);
+        ss.record_tokens("ollama", "m", 100, 2000);
+        REQUIRE_EQ(ss.entries().size(), 2u);
+        auto tbl = ss.format_table();
+        REQUIRE(tbl.find("chat_total")!=std::string::npos);
+        REQUIRE(tbl.find("50.0")!=std::string::npos); // decode 50 tok/s
+        REQUIRE(ss.to_json().find("\"decode_tps\":50.000")!=std::string::npos);
+    }
+
     // utils helpers (trim, escapes)
     {
         REQUIRE_EQ(utils::trim("  a b  "), "a b");
@@ -370,6 +635,1246 @@ int main() {
         REQUIRE(models.has_value() && !models->empty());
     }
 
+    // keep_alive とウォームアップ
+    {
+        REQUIRE_EQ(keep_alive_json("-1"), std::string("-1"));
+        REQUIRE_EQ(keep_alive_json("30m"), std::string("\"30m\""));
+        REQUIRE(is_valid_keep_alive("0") && is_valid_keep_alive("1h30m") && is_valid_keep_alive("-1"));
+        REQUIRE(!is_valid_keep_alive("forever") && !is_valid_keep_alive("") && !is_valid_keep_alive("-"));
+        InferenceTuning t; std::vector<ChatMsg> msgs = {{"user","x"}};
+        REQUIRE(build_ollama_chat_body("m", msgs, t).find("keep_alive")==std::string::npos);
+        t.keep_alive = "-1";
+        REQUIRE(build_ollama_chat_body("m", msgs, t).find("\"keep_alive\":-1,")!=std::string::npos);
+
+        struct CaptureHttp : MockHttp {
+            std::string last_body;
+            std::optional<std::string> post_json(const std::string& url, const std::string& json, const std::vector<std::string>& headers = {}) override {
+                last_body = json;
+                return MockHttp::post_json(url, json, headers);
+            }
+        };
+        CaptureHttp http; http.on_post("http://localhost:11434/api/chat", "{\"model\":\"m\",\"done\":true,\"done_reason\":\"load\"}");
+        REQUIRE(backend::warmup("ollama", http, "m", "30m"));
+        REQUIRE(http.last_body.find("\"messages\":[]")!=std::string::npos);
+        REQUIRE(http.last_body.find("\"keep_alive\":\"30m\"")!=std::string::npos);
+        REQUIRE(!backend::warmup("lmstudio", http, "m", ""));
+
+        std::atomic<int> calls{0};
+        std::atomic<bool> release{false};
+        {
+            BackgroundWarmer w;
+            auto job = [&]{ ++calls; while (!release) std::this_thread::sleep_for(std::chrono::milliseconds(1)); return true; };
+            REQUIRE(w.start("a", job));
+            REQUIRE(!w.start("a", job)); // 実行中は重複起動しない
+            REQUIRE(w.pending("a"));
+            release = true;
+            REQUIRE(w.wait("a"));
+            REQUIRE(w.warm("a"));
+            REQUIRE(!w.start("a", job)); // 成功済み
+            REQUIRE(w.start("b", []{ return false; }));
+            REQUIRE(!w.wait("b"));
+            REQUIRE(w.start("b", job)); // 失敗したものは再試行できる
+            w.forget("a");
+            REQUIRE(!w.warm("a"));
+        }
+        REQUIRE_EQ(calls.load(), 2);
+
+        auto c = pick_preload_candidates({"a","b","c"}, {"cur","x","c","b"}, "cur");
+        REQUIRE(c.size()==1 && c[0]=="c");
+    }
+
+    // 常駐モデル（/api/ps）と一部オフロード検出
+    {
+        const std::string ps = "{\"models\":[{\"name\":\"llama3:latest\",\"model\":\"llama3:latest\",\"size\":8589934592,"
+            "\"details\":{\"parameter_size\":\"8.0B\",\"families\":[\"llama\"]},\"expires_at\":\"2026-01-01T00:00:00Z\","
+            "\"size_vram\":4294967296,\"context_length\":8192},"
+            "{\"name\":\"qwen2:0.5b\",\"size\":1000,\"size_vram\":1000}]}";
+        MockHttp http; http.on_get("http://localhost:11434/api/ps", ps);
+        auto rs = backend::list_running("ollama", http);
+        REQUIRE(rs.has_value() && rs->size()==2);
+        const ResidentModel* r = find_resident(*rs, "llama3");
+        REQUIRE(r != nullptr);
+        REQUIRE_EQ(r->context_length, 8192);
+        REQUIRE(std::fabs(r->gpu_fraction() - 0.5) < 1e-9);
+        REQUIRE(r->partially_offloaded());
+        REQUIRE(!format_offload_warning(*r).empty());
+        REQUIRE(format_offload_warning((*rs)[1]).empty());
+        auto idle = idle_residents(*rs, "llama3:latest");
+        REQUIRE(idle.size()==1 && idle[0]=="qwen2:0.5b");
+        REQUIRE(format_residency_table(*rs, "llama3").find("*llama3:latest")!=std::string::npos);
+        MockHttp down;
+        REQUIRE(!backend::list_running("ollama", down).has_value());
+
+        auto lm = parse_lmstudio_loaded("{\"data\":[{\"id\":\"a\",\"state\":\"loaded\",\"loaded_context_length\":4096},{\"id\":\"b\",\"state\":\"not-loaded\"}]}");
+        REQUIRE(lm.size()==1 && lm[0].name=="a" && lm[0].context_length==4096);
+        REQUIRE(!lm[0].partially_offloaded());
+    }
+
+    // インストール済みモデルの推奨順位（8GB VRAM + 16GB RAM）
+    {
+        const std::string tags = "{\"models\":["
+            "{\"name\":\"llama3:70b\",\"size\":39969745349,\"details\":{\"family\":\"llama\",\"parameter_size\":\"70.6B\",\"quantization_level\":\"Q4_0\"}},"
+            "{\"name\":\"nomic-embed-text:latest\",\"size\":274302450,\"details\":{\"parameter_size\":\"137M\",\"quantization_level\":\"F16\"}},"
+            "{\"name\":\"qwen2:0.5b\",\"size\":352164041,\"details\":{\"parameter_size\":\"494.03M\",\"quantization_level\":\"Q4_0\"}},"
+            "{\"name\":\"phi3:14b\",\"size\":7897126241,\"details\":{\"parameter_size\":\"14.0B\",\"quantization_level\":\"Q4_0\"}},"
+            "{\"name\":\"llama3:8b\",\"size\":4661224676,\"details\":{\"parameter_size\":\"8.0B\",\"quantization_level\":\"Q4_0\"}}]}";
+        MockHttp http; http.on_get("http://localhost:11434/api/tags", tags);
+        auto infos = backend::list_model_infos("ollama", http);
+        REQUIRE_EQ(infos.size(), static_cast<size_t>(5));
+        REQUIRE_EQ(infos[0].size_bytes, static_cast<uint64_t>(39969745349ull));
+        REQUIRE_EQ(infos[0].quantization, std::string("Q4_0"));
+
+        SystemInfo si; si.is_linux = true; si.has_nvidia = true; si.vram_mb = 8192; si.ram_bytes = 16ull<<30;
+        auto ranks = rank_models(si, infos);
+        REQUIRE_EQ(ranks.size(), static_cast<size_t>(4)); // 埋め込みモデルは除外
+        REQUIRE_EQ(ranks[0].info.name, std::string("llama3:8b"));
+        REQUIRE(ranks[0].cls == FitClass::Full);
+        REQUIRE_EQ(ranks[1].info.name, std::string("qwen2:0.5b"));
+        REQUIRE(ranks[2].cls == FitClass::Partial);
+        REQUIRE(ranks[3].cls == FitClass::TooLarge);
+        REQUIRE(ranks[1].est_decode_tps > ranks[0].est_decode_tps);
+        REQUIRE(ranks[0].est_decode_tps > ranks[2].est_decode_tps);
+
+        AutoModelFloor fl;
+        auto best = pick_auto_model(ranks, fl);
+        REQUIRE(best && best->info.name=="llama3:8b");
+        fl.min_params = 10e9; // 14B 以上は一部CPUしか無い: 速度下限を満たさなくてもそれを選ぶ
+        best = pick_auto_model(ranks, fl);
+        REQUIRE(best && best->info.name=="phi3:14b");
+        fl.min_params = 100e9;
+        REQUIRE(!pick_auto_model(ranks, fl).has_value());
+
+        // 実測値があれば推定より優先
+        auto ranks2 = rank_models(si, infos, 0.5, [](const std::string& m){ return m=="llama3:8b" ? 42.0 : 0.0; });
+        REQUIRE(ranks2[0].measured && ranks2[0].est_decode_tps == 42.0);
+        REQUIRE(format_model_ranking(ranks2, "llama3:8b").find("*llama3:8b  全層GPU")!=std::string::npos);
+        // 一覧に埋め込みモデルがあっても推奨順で並べ、順位の無いものは後ろへ
+        std::vector<ModelRank> ranked;
+        auto ordered = order_models_by_rank(ranks, {"nomic-embed-text:latest", "phi3:14b", "llama3:8b"}, &ranked);
+        REQUIRE(ordered == (std::vector<std::string>{"llama3:8b", "phi3:14b", "nomic-embed-text:latest"}));
+        REQUIRE_EQ(ranked.size(), (size_t)2);
+
+        // GPU なしの 16GB ノート: 8B は CPU のみ
+        SystemInfo laptop; laptop.is_linux = true; laptop.ram_bytes = 16ull<<30;
+        auto r3 = rank_models(laptop, infos);
+        REQUIRE(r3[0].cls == FitClass::CpuOnly);
+        REQUIRE(r3.back().info.name == "llama3:70b" && r3.back().cls == FitClass::TooLarge);
+    }
+
+    // カスケードルーティング
+    {
+        REQUIRE_EQ(estimate_tokens("abcdefgh"), 2L);
+        REQUIRE_EQ(estimate_tokens("日本語"), 3L);
+        RouteConfig rc; rc.small_model = "small"; rc.large_model = "";
+        auto d = route_prompt(rc, "こんにちは", false, "big");
+        REQUIRE(d.model=="big" && d.reason=="off"); // 無効時は現在のモデル
+        rc.enabled = true;
+        d = route_prompt(rc, "東京の天気は？", false, "big");
+        REQUIRE(d.small && d.model=="small" && d.reason=="short");
+        REQUIRE_EQ(route_prompt(rc, "東京の天気は？", true, "big").reason, std::string("agent"));
+        REQUIRE_EQ(route_prompt(rc, "この関数を直して", false, "big").reason, std::string("code"));
+        REQUIRE_EQ(route_prompt(rc, "```cpp\nint x;\n```", false, "big").model, std::string("big"));
+        REQUIRE_EQ(route_prompt(rc, std::string(2000, 'a'), false, "big").reason, std::string("long"));
+        REQUIRE_EQ(route_prompt(rc, "a\nb\nc\nd\ne\nf", false, "big").reason, std::string("multiline"));
+        rc.large_model = "huge";
+        REQUIRE_EQ(route_prompt(rc, std::string(2000, 'a'), false, "big").model, std::string("huge"));
+
+        PerfProfile prof; prof.add(PerfSample{4096, 100, 500.0, 20.0, 0});
+        REQUIRE(std::fabs(estimate_chat_ms(&prof, 4096, 100, 40) - 2200.0) < 1e-6);
+        REQUIRE(estimate_chat_ms(nullptr, 4096, 100, 40) < 0);
+
+        RouteTally tally;
+        RouteDecision small; small.small = true;
+        RouteDecision large;
+        tally.add(small, 1500.0); tally.add(small, std::nullopt); tally.add(large, 99.0);
+        REQUIRE(tally.small_turns==2 && tally.large_turns==1 && tally.estimated_turns==1);
+        REQUIRE(tally.saved_ms == 1500.0);
+
+        std::vector<ModelRank> ranks(3);
+        ranks[0].info.name = "big"; ranks[0].cls = FitClass::Full; ranks[0].info.parameter_count = 8e9; ranks[0].est_decode_tps = 60;
+        ranks[1].info.name = "tiny"; ranks[1].cls = FitClass::Full; ranks[1].info.parameter_count = 0.5e9; ranks[1].est_decode_tps = 400;
+        ranks[2].info.name = "mid"; ranks[2].cls = FitClass::Full; ranks[2].info.parameter_count = 3e9; ranks[2].est_decode_tps = 150;
+        auto sm = pick_small_model(ranks, "big");
+        REQUIRE(sm && *sm=="mid"); // 1B 未満は他に無いときだけ
+        ranks[2].cls = FitClass::Partial;
+        sm = pick_small_model(ranks, "big");
+        REQUIRE(sm && *sm=="tiny");
+    }
+
+    // llama.cpp server バックエンド
+    {
+        MockHttp http;
+        http.on_get("http://localhost:8080/health", "{\"status\":\"ok\"}");
+        http.on_get("http://localhost:8080/v1/models", "{\"object\":\"list\",\"data\":[{\"id\":\"Qwen2.5-7B-Instruct-Q4_K_M.gguf\",\"object\":\"model\","
+                    "\"meta\":{\"n_ctx_train\":32768,\"n_embd\":3584,\"n_params\":7615616512,\"size\":4677120000}}]}");
+        http.on_get("http://localhost:8080/props", "{\"default_generation_settings\":{\"n_ctx\":8192},\"total_slots\":4,\"model_path\":\"/m/q.gguf\"}");
+        http.on_get("http://localhost:8080/slots", "[{\"id\":0,\"n_ctx\":8192,\"is_processing\":true},{\"id\":1,\"n_ctx\":8192,\"is_processing\":false},{\"id\":2,\"n_ctx\":8192,\"is_processing\":false}]");
+        http.on_post("http://localhost:8080/v1/chat/completions", "{\"choices\":[{\"message\":{\"role\":\"assistant\",\"content\":\"はい\"}}],"
+                     "\"timings\":{\"prompt_n\":12,\"prompt_ms\":30.0,\"predicted_n\":40,\"predicted_ms\":800.0}}");
+        http.on_post("http://localhost:8080/slots/1?action=save", "{\"id_slot\":1,\"filename\":\"s.bin\",\"n_saved\":52}");
+        http.on_post("http://localhost:8080/slots/1?action=restore", "{\"error\":{\"message\":\"file not found\"}}");
+        REQUIRE(backend::llamacpp::probe(http));
+        auto models = backend::list_models("llamacpp", http);
+        REQUIRE(models.size()==1 && models[0]=="Qwen2.5-7B-Instruct-Q4_K_M.gguf");
+        auto mi = backend::show_model("llamacpp", http, models[0]);
+        REQUIRE(mi.has_value());
+        REQUIRE_EQ(mi->context_length, 8192); // サーバの n_ctx で頭打ち
+        REQUIRE_EQ(mi->embedding_length, 3584);
+        REQUIRE_EQ(mi->size_bytes, static_cast<uint64_t>(4677120000ull));
+        auto pr = backend::llamacpp::props(http);
+        REQUIRE(pr && pr->total_slots==4);
+        auto slots = backend::llamacpp::list_slots(http);
+        REQUIRE(slots && slots->size()==3);
+        REQUIRE((*slots)[0].is_processing && !(*slots)[1].is_processing);
+        auto idle = backend::llamacpp::pick_idle_slot(*slots);
+        REQUIRE(idle && *idle==1);
+
+        InferenceTuning t; t.slot_id = 1;
+        std::vector<ChatMsg> msgs = {{"user","やあ"}};
+        auto body = build_llamacpp_chat_body("m", msgs, t);
+        REQUIRE(body.find("\"cache_prompt\":true")!=std::string::npos);
+        REQUIRE(body.find("\"id_slot\":1")!=std::string::npos);
+        t.slot_id = -1;
+        REQUIRE(build_llamacpp_chat_body("m", msgs, t).find("id_slot")==std::string::npos);
+        auto out = backend::chat("llamacpp", http, "m", msgs, t);
+        REQUIRE(out && out->content=="はい");
+        REQUIRE(std::fabs(out->stats.decode_tps() - 50.0) < 1e-6);
+        REQUIRE(backend::llamacpp::slot_save(http, 1, "s.bin"));
+        REQUIRE(!backend::llamacpp::slot_restore(http, 1, "s.bin"));
+        REQUIRE(!backend::llamacpp::slot_erase(http, 1));
+
+        // 常駐一覧は /v1/models を1回だけ取得する
+        http.gets.clear();
+        auto running = backend::list_running("llamacpp", http);
+        REQUIRE(running && running->size()==1 && (*running)[0].context_length==8192);
+        REQUIRE_EQ(http.gets["http://localhost:8080/v1/models"], 1);
+        MockHttp loading; loading.on_get("http://localhost:8080/health", "{\"error\":{\"code\":503,\"message\":\"Loading model\"}}");
+        REQUIRE(!backend::llamacpp::probe(loading));
+    }
+
+    // 投機的デコード（ドラフトモデルの選択・送信・採択率）
+    {
+        REQUIRE_EQ(model_series("Qwen2.5-7B-Instruct-GGUF"), std::string("qwen2.5"));
+        REQUIRE_EQ(model_series("lmstudio-community/qwen2.5-0.5b-instruct"), std::string("qwen2.5"));
+        REQUIRE_EQ(model_series("llama3.1:8b"), std::string("llama3.1"));
+        ModelInfo target; target.name = "qwen2.5-14b-instruct";
+        std::vector<ModelInfo> cands(5);
+        cands[0].name = "qwen2.5-14b-instruct";
+        cands[1].name = "qwen2.5-0.5b-instruct";
+        cands[2].name = "qwen2.5-1.5b-instruct";
+        cands[3].name = "qwen2.5-7b-instruct";   // 1/8 より大きい
+        cands[4].name = "llama-3.2-1b-instruct"; // 別系列
+        auto d = pick_draft_model(target, cands);
+        REQUIRE(d && *d=="qwen2.5-1.5b-instruct");
+        target.name = "mystery-model";
+        REQUIRE(!pick_draft_model(target, cands).has_value());
+        // ファミリーだけが一致する別系列（語彙の違う TinyLlama）は大きくても選ばない
+        target.name = "llama-3-70b-instruct"; target.family = "llama"; target.parameter_count = 70e9;
+        cands[4].family = "llama"; cands[4].parameter_count = 1.2e9;
+        ModelInfo impostor; impostor.name = "tinyllama-1.1b-chat"; impostor.family = "llama"; impostor.parameter_count = 2e9;
+        cands.push_back(impostor);
+        d = pick_draft_model(target, cands);
+        REQUIRE(d && *d=="llama-3.2-1b-instruct");
+        // 系列名が同じでも、両方が報告するファミリーが食い違えば除く。同じ大きさならファミリーの一致を優先
+        cands[4].family = "mllama";
+        REQUIRE(!pick_draft_model(target, cands).has_value());
+        ModelInfo untagged; untagged.name = "llama-3.2-1b-a"; untagged.parameter_count = 1.2e9;
+        ModelInfo tagged = untagged; tagged.name = "llama-3.2-1b-b"; tagged.family = "llama";
+        d = pick_draft_model(target, {untagged, tagged});
+        REQUIRE(d && *d=="llama-3.2-1b-b");
+
+        InferenceTuning t; t.draft_model = "qwen2.5-0.5b-instruct"; t.draft_max = 16; t.draft_p_min = 0.75;
+        std::vector<ChatMsg> msgs = {{"user","x"}};
+        REQUIRE(build_lmstudio_chat_body("m", msgs, t).find("\"draft_model\":\"qwen2.5-0.5b-instruct\"")!=std::string::npos);
+        auto lb = build_llamacpp_chat_body("m", msgs, t);
+        REQUIRE(lb.find("\"speculative.n_max\":16")!=std::string::npos);
+        REQUIRE(lb.find("\"speculative.p_min\":0.75")!=std::string::npos);
+        REQUIRE(lb.find("speculative.n_min")==std::string::npos);
+        REQUIRE(build_ollama_chat_body("m", msgs, t).find("draft")==std::string::npos);
+
+        auto st = parse_openai_stats("{\"timings\":{\"predicted_n\":100,\"predicted_ms\":1000,\"draft_n\":80,\"draft_n_accepted\":60}}");
+        REQUIRE(std::fabs(st.draft_acceptance() - 0.75) < 1e-9);
+        REQUIRE(format_stats_line(st).find("draft accept 75% (60/80)")!=std::string::npos);
+        auto st2 = parse_openai_stats("{\"stats\":{\"total_draft_tokens_count\":50,\"accepted_draft_tokens_count\":10}}");
+        REQUIRE(std::fabs(st2.draft_acceptance() - 0.2) < 1e-9);
+        REQUIRE(parse_openai_stats("{}").draft_acceptance() < 0);
+    }
+
+    // MappedFile / map-reduce 要約
+    {
+        namespace fs = std::filesystem;
+        auto path = fs::temp_directory_path() / "agens_test_mapped.txt";
+        { std::ofstream(path, std::ios::binary) << "hello\nworld\n"; }
+        MappedFile mf;
+        REQUIRE(mf.open(path.string()));
+        REQUIRE_EQ(mf.view(), std::string_view("hello\nworld\n"));
+        MappedFile moved = std::move(mf);
+        REQUIRE(!mf.is_open() && moved.size()==12);
+        { std::ofstream(path, std::ios::binary | std::ios::trunc); }
+        MappedFile empty;
+        REQUIRE(empty.open(path.string()) && empty.size()==0 && empty.view().empty());
+        std::string err;
+        REQUIRE(!MappedFile().open((fs::temp_directory_path() / "agens_no_such_file").string(), &err) && !err.empty());
+        // read_whole_file: 空・1MB の塊をまたぐファイル・無いファイル
+        std::string content = "stale";
+        REQUIRE(read_whole_file(path.string(), content) && content.empty());
+        std::string lines;
+        for (int i = 0; lines.size() < (3u << 20) / 2; ++i) lines += "line " + std::to_string(i) + "\n";
+        { std::ofstream(path, std::ios::binary | std::ios::trunc) << lines; }
+        REQUIRE(read_whole_file(path.string(), content) && content==lines);
+        err.clear();
+        REQUIRE(!read_whole_file((fs::temp_directory_path() / "agens_no_such_file").string(), content, &err) && !err.empty());
+        fs::remove(path);
+
+        // 関数の区切り（トップレベルの '}'）を優先して切る
+        std::string src;
+        for (int f = 0; f < 6; ++f) {
+            src += "int f" + std::to_string(f) + "() {\n";
+            for (int k = 0; k < 8; ++k) src += "    call_something_long(" + std::to_string(k) + ");\n";
+            src += "}\n";
+        }
+        auto chunks = split_chunks(src, 200);
+        REQUIRE(chunks.size() > 1);
+        size_t covered = 0, next_line = 1;
+        for (auto& c : chunks) {
+            REQUIRE_EQ(c.first_line, next_line);
+            next_line = c.last_line + 1;
+            covered += c.text.size();
+            REQUIRE(estimate_tokens(std::string(c.text)) <= 200);
+            if (&c != &chunks.back()) REQUIRE(c.text.substr(c.text.size()-2)=="}\n");
+        }
+        REQUIRE_EQ(covered, src.size());
+        // 改行の無い巨大な1行は UTF-8 の境界で分割
+        std::string longline;
+        for (int k = 0; k < 300; ++k) longline += "あ";
+        auto lc = split_chunks(longline, 64);
+        REQUIRE(lc.size() > 1);
+        std::string joined;
+        for (auto& c : lc) { joined += c.text; REQUIRE((static_cast<unsigned char>(c.text[0]) & 0xC0) != 0x80); }
+        REQUIRE_EQ(joined, longline);
+        REQUIRE(split_chunks("", 100).empty());
+
+        // 統合のグループは予算を超えない（余った1つは次の段へ持ち越す）
+        REQUIRE(group_for_reduce({"a","b","c"}, 3) == (std::vector<std::vector<size_t>>{{0, 1, 2}}));
+        REQUIRE(group_for_reduce({"a","b","c"}, 2) == (std::vector<std::vector<size_t>>{{0, 1}, {2}}));
+        REQUIRE(group_for_reduce({std::string(40, 'x'), "a", "b"}, 4) == (std::vector<std::vector<size_t>>{{0}, {1, 2}}));
+
+        // 並列に map し、1つになるまで統合する
+        std::string big;
+        for (int k = 0; k < 40; ++k) big += "line " + std::to_string(k) + " " + std::string(60, 'x') + "\n";
+        SummarizeOptions so; so.name = "big.txt"; so.chunk_tokens = 40; so.reduce_tokens = 12; so.parallel = 4;
+        std::atomic<int> inflight{0}, peak{0}, calls{0};
+        auto ask = [&](const std::string& prompt)->std::optional<std::string>{
+            int now = ++inflight;
+            for (int p = peak.load(); now > p && !peak.compare_exchange_weak(p, now);) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            --inflight;
+            ++calls;
+            return prompt.find("部分要約")!=std::string::npos ? std::string("merged summary") : std::string("chunk summary");
+        };
+        int progress_calls = 0;
+        auto res = summarize_text(big, so, ask, [&](const SummarizeProgress&){ ++progress_calls; });
+        REQUIRE_EQ(res.summary, std::string("merged summary"));
+        REQUIRE(res.chunks > 4 && res.levels >= 2 && res.failed == 0);
+        REQUIRE(peak.load() > 1 && peak.load() <= 4);
+        REQUIRE_EQ(progress_calls, calls.load());
+        // 一部のチャンクが失敗しても残りで要約する
+        std::atomic<int> n{0};
+        auto flaky = [&](const std::string&)->std::optional<std::string>{
+            if (n++ == 0) return std::nullopt;
+            return std::string("ok");
+        };
+        so.parallel = 1;
+        auto res2 = summarize_text(big, so, flaky);
+        REQUIRE(!res2.summary.empty() && res2.failed == 1);
+        REQUIRE(summarize_text(big, so, [](const std::string&){ return std::optional<std::string>(); }).summary.empty());
+        // 2つを合わせると予算を超えるなら統合要求は送らず連結して返す
+        so.reduce_tokens = 1;
+        calls = 0;
+        auto res3 = summarize_text(big, so, ask);
+        REQUIRE_EQ(static_cast<size_t>(calls.load()), res3.chunks);
+        REQUIRE(res3.summary.find("chunk summary\n\nchunk summary")!=std::string::npos);
+    }
+
+    // 永続セッション: 追記ログの書き込みと再開
+    {
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_sessions";
+        fs::remove_all(dir);
+        {
+            SessionLog log;
+            log.start("20260101-000000", dir);
+            REQUIRE(log.active() && !log.written());
+            log.set_value("backend", "llamacpp");
+            log.set_value("model", "qwen");
+            InferenceTuning t; t.context = 8192; t.max_tokens = 256; t.temperature = 0.2; t.keep_alive = "1h";
+            log.set_tune(t);
+            log.set_tune(t); // 変化なしは書かない
+            log.message({"user", "タブ\tと改行\nと \\ を含む"});
+            log.message({"assistant", "a1"});
+            log.message({"user", "q2"});
+            log.message({"assistant", "a2"});
+            log.pop(2);
+            log.set_value("auto", "1");
+            log.kv("agens-session-x.bin", "qwen");
+            REQUIRE(log.written());
+        }
+        auto path = dir / "20260101-000000.log";
+        SessionState st;
+        REQUIRE(load_session(path, st));
+        REQUIRE_EQ(st.id, std::string("20260101-000000"));
+        REQUIRE_EQ(st.backend, std::string("llamacpp"));
+        REQUIRE_EQ(st.model, std::string("qwen"));
+        REQUIRE(st.tune && st.tune->context==8192 && st.tune->max_tokens==256 && st.tune->keep_alive=="1h");
+        REQUIRE(std::fabs(st.tune->temperature - 0.2) < 1e-9);
+        REQUIRE_EQ(st.history.size(), static_cast<size_t>(2));
+        REQUIRE_EQ(st.history[0].content(), std::string_view("タブ\tと改行\nと \\ を含む"));
+        REQUIRE(st.auto_mode && st.kv_file=="agens-session-x.bin" && st.kv_model=="qwen");
+        REQUIRE_EQ(st.records, static_cast<size_t>(10));
+        // 書き込み途中の末尾行・未知のレコードは無視し、clear で履歴を空にする
+        { std::ofstream(path, std::ios::binary | std::ios::app) << "future\tx\nclear\nmsg\tuser\tq3\nmsg\tassis"; }
+        REQUIRE(load_session(path, st));
+        REQUIRE(st.history.size()==1 && st.history[0].content()=="q3");
+        auto ids = list_sessions(dir);
+        REQUIRE(ids.size()==1 && ids[0]=="20260101-000000");
+        { std::ofstream(dir / "bogus.log", std::ios::binary) << "not a session\n"; }
+        std::string err;
+        REQUIRE(!load_session(dir / "bogus.log", st, &err) && !err.empty());
+        // 再開したログにも追記する（書き込み途中の末尾行は切り捨てる）。clear・detach は次の再開で戻らない
+        {
+            SessionLog log;
+            log.start("20260101-000000", dir);
+            REQUIRE(log.written());
+            log.attach("/a.cpp");
+            log.message({"user", "q4"});
+        }
+        REQUIRE(load_session(path, st));
+        REQUIRE(st.history.size()==2 && st.history[1].content()=="q4" && st.attachments.size()==1);
+        {
+            SessionLog log;
+            log.start("20260101-000000", dir);
+            log.clear();
+            log.detach("/a.cpp");
+        }
+        REQUIRE(load_session(path, st));
+        REQUIRE(st.history.empty() && st.attachments.empty());
+        fs::remove_all(dir);
+
+        // 履歴は予算内の直近のみ、user から始まるよう揃える
+        std::vector<ChatMsg> h = {{"user", std::string(400, 'a')}, {"assistant", std::string(400, 'b')}, {"user", "short"}, {"assistant", "ok"}};
+        auto fit = fit_history(h, 120);
+        REQUIRE(fit.size()==2 && fit[0].content()=="short");
+        REQUIRE_EQ(fit_history(h, 100000).size(), h.size());
+        REQUIRE(fit_history(h, 0).empty());
+
+        // /escalate: 履歴に残した質問で直前の組を外す（/ask --ctx で送った参照コード付きの本文とは一致しない）
+        std::string question = "render_frame はどこ？";
+        ContextPack one;
+        ContextRegion region;
+        region.path = "./a.cpp"; region.first_line = region.last_line = 1; region.text = "int render_frame();";
+        one.regions.push_back(region);
+        std::string sent = format_context_prompt(one, question);
+        REQUIRE(sent != question);
+        std::vector<ChatMsg> eh = {{"user", "前の質問"}, {"assistant", "前の答え"}, {"user", question}, {"assistant", "a.cpp です"}};
+        REQUIRE(!pop_last_turn(eh, sent) && eh.size()==4);
+        REQUIRE(pop_last_turn(eh, question));
+        REQUIRE(eh.size()==2 && eh.back().content()=="前の答え");
+        REQUIRE(!pop_last_turn(eh, question)); // 末尾が別の質問なら外さない
+        std::vector<ChatMsg> dangling = {{"assistant", "x"}, {"user", question}};
+        REQUIRE(!pop_last_turn(dangling, question));
+    }
+
+    // 共有メッセージ: ターンごとの組み立てで本文を複製しない（割り当てが履歴・システムプロンプトの大きさに比例しない）
+    {
+        std::vector<ChatMsg> msgs = {{"system","s"}, {"user","u"}, {"assistant","a"}, {"tool","x"}};
+        REQUIRE(msgs[0].role==Role::System && msgs[2].role==Role::Assistant && msgs[3].role==Role::User);
+        ChatMsg copy = msgs[1];
+        REQUIRE(copy.body.get()==msgs[1].body.get());
+        REQUIRE(!parse_role("bogus") && std::string(role_name(Role::Assistant))=="assistant");
+        std::string esc;
+        append_json_escaped(esc, "a\"b\\c\nd");
+        REQUIRE_EQ(esc, std::string("a\\\"b\\\\c\\nd"));
+
+        auto turn_allocs = [](size_t system_bytes, size_t turns){
+            ChatMsg system_msg(Role::System, std::string(system_bytes, 's'));
+            std::vector<ChatMsg> history;
+            for (size_t i = 0; i < turns; ++i) {
+                history.emplace_back(Role::User, std::string(2000, 'q'));
+                history.emplace_back(Role::Assistant, std::string(2000, 'a'));
+            }
+            std::string user = "次の質問";
+            AllocCounter counter;
+            auto msgs = fit_history(history, 1L << 30);
+            msgs.insert(msgs.begin(), system_msg);
+            msgs.emplace_back(Role::User, user);
+            auto c = counter.get();
+            return std::make_pair(c.count, c.bytes);
+        };
+        auto small = turn_allocs(1000, 10);
+        auto big = turn_allocs(4 << 20, 10);
+        REQUIRE(small.first > 0);
+        REQUIRE_EQ(small.first, big.first);
+        REQUIRE_EQ(small.second, big.second);
+        REQUIRE(big.second < 8192); // 本文（4MB + 40KB）は複製されない
+
+        // 本文組み立ては出力バッファへ直接エスケープする（メッセージ数に比例した一時文字列を作らない）
+        std::vector<ChatMsg> many;
+        for (int i = 0; i < 200; ++i) many.emplace_back(i % 2 ? Role::Assistant : Role::User, "line \"" + std::to_string(i) + "\"\n");
+        InferenceTuning t;
+        AllocCount body_allocs;
+        std::string body;
+        {
+            AllocCounter counter;
+            body = build_llamacpp_chat_body("m", many, t);
+            body_allocs = counter.get();
+        }
+        REQUIRE(body_allocs.count < 32);
+        REQUIRE(body.find("{\"role\":\"assistant\",\"content\":\"line \\\"199\\\"\\n\"}]}")!=std::string::npos);
+
+        // 置き換えた operator new も確保できなければ new_handler を呼んでから bad_alloc を投げる
+        REQUIRE(alloc_counting_enabled());
+#if !defined(__SANITIZE_ADDRESS__)
+        static int handler_calls = 0;
+        std::set_new_handler([]{ ++handler_calls; std::set_new_handler(nullptr); });
+        bool threw = false;
+        try {
+            void* p = ::operator new(SIZE_MAX / 2);
+            ::operator delete(p);
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        REQUIRE(threw && handler_calls == 1);
+        REQUIRE(::operator new(SIZE_MAX / 2, std::nothrow) == nullptr);
+#endif
+    }
+
+    // /attach: mmap した添付を本文へ直接エスケープし、変更時だけ読み直す
+    {
+        namespace fs = std::filesystem;
+        auto path = fs::temp_directory_path() / "agens_test_attach.cpp";
+        { std::ofstream(path, std::ios::binary) << "int main() {\n\treturn \"x\";\n}\n"; }
+        std::string err;
+        auto a = load_attachment(path.string(), &err);
+        REQUIRE(a && a->size()==28 && a->tokens() > 0);
+        REQUIRE(a->text().find("return")!=std::string_view::npos);
+
+        ChatMsg sys(Role::System, "sys");
+        sys.attachments = {a};
+        InferenceTuning t;
+        std::vector<ChatMsg> msgs = {sys, {"user","q"}};
+        auto body = build_llamacpp_chat_body("m", msgs, t);
+        REQUIRE(body.find("\"content\":\"sys\\n\\n[添付ファイル: " + path.string() + "]\\n```\\nint main() {\\n\\treturn \\\"x\\\";\\n}\\n\\n```\\n\"}")!=std::string::npos);
+        std::ostringstream streamed;
+        write_llamacpp_chat_body(streamed, "m", msgs, t);
+        REQUIRE_EQ(streamed.str(), body);
+
+        bool changed = true;
+        REQUIRE(refresh_attachment(a, &changed)==a && !changed);
+        { std::ofstream(path, std::ios::binary | std::ios::trunc) << "int main() { return 0; }\n// edited\n"; }
+        auto b = refresh_attachment(a, &changed);
+        REQUIRE(changed && b!=a && b->text().find("edited")!=std::string_view::npos);
+        REQUIRE_EQ(attachment_tokens({a, b}), a->tokens() + b->tokens());
+
+        { std::ofstream(path, std::ios::binary | std::ios::trunc) << std::string("ab\0cd", 5); }
+        REQUIRE(!load_attachment(path.string(), &err) && err.find("バイナリ")!=std::string::npos);
+        REQUIRE(!load_attachment((fs::temp_directory_path() / "agens_no_such_attach").string()));
+        // 変わったのに読み直せない・消えた添付は古いマップのまま使わない
+        err.clear(); changed = false;
+        REQUIRE(!refresh_attachment(b, &changed, &err) && changed && err.find("バイナリ")!=std::string::npos);
+        fs::remove(path);
+        changed = false;
+        REQUIRE(!refresh_attachment(b, &changed) && changed);
+
+        // ストリーム送信できない IHttp は文字列に書き出して post_json へ委譲する
+        MockHttp mh;
+        mh.on_post("http://x/", "ok");
+        HttpTiming tm;
+        auto r = mh.post_json_stream("http://x/", [](std::ostream& os){ os << "{}"; }, {}, tm);
+        REQUIRE(r && *r=="ok");
+
+        auto st = parse_session_log("agens-session 1\nattach\t/a.cpp\nattach\t/b.cpp\nattach\t/a.cpp\ndetach\t/a.cpp\n");
+        REQUIRE(st.attachments.size()==1 && st.attachments[0]=="/b.cpp");
+    }
+
+    // トライグラム索引: 候補の絞り込み・差分更新・保存と読み込み
+    {
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_index";
+        auto cache = fs::temp_directory_path() / "agens_test_index_cache";
+        std::error_code ec; fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+        fs::create_directories(dir / "src");
+        fs::create_directories(dir / "node_modules");
+        std::ofstream(dir / "src" / "alpha.cpp") << "int alpha_render(){ return 1; }\n";
+        std::ofstream(dir / "src" / "beta.cpp") << "// Render the Frame\nvoid beta(){}\n";
+        std::ofstream(dir / "notes.md") << "メモ: ターゲット\n";
+        std::ofstream(dir / "node_modules" / "x.js") << "render();\n";
+        { std::ofstream(dir / "blob.bin", std::ios::binary) << std::string("render\0\0\0", 9); }
+
+        auto paths = [](std::vector<FileHit> hits) {
+            std::vector<std::string> v;
+            for (auto& h : hits) v.push_back(h.path);
+            std::sort(v.begin(), v.end());
+            return v;
+        };
+        TrigramIndex idx(dir.string(), cache);
+        REQUIRE(!idx.load());
+        // 打ち切った初回の作成は検索に使わない（締め切り切れ・中断）
+        std::atomic<bool> cancel{true};
+        REQUIRE(!idx.update(&cancel) && !idx.ready() && idx.stats().files==0);
+        REQUIRE(!idx.refresh(30, nullptr, std::chrono::steady_clock::now() - std::chrono::seconds(1)) && !idx.ready());
+        REQUIRE(idx.update());
+        REQUIRE(idx.ready());
+        REQUIRE(idx.stats().files==4 && idx.stats().added==4);
+        REQUIRE(idx.save() && fs::exists(idx.path()));
+
+        // 大文字小文字を畳んだトライグラムで候補を絞り、採点結果は全走査と一致する
+        auto cands = idx.candidates({"render"});
+        REQUIRE_EQ(cands.size(), (size_t)2);
+        REQUIRE(paths(find_relevant_files(idx, "render", 10))==paths(find_relevant_files(dir.string(), "render", 10)));
+        REQUIRE_EQ(idx.stats().candidates, (size_t)2);
+        REQUIRE(idx.stats().query_ms >= 0);
+        // パス名だけに一致するファイルも候補、3バイト未満のトークンはバイナリ以外の全件
+        REQUIRE_EQ(idx.candidates({"alpha.cpp"}).size(), (size_t)1);
+        REQUIRE_EQ(idx.candidates({"zzzz"}).size(), (size_t)0);
+        REQUIRE_EQ(idx.candidates({"zz"}).size(), (size_t)3);
+        REQUIRE_EQ(find_relevant_files(idx, "ターゲット", 10).size(), (size_t)1);
+
+        // 変更・追加・削除だけを読み直す
+        REQUIRE(!idx.update());
+        { std::ofstream(dir / "src" / "alpha.cpp", std::ios::trunc) << "int alpha(){ return 0; } // no match here\n"; }
+        std::ofstream(dir / "src" / "gamma.cpp") << "void gamma_render();\n";
+        fs::remove(dir / "notes.md");
+        REQUIRE(idx.update());
+        REQUIRE(idx.stats().added==1 && idx.stats().changed==1 && idx.stats().removed==1 && idx.stats().files==4);
+        REQUIRE(paths(find_relevant_files(idx, "render", 10))==paths(find_relevant_files(dir.string(), "render", 10)));
+        REQUIRE(idx.save());
+
+        // 保存した索引を読み込めば走査なしで同じ候補が出る。壊れた索引は捨てる
+        TrigramIndex again(dir.string(), cache);
+        REQUIRE(again.load());
+        REQUIRE(again.ready());
+        REQUIRE(again.stats().files==4 && again.stats().load_ms >= 0);
+        REQUIRE(again.candidates({"render"})==idx.candidates({"render"}));
+        REQUIRE(!again.update());
+        { std::ofstream(again.path(), std::ios::binary | std::ios::trunc) << "AGTI garbage"; }
+        TrigramIndex broken(dir.string(), cache);
+        REQUIRE(!broken.load() && broken.stats().files==0);
+        broken.clear();
+        REQUIRE(!fs::exists(broken.path()));
+        fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+    }
+
+    // 本文の採点: ファイル全体を行コピーなしで走査し、一致行に行番号を付ける
+    {
+        auto cs = score_content("alpha\r\nnothing\nHTTP Client here\nhttp http\n", {"http", "client"});
+        REQUIRE_EQ(cs.score, 3 * 3); // http は2行、client は1行（同じ行の2回目は数えない）
+        REQUIRE_EQ(cs.snippets.size(), (size_t)2);
+        REQUIRE_EQ(cs.snippets[0].line, 3);
+        REQUIRE_EQ(cs.snippets[0].text, std::string("HTTP Client here"));
+        REQUIRE_EQ(cs.snippets[1].line, 4);
+        REQUIRE_EQ(score_content("x\r\nNeedle\r\n", {"needle"}).snippets[0].text, std::string("Needle"));
+        REQUIRE_EQ(score_content("日本語の検索テスト\n", {"検索"}).score, 3);
+        REQUIRE_EQ(score_content("needl", {"needle"}).score, 0);
+        auto long_line = score_content(std::string(150, 'a') + "ターゲット" + std::string(300, 'b'), {"ターゲット"});
+        REQUIRE(long_line.snippets[0].text.size() <= 200);
+
+        namespace fs = std::filesystem;
+        auto path = fs::temp_directory_path() / "agens_test_scan_large.txt";
+        {
+            std::ofstream os(path, std::ios::binary);
+            for (int i = 1; i <= 5000; ++i) os << "line " << i << " filler filler filler\n";
+            os << "the Late Match is here\n";
+        }
+        REQUIRE(fs::file_size(path) > 64 * 1024);
+        auto hit = score_file(path.string(), {"late", "match"});
+        REQUIRE(hit.has_value());
+        REQUIRE_EQ(hit->score, 6);
+        REQUIRE_EQ(hit->snippets.size(), (size_t)1);
+        REQUIRE_EQ(hit->snippets[0].line, 5001);
+        fs::remove(path);
+    }
+
+    // 複数トークン照合: どの命令セットでも素朴な行ごとの検索と同じ (トークン, 行) を返す
+    {
+        std::string text = "She sells SEA shells\r\nhers\tHERS\n\nusher ushers\nx";
+        for (int i = 0; i < 40; ++i) text += "padding line " + std::to_string(i) + " with Some words\n";
+        text += std::string(1000, 'q') + "SHE" + std::string(40, 'z') + "\n"; // 1025 バイト境界をまたぐ位置にも置く
+        text += "日本語の検索テスト she\nend he";
+        std::vector<std::vector<std::string>> token_sets = {
+            {"he", "she", "hers", "his"},
+            {"she", "she", "s"},                 // 重複と1バイト
+            {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "some"}, // 8 バケットを超える
+            {"検索", "テスト", "words"},
+            {"zzzz"},
+        };
+        for (const auto& toks : token_sets) {
+            std::vector<std::tuple<size_t, int, size_t>> expect;
+            int line = 1; size_t begin = 0;
+            while (begin <= text.size()) {
+                size_t nl = text.find('\n', begin);
+                size_t end = nl == std::string::npos ? text.size() : nl;
+                std::string l = text.substr(begin, end - begin);
+                for (auto& c : l) if (c >= 'A' && c <= 'Z') c += 32;
+                for (size_t k = 0; k < toks.size(); ++k) {
+                    size_t p = l.find(toks[k]);
+                    if (p != std::string::npos) expect.emplace_back(k, line, begin + p);
+                }
+                if (nl == std::string::npos) break;
+                begin = nl + 1; ++line;
+            }
+            std::sort(expect.begin(), expect.end(), [](auto& a, auto& b){ return std::get<1>(a) != std::get<1>(b) ? std::get<1>(a) < std::get<1>(b) : std::get<0>(a) < std::get<0>(b); });
+            for (int lv = 0; lv <= (int)detected_simd_level(); ++lv) {
+                MultiMatcher m(toks);
+                m.set_level((SimdLevel)lv);
+                std::vector<std::tuple<size_t, int, size_t>> got;
+                auto r = m.scan(text, 1, true, [&](size_t k, int ln, size_t pos){ got.emplace_back(k, ln, pos); });
+                std::sort(got.begin(), got.end(), [](auto& a, auto& b){ return std::get<1>(a) != std::get<1>(b) ? std::get<1>(a) < std::get<1>(b) : std::get<0>(a) < std::get<0>(b); });
+                REQUIRE(!r.binary);
+                REQUIRE_EQ(r.end_line, line);
+                REQUIRE_EQ(got.size(), expect.size());
+                bool same = got.size() == expect.size();
+                for (size_t i = 0; same && i < got.size(); ++i) {
+                    // 同じ行に2回出るトークンは最初の位置だけ
+                    same = std::get<0>(got[i]) == std::get<0>(expect[i]) && std::get<1>(got[i]) == std::get<1>(expect[i])
+                        && std::get<2>(got[i]) == std::get<2>(expect[i]);
+                }
+                if (!same) std::cerr << "matcher mismatch at level " << simd_level_name((SimdLevel)lv) << "\n";
+                REQUIRE(same);
+            }
+        }
+        // 制御文字の数とバイナリ判定（先頭 1025 バイトの 1/16 超）
+        std::string bin(2000, 'a');
+        for (int i = 0; i < 70; ++i) bin[i * 7] = (char)(i % 2 ? 0x01 : 0x1B);
+        bin[3] = '\t'; bin[5] = '\r';
+        size_t scalar_ctrl = 0;
+        for (unsigned char c : bin) if (c < 9 || (c > 13 && c < 32)) ++scalar_ctrl;
+        for (int lv = 0; lv <= (int)detected_simd_level(); ++lv) {
+            REQUIRE_EQ(count_control_bytes(bin, (SimdLevel)lv), scalar_ctrl);
+            MultiMatcher m({"aaa"});
+            m.set_level((SimdLevel)lv);
+            REQUIRE(m.scan(bin, 1, true, [](size_t, int, size_t){}).binary);
+            REQUIRE(!m.scan(bin.substr(1100), 1, true, [](size_t, int, size_t){}).binary);
+        }
+        REQUIRE(looks_binary(bin) && !looks_binary("plain text\n") && !looks_binary(""));
+    }
+
+    // 並列走査: ワークスティーリングのプールと、スレッド数によらない順位
+    {
+        TaskPool pool(4);
+        REQUIRE_EQ(pool.threads(), 4);
+        std::vector<long> per_worker(pool.threads(), 0);
+        std::atomic<long> total{0};
+        // 子タスクを入れ子に spawn しても全部終わってから run() が戻る
+        std::function<void(int, int)> tree = [&](int depth, int w) {
+            per_worker[w] += 1; total += 1;
+            if (depth < 6) for (int i = 0; i < 3; ++i) pool.spawn([&, depth](int w2){ tree(depth + 1, w2); });
+        };
+        pool.spawn([&](int w){ tree(0, w); });
+        pool.run();
+        REQUIRE_EQ(total.load(), 1093L); // 3^0 + ... + 3^6
+        long sum = 0; for (long c : per_worker) sum += c;
+        REQUIRE_EQ(sum, 1093L);
+        REQUIRE(default_thread_count() >= 1);
+
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_parallel";
+        std::error_code ec; fs::remove_all(dir, ec);
+        int matching = 0;
+        for (int d = 0; d < 8; ++d) {
+            fs::create_directories(dir / ("d" + std::to_string(d)) / "sub");
+            for (int f = 0; f < 12; ++f) {
+                auto name = dir / ("d" + std::to_string(d)) / (f % 2 ? "sub" : "") / ("f" + std::to_string(f) + ".txt");
+                std::ofstream os(name);
+                for (int k = 0; k < (f * 7 + d) % 5; ++k) os << "needle line " << k << "\n";
+                if ((f * 7 + d) % 5) ++matching;
+                os << "filler\n";
+            }
+        }
+        fs::create_directories(dir / "build");
+        std::ofstream(dir / "build" / "needle.txt") << "needle\n";
+        // 同点が多いので、順位は score の降順・パスの昇順で決まる
+        std::vector<FileHit> serial;
+        for_each_source_file(dir.string(), [&](const fs::directory_entry& e){
+            if (auto h = score_file(e.path().string(), {"needle"})) serial.push_back(std::move(*h));
+        });
+        rank_hits(serial, 10);
+        REQUIRE_EQ(serial.size(), (size_t)10);
+        for (int threads : {1, 2, 3, 8}) {
+            auto par = find_relevant_files(dir.string(), "needle", 10, threads);
+            REQUIRE_EQ(par.size(), serial.size());
+            for (size_t i = 0; i < par.size() && i < serial.size(); ++i) {
+                REQUIRE_EQ(par[i].path, serial[i].path);
+                REQUIRE_EQ(par[i].score, serial[i].score);
+            }
+        }
+        for (size_t i = 1; i < serial.size(); ++i) REQUIRE(!hit_before(serial[i], serial[i-1]));
+        auto all = find_relevant_files(dir.string(), "needle", 1000, 4);
+        REQUIRE_EQ(all.size(), (size_t)matching);
+        for (auto& h : all) REQUIRE(h.path.find("build")==std::string::npos);
+        REQUIRE(find_relevant_files(dir.string(), "needle", 0, 4).empty());
+        std::vector<std::string> paths;
+        for (auto& h : all) paths.push_back(h.path);
+        SearchOptions so; so.max_results = 1000; so.threads = 3;
+        auto rescored = score_files(paths, {"needle"}, so);
+        REQUIRE_EQ(rescored.hits.size(), all.size());
+        REQUIRE_EQ(rescored.scanned, paths.size());
+        fs::remove_all(dir, ec);
+    }
+
+    // git 作業ツリーの列挙: gitignore の照合と、.git/index（v2〜v4）の読み込みを git 自身の出力と比べる
+    {
+        REQUIRE(wildmatch("*.log", "a.log") && !wildmatch("*.log", "d/a.log"));
+        REQUIRE(wildmatch("**/foo", "foo") && wildmatch("**/foo", "a/b/foo") && !wildmatch("**/foo", "afoo"));
+        REQUIRE(wildmatch("a/**/b", "a/b") && wildmatch("a/**/b", "a/x/y/b") && wildmatch("abc/**", "abc/x/y"));
+        REQUIRE(wildmatch("file[0-9].t?t", "file7.txt") && !wildmatch("file[!0-9].txt", "file7.txt") && !wildmatch("a?b", "a/b"));
+        REQUIRE(wildmatch("\\#x", "#x"));
+        GitIgnore gi;
+        gi.add_rules("# comment\n*.log\n!keep.log\nbuild/\n/root_only\ndoc/*.md\n");
+        gi.add_rules("*.tmp\n", "sub/");
+        REQUIRE(gi.ignored("x/a.log", false) && !gi.ignored("x/keep.log", false));
+        REQUIRE(gi.ignored("a/build", true) && !gi.ignored("a/build", false));
+        REQUIRE(gi.ignored("root_only", false) && !gi.ignored("x/root_only", false));
+        REQUIRE(gi.ignored("doc/a.md", false) && !gi.ignored("doc/x/a.md", false));
+        REQUIRE(gi.ignored("sub/a.tmp", false) && !gi.ignored("a.tmp", false));
+
+        namespace fs = std::filesystem;
+#if !defined(_WIN32)
+        if (std::system("git --version >/dev/null 2>&1") == 0) {
+            auto dir = fs::temp_directory_path() / "agens_test_git";
+            std::error_code ec; fs::remove_all(dir, ec);
+            fs::create_directories(dir);
+            auto write = [&](const std::string& rel, const std::string& body) {
+                fs::create_directories((dir / rel).parent_path());
+                std::ofstream(dir / rel) << body;
+            };
+            write(".gitignore", "build/\n*.log\n!keep.log\nvendor/\nnode_modules/\n");
+            write("a.cpp", "int http_client;\n");
+            write("src/b.cpp", "// http client\n");
+            write("build/out.cpp", "http client generated\n");
+            write("vendor/keep.c", "forced\n");
+            write("vendor/drop.c", "ignored\n");
+            write("x.log", "log\n");
+            write("keep.log", "kept\n");
+            write("docs/AGENTS.md", "- task\n");
+            write("node_modules/pkg/AGENTS.md", "- not mine\n");
+            write("sub/.gitignore", "*.tmp\n");
+            write("sub/x.tmp", "tmp\n");
+            write("sub/y.txt", "y\n");
+            write("untracked.txt", "new\n");
+            write("intent.txt", "intent\n");
+            write("secret.txt", "s\n");
+            std::string q = "cd '" + dir.string() + "' && ";
+            REQUIRE(std::system((q + "git init -q . >/dev/null 2>&1 && echo secret.txt >> .git/info/exclude"
+                                     " && git add .gitignore a.cpp src sub docs keep.log && git add -f vendor/keep.c && git add -N intent.txt").c_str()) == 0);
+            auto sorted = [](std::vector<std::string> v) { std::sort(v.begin(), v.end()); return v; };
+            auto git_list = [&](const std::string& sub) {
+                auto out = fs::temp_directory_path() / "agens_test_git_ls.txt";
+                std::string cmd = "cd '" + (dir / sub).string() + "' && (git ls-files; git ls-files --others --exclude-standard) > '" + out.string() + "'";
+                std::vector<std::string> v;
+                if (std::system(cmd.c_str()) != 0) return v;
+                std::ifstream is(out); std::string line;
+                while (std::getline(is, line)) if (!line.empty()) v.push_back(line);
+                fs::remove(out);
+                return sorted(v);
+            };
+            for (const char* version : {"2", "3", "4"}) {
+                REQUIRE(std::system((q + "git update-index --index-version " + version).c_str()) == 0);
+                auto mine = list_git_files(dir);
+                REQUIRE(mine.has_value());
+                if (!mine) break;
+                auto expect = git_list("");
+                REQUIRE(sorted(mine->files) == expect);
+                REQUIRE_EQ(mine->tracked, (size_t)9); // intent-to-add も index に載る
+                auto in_sub = list_git_files(dir / "sub");
+                REQUIRE(in_sub && sorted(in_sub->files) == git_list("sub"));
+            }
+            // 1パスずつの判定（ファイル監視用）も git の列挙と一致する
+            auto filter = GitPathFilter::open(dir);
+            REQUIRE(filter.has_value());
+            if (filter) {
+                auto expect = git_list("");
+                for (auto it = fs::recursive_directory_iterator(dir); it != fs::recursive_directory_iterator(); ++it) {
+                    std::string rel = it->path().lexically_relative(dir).generic_string();
+                    if (rel.rfind(".git/", 0) == 0 || !it->is_regular_file()) continue;
+                    bool listed = std::binary_search(expect.begin(), expect.end(), rel);
+                    REQUIRE_EQ(filter->excluded(rel, false), !listed);
+                }
+                REQUIRE(filter->excluded("build", true) && filter->excluded(".git", true) && !filter->excluded("src", true));
+                REQUIRE(filter->excluded(".git/config", false));
+            }
+            // index に載っていても、ディレクトリを指すリンクや作業ツリーから消えたファイルは採点しない
+            fs::create_directory_symlink("src", dir / "http_dir", ec);
+            write("http_gone.cpp", "http client\n");
+            REQUIRE(std::system((q + "git add http_dir http_gone.cpp && rm http_gone.cpp").c_str()) == 0);
+            // 除外されたディレクトリは /target でも AGENT(S).md の探索でも辿らない
+            auto hits = find_relevant_files(dir.string(), "http client", 10);
+            REQUIRE_EQ(hits.size(), (size_t)2);
+            for (auto& h : hits) REQUIRE(h.path.find("build")==std::string::npos);
+            auto docs = find_agent_docs(dir);
+            REQUIRE_EQ(docs.size(), (size_t)1);
+            REQUIRE(docs[0].path.generic_string().find("docs/AGENTS.md")!=std::string::npos);
+            fs::remove_all(dir, ec);
+        }
+#endif
+        // git 管理外は従来どおり辿る
+        REQUIRE(!list_git_files(fs::temp_directory_path() / "agens_no_such_dir_for_git"));
+    }
+
+    // /target の時間制限・中断・途中経過
+    {
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_budget";
+        std::error_code ec; fs::remove_all(dir, ec);
+        std::vector<std::string> paths;
+        for (int d = 0; d < 20; ++d) {
+            fs::create_directories(dir / ("d" + std::to_string(d)));
+            for (int f = 0; f < 100; ++f) {
+                auto p = dir / ("d" + std::to_string(d)) / ("f" + std::to_string(f) + ".txt");
+                std::ofstream os(p);
+                for (int k = 0; k < (d + f) % 4; ++k) os << "needle " << k << "\n";
+                os << std::string(2000, 'x') << "\n";
+                paths.push_back(p.string());
+            }
+        }
+        SearchOptions so; so.max_results = 5; so.threads = 2;
+        so.budget = std::chrono::milliseconds(1);
+        auto cut = score_files(paths, {"needle"}, so);
+        REQUIRE(cut.timed_out && !cut.cancelled);
+        REQUIRE(cut.scanned < paths.size());
+        REQUIRE(cut.hits.size() <= (size_t)5);
+
+        std::atomic<bool> cancel{true};
+        SearchOptions sc; sc.cancel = &cancel;
+        auto none = score_files(paths, {"needle"}, sc);
+        REQUIRE(none.cancelled && !none.timed_out);
+        REQUIRE_EQ(none.scanned, (size_t)0);
+        REQUIRE(none.hits.empty());
+
+        // 途中経過は順位どおりに並び、最後の通知は最終結果と一致する
+        SearchOptions sp; sp.max_results = 5; sp.threads = 1;
+        sp.progress_interval = std::chrono::milliseconds(0);
+        int calls = 0; bool sorted_ok = true; std::vector<FileHit> last;
+        sp.on_progress = [&](const std::vector<FileHit>& best, size_t scanned) {
+            ++calls;
+            if (best.size() > 5 || scanned == 0) sorted_ok = false;
+            for (size_t i = 1; i < best.size(); ++i) if (hit_before(best[i], best[i-1])) sorted_ok = false;
+            last = best;
+        };
+        auto full = search_files(dir.string(), "needle", sp);
+        REQUIRE(calls > 0 && sorted_ok);
+        REQUIRE(!full.timed_out && !full.cancelled);
+        REQUIRE_EQ(full.scanned, paths.size());
+        REQUIRE_EQ(last.size(), full.hits.size());
+        for (size_t i = 0; i < last.size() && i < full.hits.size(); ++i) REQUIRE_EQ(last[i].path, full.hits[i].path);
+        auto plain = find_relevant_files(dir.string(), "needle", 5, 1);
+        REQUIRE_EQ(plain.size(), full.hits.size());
+        for (size_t i = 0; i < plain.size() && i < full.hits.size(); ++i) REQUIRE_EQ(plain[i].path, full.hits[i].path);
+        fs::remove_all(dir, ec);
+    }
+
+    // 索引の差分反映と変更監視: 初回の後は変わったパスだけを読み直す
+    {
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_watch";
+        auto cache = fs::temp_directory_path() / "agens_test_watch_cache";
+        std::error_code ec; fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+        fs::create_directories(dir / "src");
+        fs::create_directories(dir / "node_modules");
+        std::ofstream(dir / "src" / "a.cpp") << "void render();\n";
+        std::ofstream(dir / "src" / "b.cpp") << "int other;\n";
+
+        SourcePathFilter sf(dir.string());
+        REQUIRE(sf.excluded("node_modules/x.js", false) && sf.excluded("build", true));
+        REQUIRE(!sf.excluded("src/a.cpp", false) && !sf.excluded("src", true));
+
+        auto sorted_files = [](const TrigramIndex& idx) { auto v = idx.files(); std::sort(v.begin(), v.end()); return v; };
+        TrigramIndex idx(dir.string(), cache);
+        REQUIRE(idx.update());
+        REQUIRE_EQ(idx.stats().rescans, (size_t)1);
+        // 追加・変更・削除・ディレクトリごとの削除・対象外のパス
+        fs::create_directories(dir / "lib" / "deep");
+        std::ofstream(dir / "lib" / "deep" / "c.cpp") << "void render_deep();\n";
+        std::ofstream(dir / "node_modules" / "x.js") << "render();\n";
+        REQUIRE(idx.apply({"lib/deep/c.cpp", "node_modules/x.js", "src/nothing.cpp"}));
+        REQUIRE(idx.stats().added==1 && idx.stats().removed==0);
+        REQUIRE(sorted_files(idx)==(std::vector<std::string>{"lib/deep/c.cpp", "src/a.cpp", "src/b.cpp"}));
+        REQUIRE_EQ(idx.candidates({"render"}).size(), (size_t)2);
+        { std::ofstream(dir / "src" / "b.cpp", std::ios::trunc) << "void render_b();\n"; }
+        std::ofstream(dir / "lib.cpp") << "int lib;\n"; // "lib" を接頭辞に持つが配下ではない
+        REQUIRE(idx.apply({"lib.cpp"}));
+        fs::remove_all(dir / "lib");
+        REQUIRE(idx.apply({"lib", "src/b.cpp", "gone_dir"}));
+        REQUIRE(idx.stats().changed==1 && idx.stats().removed==1);
+        REQUIRE(sorted_files(idx)==(std::vector<std::string>{"lib.cpp", "src/a.cpp", "src/b.cpp"}));
+        fs::remove(dir / "lib.cpp");
+        REQUIRE(idx.apply({"lib.cpp"}));
+        REQUIRE(sorted_files(idx)==(std::vector<std::string>{"src/a.cpp", "src/b.cpp"}));
+        REQUIRE_EQ(idx.stats().rescans, (size_t)1);
+
+#if defined(__linux__)
+        // inotify: 監視を始めた後の変更は全走査なしで反映される
+        TrigramIndex live(dir.string(), cache);
+        REQUIRE(live.watch());
+        REQUIRE(live.watching());
+        REQUIRE(live.refresh(30)); // 初回だけ全走査
+        fs::create_directories(dir / "docs" / "sub");
+        std::ofstream(dir / "docs" / "sub" / "AGENTS.md") << "- render the docs\n";
+        std::ofstream(dir / "node_modules" / "y.js") << "render();\n";
+        fs::remove(dir / "src" / "a.cpp");
+        { std::ofstream(dir / "src" / "b.cpp", std::ios::app) << "// render again\n"; }
+        std::vector<std::string> want = {"docs/sub/AGENTS.md", "src/b.cpp"};
+        for (int i = 0; i < 200 && sorted_files(live) != want; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            live.refresh(30);
+        }
+        REQUIRE(sorted_files(live)==want);
+        REQUIRE_EQ(live.stats().rescans, (size_t)1);
+        REQUIRE(live.stats().watched_dirs >= 4); // ., src, docs, docs/sub（node_modules は除く）
+        auto docs = find_agent_docs(dir, live.files());
+        REQUIRE_EQ(docs.size(), (size_t)1);
+        REQUIRE_EQ(live.candidates({"render"}).size(), (size_t)2);
+
+        // .gitignore で対象に戻したディレクトリにも監視が付き、中の編集が全走査なしで届く
+        if (std::system("git --version >/dev/null 2>&1") == 0) {
+            auto gdir = fs::temp_directory_path() / "agens_test_watch_git";
+            fs::remove_all(gdir, ec);
+            fs::create_directories(gdir / "gen");
+            std::ofstream(gdir / ".gitignore") << "gen/\n";
+            std::ofstream(gdir / "gen" / "x.cpp") << "int old_name;\n";
+            std::ofstream(gdir / "a.cpp") << "int a;\n";
+            REQUIRE(std::system(("cd '" + gdir.string() + "' && git init -q . >/dev/null 2>&1").c_str()) == 0);
+            TrigramIndex gidx(gdir.string(), cache);
+            REQUIRE(gidx.watch());
+            REQUIRE(gidx.refresh(30));
+            REQUIRE(sorted_files(gidx)==(std::vector<std::string>{".gitignore", "a.cpp"}));
+            { std::ofstream(gdir / ".gitignore", std::ios::trunc) << "# nothing ignored\n"; }
+            std::vector<std::string> unignored = {".gitignore", "a.cpp", "gen/x.cpp"};
+            for (int i = 0; i < 200 && sorted_files(gidx) != unignored; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                gidx.refresh(30);
+            }
+            REQUIRE(sorted_files(gidx)==unignored);
+            size_t rescans = gidx.stats().rescans;
+            { std::ofstream(gdir / "gen" / "x.cpp", std::ios::app) << "int fresh_symbol_name;\n"; }
+            for (int i = 0; i < 200 && gidx.candidates({"fresh_symbol_name"}).empty(); ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                gidx.refresh(30);
+            }
+            REQUIRE_EQ(gidx.candidates({"fresh_symbol_name"}).size(), (size_t)1);
+            REQUIRE_EQ(gidx.stats().rescans, rescans);
+            fs::remove_all(gdir, ec);
+        }
+#endif
+        fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+    }
+
+    // 定義の抽出と、/target で定義しているファイルを先に出す定義表
+    {
+        REQUIRE(lang_for_path("a/b.hpp")==SourceLang::Cpp && lang_for_path("x.PY")==SourceLang::Python);
+        REQUIRE(lang_for_path("x.tsx")==SourceLang::TypeScript && lang_for_path("a.d/README")==SourceLang::Unknown);
+        REQUIRE_EQ(symbol_key("ns::Widget::Render"), std::string("render"));
+        auto names = [](const std::vector<Symbol>& v) {
+            std::vector<std::string> out;
+            for (auto& s : v) out.push_back(std::string(symbol_kind_name(s.kind)) + " " + s.name + " "
+                                            + std::to_string(s.line) + "-" + std::to_string(s.end_line));
+            return out;
+        };
+        auto cpp = extract_symbols(
+            "#define TWICE(x) \\\n  ((x) * 2)\n"
+            "namespace app {\n"
+            "template <class T>\n"
+            "class Box : public Base {\n"
+            "public:\n"
+            "    Box() : v_{1} {}\n"
+            "    int get() const { return v_; } // }\n"
+            "    void decl();\n"
+            "};\n"
+            "using Id = int;\n"
+            "static int render(int a, const char* s = \"{\") {\n"
+            "    auto f = [&](int x) { return x; };\n"
+            "    if (a) { return f(a); }\n"
+            "    return 0;\n"
+            "}\n"
+            "}\n"
+            "void Box::decl() {}\n", SourceLang::Cpp);
+        REQUIRE(names(cpp)==(std::vector<std::string>{"macro TWICE 1-2", "namespace app 3-17", "class Box 4-10",
+            "method Box 7-7", "method get 8-8", "type Id 11-11", "function render 12-16", "function Box::decl 18-18"}));
+        auto py = extract_symbols("class A:\n    def f(self,\n          x):\n        s = \"\"\"\ndef fake():\n\"\"\"\n        return x\n\n"
+                                  "async def g():\n    pass\n", SourceLang::Python);
+        REQUIRE(names(py)==(std::vector<std::string>{"class A 1-7", "method f 2-7", "function g 9-10"}));
+        auto go = extract_symbols("package m\ntype ID int\ntype S struct {\n\tN int\n}\nfunc (s *S) Run() error {\n\treturn nil\n}\n"
+                                  "func main() {\n\tf := func() {}\n\t_ = f\n}\n", SourceLang::Go);
+        REQUIRE(names(go)==(std::vector<std::string>{"type ID 2-2", "struct S 3-5", "method Run 6-8", "function main 9-12"}));
+        auto rs = extract_symbols("#[derive(Debug)]\npub struct P { x: i32 }\nimpl<'a> P {\n    pub fn new() -> Self { let c = '{'; P { x: 0 } }\n}\n"
+                                  "fn helper<'a>(s: &'a str) -> &'a str { s }\nconst MAX: u32 = 5;\n", SourceLang::Rust);
+        REQUIRE(names(rs)==(std::vector<std::string>{"struct P 2-2", "method new 4-4", "function helper 6-6", "variable MAX 7-7"}));
+        auto ts = extract_symbols("import x from \"y\"\nexport interface Props { a: number }\nexport default class App {\n"
+                                  "  handle = (e) => {\n    log(\"}\")\n  }\n  async render(): Promise<void> {\n    if (x) { return }\n  }\n}\n"
+                                  "export function helper(a: string) {\n  return `${a} {`\n}\nconst run = async () => {\n  it(\"x\", () => {})\n}\n",
+                                  SourceLang::TypeScript);
+        REQUIRE(names(ts)==(std::vector<std::string>{"interface Props 2-2", "class App 3-10", "method handle 4-6",
+            "method render 7-9", "function helper 11-13", "function run 14-16"}));
+
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_symbols";
+        auto cache = fs::temp_directory_path() / "agens_test_symbols_cache";
+        std::error_code ec; fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+        fs::create_directories(dir / "src");
+        std::ofstream(dir / "src" / "engine.cpp") << "// engine\n\nint render_frame(int n) {\n    return n;\n}\n";
+        for (int i = 0; i < 3; ++i) {
+            std::ofstream os(dir / "src" / ("caller" + std::to_string(i) + ".cpp"));
+            for (int k = 0; k < 5; ++k) os << "int x" << k << " = render_frame(" << k << ");\n";
+        }
+        TrigramIndex idx(dir.string(), cache);
+        REQUIRE(idx.update());
+        REQUIRE(idx.stats().symbols >= 1);
+        auto hits = find_relevant_files(idx, "render_frame", 10);
+        REQUIRE_EQ(hits.size(), (size_t)4);
+        if (!hits.empty()) {
+            REQUIRE(hits[0].path.find("engine.cpp")!=std::string::npos);
+            REQUIRE_EQ(hits[0].definitions.size(), (size_t)1);
+            if (!hits[0].definitions.empty()) {
+                REQUIRE_EQ(hits[0].definitions[0].line, 3);
+                REQUIRE_EQ(hits[0].definitions[0].end_line, 5);
+            }
+            for (size_t i = 1; i < hits.size(); ++i) REQUIRE(hits[i].definitions.empty());
+        }
+        // 保存した定義表を読み直しても同じ。定義を消せば表からも消える
+        REQUIRE(idx.save());
+        TrigramIndex again(dir.string(), cache);
+        REQUIRE(again.load());
+        auto defs = again.definitions({"render_frame"});
+        REQUIRE_EQ(defs.size(), (size_t)1);
+        { std::ofstream(dir / "src" / "engine.cpp", std::ios::trunc) << "// moved\n"; }
+        REQUIRE(again.update());
+        REQUIRE(again.definitions({"render_frame"}).empty());
+        REQUIRE(find_relevant_files(again, "render_frame", 10)[0].definitions.empty());
+        // 後から足した行は整列済みの表へ併合され、保存・読み込みでも同じ表になる
+        std::ofstream(dir / "src" / "late.cpp") << "void a_helper() {}\nint render_frame(int n) { return n; }\nvoid zz_last() {}\n";
+        REQUIRE(again.update());
+        REQUIRE_EQ(again.definitions({"render_frame"}).size(), (size_t)1);
+        std::ofstream(dir / "src" / "mid.cpp") << "void m_mid() {}\n";
+        REQUIRE(again.update());
+        for (const char* name : {"a_helper", "render_frame", "zz_last", "m_mid"}) REQUIRE_EQ(again.definitions({name}).size(), (size_t)1);
+        REQUIRE(again.save());
+        TrigramIndex reloaded(dir.string(), cache);
+        REQUIRE(reloaded.load());
+        for (const char* name : {"a_helper", "render_frame", "zz_last", "m_mid"}) {
+            auto d = reloaded.definitions({name});
+            auto before = again.definitions({name});
+            REQUIRE(d.size()==1 && before.size()==1);
+            if (d.size()==1 && before.size()==1) {
+                REQUIRE_EQ(d.begin()->first, before.begin()->first);
+                REQUIRE_EQ(d.begin()->second.size(), before.begin()->second.size());
+                REQUIRE_EQ(d.begin()->second[0].line, before.begin()->second[0].line);
+            }
+        }
+        fs::remove_all(dir, ec); fs::remove_all(cache, ec);
+    }
+
+    // /ask --ctx: 検索結果からの範囲の切り出し・統合・重複除去と予算内への詰め込み
+    {
+        REQUIRE_EQ(context_query("render_frame はどこ？ gfx::Scene と file.cpp. を見て"), std::string("render_frame gfx::Scene file.cpp"));
+        REQUIRE_EQ(context_query("説明して"), std::string("説明して"));
+
+        namespace fs = std::filesystem;
+        auto dir = fs::temp_directory_path() / "agens_test_ctxpack";
+        std::error_code ec; fs::remove_all(dir, ec);
+        fs::create_directories(dir / "vendor");
+        const std::string engine = "// engine\n\nint render_frame(int n) {\n    return n;\n}\n";
+        std::ofstream(dir / "engine.cpp") << engine;
+        std::ofstream(dir / "vendor" / "engine.cpp") << engine;
+        {
+            std::ofstream os(dir / "caller.cpp");
+            for (int i = 1; i <= 40; ++i) os << (i==10 || i==13 || i==30 ? "render_frame(" + std::to_string(i) + ");" : "line " + std::to_string(i)) << "\n";
+        }
+        auto hit = [](const fs::path& p, std::vector<int> lines, std::vector<Symbol> defs) {
+            FileHit h; h.path = p.string();
+            for (int l : lines) h.snippets.push_back({l, ""});
+            h.definitions = std::move(defs);
+            return h;
+        };
+        Symbol def{"render_frame", SymbolKind::Function, 3, 5};
+        std::vector<FileHit> hits = {hit(dir / "engine.cpp", {3}, {def}), hit(dir / "vendor" / "engine.cpp", {3}, {def}),
+                                     hit(dir / "caller.cpp", {10, 13, 30}, {})};
+        ContextPackOptions po;
+        po.budget_tokens = 100000;
+        auto pack = pack_context(hits, po);
+        REQUIRE_EQ(pack.candidates, (size_t)4);
+        REQUIRE_EQ(pack.duplicates, (size_t)1);
+        REQUIRE_EQ(pack.regions.size(), (size_t)3);
+        if (pack.regions.size() == 3) {
+            // パス・行番号の順。近い一致行は1つの範囲にまとまり、範囲はファイル末尾で止まる
+            REQUIRE(pack.regions[0].path.find("caller.cpp")!=std::string::npos);
+            REQUIRE_EQ(pack.regions[0].first_line, 7);
+            REQUIRE_EQ(pack.regions[0].last_line, 16);
+            REQUIRE_EQ(pack.regions[1].first_line, 27);
+            REQUIRE_EQ(pack.regions[1].last_line, 33);
+            REQUIRE(pack.regions[2].definition && !pack.regions[2].truncated);
+            REQUIRE_EQ(pack.regions[2].first_line, 1);
+            REQUIRE_EQ(pack.regions[2].last_line, 5);
+            REQUIRE_EQ(pack.regions[2].text, engine.substr(0, engine.size() - 1));
+        }
+        auto prompt = format_context_prompt(pack, "どう動く？");
+        REQUIRE(prompt.find("[参照: " + (dir / "caller.cpp").string() + " 7-16]\n```\nline 7\n")!=std::string::npos);
+        REQUIRE(prompt.ends_with("[質問]\nどう動く？"));
+        REQUIRE(estimate_tokens(prompt) <= pack.tokens + 8);
+        // 検索順位が入れ替わっても選ばれた範囲が同じなら同じ文字列（接頭辞キャッシュが効く）
+        std::vector<FileHit> swapped = {hits[2], hits[0], hits[1]};
+        REQUIRE_EQ(format_context_prompt(pack_context(swapped, po), "どう動く？"), prompt);
+        // 予算が小さければ上位のファイルの定義だけ。入らない範囲は捨てる
+        long overhead = pack.tokens;
+        for (const auto& r : pack.regions) overhead -= r.tokens;
+        po.budget_tokens = pack.regions.size() == 3 ? overhead + pack.regions[2].tokens : 0;
+        auto small = pack_context(hits, po);
+        REQUIRE_EQ(small.regions.size(), (size_t)1);
+        REQUIRE(small.tokens <= po.budget_tokens);
+        REQUIRE_EQ(small.dropped, (size_t)2);
+        po.budget_tokens = 0;
+        REQUIRE_EQ(format_context_prompt(pack_context(hits, po), "q"), std::string("q"));
+        // 長い定義は先頭 max_region_lines 行まで
+        po.budget_tokens = 100000; po.max_region_lines = 2;
+        auto cut = pack_context({hit(dir / "engine.cpp", {}, {Symbol{"render_frame", SymbolKind::Function, 3, 100}})}, po);
+        REQUIRE_EQ(cut.regions.size(), (size_t)1);
+        if (!cut.regions.empty()) {
+            REQUIRE(cut.regions[0].truncated);
+            REQUIRE_EQ(cut.regions[0].last_line, 4);
+        }
+        fs::remove_all(dir, ec);
+    }
+
+    // trace-event 出力（最後に有効化して他のテストへ影響させない）
+    {
+        namespace fs = std::filesystem;
+        { trace::Span off("disabled"); off.arg("x"); } // 無効時は記録しない
+        auto path = fs::temp_directory_path() / "agens_test_trace.json";
+        trace::start(path.string());
+        REQUIRE(trace::enabled());
+        {
+            trace::Span outer("outer");
+            trace::Span inner("inner", "test");
+            inner.arg("detail \"quoted\"");
+            inner.end();
+            std::thread([]{ trace::Span t("worker"); }).join();
+        }
+        // 他のスレッドが記録を続けている間に書き出してもよい
+        std::atomic<bool> stop_rec{false};
+        std::thread rec([&]{ while (!stop_rec) { trace::Span t("busy"); } });
+        for (int i = 0; i < 3; ++i) REQUIRE(trace::flush());
+        stop_rec = true;
+        rec.join();
+        REQUIRE(trace::flush());
+        std::ifstream ifs(path); std::stringstream ss; ss << ifs.rdbuf(); auto js = ss.str();
+        REQUIRE(js.find("\"traceEvents\"")!=std::string::npos);
+        REQUIRE(js.find("\"name\":\"outer\"")!=std::string::npos);
+        REQUIRE(js.find("\"name\":\"worker\"")!=std::string::npos);
+        REQUIRE(js.find("detail \\\"quoted\\\"")!=std::string::npos);
+        REQUIRE(js.find("peak_rss_mb")!=std::string::npos);
+        REQUIRE(js.find("\"disabled\"")==std::string::npos);
+        REQUIRE(trace::peak_rss_bytes() > 0);
+        std::error_code ec; fs::remove(path, ec);
+    }
+
     if (failures==0) {
         std::cout << "All tests passed\n";
         return 0;